@@ -56,6 +56,7 @@ A->B
 
 #include "dialback.h"
 
+#include <dnscache.hh>
 #include <hash.hh>
 #include <hmac.hh>
 #include <messages.hh>
@@ -391,18 +392,20 @@ void dialback_miod_hash(miod md, xht ht, jid key) {
  * @return the IP of the external server
  */
 char *dialback_ip_get(db d, jid host, char *ip) {
-    char *ret;
+    char *ret = NULL;
+    std::vector<xmppd::dns_record> records;
+
     if (host == NULL)
         return NULL;
 
     if (ip != NULL)
         return ip;
 
-    ret =
-        pstrdup(host->get_pool(),
-                xmlnode_get_attrib_ns(
-                    (xmlnode)xhash_get(d->nscache, host->get_domain().c_str()),
-                    "i", NULL));
+    if (xmppd::dns_cache::shared().get(host->get_domain().c_str(),
+                                       xmppd::dns_cache::rr_host,
+                                       records) == xmppd::dns_cache::lookup_hit)
+        ret = pstrdup(host->get_pool(),
+                      xmppd::dns_cache::format_addresses(records).c_str());
     log_debug2(ZONE, LOGT_IO, "returning cached ip %s for %s", ret,
                host->get_domain().c_str());
     return ret;
@@ -411,31 +414,29 @@ char *dialback_ip_get(db d, jid host, char *ip) {
 /**
  * put an IP address in our DNS cache
  *
+ * The address is only kept if the cache has no (more complete) result of
+ * resolving the host.
+ *
  * @param d db structure which contains the context of the dialback component
  * instance
  * @param host the host for which we put the IP address
  * @param ip the IP address
  */
 void dialback_ip_set(db d, jid host, char *ip) {
-    xmlnode cache, old;
+    xmppd::dns_cache &cache = xmppd::dns_cache::shared();
+    std::vector<xmppd::dns_record> records;
 
     if (host == NULL || ip == NULL)
         return;
 
-    /* first, get existing cache so we can dump it later */
-    old = (xmlnode)xhash_get(d->nscache, host->get_domain().c_str());
+    if (cache.get(host->get_domain().c_str(), xmppd::dns_cache::rr_host,
+                  records) == xmppd::dns_cache::lookup_hit)
+        return;
 
-    /* new cache */
-    cache = xmlnode_new_tag_ns("d", NULL, NS_JABBERD_WRAPPER);
-    xmlnode_put_attrib_ns(cache, "h", NULL, NULL, host->get_domain().c_str());
-    xmlnode_put_attrib_ns(cache, "i", NULL, NULL, ip);
-    xhash_put(d->nscache, xmlnode_get_attrib_ns(cache, "h", NULL),
-              (void *)cache);
+    cache.put(host->get_domain().c_str(), xmppd::dns_cache::rr_host,
+              xmppd::dns_cache::parse_addresses(ip), -1);
     log_debug2(ZONE, LOGT_IO, "cached ip %s for %s", ip,
                host->get_domain().c_str());
-
-    /* free any old entry that's been replaced */
-    xmlnode_free(old);
 }
 
 /**
@@ -840,18 +841,13 @@ static void dialback_handle_discoinfo(db d, dpacket dp, xmlnode query, jid to) {
             name << messages_get(lang, N_("Pending verifies: ")) << count;
             xmlnode_put_attrib_ns(x, "name", NULL, NULL, name.str().c_str());
         } else if (j_strcmp(node, "pendingstanzas") == 0) {
-            int count = 0;
-            dboq iter = NULL;
-
-            for (iter = dc->q; iter != NULL; iter = iter->next) {
-                count++;
-            }
-
             x = xmlnode_insert_tag_ns(result, "identity", NULL, NS_DISCO_INFO);
             xmlnode_put_attrib_ns(x, "category", NULL, NULL, "hierarchy");
             xmlnode_put_attrib_ns(x, "type", NULL, NULL, "leaf");
             std::ostringstream name;
-            name << messages_get(lang, N_("Pending stanzas: ")) << count;
+            name << messages_get(lang, N_("Pending stanzas: ")) << dc->q_count
+                 << " (" << dc->q_bytes << " "
+                 << messages_get(lang, N_("bytes")) << ")";
             xmlnode_put_attrib_ns(x, "name", NULL, NULL, name.str().c_str());
         }
     } else if (s2s_right && to->get_node() == "in-established" &&
@@ -1411,6 +1407,7 @@ result dialback_packets(instance i, dpacket dp, void *arg) {
     if (dp->type == p_ROUTE) {
         x = xmlnode_get_firstchild(x);
         ip = xmlnode_get_attrib_ns(dp->x, "ip", NULL);
+        xmlnode_hide_attrib_ns(x, "dnsqueryby", NULL); /* not needed anymore */
     }
 
     /* all packets going to our "id" go to the incoming handler,
@@ -1585,6 +1582,8 @@ extern "C" void dialback(instance i, xmlnode x) {
     xhash_put(d->std_ns_prefixes, "", const_cast<char *>(NS_SERVER));
     xhash_put(d->std_ns_prefixes, "stream", const_cast<char *>(NS_STREAM));
     xhash_put(d->std_ns_prefixes, "db", const_cast<char *>(NS_DIALBACK));
+    xhash_put(d->std_ns_prefixes, "dbfeatures",
+              const_cast<char *>(NS_DIALBACK_FEATURES));
     xhash_put(d->std_ns_prefixes, "wrap",
               const_cast<char *>(NS_JABBERD_WRAPPER));
     xhash_put(d->std_ns_prefixes, "tls", const_cast<char *>(NS_XMPP_TLS));
@@ -1600,12 +1599,12 @@ extern "C" void dialback(instance i, xmlnode x) {
         xmlnode_get_list_item_data(
             xmlnode_get_tags(cfg, "conf:maxhosts", d->std_ns_prefixes), 0),
         997);
-    d->nscache = xhash_new(max);
-    pool_cleanup(i->p, (pool_cleaner)xhash_free, d->nscache);
     d->out_connecting = xhash_new(67);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->out_connecting);
     d->out_ok_db = xhash_new(max);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->out_ok_db);
+    d->out_peers = xhash_new(max);
+    pool_cleanup(i->p, (pool_cleaner)xhash_free, d->out_peers);
     d->in_id = xhash_new(max);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->in_id);
     d->in_ok_db = xhash_new(max);
@@ -1616,6 +1615,8 @@ extern "C" void dialback(instance i, xmlnode x) {
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->hosts_tls);
     d->hosts_auth = xhash_new(max);
     pool_cleanup(i->p, (pool_cleaner)xhash_free, d->hosts_auth);
+    d->connect_latency = xhash_new(max);
+    pool_cleanup(i->p, (pool_cleaner)xhash_free, d->connect_latency);
     d->i = i;
     d->timeout_idle = j_atoi(
         xmlnode_get_list_item_data(
@@ -1629,6 +1630,19 @@ extern "C" void dialback(instance i, xmlnode x) {
         xmlnode_get_list_item_data(
             xmlnode_get_tags(cfg, "conf:authtimeout", d->std_ns_prefixes), 0),
         d->timeout_idle);
+    d->queue_stanzas = j_atoi(
+        xmlnode_get_list_item_data(
+            xmlnode_get_tags(cfg, "conf:queuestanzas", d->std_ns_prefixes), 0),
+        1000);
+    d->queue_bytes = j_atoi(
+        xmlnode_get_list_item_data(
+            xmlnode_get_tags(cfg, "conf:queuebytes", d->std_ns_prefixes), 0),
+        4194304);
+    d->connect_stagger = j_atoi(
+        xmlnode_get_list_item_data(
+            xmlnode_get_tags(cfg, "conf:connectstagger", d->std_ns_prefixes),
+            0),
+        250);
     d->secret = pstrdup(
         i->p, xmlnode_get_list_item_data(
                   xmlnode_get_tags(cfg, "conf:secret", d->std_ns_prefixes), 0));
@@ -43,14 +43,18 @@
 
 #include <jabberd.h>
 
+/** a stanza waiting for an outgoing connection */
+typedef struct dboq_struct *dboq;
+
 /** s2s instance */
 typedef struct db_struct {
     instance i;         /**< data jabberd hold for each instance */
-    xht nscache;        /**< host/ip local resolution cache */
     xht out_connecting; /**< where unvalidated in-progress connections are, key
                            is to/from */
     xht out_ok_db; /**< hash table of all connected dialback hosts, key is same
                       to/from */
+    xht out_peers; /**< established outgoing streams, on which more domain
+                      pairs can be authorized (::miod), key is the peer */
     xht in_id; /**< all the incoming connections waiting to be checked, rand id
                   attrib is key */
     xht in_ok_db;   /**< all the incoming dialback connections that are ok,
@@ -70,6 +74,17 @@ typedef struct db_struct {
     int timeout_auth; /**< configuration option &lt;authtimeout/&gt;: after how
                          many seconds a connection should be closed, if it is
                          not authorized for any domain */
+    int queue_stanzas; /**< configuration option &lt;queuestanzas/&gt;: how
+                          many stanzas may wait for a connection to a peer */
+    long queue_bytes;  /**< configuration option &lt;queuebytes/&gt;: how much
+                          memory stanzas waiting for a peer may use */
+    int connect_stagger; /**< configuration option &lt;connectstagger/&gt;:
+                            milliseconds to wait for a connection attempt
+                            before the next address is tried in parallel */
+    xht connect_latency; /**< ::dbol connect latencies, key is the peer */
+    dboq queue_oldest; /**< oldest stanza waiting for any peer (first to
+                          expire) */
+    dboq queue_newest; /**< newest stanza waiting for any peer */
     xht std_ns_prefixes; /**< standard prefixes used inside the dialback
                             component for xpath expressions */
     xdbcache xc; /**< pointer to the ::xdbcache_cache structure used to access
@@ -82,6 +97,7 @@ typedef struct miod_struct {
     int last;  /**< last time this connection has been used */
     int count; /**< number of sent stanzas on the connection */
     db d;      /**< the dialback instance */
+    char *stream_id; /**< id the peer assigned to an outgoing stream */
 } * miod, _miod;
 
 void dialback_out_packet(db d, xmlnode x, char *ip);
@@ -105,12 +121,30 @@ void dialback_ip_set(db d, jid host, char *ip);
 
 const char *dialback_get_loopcheck_token(db d);
 
-/** simple queue for out_queue */
-typedef struct dboq_struct {
-    int stamp;
-    xmlnode x;
-    struct dboq_struct *next;
-} * dboq, _dboq;
+/** connect latency to a peer, see dialback_out_connect() */
+typedef struct dbol_struct {
+    unsigned long count; /**< number of established connections */
+    long last;           /**< milliseconds the last connect took */
+    long average;        /**< moving average of the connect time in ms */
+} * dbol, _dbol;
+
+/**
+ * simple queue for out_queue
+ *
+ * Each stanza is in the queue of its peer and in the queue of all waiting
+ * stanzas of the instance. Stanzas are appended at the end, as they all wait
+ * the same time the queues are ordered by the time they expire.
+ */
+struct dboq_struct {
+    int stamp;                 /**< when the stanza has been queued */
+    xmlnode x;                 /**< the queued stanza */
+    int size;                  /**< bytes accounted for the stanza */
+    struct dboc_struct *c;     /**< the connect object the stanza waits for */
+    struct dboq_struct *next;  /**< next (newer) stanza for the same peer */
+    struct dboq_struct *older; /**< previous stanza for any peer */
+    struct dboq_struct *newer; /**< next stanza for any peer */
+};
+typedef struct dboq_struct _dboq;
 
 /**
  * enumeration of dialback request states an outgoing connection can have
@@ -148,11 +182,17 @@ typedef enum {
     sasl_success      /**< we successfully used sasl */
 } db_connection_state;
 
+/** a connection attempt to one of the addresses of a peer */
+typedef struct dboa_struct *dboa;
+
+/** a timer starting the next connection attempt */
+typedef struct dbos_struct *dbos;
+
 /* for connecting db sockets */
 /**
  * structure holding information about an outgoing connection
  */
-typedef struct {
+typedef struct dboc_struct {
     char *ip; /**< where to connect to (list of comma separated addresses of the
                  format [ip]:port, [ip], ip:port, or ip) */
     int stamp; /**< when we started to connect to this peer */
@@ -162,8 +202,14 @@ typedef struct {
     xmlnode
         verifies; /**< waiting db:verify elements we have to send to the peer */
     pool p;       /**< memory pool we are using for this connections data */
-    dboq q;       /**< pending stanzas, that need to be sent to the peer */
+    dboq q;       /**< pending stanzas, that need to be sent to the peer (oldest
+                     first) */
+    dboq q_last;  /**< newest pending stanza */
+    int q_count;  /**< number of pending stanzas */
+    long q_bytes; /**< bytes used by the pending stanzas */
     mio m;        /**< the mio connection this outgoing stream is using */
+    miod carrier; /**< the established stream the domain pair is authorized
+                     on, if piggybacking */
     /* original comment: for that short time when we're connected and open, but
      * haven't auth'd ourselves yet */
     int xmpp_version;    /**< version the peer supports, -1 not yet known, 0
@@ -178,8 +224,13 @@ typedef struct {
                                              connecting to the other host */
     std::ostringstream
         *connect_results; /**< result messages for the connection attempts */
+    dboa attempts;        /**< connection attempts still in progress */
+    dbos stagger;         /**< timer for the next connection attempt */
     struct {
-        int db : 1; /**< if the peer supports dialback */
+        int db : 1;        /**< if the peer supports dialback */
+        int db_errors : 1; /**< if the peer advertised dialback errors (and
+                              accepts more domain pairs on the stream) */
+        int piggyback : 1; /**< authorizing on an established stream */
     } flags;
 } * dboc, _dboc;
 
@@ -653,6 +653,15 @@ void dialback_in_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                                               NS_XMPP_SASL);
             xmlnode_insert_cdata(mechanism, "EXTERNAL", -1);
         }
+        if (j_strcmp(static_cast<char *>(xhash_get_by_domain(
+                         c->d->hosts_auth, c->other_domain)),
+                     "sasl") != 0) {
+            /* we accept dialback for more domain pairs on this stream */
+            xmlnode_insert_tag_ns(
+                xmlnode_insert_tag_ns(features, "dialback", NULL,
+                                      NS_DIALBACK_FEATURES),
+                "errors", NULL, NS_DIALBACK_FEATURES);
+        }
         log_debug2(
             ZONE, LOGT_IO, "sending stream features: %s",
             xmlnode_serialize_string(features, xmppd::ns_decl_list(), 0));
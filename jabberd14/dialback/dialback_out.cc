@@ -58,15 +58,195 @@
 #include <messages.hh>
 #include <namespaces.hh>
 
+#include <list>
+#include <sys/time.h>
+
 /* forward declaration */
 void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                        int unused2);
 
+/**
+ * a connection attempt to one of the addresses of a peer
+ *
+ * The attempt is the argument of the mio callback until it is connected. It
+ * is kept in its own pool as the connect object might be freed while the
+ * attempt is still in progress.
+ */
+struct dboa_struct {
+    pool p;                 /**< memory pool of the attempt */
+    dboc c;                 /**< the connect object, NULL if not needed */
+    char *ip;               /**< the address we are connecting to */
+    struct timeval started; /**< when we started connecting */
+    dboa next;              /**< next attempt of the same connect object */
+};
+
+/**
+ * a timer starting the next connection attempt, if the pending attempts did
+ * not succeed within the configured stagger
+ */
+struct dbos_struct {
+    dboc c;   /**< the connect object, NULL if the timer has been canceled */
+    int wait; /**< milliseconds to wait */
+};
+
+/* forward declarations */
+void dialback_out_connect(dboc c);
+void dialback_out_connection_cleanup(dboc c);
+void dialback_out_qflush(miod md, dboc c);
+static void dialback_out_unlink(dboq q);
+static void dialback_out_attempt_read(mio m, int flags, void *arg, xmlnode x,
+                                      char *unused1, int unused2);
+
+/**
+ * check if an address of the list of addresses of a peer is an IPv6 address
+ *
+ * @param ip the address (format "[ip]:port", "[ip]", "ip:port", or "ip")
+ * @return 1 for IPv6 addresses, 0 else
+ */
+static int dialback_out_is_ipv6(char const *ip) {
+    char const *col = strchr(ip, ':');
+    return ip[0] == '[' || (col != NULL && strchr(col + 1, ':') != NULL);
+}
+
+/**
+ * reorder a list of addresses so that IPv6 and IPv4 addresses alternate,
+ * keeping the order within each address family
+ *
+ * This way a broken IPv6 (or IPv4) connectivity does only delay every second
+ * connection attempt.
+ *
+ * @param p the memory pool to use
+ * @param ip comma separated list of addresses
+ * @return the reordered list
+ */
+static char *dialback_out_interleave(pool p, char const *ip) {
+    std::vector<std::string> family[2];
+    std::string list(ip);
+    std::string::size_type start = 0;
+    int first = -1;
+
+    while (start < list.length()) {
+        std::string::size_type end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.length();
+        std::string item = list.substr(start, end - start);
+        start = end + 1;
+        if (item.empty())
+            continue;
+
+        int ipv6 = dialback_out_is_ipv6(item.c_str());
+        family[ipv6].push_back(item);
+
+        /* start with the family of the first (most preferred) address */
+        if (first < 0)
+            first = ipv6;
+    }
+
+    std::ostringstream result;
+    for (size_t i = 0; i < family[0].size() || i < family[1].size(); i++) {
+        for (int f = first; f < first + 2; f++) {
+            if (i >= family[f % 2].size())
+                continue;
+            if (result.tellp() > 0)
+                result << ",";
+            result << family[f % 2][i];
+        }
+    }
+
+    return pstrdup(p, result.str().c_str());
+}
+
+/**
+ * milliseconds passed since a point in time
+ *
+ * @param since the point in time
+ * @return milliseconds passed
+ */
+static long dialback_out_elapsed(struct timeval const &since) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since.tv_sec) * 1000 +
+           (now.tv_usec - since.tv_usec) / 1000;
+}
+
+/**
+ * record how long connecting to a peer took
+ *
+ * @param d the dialback instance
+ * @param peer the peer we connected to
+ * @param ip the address we connected to
+ * @param ms milliseconds the connect took
+ */
+static void dialback_out_record_latency(db d, char const *peer, char const *ip,
+                                        long ms) {
+    dbol l = static_cast<dbol>(xhash_get(d->connect_latency, peer));
+    if (l == NULL) {
+        l = static_cast<dbol>(pmalloco(d->i->p, sizeof(_dbol)));
+        l->average = ms;
+        xhash_put(d->connect_latency, pstrdup(d->i->p, peer), l);
+    }
+    l->count++;
+    l->last = ms;
+    l->average = (7 * l->average + ms) / 8;
+
+    log_debug2(ZONE, LOGT_IO,
+               "connected to %s at %s after %li ms (average %li ms, %lu "
+               "connects)",
+               peer, ip, ms, l->average, l->count);
+}
+
+/**
+ * thread waiting for the stagger time and starting the next connection
+ * attempt, if the timer has not been canceled meanwhile
+ *
+ * @param arg the ::dbos timer
+ * @return always NULL
+ */
+static void *dialback_out_stagger(void *arg) {
+    dbos s = static_cast<dbos>(arg);
+
+    pth_nap(pth_time(s->wait / 1000, (s->wait % 1000) * 1000));
+    if (s->c != NULL) {
+        s->c->stagger = NULL;
+        dialback_out_connect(s->c);
+    }
+
+    delete s;
+    return NULL;
+}
+
+/**
+ * cancel the timer for the next connection attempt
+ *
+ * @param c the connect object
+ */
+static void dialback_out_cancel_stagger(dboc c) {
+    if (c->stagger == NULL)
+        return;
+    c->stagger->c = NULL;
+    c->stagger = NULL;
+}
+
+/**
+ * release all pending connection attempts of a connect object, they close
+ * their connections if they still succeed
+ *
+ * @param c the connect object
+ */
+static void dialback_out_cancel_attempts(dboc c) {
+    dialback_out_cancel_stagger(c);
+    for (dboa a = c->attempts; a != NULL; a = a->next)
+        a->c = NULL;
+    c->attempts = NULL;
+}
+
 /**
  * try to start a connection based upon a given connect object
  *
- * Tell mio to connect to the peer and make dialback_out_read() the first mio
- * handler
+ * Tell mio to connect to the next address of the peer. If there are more
+ * addresses, the next one is tried in parallel if connecting takes longer
+ * than the configured stagger. The first attempt that succeeds is used,
+ * dialback_out_read() becomes its mio handler.
  *
  * @param c the connect object
  */
@@ -88,10 +268,15 @@ void dialback_out_connect(dboc c) {
     log_debug2(ZONE, LOGT_IO, "Attempting to connect to %s at %s",
                jid_full(c->key), ip);
 
-    /* to which IP we connect, for logging */
-    if (c->connect_results != NULL) {
-        *c->connect_results << ip << ": ";
-    }
+    /* track the attempt */
+    pool p = pool_new();
+    dboa a = static_cast<dboa>(pmalloco(p, sizeof(struct dboa_struct)));
+    a->p = p;
+    a->c = c;
+    a->ip = pstrdup(p, ip);
+    gettimeofday(&a->started, NULL);
+    a->next = c->attempts;
+    c->attempts = a;
 
     /* get the ip/port for io_select */
     if (ip[0] == '[') {
@@ -121,7 +306,106 @@ void dialback_out_connect(dboc c) {
     /* we are now in the state of connecting */
     c->connection_state = connecting;
 
-    mio_connect(ip, port, dialback_out_read, (void *)c, 20, MIO_CONNECT_XML);
+    /* try the next address if this one does not connect soon */
+    dialback_out_cancel_stagger(c);
+    if (c->ip != NULL && c->d->connect_stagger > 0) {
+        dbos s = new dbos_struct;
+        s->c = c;
+        s->wait = c->d->connect_stagger;
+        c->stagger = s;
+
+        /* nobody joins the timer, it has to release itself */
+        pth_attr_t attr = pth_attr_new();
+        pth_attr_set(attr, PTH_ATTR_JOINABLE, FALSE);
+        pth_spawn(attr, dialback_out_stagger, s);
+        pth_attr_destroy(attr);
+    }
+
+    mio_connect(ip, port, dialback_out_attempt_read, (void *)a, 20,
+                MIO_CONNECT_XML);
+}
+
+/**
+ * mio handler of a connection attempt, until it is connected
+ *
+ * The first attempt that connects is handed to dialback_out_read(), the other
+ * attempts are released and close their connections. If an attempt fails,
+ * the next address is tried, or the connect object is cleaned up if this has
+ * been the last attempt.
+ *
+ * @param m the connection
+ * @param flags the mio action, only MIO_NEW and MIO_CLOSED are expected
+ * @param arg the ::dboa attempt
+ * @param x unused/ignored
+ * @param unused1 unused/ignored
+ * @param unused2 unused/ignored
+ */
+static void dialback_out_attempt_read(mio m, int flags, void *arg, xmlnode x,
+                                      char *unused1, int unused2) {
+    dboa a = static_cast<dboa>(arg);
+    dboc c = a->c;
+
+    /* remove the attempt from the list of its connect object */
+    if (c != NULL && (flags == MIO_NEW || flags == MIO_CLOSED)) {
+        for (dboa *cur = &c->attempts; *cur != NULL; cur = &(*cur)->next) {
+            if (*cur == a) {
+                *cur = a->next;
+                break;
+            }
+        }
+    }
+
+    switch (flags) {
+        case MIO_NEW:
+            if (c == NULL) {
+                /* another attempt has been faster */
+                log_debug2(ZONE, LOGT_IO,
+                           "closing superfluous connection to %s", a->ip);
+                a->c = NULL;
+                mio_close(m);
+                return;
+            }
+
+            /* we have a winner, all other attempts are not needed anymore */
+            dialback_out_record_latency(
+                c->d, c->key->get_domain().c_str(), a->ip,
+                dialback_out_elapsed(a->started));
+            dialback_out_cancel_attempts(c);
+            if (c->connect_results != NULL)
+                *c->connect_results << a->ip << ": ";
+            pool_free(a->p);
+
+            mio_reset(m, dialback_out_read, (void *)c);
+            dialback_out_read(m, MIO_NEW, (void *)c, NULL, NULL, 0);
+            return;
+
+        case MIO_CLOSED:
+            if (c == NULL) {
+                pool_free(a->p);
+                return;
+            }
+
+            /* add the connect error message to the list of messages for the
+             * tried hosts */
+            if (c->connect_results != NULL) {
+                if (c->connect_results->tellp() > 0)
+                    *c->connect_results << " / ";
+                *c->connect_results << a->ip << ": " << mio_connect_errmsg(m);
+            }
+            pool_free(a->p);
+
+            if (c->ip != NULL) {
+                dialback_out_connect(c); /* this one failed, try another */
+            } else if (c->attempts == NULL) {
+                dialback_out_connection_cleanup(c); /* buh bye! */
+            }
+            return;
+
+        default:
+            if (x != NULL)
+                xmlnode_free(x);
+            return;
+    }
 }
 
 /**
@@ -135,6 +419,121 @@ static void delete_ostringstream(void *arg) {
     delete os;
 }
 
+/**
+ * send a &lt;db:result/&gt; to request dialback for the domain pair of a
+ * connect object
+ *
+ * @param c the connect object
+ * @param m the stream to send the request on
+ * @param stream_id the id the peer assigned to the stream
+ */
+static void dialback_out_send_result(dboc c, mio m, char const *stream_id) {
+    xmlnode db_result = xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
+    xmlnode_put_attrib_ns(db_result, "to", NULL, NULL,
+                          c->key->get_domain().c_str());
+    xmlnode_put_attrib_ns(db_result, "from", NULL, NULL,
+                          c->key->get_resource().c_str());
+    xmlnode_insert_cdata(db_result,
+                         dialback_merlin(xmlnode_pool(db_result), c->d->secret,
+                                         c->key->get_domain().c_str(),
+                                         c->key->get_resource().c_str(),
+                                         stream_id),
+                         -1);
+    mio_write(m, db_result, NULL, 0);
+}
+
+/**
+ * authorize the domain pair of a connect object on an established stream to
+ * the peer (dialback piggybacking), instead of opening a new connection
+ *
+ * @param c the connect object
+ * @param carrier the established stream
+ */
+static void dialback_out_piggyback(dboc c, miod carrier) {
+    log_debug2(ZONE, LOGT_IO, "requesting dialback for %s on stream %s (%s)",
+               jid_full(c->key), carrier->stream_id, mio_ip(carrier->m));
+
+    c->m = carrier->m;
+    c->carrier = carrier;
+    c->stream_id = pstrdup(c->p, carrier->stream_id);
+    c->xmpp_version = 1;
+    c->flags.db = 1;
+    c->flags.piggyback = 1;
+    c->connection_state = sent_db_request;
+    c->db_state = sent_request;
+    if (c->connect_results != NULL)
+        *c->connect_results << mio_ip(c->m) << ": Reusing stream";
+
+    dialback_out_send_result(c, c->m, c->stream_id);
+}
+
+/**
+ * pass the stanzas waiting for a connect object to the resolver, that sends
+ * them back together with the addresses of the peer, and drop the connect
+ * object
+ *
+ * @param c the connect object
+ */
+static void dialback_out_resolve(dboc c) {
+    dboq cur = c->q;
+    c->q = NULL;
+    c->q_last = NULL;
+    c->q_count = 0;
+    c->q_bytes = 0;
+
+    while (cur != NULL) {
+        dboq next = cur->next;
+        xmlnode x = cur->x;
+        dialback_out_unlink(cur);
+
+        /* wrapped the same way as db:verify in dialback_in_read_db(), so that
+         * the route reaches the resolver and the result gets back to us */
+        xmlnode_put_attrib_ns(x, "dnsqueryby", NULL, NULL, c->d->i->id);
+        x = xmlnode_wrap_ns(x, "route", NULL, NS_SERVER);
+        xmlnode_put_attrib_ns(x, "type", NULL, NULL, "resolve");
+        xmlnode_put_attrib_ns(x, "to", NULL, NULL, "dnsrv.amessage.info");
+        xmlnode_put_attrib_ns(x, "from", NULL, NULL, c->d->i->id);
+        deliver(dpacket_new(x), c->d->i);
+
+        cur = next;
+    }
+
+    dialback_out_connection_cleanup(c);
+}
+
+/**
+ * authorizing a domain pair on an established stream did not work: open a
+ * connection of its own, to the addresses we know or after resolving the peer
+ *
+ * @param c the connect object
+ */
+static void dialback_out_piggyback_failed(dboc c) {
+    c->m = NULL;
+    c->carrier = NULL;
+    if (c->ip == NULL) {
+        char *ip = dialback_ip_get(c->d, c->key, NULL);
+        if (ip == NULL) {
+            log_debug2(ZONE, LOGT_IO, "resolving %s to open a connection",
+                       jid_full(c->key));
+            dialback_out_resolve(c);
+            return;
+        }
+        c->ip = dialback_out_interleave(c->p, ip);
+    }
+
+    log_debug2(ZONE, LOGT_IO, "opening a connection of its own for %s",
+               jid_full(c->key));
+    c->stream_id = NULL;
+    c->xmpp_version = -1;
+    c->flags.db = 0;
+    c->flags.piggyback = 0;
+    c->connection_state = created;
+    c->db_state = want_request;
+    if (c->connect_results != NULL)
+        *c->connect_results << " / ";
+    dialback_out_connect(c);
+}
+
 /**
  * make a new outgoing connect(ion) object, and start to connect to the peer
  *
@@ -159,20 +558,7 @@ dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
                 c->db_state = want_request;
             } else if (c->db_state == could_request) {
                 /* send <db:result/> to request dialback */
-                xmlnode db_result =
-                    xmlnode_new_tag_ns("result", "db", NS_DIALBACK);
-                xmlnode_put_attrib_ns(db_result, "to", NULL, NULL,
-                                      c->key->get_domain().c_str());
-                xmlnode_put_attrib_ns(db_result, "from", NULL, NULL,
-                                      c->key->get_resource().c_str());
-                xmlnode_insert_cdata(
-                    db_result,
-                    dialback_merlin(xmlnode_pool(db_result), c->d->secret,
-                                    c->key->get_domain().c_str(),
-                                    c->key->get_resource().c_str(),
-                                    c->stream_id),
-                    -1);
-                mio_write(c->m, db_result, NULL, 0);
+                dialback_out_send_result(c, c->m, c->stream_id);
                 c->db_state = sent_request;
                 log_debug2(ZONE, LOGT_IO,
                            "packet for existing connection: state change "
@@ -182,7 +568,13 @@ dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
         return c;
     }
 
-    if (ip == NULL)
+    /* is there an established stream to the peer we can reuse? */
+    miod carrier = NULL;
+    if (db_state == want_request)
+        carrier = static_cast<miod>(
+            xhash_get(d->out_peers, key->get_domain().c_str()));
+
+    if (ip == NULL && carrier == NULL)
         return NULL;
 
     /* none, make a new one */
@@ -193,7 +585,7 @@ dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
     c->key = jid_new(p, jid_full(key));
     c->stamp = time(NULL);
     c->verifies = xmlnode_new_tag_pool_ns(p, "v", NULL, NS_JABBERD_WRAPPER);
-    c->ip = pstrdup(p, ip);
+    c->ip = ip == NULL ? NULL : dialback_out_interleave(p, ip);
     c->db_state = db_state;
     c->connection_state = created;
     c->connect_results = new std::ostringstream();
@@ -203,12 +595,33 @@ dboc dialback_out_connection(db d, jid key, char *ip, db_request db_state) {
     /* insert in the hash */
     xhash_put(d->out_connecting, jid_full(c->key), (void *)c);
 
-    /* start the conneciton process */
-    dialback_out_connect(c);
+    /* authorize on the established stream, or start the conneciton process */
+    if (carrier != NULL)
+        dialback_out_piggyback(c, carrier);
+    else
+        dialback_out_connect(c);
 
     return c;
 }
 
+/**
+ * remove a stanza from the queue of all stanzas waiting for a connection
+ *
+ * @param q the stanza to remove
+ */
+static void dialback_out_unlink(dboq q) {
+    db d = q->c->d;
+
+    if (q->older == NULL)
+        d->queue_oldest = q->newer;
+    else
+        q->older->newer = q->newer;
+    if (q->newer == NULL)
+        d->queue_newest = q->older;
+    else
+        q->newer->older = q->older;
+}
+
 /**
  * get the textual representation of a db_connection_state
  *
@@ -262,6 +675,7 @@ void dialback_out_connection_cleanup(dboc c) {
     const char *lang = NULL;
 
     xhash_zap(c->d->out_connecting, jid_full(c->key));
+    dialback_out_cancel_attempts(c);
 
     /* get the results of connection attempts */
     Glib::ustring connect_results;
@@ -302,6 +716,7 @@ void dialback_out_connection_cleanup(dboc c) {
     }
     while (cur != NULL) {
         next = cur->next;
+        dialback_out_unlink(cur);
         deliver_fail(
             dpacket_new(cur->x),
             bounce_reason
@@ -430,12 +845,111 @@ void dialback_out_packet(db d, xmlnode x, char *ip) {
         return;
     }
 
-    /* insert into the queue */
+    /* bounce right now, if the queue for this peer is full already */
+    int size = pool_size(xmlnode_pool(x));
+    if ((c->d->queue_stanzas > 0 && c->q_count >= c->d->queue_stanzas) ||
+        (c->d->queue_bytes > 0 && c->q_bytes + size > c->d->queue_bytes)) {
+        log_debug2(ZONE, LOGT_IO,
+                   "queue for %s full (%i stanzas, %li bytes), bouncing",
+                   jid_full(key), c->q_count, c->q_bytes);
+        deliver_fail(dpacket_new(x),
+                     messages_get(xmlnode_get_lang(x),
+                                  N_("Too many stanzas waiting for the "
+                                     "connection to the other server")));
+        return;
+    }
+
+    /* append to the queue */
     q = static_cast<dboq>(pmalloco(xmlnode_pool(x), sizeof(_dboq)));
     q->stamp = time(NULL);
     q->x = x;
-    q->next = c->q;
-    c->q = q;
+    q->size = size;
+    q->c = c;
+    if (c->q_last == NULL)
+        c->q = q;
+    else
+        c->q_last->next = q;
+    c->q_last = q;
+    c->q_count++;
+    c->q_bytes += size;
+
+    /* and to the queue of all waiting stanzas */
+    q->older = d->queue_newest;
+    if (d->queue_newest == NULL)
+        d->queue_oldest = q;
+    else
+        d->queue_newest->newer = q;
+    d->queue_newest = q;
+}
+
+/**
+ * collect the connect objects authorizing on a stream, helper for
+ * dialback_out_read_db() called by xhash_walk()
+ *
+ * @param h the hash of connect objects
+ * @param key the key of the connect object
+ * @param data the connect object
+ * @param arg pair of the stream and the list of found connect objects
+ */
+static void _dialback_out_piggybacked(xht h, char const *key, void *data,
+                                      void *arg) {
+    dboc c = static_cast<dboc>(data);
+    std::pair<mio, std::list<dboc>> *found =
+        static_cast<std::pair<mio, std::list<dboc>> *>(arg);
+
+    if (c->flags.piggyback && c->m == found->first)
+        found->second.push_back(c);
+}
+
+/**
+ * handle the result of authorizing an additional domain pair on an established
+ * stream
+ *
+ * @param d the dialback instance
+ * @param m the established stream
+ * @param x the &lt;db:result/&gt; element received
+ */
+static void dialback_out_piggyback_result(db d, mio m, xmlnode x) {
+    jid key = jid_new(xmlnode_pool(x), xmlnode_get_attrib_ns(x, "from", NULL));
+    if (key != NULL)
+        jid_set(key, xmlnode_get_attrib_ns(x, "to", NULL), JID_RESOURCE);
+    dboc c = key == NULL ? NULL
+                         : static_cast<dboc>(
+                               xhash_get(d->out_connecting, jid_full(key)));
+
+    if (c == NULL || !c->flags.piggyback || c->m != m) {
+        log_warn(d->i->id, "ignoring unexpected dialback result on %s: %s",
+                 mio_ip(m),
+                 xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
+        return;
+    }
+
+    if (j_strcmp(xmlnode_get_attrib_ns(x, "type", NULL), "valid") == 0) {
+        log_debug2(ZONE, LOGT_IO, "%s authorized on stream %s (%s)",
+                   jid_full(c->key), c->stream_id, mio_ip(m));
+        c->connection_state = db_succeeded;
+        /* share the miod of the stream, so that it is idle only if all
+         * domain pairs on it are */
+        dialback_miod_hash(c->carrier, d->out_ok_db, c->key);
+        dialback_out_qflush(c->carrier, c);
+        dialback_out_connection_cleanup(c);
+        return;
+    }
+
+    /* the peer does not accept the pair on this stream, but the stream itself
+     * is still fine */
+    char const *type_attribute = xmlnode_get_attrib_ns(x, "type", NULL);
+    log_notice(d->i->id, "%s refused to authorize %s on stream %s: %s",
+               c->key->get_domain().c_str(), c->key->get_resource().c_str(),
+               c->stream_id,
+               type_attribute ? type_attribute : "no type attribute");
+    c->connection_state = db_failed;
+    if (c->connect_results != NULL)
+        *c->connect_results << " (dialback result: "
+                            << (type_attribute ? type_attribute
+                                               : "no type attribute")
+                            << ")";
+    dialback_out_piggyback_failed(c);
 }
 
 /**
@@ -443,7 +957,8 @@ void dialback_out_packet(db d, xmlnode x, char *ip) {
  * isn't much of a job
  *
  * The only packets we have to expect on an outgoing dialback socket are
- * db:verify and maybe stream:error
+ * db:verify, db:result for domain pairs authorized on an established stream,
+ * and maybe stream:error
  *
  * @param m the connection the packet has been received on
  * @param flags the mio action, we ignore anything but MIO_XML_NODE
@@ -456,9 +971,27 @@ void dialback_out_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
                           int unused2) {
     db d = (db)arg;
 
+    /* domain pairs waiting for authorization on this stream need another one */
+    if (flags == MIO_CLOSED) {
+        std::pair<mio, std::list<dboc>> found(m, std::list<dboc>());
+        xhash_walk(d->out_connecting, _dialback_out_piggybacked, &found);
+        for (std::list<dboc>::iterator p = found.second.begin();
+             p != found.second.end(); ++p)
+            dialback_out_piggyback_failed(*p);
+        return;
+    }
+
     if (flags != MIO_XML_NODE)
         return;
 
+    /* result for a domain pair authorized on this established stream? */
+    if (j_strcmp(xmlnode_get_localname(x), "result") == 0 &&
+        j_strcmp(xmlnode_get_namespace(x), NS_DIALBACK) == 0) {
+        dialback_out_piggyback_result(d, m, x);
+        xmlnode_free(x);
+        return;
+    }
+
     /* it's either a valid verify response, or bust! */
     if (j_strcmp(xmlnode_get_localname(x), "verify") == 0 &&
         j_strcmp(xmlnode_get_namespace(x), NS_DIALBACK) == 0) {
@@ -513,17 +1046,24 @@ void dialback_out_read_db(mio m, int flags, void *arg, xmlnode x, char *unused1,
 /**
  * util to flush queue to mio
  *
- * Take elements from the queue and send it to a miod connection.
+ * Take elements from the queue of a connect object and send them to a miod
+ * connection, in the order they have been queued.
  *
  * @param md the miod connection
- * @param q the queue to flush
+ * @param c the connect object, its queue is empty afterwards
  */
-void dialback_out_qflush(miod md, dboq q) {
+void dialback_out_qflush(miod md, dboc c) {
     dboq cur, next;
 
-    cur = q;
+    cur = c->q;
+    c->q = NULL;
+    c->q_last = NULL;
+    c->q_count = 0;
+    c->q_bytes = 0;
+
     while (cur != NULL) {
         next = cur->next;
+        dialback_out_unlink(cur);
         dialback_miod_write(md, cur->x);
         cur = next;
     }
@@ -828,8 +1368,7 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                     dialback_out_send_verifies(m, c);
 
                     /* flush the queue of packets */
-                    dialback_out_qflush(md, c->q);
-                    c->q = NULL;
+                    dialback_out_qflush(md, c);
 
                     /* we are connected, and can trash this now */
                     dialback_out_connection_cleanup(c);
@@ -838,6 +1377,15 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                 }
 
                 c->connection_state = got_features;
+                /* does the peer tell about dialback errors? (then we may
+                 * authorize other domain pairs on this stream later) */
+                c->flags.db_errors =
+                    xmlnode_get_list_item(
+                        xmlnode_get_tags(
+                            x, "dbfeatures:dialback/dbfeatures:errors",
+                            c->d->std_ns_prefixes),
+                        0) != NULL;
+
                 /* is starttls supported? */
                 if (xmlnode_get_list_item(
                         xmlnode_get_tags(x, "tls:starttls",
@@ -1098,8 +1646,16 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
                                                    stuff directly now */
 
                     /* flush the queue of packets */
-                    dialback_out_qflush(md, c->q);
-                    c->q = NULL;
+                    dialback_out_qflush(md, c);
+
+                    /* other domain pairs may be authorized on this stream as
+                     * well, if the peer tells us about failures */
+                    md->stream_id = pstrdup(m->p, c->stream_id);
+                    if (c->flags.db_errors)
+                        dialback_miod_hash(
+                            md, c->d->out_peers,
+                            jid_new(xmlnode_pool(x),
+                                    c->key->get_domain().c_str()));
 
                     /* we are connected, and can trash this now */
                     dialback_out_connection_cleanup(c);
@@ -1165,9 +1721,6 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
             if (c->ip == NULL) {
                 dialback_out_connection_cleanup(c); /* buh bye! */
             } else {
-                if (c->connect_results != NULL) {
-                    *c->connect_results << " / ";
-                }
                 dialback_out_connect(c); /* this one failed, try another */
             }
             return;
@@ -1179,69 +1732,50 @@ void dialback_out_read(mio m, int flags, void *arg, xmlnode x, char *unused1,
 }
 
 /**
- * callback for walking the connecting hash tree: timing out connections that
- * did not get authorized in time (default is 30 seconds, can be configured with
- * &lt;queuetimeout/&gt; in the configuration file)
+ * bounce stanzas that waited too long for a connection (default is 30
+ * seconds, can be configured with &lt;queuetimeout/&gt; in the configuration
+ * file)
+ *
+ * The queue of all waiting stanzas is ordered by the time they expire, so
+ * only the expired stanzas at its head have to be looked at.
  *
- * @param h the hash containing all pending connections
- * @param key destination/source address
- * @param data the dboc
- * @param arg unused/ignored
+ * @param arg the dialback instance
+ * @return allways r_DONE
  */
-void _dialback_out_beat_packets(xht h, const char *key, void *data, void *arg) {
-    dboc c = (dboc)data;
-    dboq cur = NULL;
-    dboq next = NULL;
-    dboq last = NULL;
+result dialback_out_beat_packets(void *arg) {
+    db d = (db)arg;
     int now = time(NULL);
-    char *bounce_reason = NULL;
 
-    /* time out individual queue'd packets */
-    cur = c->q;
-    while (cur != NULL) {
+    while (d->queue_oldest != NULL &&
+           (now - d->queue_oldest->stamp) > d->timeout_packets) {
+        dboq cur = d->queue_oldest;
+        dboc c = cur->c;
         const char *lang = xmlnode_get_lang(cur->x);
 
-        if ((now - cur->stamp) <= c->d->timeout_packets) {
-            last = cur;
-            cur = cur->next;
-            continue;
-        }
+        /* the oldest stanza of all is the oldest stanza for its peer */
+        dialback_out_unlink(cur);
+        c->q = cur->next;
+        if (c->q == NULL)
+            c->q_last = NULL;
+        c->q_count--;
+        c->q_bytes -= cur->size;
 
         /* timed out sukkah! */
-        next = cur->next;
-        if (c->q == cur)
-            c->q = next;
-        else
-            last->next = next;
-
-        if (bounce_reason == NULL) {
-            std::ostringstream errmsg;
-            errmsg << messages_get(lang, N_("Server connect timeout while "));
-            errmsg << messages_get(lang, dialback_out_connection_state_string(
-                                             c->connection_state));
-            if (c->connect_results) {
-                errmsg << ": " << c->connect_results->str();
-            }
-            bounce_reason = pstrdup(c->p, errmsg.str().c_str());
+        std::ostringstream errmsg;
+        errmsg << messages_get(lang, N_("Server connect timeout while "));
+        errmsg << messages_get(
+            lang, dialback_out_connection_state_string(c->connection_state));
+        if (c->connect_results) {
+            errmsg << ": " << c->connect_results->str();
         }
 
-        deliver_fail(dpacket_new(cur->x),
-                     bounce_reason
-                         ? bounce_reason
-                         : messages_get(lang, N_("Server Connect Timeout")));
-        cur = next;
+        deliver_fail(dpacket_new(cur->x), errmsg.str().c_str());
+
+        /* the peer did not answer for a domain pair on an established stream,
+         * nothing is waiting for it anymore */
+        if (c->q == NULL && c->flags.piggyback)
+            dialback_out_connection_cleanup(c);
     }
-}
 
-/**
- * start walking the connection hash tree, to see if connections dig not get
- * authorizsed in time
- *
- * @param arg the dialback instance
- * @return allways r_DONE
- */
-result dialback_out_beat_packets(void *arg) {
-    db d = (db)arg;
-    xhash_walk(d->out_connecting, _dialback_out_beat_packets, NULL);
     return r_DONE;
 }
@@ -35,14 +35,21 @@
  * Config format:
  * &lt;dnsrv xmlns='jabber:config:dnsrv'&gt;
  *     &lt;resend service="_jabber._tcp"&gt;s2s-component&lt;/resend&gt;
+ *     &lt;nameserver port='53'&gt;127.0.0.1&lt;/nameserver&gt;
  * &lt;/dnsrv&gt;
  *
  * Note: You must specify the services in the order you want them tried
+ *
+ * Hosts are resolved inside the server process by a srv_async_resolver,
+ * unless a &lt;coprocess/&gt; element is configured, which selects the old
+ * resolving in a forked coprocess using the blocking libresolv functions.
  */
 
 #include "jabberd.h"
+#include "srv_async.h"
 #include "srv_resolv.h"
 
+#include <dnscache.hh>
 #include <namespaces.hh>
 
 #include <sys/wait.h>
@@ -72,6 +79,15 @@ typedef struct __dns_resend_list {
     struct __dns_resend_list *next;  /**< next entry in the list */
 } * dns_resend_list, _dns_resend_list;
 
+/** interval of checking the cache for hosts to prefetch */
+#define DNSRV_PREFETCH_BEAT 30
+
+/** interval of checking the in-process resolver for timed out queries */
+#define DNSRV_TIMEOUT_BEAT 1
+
+/** interval of logging the counters of the in-process resolver */
+#define DNSRV_STATISTICS_BEAT 60
+
 /**
  * struct to keep track of a DNS coprocess
  */
@@ -81,10 +97,13 @@ typedef struct {
     int pid;                 /**< Coprocess PID */
     xht packet_table;        /**< Hash of dns_packet_lists */
     int packet_timeout;      /**< how long to keep packets in the queue */
-    xht cache_table;         /**< Hash of resolved IPs */
-    int cache_timeout;       /**< how long to keep resolutions in the cache */
+    int cache_timeout; /**< how long to cache resolutions without known TTL */
+    int prefetch_hits; /**< how often a cached resolution has to be used to be
+                          resolved again before it expires (0 = never) */
     pool mempool;            /**< memory pool to use */
     dns_resend_list svclist; /**< list of defined services */
+    srv_async_resolver *resolver; /**< in-process resolver, NULL if the
+                                     coprocess is used */
 } * dns_io, _dns_io;
 
 /**
@@ -118,6 +137,30 @@ void warning_write(int fd, const void *buf, size_t count) {
     }
 }
 
+/**
+ * select one of the hosts stanzas are resent to for a service
+ *
+ * @param svc the service
+ * @return the selected host
+ */
+char *dnsrv_select_resend(dns_resend_list svc) {
+    dns_resend_list_host_list iterhost = svc->hosts;
+
+    /* play the dice, to select one of the s2s hosts */
+    /* XXX should we statically distribute to the hosts using a hash over the
+     * destination? */
+    int host_die = svc->weight_sum <= 1 ? 0 : rand() % (svc->weight_sum);
+
+    /* find the host selected by our host_die */
+    while (host_die >= iterhost->weight && iterhost->next != NULL) {
+        /* try next host */
+        host_die -= iterhost->weight;
+        iterhost = iterhost->next;
+    }
+
+    return iterhost->host;
+}
+
 /**
  * coprocess functionality
  */
@@ -125,6 +168,7 @@ void dnsrv_child_process_xstream_io(int type, xmlnode x, void *args) {
     dns_io di = (dns_io)args;
     char *hostname, *ascii_hostname = NULL;
     char *str = NULL;
+    long ttl = -1;
     dns_resend_list iternode = NULL;
 
     if (type == XSTREAM_NODE) {
@@ -145,30 +189,22 @@ void dnsrv_child_process_xstream_io(int type, xmlnode x, void *args) {
                the specified service and resend it to the specified host */
             iternode = di->svclist;
             while (iternode != NULL) {
-                str = srv_lookup(xmlnode_pool(x), iternode->service, hostname);
+                str = srv_lookup(xmlnode_pool(x), iternode->service, hostname,
+                                 &ttl);
                 if (str != NULL) {
-                    dns_resend_list_host_list iterhost = iternode->hosts;
-
-                    /* play the dice, to select one of the s2s hosts */
-                    /* XXX should we statically distribute to the hosts using a
-                     * hash over the destination? */
-                    int host_die = iternode->weight_sum <= 1
-                                       ? 0
-                                       : rand() % (iternode->weight_sum);
-
-                    /* find the host selected by our host_die */
-                    while (host_die >= iterhost->weight &&
-                           iterhost->next != NULL) {
-                        /* try next host */
-                        host_die -= iterhost->weight;
-                        iterhost = iterhost->next;
-                    }
+                    char *resend = dnsrv_select_resend(iternode);
 
                     log_debug2(ZONE, LOGT_IO,
                                "Resolved %s(%s): %s\tresend to:%s", hostname,
-                               iternode->service, str, iterhost->host);
+                               iternode->service, str, resend);
                     xmlnode_put_attrib_ns(x, "ip", NULL, NULL, str);
-                    xmlnode_put_attrib_ns(x, "to", NULL, NULL, iterhost->host);
+                    xmlnode_put_attrib_ns(x, "to", NULL, NULL, resend);
+                    if (ttl >= 0) {
+                        std::ostringstream ttl_str;
+                        ttl_str << ttl;
+                        xmlnode_put_attrib_ns(x, "ttl", NULL, NULL,
+                                              ttl_str.str().c_str());
+                    }
                     break;
                 }
                 iternode = iternode->next;
@@ -289,14 +325,34 @@ void dnsrv_resend(xmlnode pkt, char *ip, char *to) {
     deliver(dpacket_new(pkt), NULL);
 }
 
+/**
+ * start resolving a host, either by the in-process resolver or by sending a
+ * request to the coprocess
+ *
+ * @param d the dnsrv instance
+ * @param host the host to resolve
+ */
+void dnsrv_request(dns_io d, char const *host) {
+    if (d->resolver != NULL) {
+        d->resolver->resolve(host);
+        return;
+    }
+
+    xmlnode req = xmlnode_new_tag_ns("host", NULL, NS_SERVER);
+    xmlnode_insert_cdata(req, host, -1);
+
+    char const *reqs = xmlnode_serialize_string(req, xmppd::ns_decl_list(), 0);
+    log_debug2(ZONE, LOGT_IO, "dnsrv: Transmitting lookup request: %s", reqs);
+    pth_write(d->out, reqs, strlen(reqs));
+    xmlnode_free(req);
+}
+
 /* Hostname lookup requested */
 void dnsrv_lookup(dns_io d, dpacket p) {
     dns_packet_list l, lnew;
-    xmlnode req;
-    char *reqs;
 
     /* make sure we have a child! */
-    if (d->out <= 0) {
+    if (d->resolver == NULL && d->out <= 0) {
         deliver_fail(p, N_("DNS Resolver Error"));
         return;
     }
@@ -327,25 +383,18 @@ void dnsrv_lookup(dns_io d, dpacket p) {
     l->packet = p;
     l->stamp = time(NULL);
     xhash_put(d->packet_table, p->host, l);
-    req = xmlnode_new_tag_pool_ns(p->p, "host", NULL, NS_SERVER);
-    xmlnode_insert_cdata(req, p->host, -1);
-
-    reqs = xmlnode_serialize_string(req, xmppd::ns_decl_list(), 0);
-    log_debug2(ZONE, LOGT_IO, "dnsrv: Transmitting lookup request: %s", reqs);
-    pth_write(d->out, reqs, strlen(reqs));
+    dnsrv_request(d, p->host);
 }
 
 result dnsrv_deliver(instance i, dpacket p, void *args) {
     dns_io di = (dns_io)args;
-    xmlnode c;
-    int timeout = di->cache_timeout;
-    char *ip;
     jid to;
 
-    /* if we get a route packet, it has to be to *us* and have the child as the
-     * real packet */
+    /* if we get a route packet, it has to be to *us* (or a resolve request of
+     * our dialback, that got to us as the default route) and have the child
+     * as the real packet */
     if (p->type == p_ROUTE) {
-        if (j_strcmp(p->host, i->id) != 0 ||
+        if ((j_strcmp(p->host, i->id) != 0 && !deliver_is_resolve_request(p)) ||
             (to = jid_new(p->p,
                           xmlnode_get_attrib_ns(xmlnode_get_firstchild(p->x),
                                                 "to", NULL))) == NULL)
@@ -364,88 +413,126 @@ result dnsrv_deliver(instance i, dpacket p, void *args) {
         return r_DONE;
     }
 
-    /* try the cache first */
-    if ((c = static_cast<xmlnode>(xhash_get(di->cache_table, p->host))) !=
-        NULL) {
-        /* if there's no IP, cached failed lookup, time those out 10 times
-         * faster! (weird, I know, *shrug*) */
-        if ((ip = xmlnode_get_attrib_ns(c, "ip", NULL)) == NULL)
-            timeout = timeout / 10;
-
-        char const *cache_time_str = xmlnode_get_attrib_ns(c, "t", NULL);
-        time_t cache_time = 0;
-        if (cache_time_str) {
-            std::istringstream cache_time_stream(cache_time_str);
-            cache_time_stream >> cache_time;
-        }
-        if (std::time(NULL) - cache_time > timeout) {
-            /* timed out of the cache, lookup again */
-            xhash_zap(di->cache_table, p->host);
-            xmlnode_free(c);
-        } else {
+    /* try the cache first (entries without resend destination have been
+     * stored by dialback and are of no use for us) */
+    std::vector<xmppd::dns_record> records;
+    std::string resend;
+    switch (xmppd::dns_cache::shared().get(
+        p->host, xmppd::dns_cache::rr_host, records, &resend)) {
+        case xmppd::dns_cache::lookup_negative:
+            dnsrv_resend(p->x, NULL, NULL);
+            return r_DONE;
+        case xmppd::dns_cache::lookup_hit:
+            if (resend.empty())
+                break;
             /* yay, send back right from the cache */
-            dnsrv_resend(p->x, ip, xmlnode_get_attrib(c, "to"));
+            dnsrv_resend(
+                p->x,
+                pstrdup(p->p,
+                        xmppd::dns_cache::format_addresses(records).c_str()),
+                pstrdup(p->p, resend.c_str()));
             return r_DONE;
-        }
+        default:
+            break;
     }
 
     dnsrv_lookup(di, p);
     return r_DONE;
 }
 
-void dnsrv_process_xstream_io(int type, xmlnode x, void *arg) {
-    dns_io di = (dns_io)arg;
-    char *hostname = NULL;
-    char *ipaddr = NULL;
-    char *resendhost = NULL;
+/**
+ * a host has been resolved: cache the result and resend the waiting packets
+ *
+ * @param di the dnsrv instance
+ * @param hostname the host that has been resolved
+ * @param ipaddr the resolved addresses, NULL if resolving failed
+ * @param resendhost where to resend the packets to
+ * @param ttl seconds the result is valid, negative if not known
+ */
+void dnsrv_resolved(dns_io di, char const *hostname, char *ipaddr,
+                    char *resendhost, long ttl) {
     dns_packet_list head = NULL;
     dns_packet_list heado = NULL;
 
+    if (hostname == NULL)
+        return;
+
+    /* whatever the response was, let's cache it (but a failed prefetch
+     * keeps the addresses that are still valid) */
+    if (ipaddr != NULL) {
+        xmppd::dns_cache::shared().put(
+            hostname, xmppd::dns_cache::rr_host,
+            xmppd::dns_cache::parse_addresses(ipaddr), ttl,
+            resendhost != NULL ? resendhost : "");
+    } else {
+        xmppd::dns_cache::shared().put_failed(hostname,
+                                              xmppd::dns_cache::rr_host);
+    }
+
+    /* Get the hostname and look it up in the hashtable */
+    head = static_cast<dns_packet_list>(xhash_get(di->packet_table, hostname));
+    /* Process the packet list */
+    if (head != NULL) {
+        /* Remove the list from the hashtable */
+        xhash_zap(di->packet_table, hostname);
+
+        /* Walk the list and insert IPs */
+        while (head != NULL) {
+            heado = head;
+            /* Move to next.. */
+            head = head->next;
+            /* Deliver the packet */
+            dnsrv_resend(heado->packet->x, ipaddr, resendhost);
+        }
+    } else {
+        /* nothing waiting, the cache entry has been refreshed */
+        log_debug2(ZONE, LOGT_IO, "Resolved prefetched host: %s", hostname);
+    }
+}
+
+void dnsrv_process_xstream_io(int type, xmlnode x, void *arg) {
+    dns_io di = (dns_io)arg;
+
     /* Node Format: <host ip="201.83.28.2">foo.org</host> */
     if (type == XSTREAM_NODE) {
         log_debug2(ZONE, LOGT_IO, "incoming resolution: %s",
                    xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
-        hostname = xmlnode_get_data(x);
+        dnsrv_resolved(di, xmlnode_get_data(x),
+                       xmlnode_get_attrib_ns(x, "ip", NULL),
+                       xmlnode_get_attrib_ns(x, "to", NULL),
+                       j_atoi(xmlnode_get_attrib_ns(x, "ttl", NULL), -1));
+    }
+    xmlnode_free(x);
+}
 
-        /* whatever the response was, let's cache it */
-        xmlnode_free((xmlnode)xhash_get(
-            di->cache_table,
-            hostname)); /* free any old cache, shouldn't ever be any */
-
-        std::ostringstream now;
-        now << std::time(NULL);
-
-        xmlnode_put_attrib(x, "t", now.str().c_str());
-        xhash_put(di->cache_table, hostname, (void *)x);
-
-        /* Get the hostname and look it up in the hashtable */
-        head =
-            static_cast<dns_packet_list>(xhash_get(di->packet_table, hostname));
-        /* Process the packet list */
-        if (head != NULL) {
-            ipaddr = xmlnode_get_attrib_ns(x, "ip", NULL);
-            resendhost = xmlnode_get_attrib_ns(x, "to", NULL);
-
-            /* Remove the list from the hashtable */
-            xhash_zap(di->packet_table, hostname);
-
-            /* Walk the list and insert IPs */
-            while (head != NULL) {
-                heado = head;
-                /* Move to next.. */
-                head = head->next;
-                /* Deliver the packet */
-                dnsrv_resend(heado->packet->x, ipaddr, resendhost);
-            }
-        } else {
-            /* Host name was not found, something is _TERRIBLY_ wrong! */
-            log_debug2(ZONE, LOGT_IO, "Resolved unknown host/ip request: %s\n",
-                       xmlnode_serialize_string(x, xmppd::ns_decl_list(), 0));
-        }
+/**
+ * callback of the in-process resolver, called when a host has been resolved
+ *
+ * @param arg the dnsrv instance
+ * @param host the host that has been resolved
+ * @param service index of the service in the list of services, -1 on failure
+ * @param result the resolved addresses
+ * @param ttl seconds the result is valid
+ */
+void dnsrv_async_resolved(void *arg, std::string const &host, int service,
+                          std::string const &result, long ttl) {
+    dns_io di = (dns_io)arg;
+    dns_resend_list iternode = di->svclist;
+
+    for (int i = 0; i < service && iternode != NULL; i++)
+        iternode = iternode->next;
 
-        return; /* we cached x above, so we don't free it below :) */
+    if (service < 0 || iternode == NULL) {
+        log_debug2(ZONE, LOGT_IO, "Unable to resolve %s", host.c_str());
+        dnsrv_resolved(di, host.c_str(), NULL, NULL, -1);
+        return;
     }
-    xmlnode_free(x);
+
+    char *resend = dnsrv_select_resend(iternode);
+    log_debug2(ZONE, LOGT_IO, "Resolved %s(%s): %s\tresend to:%s",
+               host.c_str(), iternode->service, result.c_str(), resend);
+    dnsrv_resolved(di, host.c_str(), const_cast<char *>(result.c_str()),
+                   resend, ttl);
 }
 
 void *dnsrv_process_io(void *threadarg) {
@@ -551,6 +638,132 @@ result dnsrv_beat_packets(void *arg) {
     return r_DONE;
 }
 
+/**
+ * heartbeat resolving popular hosts again before their cache entries expire
+ *
+ * @param arg the dnsrv instance
+ * @return always r_DONE
+ */
+result dnsrv_beat_prefetch(void *arg) {
+    dns_io di = (dns_io)arg;
+    xmppd::dns_cache &cache = xmppd::dns_cache::shared();
+
+    /* make sure we have a child! */
+    if (di->resolver != NULL || di->out > 0) {
+        std::vector<std::string> hosts =
+            cache.get_prefetch(xmppd::dns_cache::rr_host,
+                               2 * DNSRV_PREFETCH_BEAT, di->prefetch_hits);
+        for (std::vector<std::string>::const_iterator p = hosts.begin();
+             p != hosts.end(); ++p) {
+            /* a lookup for this host is pending anyway */
+            if (xhash_get(di->packet_table, p->c_str()) != NULL)
+                continue;
+
+            log_debug2(ZONE, LOGT_IO, "dnsrv: prefetching %s", p->c_str());
+            dnsrv_request(di, p->c_str());
+        }
+    }
+
+    xmppd::dns_cache::statistics stats = cache.get_statistics();
+    log_debug2(ZONE, LOGT_STATUS,
+               "DNS cache: %lu entries, %lu hits, %lu negative hits, %lu "
+               "misses, %lu expired, %lu evicted, %lu prefetched",
+               static_cast<unsigned long>(stats.entries), stats.hits,
+               stats.negative_hits, stats.misses, stats.expired, stats.evicted,
+               stats.prefetches);
+
+    return r_DONE;
+}
+
+/**
+ * heartbeat resending or dropping queries of the in-process resolver that did
+ * not get an answer in time
+ *
+ * @param arg the dnsrv instance
+ * @return r_UNREG after the resolver has been freed, r_DONE else
+ */
+result dnsrv_beat_timeouts(void *arg) {
+    dns_io di = (dns_io)arg;
+    if (di->resolver == NULL)
+        return r_UNREG;
+    di->resolver->check_timeouts();
+    return r_DONE;
+}
+
+/**
+ * heartbeat logging the counters of the in-process resolver
+ *
+ * @param arg the dnsrv instance
+ * @return r_UNREG after the resolver has been freed, r_DONE else
+ */
+result dnsrv_beat_statistics(void *arg) {
+    dns_io di = (dns_io)arg;
+    if (di->resolver == NULL)
+        return r_UNREG;
+    srv_async_resolver::statistics stats = di->resolver->get_statistics();
+
+    log_debug2(ZONE, LOGT_STATUS,
+               "DNS resolver: %lu queries, %lu answers, %lu timeouts, "
+               "latency avg %lu ms max %lu ms, %lu in flight, %lu resolving",
+               stats.queries, stats.answers, stats.timeouts,
+               stats.answers > 0 ? stats.latency_sum / stats.answers : 0,
+               stats.latency_max, static_cast<unsigned long>(stats.in_flight),
+               static_cast<unsigned long>(stats.resolving));
+    return r_DONE;
+}
+
+/**
+ * free the in-process resolver of a dnsrv instance
+ *
+ * @param arg the dnsrv instance
+ */
+void dnsrv_free_resolver(void *arg) {
+    dns_io di = (dns_io)arg;
+    delete di->resolver;
+    di->resolver = NULL;
+}
+
+/**
+ * create the in-process resolver of a dnsrv instance
+ *
+ * @param i the dnsrv instance
+ * @param di the data of the dnsrv instance
+ * @param config the configuration of the dnsrv instance
+ */
+void dnsrv_start_resolver(instance i, dns_io di, xmlnode config) {
+    std::vector<std::string> services;
+    for (dns_resend_list iternode = di->svclist; iternode != NULL;
+         iternode = iternode->next)
+        services.push_back(iternode->service != NULL ? iternode->service : "");
+
+    di->resolver = new srv_async_resolver(services, dnsrv_async_resolved, di);
+    pool_cleanup(i->p, dnsrv_free_resolver, di);
+
+    /* configured name servers, e.g. a local one for testing */
+    bool nameservers = false;
+    for (xmlnode cur = xmlnode_get_firstchild(config); cur != NULL;
+         cur = xmlnode_get_nextsibling(cur)) {
+        if (j_strcmp("nameserver", xmlnode_get_localname(cur)) != 0 ||
+            j_strcmp(xmlnode_get_namespace(cur), NS_JABBERD_CONFIG_DNSRV) != 0)
+            continue;
+
+        char const *address = xmlnode_get_data(cur);
+        if (address == NULL)
+            continue;
+        if (di->resolver->add_nameserver(
+                address, j_atoi(xmlnode_get_attrib_ns(cur, "port", NULL), 53)))
+            nameservers = true;
+    }
+
+    /* else use the name servers of the system */
+    if (!nameservers && !di->resolver->add_system_nameservers() &&
+        !di->resolver->add_nameserver("127.0.0.1", 53))
+        log_error(i->id, "dnsrv has no name server to send queries to");
+
+    register_beat(DNSRV_TIMEOUT_BEAT, dnsrv_beat_timeouts, (void *)di);
+    register_beat(DNSRV_STATISTICS_BEAT, dnsrv_beat_statistics, (void *)di);
+}
+
 extern "C" void dnsrv(instance i, xmlnode x) {
     xdbcache xc = NULL;
     xmlnode config = NULL;
@@ -648,14 +861,35 @@ extern "C" void dnsrv(instance i, xmlnode x) {
         j_atoi(xmlnode_get_attrib_ns(config, "queuetimeout", NULL), 60);
     register_beat(di->packet_timeout, dnsrv_beat_packets, (void *)di);
 
-    /* Setup the internal hostname cache */
-    di->cache_table = xhash_new(
-        j_atoi(xmlnode_get_attrib_ns(config, "cachemax", NULL), 1999));
-    pool_cleanup(i->p, (pool_cleaner)xhash_free, di->cache_table);
+    /* Setup the hostname cache, the TTLs of the records are used if known,
+     * failed lookups are cached 10 times shorter */
     di->cache_timeout =
-        j_atoi(xmlnode_get_attrib_ns(config, "cachetimeout", NULL),
-               3600); /* 1 hour dns cache? XXX would be nice to get the right
-                         value from dns! */
+        j_atoi(xmlnode_get_attrib_ns(config, "cachetimeout", NULL), 3600);
+    xmppd::dns_cache::shared().configure(
+        j_atoi(xmlnode_get_attrib_ns(config, "cachemax", NULL), 1999),
+        di->cache_timeout, di->cache_timeout / 10);
+    di->prefetch_hits =
+        j_atoi(xmlnode_get_attrib_ns(config, "prefetch", NULL), 3);
+    if (di->prefetch_hits > 0)
+        register_beat(DNSRV_PREFETCH_BEAT, dnsrv_beat_prefetch, (void *)di);
+
+    /* resolve inside the server process, unless the coprocess is requested */
+    int coprocess = 0;
+    for (iternode = xmlnode_get_firstchild(config); iternode != NULL;
+         iternode = xmlnode_get_nextsibling(iternode)) {
+        if (j_strcmp("coprocess", xmlnode_get_localname(iternode)) == 0 &&
+            j_strcmp(xmlnode_get_namespace(iternode),
+                     NS_JABBERD_CONFIG_DNSRV) == 0)
+            coprocess = 1;
+    }
+    if (!coprocess) {
+        dnsrv_start_resolver(i, di, config);
+        xmlnode_free(config);
+
+        /* Register an incoming packet handler */
+        register_phandler(i, o_DELIVER, dnsrv_deliver, (void *)di);
+        return;
+    }
 
     xmlnode_free(config);
 
@@ -0,0 +1,648 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#include "jabberd.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#define BIND_8_COMPAT
+#include <arpa/nameser.h>
+#include <fcntl.h>
+#include <resolv.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+#include "srv_async.h"
+
+#ifdef LIBIDN
+#include <idna.h>
+#endif
+
+/**
+ * @file srv_async.cc
+ * @brief implements resolving of services without blocking
+ *
+ * This file implements a resolver that sends the DNS queries for SRV, AAAA
+ * and A records itself over UDP, so that dnsrv can resolve many hosts at the
+ * same time inside the server process, instead of passing each host to a
+ * coprocess that resolves them one after the other using the blocking
+ * libresolv functions.
+ */
+
+#ifndef T_SRV
+#define T_SRV 33
+#endif
+
+#ifndef T_AAAA
+#define T_AAAA 28
+#endif
+
+/** milliseconds to wait for an answer before a query is resent */
+#define SRV_ASYNC_TIMEOUT 2000
+
+/** how often a query is sent before giving up */
+#define SRV_ASYNC_TRIES 3
+
+/**
+ * milliseconds passed between two points in time
+ *
+ * @param from the earlier point in time
+ * @param to the later point in time
+ * @return the milliseconds passed
+ */
+static long srv_async_elapsed(struct timeval const &from,
+                              struct timeval const &to) {
+    return (to.tv_sec - from.tv_sec) * 1000 +
+           (to.tv_usec - from.tv_usec) / 1000;
+}
+
+/**
+ * order targets by the priority of their SRV records
+ */
+struct srv_async_priority_less {
+    template <typename T> bool operator()(T const &a, T const &b) const {
+        return a.priority < b.priority;
+    }
+};
+
+srv_async_resolver::srv_async_resolver(
+    std::vector<std::string> const &services, callback cb, void *arg)
+    : services(services), cb(cb), cb_arg(arg), stats(), reader_thread(NULL),
+      receive_buffer(NS_MAXMSG) {
+    /* res_mkquery() needs an initialized resolver state */
+    if ((_res.options & RES_INIT) == 0)
+        res_init();
+
+    if (pipe(wakeup) < 0) {
+        log_warn(ZONE, "cannot create pipe for the DNS reader: %s",
+                 strerror(errno));
+        wakeup[0] = wakeup[1] = -1;
+        return;
+    }
+    fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+
+    pth_attr_t attr = pth_attr_new();
+    pth_attr_set(attr, PTH_ATTR_JOINABLE, FALSE);
+    reader_thread = pth_spawn(attr, srv_async_resolver::reader, this);
+    pth_attr_destroy(attr);
+}
+
+srv_async_resolver::~srv_async_resolver() {
+    if (reader_thread != NULL)
+        pth_abort(reader_thread);
+
+    for (std::map<uint16_t, query>::iterator p = queries.begin();
+         p != queries.end(); ++p)
+        if (p->second.fd >= 0)
+            close(p->second.fd);
+
+    if (wakeup[0] >= 0) {
+        close(wakeup[0]);
+        close(wakeup[1]);
+    }
+}
+
+bool srv_async_resolver::add_nameserver(std::string const &address,
+                                        int port) {
+    struct sockaddr_storage sa;
+    socklen_t sa_len = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    struct sockaddr_in6 *sa6 = reinterpret_cast<struct sockaddr_in6 *>(&sa);
+    struct sockaddr_in *sa4 = reinterpret_cast<struct sockaddr_in *>(&sa);
+    if (inet_pton(AF_INET6, address.c_str(), &sa6->sin6_addr) == 1) {
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port = htons(port);
+        sa_len = sizeof(struct sockaddr_in6);
+    } else if (inet_pton(AF_INET, address.c_str(), &sa4->sin_addr) == 1) {
+        sa4->sin_family = AF_INET;
+        sa4->sin_port = htons(port);
+        sa_len = sizeof(struct sockaddr_in);
+    } else {
+        log_warn(ZONE, "invalid name server address: %s", address.c_str());
+        return false;
+    }
+
+    nameserver ns;
+    ns.address = sa;
+    ns.length = sa_len;
+    nameservers.push_back(ns);
+
+    log_debug2(ZONE, LOGT_IO, "using name server %s port %i", address.c_str(),
+               port);
+    return true;
+}
+
+bool srv_async_resolver::add_system_nameservers() {
+    bool added = false;
+
+    for (int i = 0; i < _res.nscount; i++) {
+        struct sockaddr_in const &ns = _res.nsaddr_list[i];
+        char address[INET6_ADDRSTRLEN];
+
+        if (ns.sin_family != AF_INET ||
+            inet_ntop(AF_INET, &ns.sin_addr, address, sizeof(address)) == NULL)
+            continue;
+        if (add_nameserver(address, ntohs(ns.sin_port)))
+            added = true;
+    }
+
+    return added;
+}
+
+void srv_async_resolver::resolve(std::string const &host) {
+    /* already resolving this host? */
+    if (jobs.find(host) != jobs.end())
+        return;
+
+    job &j = jobs[host];
+    j.host = host;
+    j.name = host;
+    j.service = 0;
+    j.pending = 0;
+    j.ttl = -1;
+
+#ifdef LIBIDN
+    char *ascii_host = NULL;
+    if (idna_to_ascii_8z(host.c_str(), &ascii_host, 0) == IDNA_SUCCESS) {
+        log_debug2(ZONE, LOGT_IO, "IDN conversion %s to %s", host.c_str(),
+                   ascii_host);
+        j.name = ascii_host;
+    }
+    if (ascii_host != NULL)
+        free(ascii_host);
+#endif
+
+    start_service(j);
+}
+
+void srv_async_resolver::start_service(job &j) {
+    j.targets.clear();
+    j.ttl = -1;
+
+    if (j.service >= services.size()) {
+        finish(j, std::string());
+        return;
+    }
+
+    std::string const &service = services[j.service];
+    if (service.empty()) {
+        /* no service, resolve the host itself */
+        target t;
+        t.host = j.name;
+        t.port = 0;
+        t.priority = 0;
+        t.looked_up = false;
+        j.targets.push_back(t);
+        lookup_targets(j);
+        return;
+    }
+
+    send_query(j, service + "." + j.name, T_SRV, 0);
+}
+
+bool srv_async_resolver::lookup_targets(job &j) {
+    bool sent = false;
+
+    for (size_t i = 0; i < j.targets.size(); i++) {
+        target &t = j.targets[i];
+        if (t.looked_up || !t.ipv6.empty() || !t.ipv4.empty())
+            continue;
+
+        t.looked_up = true;
+        send_query(j, t.host, T_AAAA, i);
+        send_query(j, t.host, T_A, i);
+        sent = true;
+    }
+
+    return sent;
+}
+
+uint16_t srv_async_resolver::random_id() const {
+    for (;;) {
+        uint16_t id = 0;
+        bool random = false;
+#ifdef HAVE_GETRANDOM
+        random = getrandom(&id, sizeof(id), 0) == sizeof(id);
+#else
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd >= 0) {
+            random = read(fd, &id, sizeof(id)) == sizeof(id);
+            close(fd);
+        }
+#endif
+        /* better a weak ID than no query at all */
+        if (!random)
+            id = static_cast<uint16_t>(std::rand());
+
+        if (queries.find(id) == queries.end())
+            return id;
+    }
+}
+
+srv_async_resolver::query
+srv_async_resolver::forget_query(std::map<uint16_t, query>::iterator qp) {
+    query q = qp->second;
+    if (q.fd >= 0)
+        close(q.fd);
+    q.fd = -1;
+    queries.erase(qp);
+    return q;
+}
+
+void srv_async_resolver::send_query(job &j, std::string const &name, int type,
+                                    size_t target_index) {
+    uint16_t id = random_id();
+
+    query &q = queries[id];
+    q.name = name;
+    q.type = type;
+    q.host = j.host;
+    q.target = target_index;
+    q.tries = 0;
+    q.nameserver = nameservers.empty() ? 0 : id % nameservers.size();
+    q.fd = -1;
+    j.pending++;
+
+    /* if sending fails, the query is resent by check_timeouts() */
+    transmit(id, q);
+}
+
+bool srv_async_resolver::transmit(uint16_t id, query &q) {
+    gettimeofday(&q.sent, NULL);
+    if (q.tries++ > 0 && !nameservers.empty())
+        q.nameserver = (q.nameserver + 1) % nameservers.size();
+
+    /* a new socket for each try, so that each try gets a new source port */
+    if (q.fd >= 0) {
+        close(q.fd);
+        q.fd = -1;
+    }
+
+    if (nameservers.empty())
+        return false;
+
+    unsigned char packet[NS_PACKETSZ];
+    int len = res_mkquery(ns_o_query, q.name.c_str(), ns_c_in, q.type, NULL, 0,
+                          NULL, packet, sizeof(packet));
+    if (len < NS_HFIXEDSZ) {
+        log_debug2(ZONE, LOGT_IO, "cannot build query for %s",
+                   q.name.c_str());
+        return false;
+    }
+    packet[0] = id >> 8;
+    packet[1] = id & 0xff;
+
+    nameserver const &ns = nameservers[q.nameserver];
+    int fd = socket(ns.address.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        log_debug2(ZONE, LOGT_IO, "cannot create socket for %s: %s",
+                   q.name.c_str(), strerror(errno));
+        return false;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    /* the kernel binds the socket to a random ephemeral port */
+    if (connect(fd, reinterpret_cast<struct sockaddr const *>(&ns.address),
+                ns.length) < 0 ||
+        send(fd, packet, len, 0) != len) {
+        log_debug2(ZONE, LOGT_IO, "sending query for %s failed: %s",
+                   q.name.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    q.fd = fd;
+
+    /* make the reader poll the new socket as well */
+    if (wakeup[1] >= 0 && write(wakeup[1], "", 1) < 0 && errno != EAGAIN)
+        log_debug2(ZONE, LOGT_IO, "cannot wake DNS reader: %s",
+                   strerror(errno));
+
+    stats.queries++;
+    return true;
+}
+
+void srv_async_resolver::check_timeouts() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    std::vector<uint16_t> expired;
+    for (std::map<uint16_t, query>::iterator p = queries.begin();
+         p != queries.end(); ++p) {
+        if (srv_async_elapsed(p->second.sent, now) < SRV_ASYNC_TIMEOUT)
+            continue;
+
+        if (p->second.tries < SRV_ASYNC_TRIES) {
+            log_debug2(ZONE, LOGT_IO, "resending query for %s",
+                       p->second.name.c_str());
+            transmit(p->first, p->second);
+            continue;
+        }
+
+        expired.push_back(p->first);
+    }
+
+    /* give up on queries that have been sent often enough */
+    for (std::vector<uint16_t>::iterator p = expired.begin();
+         p != expired.end(); ++p) {
+        std::map<uint16_t, query>::iterator qp = queries.find(*p);
+        if (qp == queries.end())
+            continue;
+        query q = forget_query(qp);
+        stats.timeouts++;
+
+        log_debug2(ZONE, LOGT_IO, "no answer for %s", q.name.c_str());
+
+        std::map<std::string, job>::iterator jp = jobs.find(q.host);
+        if (jp == jobs.end())
+            continue;
+        if (q.type == T_SRV)
+            process_srv_answer(jp->second, NULL);
+        else
+            process_address_answer(jp->second, q, NULL);
+        query_done(jp->second);
+    }
+}
+
+void srv_async_resolver::process_answer(unsigned char const *buffer,
+                                        size_t len, int fd) {
+    if (len < NS_HFIXEDSZ)
+        return;
+
+    /* only accept answers on the socket the current try was sent from */
+    uint16_t id = (buffer[0] << 8) | buffer[1];
+    std::map<uint16_t, query>::iterator qp = queries.find(id);
+    if (qp == queries.end() || qp->second.fd != fd)
+        return;
+
+    /* check that this is the answer to our question */
+    ns_msg msg;
+    ns_rr rr;
+    if (ns_initparse(buffer, len, &msg) < 0 ||
+        ns_msg_count(msg, ns_s_qd) != 1 ||
+        ns_parserr(&msg, ns_s_qd, 0, &rr) < 0 ||
+        ns_rr_type(rr) != qp->second.type ||
+        strcasecmp(ns_rr_name(rr), qp->second.name.c_str()) != 0) {
+        log_debug2(ZONE, LOGT_IO, "ignoring unexpected answer with ID %u",
+                   id);
+        return;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long latency = srv_async_elapsed(qp->second.sent, now);
+    if (latency < 0)
+        latency = 0;
+    stats.answers++;
+    stats.latency_sum += latency;
+    if (static_cast<unsigned long>(latency) > stats.latency_max)
+        stats.latency_max = latency;
+
+    log_debug2(ZONE, LOGT_IO, "answer for %s (type %i) after %li ms",
+               qp->second.name.c_str(), qp->second.type, latency);
+
+    query q = forget_query(qp);
+
+    std::map<std::string, job>::iterator jp = jobs.find(q.host);
+    if (jp == jobs.end())
+        return;
+    if (q.type == T_SRV)
+        process_srv_answer(jp->second, &msg);
+    else
+        process_address_answer(jp->second, q, &msg);
+    query_done(jp->second);
+}
+
+void srv_async_resolver::process_srv_answer(job &j, ns_msg *msg) {
+    if (msg == NULL || ns_msg_getflag(*msg, ns_f_rcode) != ns_r_noerror)
+        return;
+
+    ns_rr rr;
+    for (int i = 0; i < ns_msg_count(*msg, ns_s_an); i++) {
+        if (ns_parserr(msg, ns_s_an, i, &rr) < 0)
+            break;
+        if (ns_rr_type(rr) != T_SRV || ns_rr_rdlen(rr) < 7)
+            continue;
+
+        unsigned char const *rdata = ns_rr_rdata(rr);
+        char name[NS_MAXDNAME];
+        if (ns_name_uncompress(ns_msg_base(*msg), ns_msg_end(*msg), rdata + 6,
+                               name, sizeof(name)) < 0)
+            continue;
+
+        /* "." as the target means the service is not available */
+        if (name[0] == '\0' || (name[0] == '.' && name[1] == '\0'))
+            continue;
+
+        target t;
+        t.host = name;
+        t.priority = ns_get16(rdata);
+        t.port = ns_get16(rdata + 4);
+        t.looked_up = false;
+        j.targets.push_back(t);
+
+        if (j.ttl < 0 || static_cast<long>(ns_rr_ttl(rr)) < j.ttl)
+            j.ttl = ns_rr_ttl(rr);
+    }
+    std::stable_sort(j.targets.begin(), j.targets.end(),
+                     srv_async_priority_less());
+
+    /* use addresses from the additional section */
+    for (int i = 0; i < ns_msg_count(*msg, ns_s_ar); i++) {
+        if (ns_parserr(msg, ns_s_ar, i, &rr) < 0)
+            break;
+
+        char address[INET6_ADDRSTRLEN];
+        bool ipv6 = false;
+        if (ns_rr_type(rr) == T_AAAA && ns_rr_rdlen(rr) == 16) {
+            if (inet_ntop(AF_INET6, ns_rr_rdata(rr), address,
+                          sizeof(address)) == NULL)
+                continue;
+            ipv6 = true;
+        } else if (ns_rr_type(rr) == T_A && ns_rr_rdlen(rr) == 4) {
+            if (inet_ntop(AF_INET, ns_rr_rdata(rr), address,
+                          sizeof(address)) == NULL)
+                continue;
+        } else {
+            continue;
+        }
+
+        for (std::vector<target>::iterator t = j.targets.begin();
+             t != j.targets.end(); ++t) {
+            if (strcasecmp(t->host.c_str(), ns_rr_name(rr)) != 0)
+                continue;
+            (ipv6 ? t->ipv6 : t->ipv4).push_back(address);
+            if (j.ttl < 0 || static_cast<long>(ns_rr_ttl(rr)) < j.ttl)
+                j.ttl = ns_rr_ttl(rr);
+        }
+    }
+}
+
+void srv_async_resolver::process_address_answer(job &j, query const &q,
+                                                ns_msg *msg) {
+    if (msg == NULL || q.target >= j.targets.size() ||
+        ns_msg_getflag(*msg, ns_f_rcode) != ns_r_noerror)
+        return;
+
+    target &t = j.targets[q.target];
+    ns_rr rr;
+    for (int i = 0; i < ns_msg_count(*msg, ns_s_an); i++) {
+        if (ns_parserr(msg, ns_s_an, i, &rr) < 0)
+            break;
+
+        /* CNAMEs are followed by the name server, just take the addresses */
+        char address[INET6_ADDRSTRLEN];
+        if (ns_rr_type(rr) != q.type)
+            continue;
+        if (q.type == T_AAAA && ns_rr_rdlen(rr) == 16 &&
+            inet_ntop(AF_INET6, ns_rr_rdata(rr), address, sizeof(address)))
+            t.ipv6.push_back(address);
+        else if (q.type == T_A && ns_rr_rdlen(rr) == 4 &&
+                 inet_ntop(AF_INET, ns_rr_rdata(rr), address, sizeof(address)))
+            t.ipv4.push_back(address);
+        else
+            continue;
+
+        if (j.ttl < 0 || static_cast<long>(ns_rr_ttl(rr)) < j.ttl)
+            j.ttl = ns_rr_ttl(rr);
+    }
+}
+
+void srv_async_resolver::query_done(job &j) {
+    if (--j.pending > 0)
+        return;
+
+    /* SRV answered, now resolve targets not in the additional section */
+    if (lookup_targets(j))
+        return;
+
+    std::ostringstream result;
+    bool first = true;
+    for (std::vector<target>::const_iterator t = j.targets.begin();
+         t != j.targets.end(); ++t) {
+        for (std::vector<std::string>::const_iterator a = t->ipv6.begin();
+             a != t->ipv6.end(); ++a) {
+            result << (first ? "" : ",");
+            if (t->port == 0)
+                result << *a;
+            else
+                result << "[" << *a << "]:" << t->port;
+            first = false;
+        }
+        for (std::vector<std::string>::const_iterator a = t->ipv4.begin();
+             a != t->ipv4.end(); ++a) {
+            result << (first ? "" : ",") << *a;
+            if (t->port != 0)
+                result << ":" << t->port;
+            first = false;
+        }
+    }
+
+    if (!first) {
+        finish(j, result.str());
+        return;
+    }
+
+    /* nothing found for this service, try the next one */
+    j.service++;
+    start_service(j);
+}
+
+void srv_async_resolver::finish(job &j, std::string const &result) {
+    std::string host = j.host;
+    int service = result.empty() ? -1 : static_cast<int>(j.service);
+    long ttl = j.ttl;
+
+    jobs.erase(host);
+    cb(cb_arg, host, service, result, ttl);
+}
+
+srv_async_resolver::statistics srv_async_resolver::get_statistics() const {
+    statistics result = stats;
+    result.in_flight = queries.size();
+    result.resolving = jobs.size();
+    return result;
+}
+
+void *srv_async_resolver::reader(void *arg) {
+    srv_async_resolver *resolver = static_cast<srv_async_resolver *>(arg);
+    std::vector<struct pollfd> fds;
+    std::vector<int> ready;
+
+    for (;;) {
+        fds.clear();
+        struct pollfd pfd;
+        pfd.fd = resolver->wakeup[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds.push_back(pfd);
+        for (std::map<uint16_t, query>::iterator p = resolver->queries.begin();
+             p != resolver->queries.end(); ++p) {
+            if (p->second.fd < 0)
+                continue;
+            pfd.fd = p->second.fd;
+            fds.push_back(pfd);
+        }
+
+        if (pth_poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_warn(ZONE, "DNS reader cannot poll: %s", strerror(errno));
+            break;
+        }
+
+        /* drain the wakeup pipe, it only makes us poll the new sockets */
+        if (fds[0].revents != 0) {
+            char discard[64];
+            while (read(resolver->wakeup[0], discard, sizeof(discard)) > 0)
+                ;
+        }
+
+        /* processing an answer may close other sockets of the set */
+        ready.clear();
+        for (size_t i = 1; i < fds.size(); i++)
+            if (fds[i].revents != 0)
+                ready.push_back(fds[i].fd);
+
+        for (std::vector<int>::iterator fd = ready.begin(); fd != ready.end();
+             ++fd) {
+            ssize_t len = recv(*fd, &resolver->receive_buffer[0],
+                               resolver->receive_buffer.size(), MSG_DONTWAIT);
+            if (len > 0)
+                resolver->process_answer(&resolver->receive_buffer[0], len,
+                                         *fd);
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#ifndef INCL_SRV_ASYNC_H
+#define INCL_SRV_ASYNC_H
+
+#include <arpa/nameser.h>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <vector>
+
+/**
+ * @brief resolver sending DNS queries over UDP without blocking
+ *
+ * The resolver sends the queries itself, with any number of them in flight,
+ * instead of using the blocking functions of the libresolv. For each host it
+ * tries the configured services in order, doing a SRV lookup for a service
+ * and AAAA/A lookups for the targets (or the host itself for the empty
+ * service). The result has the same format as the result of srv_lookup().
+ *
+ * Each query is sent with a random ID from a socket of its own, so that the
+ * source port is random as well, making it hard to forge answers.
+ */
+class srv_async_resolver {
+  public:
+    /**
+     * callback for finished resolutions
+     *
+     * @param arg the argument passed to the constructor
+     * @param host the host that has been resolved
+     * @param service index of the service that resolved, -1 on failure
+     * @param result comma separated list of addresses (with ports for
+     * services)
+     * @param ttl seconds the result is valid
+     */
+    typedef void (*callback)(void *arg, std::string const &host, int service,
+                             std::string const &result, long ttl);
+
+    /**
+     * counters of the resolver
+     */
+    struct statistics {
+        unsigned long queries;  /**< queries sent (including retries) */
+        unsigned long answers;  /**< answers received */
+        unsigned long timeouts; /**< queries that got no answer at all */
+        unsigned long latency_sum; /**< sum of the latencies of all answers in
+                                      milliseconds */
+        unsigned long latency_max; /**< highest latency of an answer in
+                                      milliseconds */
+        size_t in_flight; /**< queries currently waiting for an answer */
+        size_t resolving; /**< hosts currently being resolved */
+    };
+
+    /**
+     * create a resolver
+     *
+     * @param services the services to try (empty string for AAAA/A lookups of
+     * the host itself)
+     * @param cb callback for finished resolutions
+     * @param arg argument passed to the callback
+     */
+    srv_async_resolver(std::vector<std::string> const &services, callback cb,
+                       void *arg);
+
+    /**
+     * stop the reader thread and close the sockets of the resolver
+     */
+    ~srv_async_resolver();
+
+    /**
+     * add a name server to send the queries to
+     *
+     * @param address IPv4 or IPv6 address of the name server
+     * @param port UDP port of the name server
+     * @return true on success, false if the address is invalid
+     */
+    bool add_nameserver(std::string const &address, int port);
+
+    /**
+     * add the name servers of the system configuration (/etc/resolv.conf)
+     *
+     * @return true if at least one name server has been added
+     */
+    bool add_system_nameservers();
+
+    /**
+     * start resolving a host
+     *
+     * @param host the host to resolve (converted to ASCII form if it is an
+     * IDN)
+     */
+    void resolve(std::string const &host);
+
+    /**
+     * resend or drop queries that did not get an answer in time
+     *
+     * Has to be called regularily.
+     */
+    void check_timeouts();
+
+    /**
+     * get the counters of the resolver
+     *
+     * @return the counters
+     */
+    statistics get_statistics() const;
+
+  private:
+    /**
+     * a target a service is provided by (SRV record)
+     */
+    struct target {
+        std::string host;              /**< the host */
+        int port;                      /**< the port, 0 for plain lookups */
+        int priority;                  /**< priority of the SRV record */
+        bool looked_up;                /**< AAAA/A queries have been sent */
+        std::vector<std::string> ipv6; /**< resolved IPv6 addresses */
+        std::vector<std::string> ipv4; /**< resolved IPv4 addresses */
+    };
+
+    /**
+     * resolution of a host
+     */
+    struct job {
+        std::string host;            /**< the host being resolved */
+        std::string name;            /**< the host in ASCII form */
+        size_t service;              /**< the service being tried */
+        std::vector<target> targets; /**< targets of the current service */
+        int pending;                 /**< queries in flight for this job */
+        long ttl;                    /**< lowest TTL of the used records */
+    };
+
+    /**
+     * address of a name server
+     */
+    struct nameserver {
+        struct sockaddr_storage address; /**< the address */
+        socklen_t length;                /**< length of the address */
+    };
+
+    /**
+     * a query sent to a name server
+     */
+    struct query {
+        std::string name;    /**< the name queried */
+        int type;            /**< the record type queried */
+        std::string host;    /**< the host the job resolves */
+        size_t target;       /**< the target resolved (AAAA/A) */
+        struct timeval sent; /**< when the query has been sent */
+        int tries;           /**< how often the query has been sent */
+        size_t nameserver;   /**< the name server the query was sent to */
+        int fd;              /**< the socket the query was sent from, -1 if
+                                none */
+    };
+
+    /**
+     * send the queries for the current service of a job
+     *
+     * @param j the job
+     */
+    void start_service(job &j);
+
+    /**
+     * send a query
+     *
+     * @param j the job the query is for
+     * @param name the name to query
+     * @param type the record type to query
+     * @param target_index the target resolved by an AAAA/A query
+     */
+    void send_query(job &j, std::string const &name, int type,
+                    size_t target_index);
+
+    /**
+     * send AAAA and A queries for the targets without addresses
+     *
+     * @param j the job
+     * @return true if queries have been sent
+     */
+    bool lookup_targets(job &j);
+
+    /**
+     * get a random ID for a query, that is not used by another query
+     *
+     * @return the ID
+     */
+    uint16_t random_id() const;
+
+    /**
+     * forget about a query, closing its socket
+     *
+     * @param qp the query
+     * @return copy of the query
+     */
+    query forget_query(std::map<uint16_t, query>::iterator qp);
+
+    /**
+     * (re)send a query to the next name server, from a new socket
+     *
+     * @param id the ID of the query
+     * @param q the query
+     * @return true if the query could be sent
+     */
+    bool transmit(uint16_t id, query &q);
+
+    /**
+     * process a received datagram
+     *
+     * @param buffer the datagram
+     * @param len length of the datagram
+     * @param fd the socket the datagram has been received on
+     */
+    void process_answer(unsigned char const *buffer, size_t len, int fd);
+
+    /**
+     * process the answer to a SRV query
+     *
+     * @param j the job
+     * @param msg the parsed answer, NULL if no answer has been received
+     */
+    void process_srv_answer(job &j, ns_msg *msg);
+
+    /**
+     * process the answer to an AAAA or A query
+     *
+     * @param j the job
+     * @param q the query
+     * @param msg the parsed answer, NULL if no answer has been received
+     */
+    void process_address_answer(job &j, query const &q, ns_msg *msg);
+
+    /**
+     * a query of a job has been finished, if it has been the last one either
+     * resolve the targets, finish the job, or try the next service
+     *
+     * @note the job may be deleted by this method
+     *
+     * @param j the job
+     */
+    void query_done(job &j);
+
+    /**
+     * finish a job and pass the result to the callback
+     *
+     * @note the job is deleted by this method
+     *
+     * @param j the job
+     * @param result the result, empty if resolving failed
+     */
+    void finish(job &j, std::string const &result);
+
+    /**
+     * main function of the thread reading the answers from the sockets of
+     * all queries
+     *
+     * @param arg the resolver
+     * @return always NULL
+     */
+    static void *reader(void *arg);
+
+    std::vector<std::string> services; /**< the services to try */
+    callback cb;                       /**< the result callback */
+    void *cb_arg;                      /**< argument for the callback */
+    std::vector<nameserver> nameservers; /**< where queries are sent to */
+    std::map<uint16_t, query> queries; /**< queries in flight by ID */
+    std::map<std::string, job> jobs;   /**< hosts being resolved */
+    statistics stats;                  /**< counters of the resolver */
+    int wakeup[2];        /**< pipe making the reader poll new sockets */
+    pth_t reader_thread;  /**< the thread reading the answers */
+    std::vector<unsigned char> receive_buffer; /**< answers are read here */
+};
+
+#endif
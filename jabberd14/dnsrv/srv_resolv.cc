@@ -219,13 +219,16 @@ static int srv_lookup_aaaa_a(std::ostream &result, const char *domain) {
  * @param p memory pool to be used by this function
  * @param service which service should be looked up (e.g. "_xmpp-server._tcp")
  * @param domain which domain should be looked up
+ * @param ttl where to store the lowest TTL of the used records (-1 if not
+ * known), may be NULL
  * @return comma separated list of results containing IPv4 and IPv6 addresses
  * with or without ports
  *
  * @todo The function honors the priority values of a SRV record but not the
  * weight values. Implement handling of weights!
  */
-char *srv_lookup(pool p, const char *service, const char *domain) {
+char *srv_lookup(pool p, const char *service, const char *domain,
+                 long *ttl) {
     unsigned char reply[1024]; /* Reply buffer */
     int replylen = 0;
     char host[1024];
@@ -241,6 +244,11 @@ char *srv_lookup(pool p, const char *service, const char *domain) {
     int result_is_empty = 1;
     char *ipname;
     char *ipaddr;
+    long rrttl;
+
+    /* getaddrinfo() does not tell us the TTL */
+    if (ttl != NULL)
+        *ttl = -1;
 
     /* If no service is specified, use a standard gethostbyname call */
     if (service == NULL) {
@@ -307,10 +315,19 @@ char *srv_lookup(pool p, const char *service, const char *domain) {
             /* Jump to RR info */
             rrptr += exprc;
             rrtype = (rrptr[0] << 8 | rrptr[1]); /* Extract RR type */
+            rrttl = static_cast<long>(
+                static_cast<uint32_t>(rrptr[4]) << 24 | rrptr[5] << 16 |
+                rrptr[6] << 8 | rrptr[7]); /* Extract RR TTL */
             rrpayloadsz =
                 (rrptr[8] << 8 | rrptr[9]); /* Extract RR payload size */
             rrptr += 10;
 
+            /* the result is valid as long as all used records are */
+            if (ttl != NULL &&
+                (rrtype == T_AAAA || rrtype == T_A || rrtype == T_SRV) &&
+                (*ttl < 0 || rrttl < *ttl))
+                *ttl = rrttl;
+
             /* Process the RR */
             switch (rrtype) {
                 /* AAAA records should be hashed for the duration of this lookup
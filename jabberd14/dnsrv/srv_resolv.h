@@ -49,6 +49,7 @@
 #ifndef INCL_SRV_RESOLV_H
 #define INCL_SRV_RESOLV_H
 
-char *srv_lookup(pool p, const char *service, const char *domain);
+char *srv_lookup(pool p, const char *service, const char *domain,
+                 long *ttl);
 
 #endif
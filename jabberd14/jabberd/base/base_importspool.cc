@@ -38,6 +38,32 @@
 
 #include <dirent.h>
 
+#include <list>
+#include <set>
+#include <string>
+
+/**
+ * a spool file that has to be imported
+ */
+typedef struct base_importspool_file_struct {
+    std::string filename; /**< path of the spool file */
+    std::string domain;   /**< domain the user belongs to */
+    std::string user;     /**< node of the user */
+    xmlnode data;         /**< the parsed spool file, NULL before parsing */
+} * base_importspool_file, _base_importspool_file;
+
+/**
+ * bounded queue of spool files passed between the threads of the importer
+ */
+typedef struct base_importspool_queue_struct {
+    std::list<base_importspool_file> files; /**< the files in the queue */
+    size_t capacity;                        /**< maximum number of files */
+    int closed;           /**< no more files will be put to the queue */
+    pth_mutex_t mutex;    /**< mutex used with the conditions */
+    pth_cond_t not_empty; /**< signalled when a file has been put */
+    pth_cond_t not_full;  /**< signalled when a file has been taken */
+} * base_importspool_queue, _base_importspool_queue;
+
 /**
  * hold data this instance of base_dir needs to be passed as void* pointer
  */
@@ -48,6 +74,25 @@ typedef struct base_importspool_struct {
     xht std_namespace_prefixes; /**< namespace prefixes used by this base
                                    handler */
     time_t importstart;         /**< time when importing data has started */
+    int parsers;                /**< number of threads parsing spool files */
+    int writers;                /**< number of threads writing to xdb, each
+                                   has one xdb request in flight */
+    int parsers_running;        /**< parsers that have not finished yet */
+    int writers_running;        /**< writers that have not finished yet */
+    int needed_steps;           /**< expected number of steps of the walker */
+    int steps_done;             /**< steps done by the walker */
+    int yield_counter;          /**< counter when to update the progress */
+    char *checkpoint;           /**< file listing the imported spool files */
+    FILE *checkpoint_file;      /**< checkpoint file opened for appending */
+    unsigned long files_imported; /**< number of imported spool files */
+    unsigned long files_skipped;  /**< files already imported before */
+    unsigned long files_failed;   /**< files that could not be parsed */
+    unsigned long files_incomplete; /**< files with failed xdb requests */
+    unsigned long xdb_requests;   /**< number of xdb requests sent */
+    _base_importspool_queue to_parse; /**< files found by the walker */
+    _base_importspool_queue to_write; /**< files parsed by the parsers */
+    std::set<std::string> imported;   /**< spool files imported by an earlier
+                                         run (domain/user) */
 } * base_importspool_st, _base_importspool_st;
 
 /**
@@ -69,29 +114,25 @@ static int is_hexdigit(char c) {
 /**
  * show some progress to the user while importing data
  *
- * @param steps_done how many steps of the expected number of steps have been
- * done
- * @param needed_steps how many steps are expected to be needed
- * @param yield_counter used to check when progress should be updated and when
- * we are cooperative
+ * @param conf_data the importer's data
+ * @param force update the output even if it has been updated recently
  */
-static void print_progress(int steps_done, int needed_steps, int *yield_counter,
-                           time_t importstart) {
+static void print_progress(base_importspool_st conf_data, int force) {
     int bar_done = 0;
     int i = 0;
     int expected_time_left = 0;
-    if (--(*yield_counter) > 0)
-        return;
+    time_t over = time(NULL) - conf_data->importstart;
 
-    *yield_counter = 10;
+    if (--(conf_data->yield_counter) > 0 && !force)
+        return;
 
-    if (needed_steps > 0) {
-        time_t now = time(NULL);
-        time_t over = now - importstart;
+    conf_data->yield_counter = 10;
 
-        bar_done = 40 * steps_done / needed_steps;
-        if (over > 10) {
-            expected_time_left = (over * needed_steps) / steps_done - over;
+    if (conf_data->needed_steps > 0) {
+        bar_done = 40 * conf_data->steps_done / conf_data->needed_steps;
+        if (over > 10 && conf_data->steps_done > 0) {
+            expected_time_left =
+                (over * conf_data->needed_steps) / conf_data->steps_done - over;
         }
     } else {
         bar_done = 40;
@@ -103,7 +144,14 @@ static void print_progress(int steps_done, int needed_steps, int *yield_counter,
     }
     printf("|");
 
-    if (needed_steps == steps_done) {
+    /* throughput */
+    printf(" %lu files (%lu/s), %lu xdb req (%lu/s)",
+           conf_data->files_imported,
+           over > 0 ? conf_data->files_imported / over : 0,
+           conf_data->xdb_requests,
+           over > 0 ? conf_data->xdb_requests / over : 0);
+
+    if (conf_data->writers_running == 0) {
         printf(" Done.                  ");
     } else if (expected_time_left > 0) {
         printf(" Remaining: ");
@@ -119,28 +167,94 @@ static void print_progress(int steps_done, int needed_steps, int *yield_counter,
     }
 
     printf("\r");
+    fflush(stdout);
 
     pth_yield(NULL);
 }
 
 /**
- * import a single file
+ * initialize a queue used to pass spool files between threads
+ *
+ * @param q the queue to initialize
+ * @param capacity maximum number of files in the queue
+ */
+static void importspool_queue_init(base_importspool_queue q, size_t capacity) {
+    q->capacity = capacity;
+    q->closed = 0;
+    pth_mutex_init(&q->mutex);
+    pth_cond_init(&q->not_empty);
+    pth_cond_init(&q->not_full);
+}
+
+/**
+ * put a spool file to a queue, blocks while the queue is full
+ *
+ * @param q the queue
+ * @param file the spool file
+ */
+static void importspool_queue_put(base_importspool_queue q,
+                                  base_importspool_file file) {
+    pth_mutex_acquire(&q->mutex, FALSE, NULL);
+    while (q->files.size() >= q->capacity)
+        pth_cond_await(&q->not_full, &q->mutex, NULL);
+    q->files.push_back(file);
+    pth_cond_notify(&q->not_empty, FALSE);
+    pth_mutex_release(&q->mutex);
+}
+
+/**
+ * take the next spool file from a queue, blocks while the queue is empty
+ *
+ * @param q the queue
+ * @return the spool file, NULL if the queue is empty and has been closed
+ */
+static base_importspool_file importspool_queue_get(base_importspool_queue q) {
+    base_importspool_file file = NULL;
+
+    pth_mutex_acquire(&q->mutex, FALSE, NULL);
+    while (q->files.empty() && !q->closed)
+        pth_cond_await(&q->not_empty, &q->mutex, NULL);
+    if (!q->files.empty()) {
+        file = q->files.front();
+        q->files.pop_front();
+        pth_cond_notify(&q->not_full, FALSE);
+    }
+    pth_mutex_release(&q->mutex);
+
+    return file;
+}
+
+/**
+ * mark a queue as closed, no more files will be put to it
  *
+ * @param q the queue
  */
-static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
-                        const char *filename, const char *domain,
-                        const char *user) {
-    xmlnode spoolfile = NULL;
+static void importspool_queue_close(base_importspool_queue q) {
+    pth_mutex_acquire(&q->mutex, FALSE, NULL);
+    q->closed = 1;
+    pth_cond_notify(&q->not_empty, TRUE);
+    pth_mutex_release(&q->mutex);
+}
+
+/**
+ * import the data of a single spool file
+ *
+ * @param xc the xdbcache used to write the data
+ * @param std_namespace_prefixes namespace prefixes used in the XPath
+ * expressions
+ * @param spoolfile the parsed spool file
+ * @param domain the domain of the user
+ * @param user the node of the user
+ * @param failed where to count the xdb requests that failed
+ * @return number of xdb requests that have been sent
+ */
+static int import_file(xdbcache xc, xht std_namespace_prefixes,
+                       xmlnode spoolfile, const char *domain, const char *user,
+                       int *failed) {
     xmlnode data_element = NULL;
     pool p = NULL;
     jid userid = NULL;
-
-    /* read the spool file */
-    spoolfile = xmlnode_file(filename);
-    if (spoolfile == NULL) {
-        log_debug2(ZONE, LOGT_IO, "spoolfile could not be read: %s", filename);
-        return;
-    }
+    int requests = 0;
 
     /* create user's JID */
     p = pool_new();
@@ -149,9 +263,8 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
     if (userid == NULL || !userid->has_node()) {
         log_debug2(ZONE, LOGT_IO, "invalid user: %s@%s - skipping", user,
                    domain);
-        xmlnode_free(spoolfile);
         pool_free(p);
-        return;
+        return 0;
     }
 
     /* iterate on the data in the spoolfile */
@@ -170,7 +283,8 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
             j_strcmp(ns, NS_REGISTER) == 0 || j_strcmp(ns, NS_ROSTER) == 0 ||
             j_strcmp(ns, NS_BROWSE) == 0 || j_strcmp(ns, NS_VCARD) == 0) {
             /* this is data we can just set to the configured storage */
-            xdb_set(xc, userid, ns, data_element);
+            requests++;
+            *failed += xdb_set(xc, userid, ns, data_element) != 0;
             continue;
         }
 
@@ -190,9 +304,10 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
                 std::ostringstream xpath;
                 xpath << "presence[@from='"
                       << xmlnode_get_attrib_ns(request, "from", NULL) << "']";
-                xdb_act_path(xc, userid, NS_JABBERD_STOREDREQUEST, "insert",
-                             xpath.str().c_str(), std_namespace_prefixes,
-                             request);
+                requests++;
+                *failed += xdb_act_path(xc, userid, NS_JABBERD_STOREDREQUEST,
+                                        "insert", xpath.str().c_str(),
+                                        std_namespace_prefixes, request) != 0;
             }
             continue;
         }
@@ -201,6 +316,11 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
         if (j_strcmp(ns, NS_OFFLINE) == 0) {
             xmlnode message = NULL;
 
+            /* messages have no key to match them on, drop the ones an
+             * interrupted earlier run might have inserted already */
+            requests++;
+            *failed += xdb_set(xc, userid, NS_OFFLINE, NULL) != 0;
+
             /* insert each offline message individually */
             for (message = xmlnode_get_firstchild(data_element);
                  message != NULL; message = xmlnode_get_nextsibling(message)) {
@@ -208,8 +328,9 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
                     continue;
                 }
 
-                xdb_act_path(xc, userid, NS_OFFLINE, "insert", NULL, NULL,
-                             message);
+                requests++;
+                *failed += xdb_act_path(xc, userid, NS_OFFLINE, "insert", NULL,
+                                        NULL, message) != 0;
             }
             continue;
         }
@@ -218,6 +339,10 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
         if (j_strcmp(ns, NS_JABBERD_HISTORY) == 0) {
             xmlnode message = NULL;
 
+            /* same as for offline messages */
+            requests++;
+            *failed += xdb_set(xc, userid, NS_JABBERD_HISTORY, NULL) != 0;
+
             /* insert each offline message individually */
             for (message = xmlnode_get_firstchild(data_element);
                  message != NULL; message = xmlnode_get_nextsibling(message)) {
@@ -225,8 +350,9 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
                     continue;
                 }
 
-                xdb_act_path(xc, userid, NS_JABBERD_HISTORY, "insert", NULL,
-                             NULL, message);
+                requests++;
+                *failed += xdb_act_path(xc, userid, NS_JABBERD_HISTORY,
+                                        "insert", NULL, NULL, message) != 0;
             }
             continue;
         }
@@ -245,8 +371,10 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
                 std::ostringstream xpath;
                 xpath << "private:query[@jabberd:ns='"
                       << xmlnode_get_namespace(item) << "']";
-                xdb_act_path(xc, userid, NS_PRIVATE, "insert",
-                             xpath.str().c_str(), std_namespace_prefixes, item);
+                requests++;
+                *failed += xdb_act_path(xc, userid, NS_PRIVATE, "insert",
+                                        xpath.str().c_str(),
+                                        std_namespace_prefixes, item) != 0;
             }
             continue;
         }
@@ -265,8 +393,10 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
                 std::ostringstream xpath;
                 xpath << "privacy:list[@name='"
                       << xmlnode_get_attrib_ns(list, "name", NULL) << "']";
-                xdb_act_path(xc, userid, NS_PRIVACY, "insert",
-                             xpath.str().c_str(), std_namespace_prefixes, list);
+                requests++;
+                *failed += xdb_act_path(xc, userid, NS_PRIVACY, "insert",
+                                        xpath.str().c_str(),
+                                        std_namespace_prefixes, list) != 0;
             }
             continue;
         }
@@ -279,28 +409,168 @@ static void import_file(instance i, xdbcache xc, xht std_namespace_prefixes,
         std::ostringstream xpath;
         xpath << "private:query[@jabberd:ns='"
               << xmlnode_get_namespace(data_element) << "']";
-        xdb_act_path(xc, userid, NS_PRIVATE, "insert", xpath.str().c_str(),
-                     std_namespace_prefixes, data_element);
+        requests++;
+        *failed += xdb_act_path(xc, userid, NS_PRIVATE, "insert",
+                                xpath.str().c_str(), std_namespace_prefixes,
+                                data_element) != 0;
     }
 
     /* free memory */
-    xmlnode_free(spoolfile);
     pool_free(p);
+
+    return requests;
 }
 
 /**
- * thread that does the actual import of data from the filespool
+ * record that a spool file has been imported in the checkpoint file
+ *
+ * @param conf_data the importer's data
+ * @param file the spool file that has been imported
+ */
+static void base_importspool_checkpoint(base_importspool_st conf_data,
+                                        base_importspool_file file) {
+    if (conf_data->checkpoint_file == NULL)
+        return;
+
+    fprintf(conf_data->checkpoint_file, "%s/%s\n", file->domain.c_str(),
+            file->user.c_str());
+    fflush(conf_data->checkpoint_file);
+}
+
+/**
+ * pass a spool file found by the walker to the parsers
+ *
+ * Files that have been imported by an earlier run (according to the
+ * checkpoint file) are skipped.
+ *
+ * @param conf_data the importer's data
+ * @param filename path of the spool file
+ * @param domain the domain of the user
+ * @param user the node of the user
+ */
+static void base_importspool_enqueue(base_importspool_st conf_data,
+                                     const char *filename, const char *domain,
+                                     const char *user) {
+    base_importspool_file file = NULL;
+
+    if (!conf_data->imported.empty() &&
+        conf_data->imported.count(std::string(domain) + "/" + user) > 0) {
+        conf_data->files_skipped++;
+        return;
+    }
+
+    file = new _base_importspool_file;
+    file->filename = filename;
+    file->domain = domain;
+    file->user = user;
+    file->data = NULL;
+
+    /* blocks while the parsers are busy */
+    importspool_queue_put(&conf_data->to_parse, file);
+}
+
+/**
+ * thread that parses spool files and passes them to the writers
  *
  * @param arg pointer to the configuration data
  * @return allways NULL
  */
-static void *base_importspool_worker(void *arg) {
+static void *base_importspool_parser(void *arg) {
+    base_importspool_st conf_data = (base_importspool_st)arg;
+    base_importspool_file file = NULL;
+
+    while ((file = importspool_queue_get(&conf_data->to_parse)) != NULL) {
+        /* read the spool file */
+        file->data = xmlnode_file(file->filename.c_str());
+        if (file->data == NULL) {
+            log_debug2(ZONE, LOGT_IO, "spoolfile could not be read: %s",
+                       file->filename.c_str());
+            conf_data->files_failed++;
+            delete file;
+            continue;
+        }
+
+        /* blocks while the writers are busy */
+        importspool_queue_put(&conf_data->to_write, file);
+    }
+
+    /* the last parser tells the writers, that there are no more files */
+    if (--conf_data->parsers_running == 0)
+        importspool_queue_close(&conf_data->to_write);
+
+    return NULL;
+}
+
+/**
+ * thread that writes the data of parsed spool files using xdb
+ *
+ * Each writer waits for the result of its xdb requests, so the number of
+ * writers is the number of xdb requests that are in flight concurrently.
+ *
+ * @param arg pointer to the configuration data
+ * @return allways NULL
+ */
+static void *base_importspool_writer(void *arg) {
+    base_importspool_st conf_data = (base_importspool_st)arg;
+    base_importspool_file file = NULL;
+
+    while ((file = importspool_queue_get(&conf_data->to_write)) != NULL) {
+        int failed = 0;
+
+        conf_data->xdb_requests += import_file(
+            conf_data->xc, conf_data->std_namespace_prefixes, file->data,
+            file->domain.c_str(), file->user.c_str(), &failed);
+
+        /* only completely imported files are skipped by a new run */
+        if (failed == 0) {
+            conf_data->files_imported++;
+            base_importspool_checkpoint(conf_data, file);
+        } else {
+            log_debug2(ZONE, LOGT_IO, "%i xdb requests failed for %s", failed,
+                       file->filename.c_str());
+            conf_data->files_incomplete++;
+        }
+
+        xmlnode_free(file->data);
+        delete file;
+
+        /* update output */
+        print_progress(conf_data, 0);
+    }
+
+    /* the last writer finishes the import */
+    if (--conf_data->writers_running > 0)
+        return NULL;
+
+    print_progress(conf_data, 1);
+    printf("\nFinished importing data: %lu files imported, %lu skipped "
+           "(imported before), %lu not readable, %lu failed to store\n",
+           conf_data->files_imported, conf_data->files_skipped,
+           conf_data->files_failed, conf_data->files_incomplete);
+
+    /* the import is complete, a new run should not resume (unless it has to
+     * retry the files that could not be stored) */
+    if (conf_data->checkpoint_file != NULL &&
+        conf_data->files_incomplete == 0) {
+        fclose(conf_data->checkpoint_file);
+        conf_data->checkpoint_file = NULL;
+        unlink(conf_data->checkpoint);
+    }
+
+    return NULL;
+}
+
+/**
+ * thread that walks the filespool and passes the spool files to the parsers
+ *
+ * @param arg pointer to the configuration data
+ * @return allways NULL
+ */
+static void *base_importspool_walker(void *arg) {
     DIR *basedir = NULL;
     struct dirent *basedir_entry = NULL;
     base_importspool_st conf_data = (base_importspool_st)arg;
-    int needed_steps = 0;
-    int steps_done = 0;
-    int yield_counter = 0;
+    int i = 0;
 
     /* sanity check */
     if (conf_data == NULL) {
@@ -342,7 +612,7 @@ static void *base_importspool_worker(void *arg) {
         /* (roughtly) calculating the number of steps we need for this directory
          */
         while ((domaindir_entry = readdir(domaindir))) {
-            needed_steps++;
+            conf_data->needed_steps++;
         }
 
         printf("%s\n", basedir_entry->d_name);
@@ -354,7 +624,17 @@ static void *base_importspool_worker(void *arg) {
     }
 
     /* tell what we are doing */
-    printf("Okay ... starting to import data ...\n");
+    printf("Okay ... starting to import data using %d parsers and %d "
+           "writers ...\n",
+           conf_data->parsers, conf_data->writers);
+
+    /* start the threads processing the files we find */
+    conf_data->parsers_running = conf_data->parsers;
+    conf_data->writers_running = conf_data->writers;
+    for (i = 0; i < conf_data->parsers; i++)
+        pth_spawn(PTH_ATTR_DEFAULT, base_importspool_parser, conf_data);
+    for (i = 0; i < conf_data->writers; i++)
+        pth_spawn(PTH_ATTR_DEFAULT, base_importspool_writer, conf_data);
 
     /* rewind directory */
     rewinddir(basedir);
@@ -378,7 +658,7 @@ static void *base_importspool_worker(void *arg) {
 
         /* iterate the files in the domain directory */
         while ((domaindir_entry = readdir(domaindir))) {
-            steps_done++;
+            conf_data->steps_done++;
 
             /* hashspool entry? */
             if (strlen(domaindir_entry->d_name) == 2) {
@@ -438,14 +718,9 @@ static void *base_importspool_worker(void *arg) {
                             snprintf(user, sizeof(user), "%s",
                                      domainsubdir2_entry->d_name);
                             user[strlen(user) - 4] = 0;
-                            import_file(conf_data->id, conf_data->xc,
-                                        conf_data->std_namespace_prefixes,
-                                        filename, basedir_entry->d_name, user);
-
-                            /* update output */
-                            print_progress(steps_done, needed_steps,
-                                           &yield_counter,
-                                           conf_data->importstart);
+                            base_importspool_enqueue(
+                                conf_data, filename, basedir_entry->d_name,
+                                user);
                         }
                     }
 
@@ -469,13 +744,8 @@ static void *base_importspool_worker(void *arg) {
                              domaindir_entry->d_name);
                     snprintf(user, sizeof(user), "%s", domaindir_entry->d_name);
                     user[strlen(user) - 4] = 0;
-                    import_file(conf_data->id, conf_data->xc,
-                                conf_data->std_namespace_prefixes, filename,
-                                basedir_entry->d_name, user);
-
-                    /* update output */
-                    print_progress(steps_done, needed_steps, &yield_counter,
-                                   conf_data->importstart);
+                    base_importspool_enqueue(conf_data, filename,
+                                             basedir_entry->d_name, user);
                 }
             }
         }
@@ -483,11 +753,8 @@ static void *base_importspool_worker(void *arg) {
         closedir(domaindir);
     }
 
-    /* tell what we are doing */
-    yield_counter = 0;
-    print_progress(steps_done, needed_steps, &yield_counter,
-                   conf_data->importstart);
-    printf("\nFinished importing data ...\n");
+    /* no more files for the parsers */
+    importspool_queue_close(&conf_data->to_parse);
 
     /* close the spool directory */
     closedir(basedir);
@@ -495,15 +762,54 @@ static void *base_importspool_worker(void *arg) {
 }
 
 /**
- * delete the std_namespace_prefixes hash, when instance is freed
+ * delete the importer's data, when instance is freed
+ *
+ * @param arg pointer to the importer's data
+ */
+static void base_importspool_cleanup(void *arg) {
+    base_importspool_st conf_data = (base_importspool_st)arg;
+
+    if (conf_data == NULL)
+        return;
+
+    if (conf_data->std_namespace_prefixes != NULL)
+        xhash_free(conf_data->std_namespace_prefixes);
+    if (conf_data->checkpoint_file != NULL)
+        fclose(conf_data->checkpoint_file);
+    delete conf_data;
+}
+
+/**
+ * read the checkpoint file of an earlier import and open it for appending
  *
- * @param arg xht pointer to the std_namespace_prefixes hash
+ * @param conf_data the importer's data
  */
-static void free_ns_prefixes(void *arg) {
-    xht std_namespace_prefixes = (xht)arg;
+static void base_importspool_load_checkpoint(base_importspool_st conf_data) {
+    FILE *previous = NULL;
+    char line[2048];
+
+    previous = fopen(conf_data->checkpoint, "r");
+    if (previous != NULL) {
+        while (fgets(line, sizeof(line), previous) != NULL) {
+            size_t len = strlen(line);
+
+            if (len > 0 && line[len - 1] == '\n')
+                line[--len] = 0;
+            if (len > 0)
+                conf_data->imported.insert(line);
+        }
+        fclose(previous);
+
+        printf("Resuming import, %u files have already been imported\n",
+               static_cast<unsigned int>(conf_data->imported.size()));
+    }
 
-    if (std_namespace_prefixes != NULL)
-        xhash_free(std_namespace_prefixes);
+    conf_data->checkpoint_file = fopen(conf_data->checkpoint, "a");
+    if (conf_data->checkpoint_file == NULL) {
+        printf("Cannot write checkpoint file %s: %s\nThe import will not be "
+               "resumable ...\n",
+               conf_data->checkpoint, strerror(errno));
+    }
 }
 
 /**
@@ -517,6 +823,7 @@ static void free_ns_prefixes(void *arg) {
  */
 static result base_importspool_config(instance id, xmlnode x, void *arg) {
     base_importspool_st conf_data = NULL;
+    int queue_size = 0;
 
     /* nothing has to be done for configuration validation */
     if (id == NULL) {
@@ -527,12 +834,31 @@ static result base_importspool_config(instance id, xmlnode x, void *arg) {
                "base_importspool configuring instance %s", id->id);
 
     /* process configuration */
-    conf_data = static_cast<base_importspool_st>(
-        pmalloco(id->p, sizeof(_base_importspool_st)));
+    conf_data = new _base_importspool_st();
+    pool_cleanup(id->p, base_importspool_cleanup, conf_data);
     conf_data->id = id;
     conf_data->importspool = xmlnode_get_data(x);
     conf_data->xc = xdb_cache(id);
     conf_data->importstart = time(NULL);
+    conf_data->parsers = j_atoi(xmlnode_get_attrib_ns(x, "parsers", NULL), 2);
+    conf_data->writers = j_atoi(xmlnode_get_attrib_ns(x, "writers", NULL), 16);
+    if (conf_data->parsers < 1)
+        conf_data->parsers = 1;
+    if (conf_data->writers < 1)
+        conf_data->writers = 1;
+    queue_size = j_atoi(xmlnode_get_attrib_ns(x, "queue", NULL),
+                        4 * conf_data->writers);
+    if (queue_size < 1)
+        queue_size = 1;
+    importspool_queue_init(&conf_data->to_parse, queue_size);
+    importspool_queue_init(&conf_data->to_write, queue_size);
+    conf_data->checkpoint = xmlnode_get_attrib_ns(x, "checkpoint", NULL);
+    if (conf_data->checkpoint == NULL) {
+        std::ostringstream checkpoint;
+        checkpoint << conf_data->importspool << "/.importspool.checkpoint";
+        conf_data->checkpoint = pstrdup(id->p, checkpoint.str().c_str());
+    }
+    base_importspool_load_checkpoint(conf_data);
     conf_data->std_namespace_prefixes = xhash_new(5);
     xhash_put(conf_data->std_namespace_prefixes, "",
               const_cast<char *>(NS_SERVER));
@@ -542,10 +868,9 @@ static result base_importspool_config(instance id, xmlnode x, void *arg) {
               const_cast<char *>(NS_JABBERD_WRAPPER));
     xhash_put(conf_data->std_namespace_prefixes, "privacy",
               const_cast<char *>(NS_PRIVACY));
-    pool_cleanup(id->p, free_ns_prefixes, conf_data->std_namespace_prefixes);
 
-    /* start thread that does the import */
-    pth_spawn(PTH_ATTR_DEFAULT, base_importspool_worker, conf_data);
+    /* start thread that walks the spool, it starts the other threads */
+    pth_spawn(PTH_ATTR_DEFAULT, base_importspool_walker, conf_data);
 
     return r_DONE;
 }
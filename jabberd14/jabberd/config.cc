@@ -413,6 +413,15 @@ int configurate(char *file, xht cmd_line, int is_restart) {
         importspool = xmlnode_insert_tag_ns(service, "importspool", NULL,
                                             NS_JABBERD_CONFIGFILE);
         xmlnode_insert_cdata(importspool, import_spool, -1);
+        xmlnode_put_attrib_ns(
+            importspool, "parsers", NULL, NULL,
+            static_cast<char *>(xhash_get(cmd_line, "import-parsers")));
+        xmlnode_put_attrib_ns(
+            importspool, "writers", NULL, NULL,
+            static_cast<char *>(xhash_get(cmd_line, "import-writers")));
+        xmlnode_put_attrib_ns(
+            importspool, "checkpoint", NULL, NULL,
+            static_cast<char *>(xhash_get(cmd_line, "import-checkpoint")));
     }
 
     /* check greymatter for additional includes */
@@ -946,6 +946,56 @@ bool deliver_is_delivered_to(Glib::ustring const &host, _instance const *i) {
     return l->i == i;
 }
 
+/**
+ * util to check if a routed packet is a request to resolve its child, that
+ * has been sent by a dialback instance of this server
+ *
+ * Such requests are addressed to a host nobody handles, so that they reach the
+ * resolver as the default route.
+ *
+ * @param p the routed packet
+ * @return true if it is a resolve request of a local dialback instance
+ */
+bool deliver_is_resolve_request(dpacket p) {
+    if (p == NULL || p->type != p_ROUTE ||
+        j_strcmp(xmlnode_get_attrib_ns(p->x, "type", NULL), "resolve") != 0)
+        return false;
+
+    /* the sender has to be the instance the result is sent back to */
+    char const *from = xmlnode_get_attrib_ns(p->x, "from", NULL);
+    if (from == NULL ||
+        j_strcmp(xmlnode_get_attrib_ns(xmlnode_get_firstchild(p->x),
+                                       "dnsqueryby", NULL),
+                 from) != 0)
+        return false;
+
+    /* and it has to be a dialback instance (no default route fallback) */
+    for (ilist l = static_cast<ilist>(xhash_get(deliver__hnorm, from));
+         l != NULL; l = l->next) {
+        if (j_strcmp(l->i->id, from) == 0)
+            return l->i->module_init_funcs->count("dialback") > 0;
+    }
+    return false;
+}
+
+/**
+ * util to check if xdb requests for two namespaces of a host get routed to the
+ * same instance
+ *
+ * @param host the host the xdb requests are sent to
+ * @param ns1 the namespace of the first request
+ * @param ns2 the namespace of the second request
+ * @return true if both requests are handled by the same instance
+ */
+bool deliver_xdb_same_instance(char const *host, char const *ns1,
+                               char const *ns2) {
+    ilist a = deliver_hashmatch(deliver_hashtable(p_XDB), host);
+    instance i1 = deliver_intersect(a, deliver_hashmatch(deliver__ns, ns1));
+    instance i2 = deliver_intersect(a, deliver_hashmatch(deliver__ns, ns2));
+
+    return i1 != NULL && i1 == i2;
+}
+
 /**
  * initialize the XML delivery system
  *
@@ -28,16 +28,22 @@
  */
 
 #include <gcrypt.h>
-#include <pth.h>
+#include <pthread.h>
 #include <errno.h>
 
-/* prepare gcrypt for libpth */
-GCRY_THREAD_OPTION_PTH_IMPL;
+/* prepare gcrypt for POSIX threads */
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
 /**
- * Tell gcrypt we are using libpth
+ * Tell gcrypt to lock with POSIX mutexes
+ *
+ * The TLS handshake worker threads are OS threads, that use gcrypt (through
+ * GNU TLS) concurrently to the pth threads, so pth mutexes would not protect
+ * gcrypt's state. Using POSIX mutexes from the pth threads is safe, as all pth
+ * threads run in the same OS thread and gcrypt does not yield to another pth
+ * thread while holding one of its locks: a pth thread only waits for a lock
+ * held by a worker thread, which releases it without needing the pth threads.
  */
 void mio_tls_gcrypt_init() {
-    /* prepare gcrypt with libpth */
-    gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pth);
+    gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
 }
@@ -106,11 +106,14 @@ int main(int argc, const char **argv) {
     char *c = NULL;
     char *cmd = NULL;
     char *home = NULL;
-    char *zones = NULL;        /* debugging zones */
-    char *host = NULL;         /* domain/hostname to run as */
-    char *spool = NULL;        /* spool directory for xdb_file */
-    char *import_spool = NULL; /* spool base dir for import */
-    char *do_include = NULL;   /* include files in configuration */
+    char *zones = NULL;             /* debugging zones */
+    char *host = NULL;              /* domain/hostname to run as */
+    char *spool = NULL;             /* spool directory for xdb_file */
+    char *import_spool = NULL;      /* spool base dir for import */
+    char *import_parsers = NULL;    /* threads parsing spool files */
+    char *import_writers = NULL;    /* concurrent xdb writes while importing */
+    char *import_checkpoint = NULL; /* file to resume an import from */
+    char *do_include = NULL;        /* include files in configuration */
     float avload;
     int do_debug = 0;         /* Debug output option, default no */
     int do_background = 0;    /* Daemonize option, default no */
@@ -149,6 +152,12 @@ int main(int argc, const char **argv) {
          "directory path"},
         {"import", 'I', POPT_ARG_STRING, &import_spool, 0,
          "import data to the server from a filespool", "basedir of file-spool"},
+        {"import-parsers", 0, POPT_ARG_STRING, &import_parsers, 0,
+         "number of threads parsing spool files while importing", "number"},
+        {"import-writers", 0, POPT_ARG_STRING, &import_writers, 0,
+         "number of concurrent xdb writes while importing", "number"},
+        {"import-checkpoint", 0, POPT_ARG_STRING, &import_checkpoint, 0,
+         "file used to resume an interrupted import", "path and filename"},
         {"version", 'V', POPT_ARG_NONE, &do_version, 0, "print server version",
          NULL},
         {NULL, 'v', POPT_ARG_NONE | POPT_ARGFLAG_DOC_HIDDEN, &do_version, 0,
@@ -244,6 +253,15 @@ int main(int argc, const char **argv) {
     if (import_spool != NULL) {
         xhash_put(jabberd.cmd_line, "I", import_spool);
     }
+    if (import_parsers != NULL) {
+        xhash_put(jabberd.cmd_line, "import-parsers", import_parsers);
+    }
+    if (import_writers != NULL) {
+        xhash_put(jabberd.cmd_line, "import-writers", import_writers);
+    }
+    if (import_checkpoint != NULL) {
+        xhash_put(jabberd.cmd_line, "import-checkpoint", import_checkpoint);
+    }
 
     /* the special -Z flag provides a list of zones to filter debug output for,
      * flagged w/ a simple hash */
@@ -359,6 +377,13 @@ int main(int argc, const char **argv) {
         log_debug2(ZONE, LOGT_STATUS,
                    "main load check of %.2f with %ld total threads", avload,
                    pth_ctrl(PTH_CTRL_GETTHREADS));
+        xmppd::preparation_statistics prep =
+            xmppd::get_preparation_statistics();
+        log_debug2(ZONE, LOGT_STATUS,
+                   "stringprep caches: %zu entries, %lu hits, %lu misses, "
+                   "%lu evictions, %lu ASCII strings not needing preparation",
+                   prep.entries, prep.hits, prep.misses, prep.evictions,
+                   prep.ascii_hits);
 #ifdef POOL_DEBUG
         pool_stat(0);
         xmlnode_stat();
@@ -133,6 +133,7 @@
 #include <xstream.hh>
 
 #include <set>
+#include <vector>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
@@ -281,6 +282,13 @@ bool deliver_is_delivered_to(
                             hostname for normal packets */
 bool deliver_is_uplink(
     instance i); // checks if an instance is configured to be the uplink
+bool deliver_is_resolve_request(
+    dpacket p); /* util that checks if a routed packet is a resolve request of
+                   a local dialback instance */
+bool deliver_xdb_same_instance(
+    char const *host, char const *ns1,
+    char const *ns2); /* util that checks if xdb requests for both namespaces
+                         are handled by the same instance */
 std::set<Glib::ustring> deliver_routed_hosts(ptype type, instance i);
 void deliver_config_filter(xmlnode greymatter);
 
@@ -355,6 +363,8 @@ typedef struct xdbcache_struct {
     char const *act;       /**< for set */
     char const *match;     /**< for set */
     char const *matchpath; /**< for set, namespace aware version of match */
+    char const *batch; /**< for get, space separated list of namespaces to get
+                          in a single request (NULL for a single namespace) */
     xht namespaces; /**< for set, namespace prefix declarations for matchpath */
     xmlnode data;   /**< for set */
     jid owner;
@@ -363,6 +373,9 @@ typedef struct xdbcache_struct {
                      pth_cond_notify() on ::cond */
     pth_cond_t cond;
     pth_mutex_t mutex;
+    struct xdb_readcache_struct
+        *readcache; /**< read-through cache of results (only at the top of
+                       the ring), NULL if not configured */
     struct xdbcache_struct *prev;
     struct xdbcache_struct *next;
 } * xdbcache, _xdbcache;
@@ -380,6 +393,10 @@ int xdb_act_path(
 int xdb_set(xdbcache xc, jid owner, const char *ns,
             xmlnode data); /**< sends new xml to replace old, returns non-zero
                               if failure */
+void xdb_prefetch(xdbcache xc, jid owner,
+                  char const *const *namespaces); /**< gets several namespaces
+                                                     in a single request and
+                                                     keeps them for xdb_get() */
 
 /* Error messages */
 #define SERROR_NAMESPACE                                                       \
@@ -392,6 +409,11 @@ int xdb_set(xdbcache xc, jid owner, const char *ns,
     "xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text "                      \
     "xmlns='urn:ietf:params:xml:ns:xmpp-streams' xml:lang='en'>Invalid "       \
     "hostname used.</text></stream:error>"
+#define SERROR_POLICYVIOLATION                                                 \
+    "<stream:error><policy-violation "                                         \
+    "xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text "                      \
+    "xmlns='urn:ietf:params:xml:ns:xmpp-streams' xml:lang='en'>Stanza "        \
+    "exceeds the limits of this server.</text></stream:error>"
 
 /* ------------------------------------
  * Managed Thread Queue (MTQ) utilities
@@ -505,6 +527,23 @@ typedef struct mio_st {
         int recall_handshake_when_writeable : 1; /**< recall the handshake
                                                     function, when the socket
                                                     allows writing again */
+        int in_raw_tainted : 1; /**< set to 1, if the stanza currently received
+                                   cannot be passed through unchanged */
+        int in_limit_exceeded : 1; /**< set to 1, if a received stanza exceeded
+                                      a limit, further data is discarded */
+        int handshake_parked : 1; /**< set to 1, while a TLS worker thread does
+                                     the handshake, the socket is not used by
+                                     the mio loop */
+        int ktls_send : 1; /**< set to 1, if the kernel encrypts the data
+                              written to a TLS connection */
+        int ktls_recv : 1; /**< set to 1, if the kernel decrypts the data
+                              read from a TLS connection */
+        int watched : 1;    /**< set to 1, if the owner does the I/O on the
+                               socket itself, see mio_watch() */
+        int watch_read : 1; /**< set to 1, if a MIO_READABLE event is wanted
+                               for a watched socket */
+        int watch_write : 1; /**< set to 1, if a MIO_WRITEABLE event is wanted
+                                for a watched socket */
     } flags;
 
     struct karma k;     /**< karma for this socket, used to limit bandwidth of a
@@ -528,8 +567,36 @@ typedef struct mio_st {
                                        the currently recevied stanza */
     const char *
         root_lang; /**< declared language of the incoming stream root element */
+    std::string *in_raw; /**< received bytes, that have not yet been passed as
+                            part of a stanza, NULL if received stanzas are not
+                            kept as received */
+    XML_Index in_raw_offset; /**< stream position of the first byte in in_raw */
+    XML_Index in_raw_stanza; /**< stream position where the currently received
+                                stanza starts */
+    XML_Index in_parsed; /**< number of bytes passed to the XML parser */
+    XML_Index in_stanza_start; /**< stream position where the currently
+                                  received stanza (or the data following the
+                                  last stanza) starts */
+    int in_depth; /**< nesting depth of the element currently received */
+    std::vector<long> *in_children; /**< number of child elements for each
+                                       open element of the currently received
+                                       stanza, NULL if not limited */
 } * mio, _mio;
 
+/**
+ * limits for stanzas received on XML streams
+ */
+typedef enum {
+    mio_limit_size,     /**< number of bytes of a stanza */
+    mio_limit_depth,    /**< nesting depth of elements in a stanza */
+    mio_limit_attribs,  /**< number of attributes of an element */
+    mio_limit_children, /**< number of child elements of an element */
+    mio_limit_count     /**< number of limits (not a limit itself) */
+} mio_limit;
+
+/** maximum number of expat parsers kept for reuse by new XML streams */
+#define MIO_XML_IDLE_PARSERS 32
+
 /**
  * @brief structure that holds the global mio data
  *
@@ -549,6 +616,17 @@ typedef struct mio_main_st {
     char const *webserver_path; /**< location where small HTTP requests are
                                    handled from */
     char const *flash_policy;   /**< location of the flash policy file */
+    XML_Parser idle_parsers[MIO_XML_IDLE_PARSERS]; /**< expat parsers of closed
+                                                      XML streams, kept for
+                                                      reuse */
+    int idle_parsers_count; /**< number of parsers in idle_parsers */
+    int passthrough; /**< keep received stanzas as received, to write them
+                        unchanged if they are forwarded unmodified */
+    long limits[mio_limit_count]; /**< limits for received stanzas (0 for no
+                                     limit) */
+    unsigned long limits_exceeded[mio_limit_count]; /**< number of streams
+                                                       closed for exceeding
+                                                       each limit */
 
 } _ios, *ios;
 
@@ -583,6 +661,7 @@ void _mio_raw_parser(mio m, const void *buf, size_t bufsz);
 void mio_xml_reset(mio m);
 int mio_xml_starttls(mio m, int originator, const char *identity);
 void _mio_xml_parser(mio m, const void *buf, size_t bufsz);
+void _mio_xml_free_idle_parsers(void);
 #define MIO_XML_PARSER (mio_parser_func) & _mio_xml_parser
 
 /* function helpers */
@@ -602,6 +681,7 @@ ssize_t _mio_ssl_write(mio m, const void *buf, size_t count);
 int _mio_ssl_accepted(mio m);
 void mio_tls_get_characteristics(mio m, char *buffer, size_t len);
 void mio_tls_get_certtype(mio m, char *buffer, size_t len);
+void mio_tls_collect_handshakes();
 #define MIO_SSL_READ _mio_ssl_read
 #define MIO_SSL_WRITE _mio_ssl_write
 #define MIO_SSL_ACCEPTED _mio_ssl_accepted
@@ -621,6 +701,8 @@ void mio_set_handlers(mio m, mio_handlers mh);
 #define MIO_XML_NODE 3
 #define MIO_CLOSED 4
 #define MIO_ERROR 5
+#define MIO_READABLE 6
+#define MIO_WRITEABLE 7
 
 /* Initializes the MIO subsystem */
 void mio_init(void);
@@ -637,6 +719,9 @@ void mio_reset(mio m, mio_std_cb cb, void *arg);
 /* Request the mio socket be closed */
 void mio_close(mio m);
 
+/* Only signal readiness, the owner does the I/O on the socket */
+void mio_watch(mio m, int readable, int writeable);
+
 /* Writes an xmlnode to the socket */
 void mio_write(mio m, xmlnode stanza, char const *buffer, int len);
 
@@ -0,0 +1,282 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file dnscache.cc
+ * @brief cache of DNS resolution results
+ *
+ * This file implements the cache of DNS results shared by the dnsrv, resolver
+ * and dialback components.
+ */
+
+#include <dnscache.hh>
+
+#include <cstdlib>
+#include <sstream>
+
+/** default maximum number of cached entries */
+#define DNS_CACHE_MAX_ENTRIES 4096
+
+/** default seconds to cache results without a known TTL */
+#define DNS_CACHE_DEFAULT_TTL 3600
+
+/** default seconds to cache failed lookups */
+#define DNS_CACHE_NEGATIVE_TTL 360
+
+/** maximum seconds a result is cached, whatever its TTL is */
+#define DNS_CACHE_MAX_TTL 86400
+
+namespace xmppd {
+
+dns_cache::dns_cache()
+    : max_entries(DNS_CACHE_MAX_ENTRIES), default_ttl(DNS_CACHE_DEFAULT_TTL),
+      negative_ttl(DNS_CACHE_NEGATIVE_TTL), stats() {}
+
+dns_cache &dns_cache::shared() {
+    static dns_cache cache;
+    return cache;
+}
+
+void dns_cache::configure(size_t max_entries, long default_ttl,
+                          long negative_ttl) {
+    this->max_entries = max_entries;
+    this->default_ttl = default_ttl;
+    this->negative_ttl = negative_ttl;
+
+    while (index.size() > max_entries) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+        stats.evicted++;
+    }
+}
+
+long dns_cache::get_default_ttl() const { return default_ttl; }
+
+std::string dns_cache::make_key(std::string const &name, rr_type type) {
+    std::string key(1, static_cast<char>('0' + type));
+    key.reserve(name.length() + 1);
+    for (std::string::const_iterator p = name.begin(); p != name.end(); ++p)
+        key += (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+
+    // ignore a trailing dot
+    if (key.length() > 1 && key[key.length() - 1] == '.')
+        key.erase(key.length() - 1);
+    return key;
+}
+
+void dns_cache::store(entry const &e) {
+    std::unordered_map<std::string, entry_list::iterator>::iterator p =
+        index.find(e.key);
+    if (p != index.end()) {
+        entries.erase(p->second);
+        index.erase(p);
+    }
+
+    if (index.size() >= max_entries && !entries.empty()) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+        stats.evicted++;
+    }
+
+    entries.push_front(e);
+    index[e.key] = entries.begin();
+}
+
+void dns_cache::put(std::string const &name, rr_type type,
+                    std::vector<dns_record> const &records, long ttl,
+                    std::string const &resend) {
+    if (records.empty()) {
+        put_negative(name, type);
+        return;
+    }
+
+    if (ttl < 0)
+        ttl = default_ttl;
+    if (ttl > DNS_CACHE_MAX_TTL)
+        ttl = DNS_CACHE_MAX_TTL;
+    if (ttl == 0 || max_entries == 0)
+        return;
+
+    entry e;
+    e.key = make_key(name, type);
+    e.records = records;
+    e.resend = resend;
+    e.negative = false;
+    e.expires = std::time(NULL) + ttl;
+    e.hits = 0;
+    e.prefetching = false;
+    store(e);
+}
+
+void dns_cache::put_negative(std::string const &name, rr_type type,
+                             long ttl) {
+    if (ttl < 0 || ttl > negative_ttl)
+        ttl = negative_ttl;
+    if (ttl == 0 || max_entries == 0)
+        return;
+
+    entry e;
+    e.key = make_key(name, type);
+    e.negative = true;
+    e.expires = std::time(NULL) + ttl;
+    e.hits = 0;
+    e.prefetching = false;
+    store(e);
+}
+
+void dns_cache::put_failed(std::string const &name, rr_type type) {
+    std::unordered_map<std::string, entry_list::iterator>::iterator p =
+        index.find(make_key(name, type));
+    if (p != index.end() && !p->second->negative &&
+        p->second->expires > std::time(NULL)) {
+        p->second->prefetching = false;
+        return;
+    }
+
+    put_negative(name, type);
+}
+
+dns_cache::lookup_result dns_cache::get(std::string const &name, rr_type type,
+                                        std::vector<dns_record> &records,
+                                        std::string *resend) {
+    std::unordered_map<std::string, entry_list::iterator>::iterator p =
+        index.find(make_key(name, type));
+    if (p == index.end()) {
+        stats.misses++;
+        return lookup_miss;
+    }
+
+    entry_list::iterator e = p->second;
+    if (e->expires <= std::time(NULL)) {
+        entries.erase(e);
+        index.erase(p);
+        stats.expired++;
+        stats.misses++;
+        return lookup_miss;
+    }
+
+    entries.splice(entries.begin(), entries, e);
+    e->hits++;
+
+    if (e->negative) {
+        stats.negative_hits++;
+        return lookup_negative;
+    }
+
+    stats.hits++;
+    records = e->records;
+    if (resend != NULL)
+        *resend = e->resend;
+    return lookup_hit;
+}
+
+std::vector<std::string> dns_cache::get_prefetch(rr_type type, long lead,
+                                                 unsigned long min_hits) {
+    std::vector<std::string> result;
+    time_t limit = std::time(NULL) + lead;
+    char type_char = static_cast<char>('0' + type);
+
+    for (entry_list::iterator p = entries.begin(); p != entries.end(); ++p) {
+        if (p->key[0] != type_char || p->negative || p->prefetching ||
+            p->hits < min_hits || p->expires > limit)
+            continue;
+
+        p->prefetching = true;
+        result.push_back(p->key.substr(1));
+        stats.prefetches++;
+    }
+
+    return result;
+}
+
+dns_cache::statistics dns_cache::get_statistics() const {
+    statistics result = stats;
+    result.entries = index.size();
+    return result;
+}
+
+std::vector<dns_record> dns_cache::parse_addresses(std::string const &list) {
+    std::vector<dns_record> result;
+    std::string::size_type start = 0;
+
+    while (start < list.length()) {
+        std::string::size_type end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.length();
+        std::string item = list.substr(start, end - start);
+        start = end + 1;
+
+        if (item.empty())
+            continue;
+
+        dns_record record;
+        record.port = 0;
+        record.priority = 0;
+        record.weight = 0;
+
+        std::string::size_type colon = item.rfind(':');
+        if (item[0] == '[') {
+            // [IPv6]:port
+            std::string::size_type bracket = item.find(']');
+            if (bracket == std::string::npos)
+                continue;
+            record.target = item.substr(1, bracket - 1);
+            if (colon != std::string::npos && colon > bracket)
+                record.port = std::atoi(item.c_str() + colon + 1);
+        } else if (colon != std::string::npos && item.find(':') == colon) {
+            // IPv4:port
+            record.target = item.substr(0, colon);
+            record.port = std::atoi(item.c_str() + colon + 1);
+        } else {
+            // plain IPv4 or IPv6 address
+            record.target = item;
+        }
+
+        result.push_back(record);
+    }
+
+    return result;
+}
+
+std::string
+dns_cache::format_addresses(std::vector<dns_record> const &records) {
+    std::ostringstream result;
+
+    for (std::vector<dns_record>::const_iterator p = records.begin();
+         p != records.end(); ++p) {
+        if (p != records.begin())
+            result << ",";
+
+        if (p->port == 0)
+            result << p->target;
+        else if (p->target.find(':') != std::string::npos)
+            result << "[" << p->target << "]:" << p->port;
+        else
+            result << p->target << ":" << p->port;
+    }
+
+    return result.str();
+}
+
+} // namespace xmppd
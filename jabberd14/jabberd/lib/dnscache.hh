@@ -0,0 +1,249 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#ifndef __DNSCACHE_HH
+#define __DNSCACHE_HH
+
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace xmppd {
+
+/**
+ * @brief a single resolved record as kept in the dns_cache
+ */
+struct dns_record {
+    std::string target; /**< IP address (A, AAAA, host) or target host (SRV) */
+    uint16_t port;      /**< port (SRV, host), 0 if not known */
+    uint16_t priority;  /**< priority (SRV) */
+    uint16_t weight;    /**< weight (SRV) */
+};
+
+/**
+ * @brief cache of DNS resolution results, honoring the TTLs of the records
+ *
+ * The cache is shared by all components running in the same process (see
+ * shared()). It keeps the records of SRV, AAAA and A lookups, as well as the
+ * final result of resolving a host (the addresses to connect to). Failed
+ * lookups are cached as negative entries. If the cache is full, the least
+ * recently used entry is dropped.
+ */
+class dns_cache {
+  public:
+    /**
+     * types of cached entries
+     */
+    enum rr_type {
+        rr_srv,  /**< SRV records of a service */
+        rr_a,    /**< A records of a host */
+        rr_aaaa, /**< AAAA records of a host */
+        rr_host  /**< addresses (and ports) to connect to for a domain */
+    };
+
+    /**
+     * results of a lookup in the cache
+     */
+    enum lookup_result {
+        lookup_miss,    /**< nothing (valid) cached */
+        lookup_hit,     /**< records have been found */
+        lookup_negative /**< the name is cached as not resolvable */
+    };
+
+    /**
+     * counters of cache operations
+     */
+    struct statistics {
+        unsigned long hits;          /**< lookups returning records */
+        unsigned long negative_hits; /**< lookups returning a negative entry */
+        unsigned long misses;        /**< lookups without a cached entry */
+        unsigned long expired;       /**< entries dropped as their TTL passed */
+        unsigned long evicted;       /**< entries dropped to make room */
+        unsigned long prefetches;    /**< entries returned for prefetching */
+        size_t entries;              /**< entries currently in the cache */
+    };
+
+    /**
+     * create an empty cache
+     */
+    dns_cache();
+
+    /**
+     * get the cache shared by all components
+     *
+     * @return the shared cache
+     */
+    static dns_cache &shared();
+
+    /**
+     * configure the cache
+     *
+     * @param max_entries maximum number of entries (0 disables caching)
+     * @param default_ttl seconds to cache results without a known TTL
+     * @param negative_ttl seconds to cache failed lookups
+     */
+    void configure(size_t max_entries, long default_ttl, long negative_ttl);
+
+    /**
+     * get the TTL used for results without a known TTL
+     *
+     * @return the TTL in seconds
+     */
+    long get_default_ttl() const;
+
+    /**
+     * store resolved records
+     *
+     * @param name the resolved domain
+     * @param type the type of the records
+     * @param records the resolved records
+     * @param ttl seconds the records are valid (negative if not known)
+     * @param resend where stanzas for the domain are resent to (dnsrv)
+     */
+    void put(std::string const &name, rr_type type,
+             std::vector<dns_record> const &records, long ttl,
+             std::string const &resend = std::string());
+
+    /**
+     * store that a name cannot be resolved
+     *
+     * @param name the domain that failed to resolve
+     * @param type the type of the lookup
+     * @param ttl seconds to cache the failure (negative for the default)
+     */
+    void put_negative(std::string const &name, rr_type type, long ttl = -1);
+
+    /**
+     * store that resolving a name failed, unless records of an earlier lookup
+     * are still valid
+     *
+     * Records that are still valid are kept (a failed prefetch must not throw
+     * them away), and may be returned by get_prefetch() again.
+     *
+     * @param name the domain that failed to resolve
+     * @param type the type of the lookup
+     */
+    void put_failed(std::string const &name, rr_type type);
+
+    /**
+     * look up records in the cache
+     *
+     * @param name the domain to look up
+     * @param type the type of the records
+     * @param records where to store the records on a hit
+     * @param resend where to store the resend destination (may be NULL)
+     * @return if records have been found
+     */
+    lookup_result get(std::string const &name, rr_type type,
+                      std::vector<dns_record> &records,
+                      std::string *resend = NULL);
+
+    /**
+     * get popular entries that should be resolved again before they expire
+     *
+     * Each entry is returned only once until it has been stored again.
+     *
+     * @param type the type of the entries
+     * @param lead seconds before the expiration to start prefetching
+     * @param min_hits how often an entry has to be used to be prefetched
+     * @return names of the entries to resolve again
+     */
+    std::vector<std::string> get_prefetch(rr_type type, long lead,
+                                          unsigned long min_hits);
+
+    /**
+     * get the counters of the cache
+     *
+     * @return the counters
+     */
+    statistics get_statistics() const;
+
+    /**
+     * parse a comma separated list of addresses (as used in the ip attribute
+     * of routed stanzas)
+     *
+     * Each address is an IPv4 address, an IPv6 address, or either with a port
+     * ("1.2.3.4:5269" or "[::1]:5269").
+     *
+     * @param list the list to parse
+     * @return the addresses
+     */
+    static std::vector<dns_record> parse_addresses(std::string const &list);
+
+    /**
+     * format addresses as a comma separated list
+     *
+     * @param records the addresses
+     * @return the list in the format parsed by parse_addresses()
+     */
+    static std::string format_addresses(std::vector<dns_record> const &records);
+
+  private:
+    /**
+     * a cached entry
+     */
+    struct entry {
+        std::string key;                 /**< type and name of the entry */
+        std::vector<dns_record> records; /**< the records, empty if negative */
+        std::string resend; /**< resend destination for the domain */
+        bool negative;      /**< if the lookup failed */
+        time_t expires;     /**< when the entry expires */
+        unsigned long hits; /**< lookups since the entry has been stored */
+        bool prefetching;   /**< already returned by get_prefetch() */
+    };
+
+    /** list of entries, most recently used first */
+    typedef std::list<entry> entry_list;
+
+    /**
+     * build the key of an entry
+     *
+     * @param name the domain (converted to lowercase)
+     * @param type the type of the entry
+     * @return the key
+     */
+    static std::string make_key(std::string const &name, rr_type type);
+
+    /**
+     * store an entry, replacing an entry with the same key
+     *
+     * @param e the entry to store
+     */
+    void store(entry const &e);
+
+    size_t max_entries; /**< maximum number of entries */
+    long default_ttl;   /**< TTL for results without a known TTL */
+    long negative_ttl;  /**< TTL for failed lookups */
+    entry_list entries; /**< the cached entries */
+    std::unordered_map<std::string, entry_list::iterator>
+        index;        /**< the cached entries by key */
+    statistics stats; /**< counters of the cache */
+};
+
+} // namespace xmppd
+
+#endif // __DNSCACHE_HH
@@ -74,62 +74,23 @@ typedef struct {
  * @param atts attributes that are contained in the start element
  */
 void expat_startElement(void *userdata, const char *name, const char **atts) {
-    Glib::ustring qname = name;
-
-    Glib::ustring prefix;
-    Glib::ustring ns_iri;
-    Glib::ustring local_name;
-
     /* get the data we are working on */
     expat_callback_data callback_data =
         static_cast<expat_callback_data>(userdata);
 
-    /* get prefix, iri, and local name of the element */
-    Glib::ustring::size_type xmlns_separator_pos = qname.find(XMLNS_SEPARATOR);
-    if (xmlns_separator_pos != Glib::ustring::npos) {
-        // expat found the namespace IRI for us (this should be the case for a
-        // correct stream)
-        ns_iri = qname.substr(0, xmlns_separator_pos);
-        local_name = qname.substr(xmlns_separator_pos + 1);
-        prefix = callback_data->ns->get_nsprefix(ns_iri);
-    } else {
-        Glib::ustring::size_type colon_pos = qname.find(':');
-        if (colon_pos != Glib::ustring::npos) {
-            // expat could not expand the prefix, but there is one
-
-            // ... be liberal in what you accept ...
-
-            // start with a guess
-            prefix = qname.substr(0, colon_pos);
-            local_name = qname.substr(colon_pos + 1);
-            ns_iri = "http://jabberd.org/no/clue";
-
-            // some well known prefixes (but they would have to be declared!)
-            if (prefix == "stream") {
-                ns_iri = NS_STREAM;
-            } else if (prefix == "db") {
-                ns_iri = NS_DIALBACK;
-            }
-        } else {
-            // default namespace, but not declared
-
-            // again: ... be liberal in what you accept ... (guessing it's
-            // 'jabber:server')
-            ns_iri = NS_SERVER;
-            local_name = qname;
-        }
-    }
+    /* get prefix, iri, and local name of the element (guessing it's
+     * 'jabber:server' if the default namespace has not been declared) */
+    xmppd::expat_qname qname(name, *callback_data->ns,
+                             "http://jabberd.org/no/clue", NS_SERVER);
 
     if (callback_data->x == NULL) {
         /* allocate a base node */
-        callback_data->x = xmlnode_new_tag_ns(
-            local_name.c_str(), prefix.empty() ? NULL : prefix.c_str(),
-            ns_iri.c_str());
+        callback_data->x =
+            xmlnode_new_tag_ns(qname.local_name, qname.prefix, qname.ns_iri);
     } else {
         /* insert as child node */
         callback_data->x = xmlnode_insert_tag_ns(
-            callback_data->x, local_name.c_str(),
-            prefix.empty() ? NULL : prefix.c_str(), ns_iri.c_str());
+            callback_data->x, qname.local_name, qname.prefix, qname.ns_iri);
     }
     xmlnode_put_expat_attribs(callback_data->x, atts, *callback_data->ns);
 }
@@ -438,50 +399,12 @@ void xmlnode_put_expat_attribs(xmlnode owner, const char **atts,
         return;
 
     for (; atts[i] != NULL; i += 2) {
-        // copy qname and the value to a ustring we can handle better
-        Glib::ustring qname(atts[i]);
-        Glib::ustring attribute_value(atts[i + 1]);
-
-        Glib::ustring prefix;
-        Glib::ustring ns_iri;
-        Glib::ustring local_name;
-
-        // get prefix, iri, and local name of the element
-        Glib::ustring::size_type xmlns_separator_pos =
-            qname.find(XMLNS_SEPARATOR);
-        if (xmlns_separator_pos != Glib::ustring::npos) {
-            // expat found the namespace IRI for us (this should be the case for
-            // a correct stream)
-            ns_iri = qname.substr(0, xmlns_separator_pos);
-            local_name = qname.substr(xmlns_separator_pos + 1);
-            prefix = nslist.get_nsprefix(ns_iri);
-        } else {
-            Glib::ustring::size_type colon_pos = qname.find(':');
-            if (colon_pos != Glib::ustring::npos) {
-                // expat could not expand the prefix, but there is one
-
-                // ... be liberal in what you accept ...
-
-                // start with a guess
-                prefix = qname.substr(0, colon_pos);
-                local_name = qname.substr(colon_pos + 1);
-                ns_iri = "http://jabberd.org/no/clue";
-
-                // some well known prefixes (but they would have to be
-                // declared!)
-                if (prefix == "stream") {
-                    ns_iri = NS_STREAM;
-                } else if (prefix == "db") {
-                    ns_iri = NS_DIALBACK;
-                }
-            } else {
-                local_name = qname;
-            }
-        }
+        // get prefix, iri, and local name of the attribute
+        xmppd::expat_qname qname(atts[i], nslist, "http://jabberd.org/no/clue",
+                                 NULL);
 
         // add attribute to the node
-        xmlnode_put_attrib_ns(
-            owner, local_name.c_str(), prefix.empty() ? NULL : prefix.c_str(),
-            ns_iri.empty() ? NULL : ns_iri.c_str(), attribute_value.c_str());
+        xmlnode_put_attrib_ns(owner, qname.local_name, qname.prefix,
+                              qname.ns_iri, atts[i + 1]);
     }
 }
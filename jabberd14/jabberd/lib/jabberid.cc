@@ -28,30 +28,49 @@
 
 
 #include "jabberid.hh"
+#include "str.hh"
 
-#include "xhash.hh"
-
+#include <atomic>
 #include <cstring>
+#include <list>
+#include <mutex>
 #include <stringprep.h>
+#include <unordered_map>
+
+/** number of shards (each with its own lock) of a preparation cache */
+#define PREPARATION_CACHE_SHARDS 16
+
+/** maximum number of cached strings in a shard of a preparation cache */
+#define PREPARATION_CACHE_SHARD_ENTRIES 512
+
+/** maximum number of interned domains of jabberids */
+#define JABBERID_INTERNED_DOMAINS 1024
 
 namespace xmppd {
 /**
  * The preparation_cache class caches string prep results and is used to speed
  * up preparation of jabberid address parts
  *
- * The parent class xhash uses the original string as keys and the value is a
- * pair of the prepared string (empty string if prepared string equals the
- * original string) and the the time when the cache entry has been last used.
+ * The cache is split into shards by the hash of the original string. Each
+ * shard is protected by its own mutex and keeps at most
+ * ::PREPARATION_CACHE_SHARD_ENTRIES entries, evicting the least recently used
+ * entry if it is full.
+ *
+ * Strings only containing ASCII characters, that are not changed by the
+ * profile, are not prepared using libidn and not cached at all.
  */
-class preparation_cache : private xhash<std::pair<Glib::ustring, time_t>> {
+class preparation_cache {
   public:
     /**
      * create a new string prep cache instance
      *
      * @param profile the stringprep profile to use (stringprep_xmpp_nodeprep,
      * stringprep_nameprep, or stringprep_xmpp_resourceprep)
+     * @param ascii_prepared function checking if an ASCII character is not
+     * changed by the profile
      */
-    preparation_cache(const ::Stringprep_profile *profile);
+    preparation_cache(const ::Stringprep_profile *profile,
+                      bool (*ascii_prepared)(unsigned char c));
 
     /**
      * get the prepared version of the original string
@@ -63,9 +82,11 @@ class preparation_cache : private xhash<std::pair<Glib::ustring, time_t>> {
     Glib::ustring get_prepped(const Glib::ustring &original);
 
     /**
-     * clean the preparation cache
+     * add the statistics of this cache to a statistics structure
+     *
+     * @param stats where to add the statistics
      */
-    void clean_cache();
+    void add_statistics(preparation_statistics &stats);
 
     /**
      * prepare a node
@@ -94,16 +115,61 @@ class preparation_cache : private xhash<std::pair<Glib::ustring, time_t>> {
      */
     static Glib::ustring prepare_resource(const Glib::ustring &original);
 
+    /**
+     * get the statistics of all preparation caches
+     *
+     * @return the statistics
+     */
+    static preparation_statistics get_statistics();
+
   private:
+    /**
+     * list of cached entries (original and prepared string), the most
+     * recently used entry first
+     */
+    typedef std::list<std::pair<std::string, std::string>> lru_list;
+
+    /**
+     * a shard of the cache
+     */
+    struct shard {
+        std::mutex lock; /**< protecting all other members */
+        lru_list entries; /**< the cached entries, most recently used first */
+        std::unordered_map<std::string, lru_list::iterator>
+            index; /**< the cached entries by the original string */
+        unsigned long hits;      /**< lookups found in the cache */
+        unsigned long misses;    /**< lookups not found in the cache */
+        unsigned long evictions; /**< entries removed to make room */
+    };
+
+    /**
+     * check if a string is not changed by the profile without running the
+     * profile on it
+     *
+     * @param original the string to check
+     * @return true if the string is known to be prepared already
+     */
+    bool is_prepared_ascii(const std::string &original) const;
+
     /**
      * The string prep profile to use for this cache
      */
     const ::Stringprep_profile *profile;
 
     /**
-     * Last time the preparation cache has been cleaned
+     * function checking if an ASCII character is not changed by the profile
+     */
+    bool (*ascii_prepared)(unsigned char c);
+
+    /**
+     * the shards of the cache
      */
-    time_t last_clean;
+    shard shards[PREPARATION_CACHE_SHARDS];
+
+    /**
+     * number of strings that did not need preparation (ASCII fast path)
+     */
+    std::atomic<unsigned long> ascii_hits;
 
     /**
      * preparation cache for nodes
@@ -121,10 +187,36 @@ class preparation_cache : private xhash<std::pair<Glib::ustring, time_t>> {
     static preparation_cache resource_cache;
 };
 
-preparation_cache preparation_cache::node_cache(stringprep_xmpp_nodeprep);
-preparation_cache preparation_cache::domain_cache(stringprep_nameprep);
+/**
+ * ASCII characters not changed by nodeprep (a conservative subset)
+ */
+static bool _nodeprep_ascii(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' ||
+           c == '.' || c == '_';
+}
+
+/**
+ * ASCII characters not changed by nameprep (a conservative subset)
+ */
+static bool _nameprep_ascii(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' ||
+           c == '.';
+}
+
+/**
+ * ASCII characters not changed by resourceprep (all printable characters)
+ */
+static bool _resourceprep_ascii(unsigned char c) {
+    return c >= 0x20 && c < 0x7f;
+}
+
+preparation_cache preparation_cache::node_cache(stringprep_xmpp_nodeprep,
+                                                _nodeprep_ascii);
+preparation_cache preparation_cache::domain_cache(stringprep_nameprep,
+                                                  _nameprep_ascii);
 preparation_cache
-    preparation_cache::resource_cache(stringprep_xmpp_resourceprep);
+    preparation_cache::resource_cache(stringprep_xmpp_resourceprep,
+                                      _resourceprep_ascii);
 
 Glib::ustring preparation_cache::prepare_node(const Glib::ustring &original) {
     return node_cache.get_prepped(original);
@@ -139,64 +231,87 @@ preparation_cache::prepare_resource(const Glib::ustring &original) {
     return resource_cache.get_prepped(original);
 }
 
-preparation_cache::preparation_cache(const ::Stringprep_profile *profile)
-    : profile(profile) {
-    if (profile == NULL) {
+preparation_statistics preparation_cache::get_statistics() {
+    preparation_statistics stats = {};
+    node_cache.add_statistics(stats);
+    domain_cache.add_statistics(stats);
+    resource_cache.add_statistics(stats);
+    return stats;
+}
+
+preparation_cache::preparation_cache(const ::Stringprep_profile *profile,
+                                     bool (*ascii_prepared)(unsigned char c))
+    : profile(profile), ascii_prepared(ascii_prepared), ascii_hits(0) {
+    if (profile == NULL || ascii_prepared == NULL) {
         throw std::invalid_argument(
             "No profile given when constructing preparation_cache");
     }
 
-    last_clean = std::time(NULL);
+    for (int i = 0; i < PREPARATION_CACHE_SHARDS; i++) {
+        shards[i].hits = 0;
+        shards[i].misses = 0;
+        shards[i].evictions = 0;
+    }
 }
 
-void preparation_cache::clean_cache() {
-    time_t now = std::time(NULL);
-
-    // cleaning already necessary?
-    if (now - last_clean < 60)
-        return; // no, clean at most once a minute
-
-    // what to clean
-    time_t keep_newer_as = now - 900;
+void preparation_cache::add_statistics(preparation_statistics &stats) {
+    stats.ascii_hits += ascii_hits;
+    for (int i = 0; i < PREPARATION_CACHE_SHARDS; i++) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        stats.hits += shards[i].hits;
+        stats.misses += shards[i].misses;
+        stats.evictions += shards[i].evictions;
+        stats.entries += shards[i].index.size();
+    }
+}
 
-    // walk cache
-    std::list<Glib::ustring> items_to_remove;
-    for (preparation_cache::const_iterator p = this->begin(); p != this->end();
+bool preparation_cache::is_prepared_ascii(const std::string &original) const {
+    for (std::string::const_iterator p = original.begin(); p != original.end();
          ++p) {
-        if (p->second.second < keep_newer_as)
-            items_to_remove.push_back(p->first);
-    }
-    for (std::list<Glib::ustring>::const_iterator p = items_to_remove.begin();
-         p != items_to_remove.end(); ++p) {
-        this->erase(*p);
+        if (!ascii_prepared(static_cast<unsigned char>(*p)))
+            return false;
     }
+    return true;
 }
 
 Glib::ustring preparation_cache::get_prepped(const Glib::ustring &original) {
-    // need cleaning the cache?
-    clean_cache();
+    const std::string &key = original.raw();
+
+    // check length
+    if (key.length() > 1023) {
+        throw std::invalid_argument("JabberID part is to big");
+    }
+
+    // nothing to prepare?
+    if (is_prepared_ascii(key)) {
+        ascii_hits++;
+        return original;
+    }
+
+    // stringprep expects valid UTF-8
+    if (!j_utf8_valid(key.data(), key.length())) {
+        throw std::invalid_argument("JabberID part is not valid UTF-8");
+    }
 
     // already in cache?
-    xhash<std::pair<Glib::ustring, time_t>>::iterator iter = find(original);
-    if (iter != end()) {
-        iter->second.second = std::time(NULL);
-
-        if (iter->first.length() == 0) {
-            return original;
-        } else {
-            return iter->second.first;
+    shard &s = shards[std::hash<std::string>()(key) % PREPARATION_CACHE_SHARDS];
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        std::unordered_map<std::string, lru_list::iterator>::iterator iter =
+            s.index.find(key);
+        if (iter != s.index.end()) {
+            s.hits++;
+            s.entries.splice(s.entries.begin(), s.entries, iter->second);
+            return iter->second->second;
         }
+        s.misses++;
     }
 
-    // not yet in cache, do prepare
+    // not yet in cache, do prepare (without holding the lock)
 
-    // check length
-    if (std::string(original).length() > 1023) {
-        throw std::invalid_argument("JabberID part is to big");
-    }
     // copy original to a buffer where the preparation can be executed on
     char in_out_buffer[1024];
-    std::strncpy(in_out_buffer, original.c_str(), sizeof(in_out_buffer) - 1);
+    std::strncpy(in_out_buffer, key.c_str(), sizeof(in_out_buffer) - 1);
     in_out_buffer[sizeof(in_out_buffer) - 1] = 0; // sanity termination
 
     // do preparation
@@ -208,51 +323,143 @@ Glib::ustring preparation_cache::get_prepped(const Glib::ustring &original) {
         throw std::invalid_argument("JabberID part cannot be prepared");
     }
 
-    // cache entry
-    operator[](original) =
-        std::pair<Glib::ustring, time_t>(in_out_buffer, std::time(NULL));
+    // cache entry (might have been added by an other thread meanwhile)
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (s.index.find(key) == s.index.end()) {
+            if (s.index.size() >= PREPARATION_CACHE_SHARD_ENTRIES) {
+                s.index.erase(s.entries.back().first);
+                s.entries.pop_back();
+                s.evictions++;
+            }
+            s.entries.push_front(
+                std::pair<std::string, std::string>(key, in_out_buffer));
+            s.index[key] = s.entries.begin();
+        }
+    }
 
     // return result
     return in_out_buffer;
 }
 
+preparation_statistics get_preparation_statistics() {
+    return preparation_cache::get_statistics();
+}
+
+/**
+ * get the interned instance of a prepared domain
+ *
+ * Domains are interned until ::JABBERID_INTERNED_DOMAINS different domains
+ * have been seen, further domains get an instance of their own.
+ *
+ * @param domain the prepared domain
+ * @return the interned domain
+ */
+static std::shared_ptr<const Glib::ustring>
+_jabberid_intern_domain(const Glib::ustring &domain) {
+    static std::mutex lock;
+    static std::unordered_map<std::string,
+                              std::shared_ptr<const Glib::ustring>>
+        domains;
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<std::string,
+                       std::shared_ptr<const Glib::ustring>>::iterator iter =
+        domains.find(domain.raw());
+    if (iter != domains.end())
+        return iter->second;
+
+    std::shared_ptr<const Glib::ustring> interned =
+        std::make_shared<const Glib::ustring>(domain);
+    if (domains.size() < JABBERID_INTERNED_DOMAINS)
+        domains[domain.raw()] = interned;
+    return interned;
+}
+
 jabberid::jabberid(const Glib::ustring &jid) {
+    const std::string &raw = jid.raw();
+
     // split the JID into parts
-    Glib::ustring::size_type resource_separator = jid.find("/");
-    Glib::ustring::size_type node_separator = jid.find("@");
+    std::string::size_type resource_separator = raw.find('/');
+    std::string::size_type node_separator = raw.find('@');
 
     // there might be no node, but an at sign in the resource
-    if (resource_separator != Glib::ustring::npos &&
-        node_separator != Glib::ustring::npos &&
+    if (resource_separator != std::string::npos &&
+        node_separator != std::string::npos &&
         node_separator > resource_separator) {
-        node_separator = Glib::ustring::npos;
+        node_separator = std::string::npos;
     }
 
-    // prepare and store the parts
-    set_domain(jid.substr(
-        node_separator == Glib::ustring::npos ? 0 : node_separator + 1,
-        node_separator == Glib::ustring::npos
-            ? resource_separator
-            : resource_separator == Glib::ustring::npos
-                  ? Glib::ustring::npos
-                  : resource_separator - node_separator - 1));
-    if (node_separator != Glib::ustring::npos) {
-        set_node(jid.substr(0, node_separator));
+    std::string::size_type domain_separator =
+        node_separator == std::string::npos ? 0 : node_separator + 1;
+
+    // prepare the parts
+    Glib::ustring node;
+    Glib::ustring resource;
+    Glib::ustring domain;
+    try {
+        domain = preparation_cache::prepare_domain(raw.substr(
+            domain_separator, resource_separator == std::string::npos
+                                  ? std::string::npos
+                                  : resource_separator - domain_separator));
+    } catch (std::invalid_argument&) {
+        throw std::invalid_argument("Invalid domain for JID");
+    }
+    if (node_separator != std::string::npos && node_separator > 0) {
+        try {
+            node = preparation_cache::prepare_node(
+                raw.substr(0, node_separator));
+        } catch (std::invalid_argument&) {
+            throw std::invalid_argument("Invalid node for JID");
+        }
+    }
+    if (resource_separator != std::string::npos &&
+        resource_separator + 1 < raw.length()) {
+        try {
+            resource = preparation_cache::prepare_resource(
+                raw.substr(resource_separator + 1));
+        } catch (std::invalid_argument&) {
+            throw std::invalid_argument("Invalid resource for JID");
+        }
     }
-    if (resource_separator != Glib::ustring::npos) {
-        set_resource(jid.substr(resource_separator + 1));
+
+    // and store them
+    assign(node.raw(), _jabberid_intern_domain(domain), resource.raw());
+}
+
+void jabberid::assign(std::string_view node,
+                      std::shared_ptr<const Glib::ustring> domain,
+                      std::string_view resource) {
+    std::string new_buffer;
+    new_buffer.reserve(node.length() + domain->raw().length() +
+                       resource.length() + 2);
+
+    if (node.length() > 0) {
+        new_buffer.append(node);
+        new_buffer.push_back('@');
+    }
+    domain_start = new_buffer.length();
+    new_buffer.append(domain->raw());
+    domain_end = new_buffer.length();
+    if (resource.length() > 0) {
+        new_buffer.push_back('/');
+        new_buffer.append(resource);
     }
+
+    buffer.swap(new_buffer);
+    this->domain = domain;
 }
 
 void jabberid::set_node(const Glib::ustring &node) {
     // clearing node?
     if (node.size() == 0) {
-        this->node = "";
+        assign(std::string_view(), domain, resource_view());
         return;
     }
 
     try {
-        this->node = preparation_cache::prepare_node(node);
+        assign(preparation_cache::prepare_node(node).raw(), domain,
+               resource_view());
     } catch (std::invalid_argument&) {
         throw std::invalid_argument("Invalid node for JID");
     }
@@ -260,7 +467,10 @@ void jabberid::set_node(const Glib::ustring &node) {
 
 void jabberid::set_domain(const Glib::ustring &domain) {
     try {
-        this->domain = preparation_cache::prepare_domain(domain);
+        assign(node_view(),
+               _jabberid_intern_domain(
+                   preparation_cache::prepare_domain(domain)),
+               resource_view());
     } catch (std::invalid_argument&) {
         throw std::invalid_argument("Invalid domain for JID");
     }
@@ -269,51 +479,40 @@ void jabberid::set_domain(const Glib::ustring &domain) {
 void jabberid::set_resource(const Glib::ustring &resource) {
     // clearing resource?
     if (resource.size() == 0) {
-        this->resource = "";
+        buffer.resize(domain_end);
         return;
     }
 
     try {
-        this->resource = preparation_cache::prepare_resource(resource);
+        assign(node_view(), domain,
+               preparation_cache::prepare_resource(resource).raw());
     } catch (std::invalid_argument&) {
         throw std::invalid_argument("Invalid resource for JID");
     }
 }
 
-bool jabberid::operator==(const jabberid &otherjid) {
+bool jabberid::operator==(const jabberid &otherjid) const {
     return compare(otherjid, true, true, true);
 }
 
 bool jabberid::compare(const jabberid &otherjid, bool compare_resource,
-                       bool compare_node, bool compare_domain) {
-    if (compare_domain && domain != otherjid.domain)
+                       bool compare_node, bool compare_domain) const {
+    if (compare_domain && domain != otherjid.domain &&
+        domain->raw() != otherjid.domain->raw())
         return false;
-    if (compare_node && node != otherjid.node)
+    if (compare_node && node_view() != otherjid.node_view())
         return false;
-    if (compare_resource && resource != otherjid.resource)
+    if (compare_resource && resource_view() != otherjid.resource_view())
         return false;
     return true;
 }
 
-jabberid jabberid::get_user() {
+jabberid jabberid::get_user() const {
     jabberid jabberid_copy(*this);
-    jabberid_copy.set_resource("");
+    jabberid_copy.buffer.resize(domain_end);
     return jabberid_copy;
 }
 
-Glib::ustring jabberid::full() {
-    std::ostringstream result;
-    if (node.size() > 0) {
-        result << std::string(node) << "@";
-    }
-    result << std::string(domain);
-    if (resource.size() > 0) {
-        result << "/" << std::string(resource);
-    }
-
-    return result.str();
-}
-
 jabberid_pool::jabberid_pool(const Glib::ustring &jid, ::pool p)
     : jabberid(jid), next(NULL), jid_full(NULL) {
     if (p == NULL) {
@@ -324,6 +523,14 @@ jabberid_pool::jabberid_pool(const Glib::ustring &jid, ::pool p)
     this->p = p;
 }
 
+jabberid_pool::jabberid_pool(const jabberid &jid, ::pool p)
+    : jabberid(jid), next(NULL), p(p), jid_full(NULL) {
+    if (p == NULL) {
+        throw std::invalid_argument(
+            "trying to construct jabberid_pool with a NULL pool");
+    }
+}
+
 void jabberid_pool::set_node(const Glib::ustring &node) {
     jid_full = NULL;
     jabberid::set_node(node);
@@ -341,7 +548,9 @@ void jabberid_pool::set_resource(const Glib::ustring &resource) {
 
 char *jabberid_pool::full_pooled() {
     if (!jid_full) {
-        jid_full = pstrdup(p, full().c_str());
+        std::string_view full = full_view();
+        jid_full = static_cast<char *>(pmalloco(p, full.length() + 1));
+        std::memcpy(jid_full, full.data(), full.length());
     }
 
     return jid_full;
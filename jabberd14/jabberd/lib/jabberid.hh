@@ -26,11 +26,38 @@
 #include "pool.hh"
 
 #include <glibmm.h>
+#include <memory>
+#include <string>
+#include <string_view>
 
 namespace xmppd {
 
+/**
+ * statistics of the caches used to prepare the parts of jabberids
+ */
+struct preparation_statistics {
+    unsigned long hits;       /**< prepared strings found in the caches */
+    unsigned long misses;     /**< strings, that had to be prepared */
+    unsigned long evictions;  /**< entries removed from full caches */
+    unsigned long ascii_hits; /**< ASCII strings, that did not need
+                                 preparation */
+    size_t entries;           /**< number of cached strings */
+};
+
+/**
+ * get the statistics of the caches used to prepare the parts of jabberids
+ *
+ * @return the statistics
+ */
+preparation_statistics get_preparation_statistics();
+
 /**
  * The jabberid class represents a jid address on the xmpp network
+ *
+ * The prepared address is kept in a single buffer containing its textual
+ * representation, the parts are located by offsets into this buffer. The
+ * domain is additionally interned, as most addresses share one of a few
+ * domains, which allows to compare domains by pointer in most cases.
  */
 class jabberid {
   public:
@@ -72,35 +99,85 @@ class jabberid {
      *
      * @return the node part, empty string if no node
      */
-    const Glib::ustring &get_node() { return node; };
+    Glib::ustring get_node() const { return std::string(node_view()); };
 
     /**
      * returns if a jabberid has a node
      *
      * @return true if the jabberid has a node
      */
-    bool has_node() { return node.length() > 0; };
+    bool has_node() const { return domain_start > 0; };
 
     /**
      * get the domain part of a jabberid
      *
      * @return the domain part
      */
-    const Glib::ustring &get_domain() { return domain; };
+    const Glib::ustring &get_domain() const { return *domain; };
 
     /**
      * get the resource part of a jabberid
      *
      * @return the resource part, empty string if no resource
      */
-    const Glib::ustring &get_resource() { return resource; };
+    Glib::ustring get_resource() const {
+        return std::string(resource_view());
+    };
 
     /**
      * returns if a jabberid has a resource
      *
      * @return true if the jabberid has a resource
      */
-    bool has_resource() { return resource.length() > 0; };
+    bool has_resource() const { return domain_end < buffer.length(); };
+
+    /**
+     * get the node part of a jabberid without copying it
+     *
+     * @return the node part, empty if no node
+     */
+    std::string_view node_view() const {
+        return std::string_view(buffer).substr(
+            0, domain_start > 0 ? domain_start - 1 : 0);
+    };
+
+    /**
+     * get the resource part of a jabberid without copying it
+     *
+     * @return the resource part, empty if no resource
+     */
+    std::string_view resource_view() const {
+        return has_resource() ? std::string_view(buffer).substr(domain_end + 1)
+                              : std::string_view();
+    };
+
+    /**
+     * get the textual representation of a jabberid without the resource
+     * without copying it
+     *
+     * @return the textual representation of the bare jid
+     */
+    std::string_view bare_view() const {
+        return std::string_view(buffer).substr(0, domain_end);
+    };
+
+    /**
+     * get the textual representation of a jabberid without copying it
+     *
+     * @return the textual representation
+     */
+    std::string_view full_view() const { return buffer; };
+
+    /**
+     * calculate a hash value of a jabberid
+     *
+     * @param include_resource true if the resource should be part of the hash
+     * @return the hash value
+     */
+    size_t hash(bool include_resource = true) const {
+        return std::hash<std::string_view>()(include_resource ? full_view()
+                                                              : bare_view());
+    };
 
     /**
      * compare jabberid instance with another instance
@@ -109,7 +186,7 @@ class jabberid {
      * @return true if both jabberid instances represent the same JIDs, false
      * else
      */
-    bool operator==(const jabberid &otherjid);
+    bool operator==(const jabberid &otherjid) const;
 
     /**
      * compare some parts of two jabberid instances
@@ -121,7 +198,7 @@ class jabberid {
      * @return true if the compared parts of the jabberid instances are matching
      */
     bool compare(const jabberid &otherjid, bool compare_resource = false,
-                 bool compare_node = true, bool compare_domain = true);
+                 bool compare_node = true, bool compare_domain = true) const;
 
     /**
      * get a copy of the jid without the resource
@@ -129,36 +206,49 @@ class jabberid {
      * @return new jabberid instance representing the same jabberid but without
      * resource
      */
-    jabberid get_user();
+    jabberid get_user() const;
 
     /**
      * get the textual representation of a jabberid
      *
      * @return the textual representation
      */
-    Glib::ustring full();
+    Glib::ustring full() const { return buffer; };
 
   private:
     /**
-     * node part of the JID (the part before the @ sign)
+     * rebuild the buffer from already prepared parts
      *
-     * empty string of no node
+     * @param node the prepared node, empty for no node
+     * @param domain the prepared and interned domain
+     * @param resource the prepared resource, empty for no resource
      */
-    Glib::ustring node;
+    void assign(std::string_view node,
+                std::shared_ptr<const Glib::ustring> domain,
+                std::string_view resource);
 
     /**
-     * domain part of the JID
-     *
-     * there must always be a domain part in a JID
+     * textual representation of the JID (node@domain/resource)
+     */
+    std::string buffer;
+
+    /**
+     * offset of the domain in the buffer (0 if there is no node)
+     */
+    std::string::size_type domain_start;
+
+    /**
+     * offset of the end of the domain in the buffer (length of the buffer if
+     * there is no resource)
      */
-    Glib::ustring domain;
+    std::string::size_type domain_end;
 
     /**
-     * resource part of the JID
+     * domain part of the JID (interned)
      *
-     * empty strong for no resource
+     * there must always be a domain part in a JID
      */
-    Glib::ustring resource;
+    std::shared_ptr<const Glib::ustring> domain;
 };
 
 /**
@@ -177,6 +267,15 @@ class jabberid_pool : public jabberid {
      */
     jabberid_pool(const Glib::ustring &jid, ::pool p);
 
+    /**
+     * construct a jabberid_pool as a copy of an already prepared jabberid
+     *
+     * @param jid the jabberid to copy
+     * @param p the pool to assign
+     * @throws std::invalid_argument if the pool is NULL
+     */
+    jabberid_pool(const jabberid &jid, ::pool p);
+
     /**
      * get the textual representation of a jabberid (allocated in pooled memory
      *
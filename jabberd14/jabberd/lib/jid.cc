@@ -117,7 +117,9 @@ jid jid_user_pool(jid a, pool p) {
     if (!a || !p)
         return NULL;
 
-    return jid_new(p, a->get_user().full().c_str());
+    jid id = new xmppd::jabberid_pool(a->get_user(), p);
+    pool_cleanup(p, jid_pool_cleaner, id);
+    return id;
 }
 
 jid jid_user(jid a) { return jid_user_pool(a, a->get_pool()); }
@@ -133,7 +135,9 @@ jid jid_append(jid a, jid b) {
         if (jid_cmp(next, b) == 0)
             break;
         if (next->next == NULL) {
-            next->next = jid_new(a->get_pool(), jid_full(b));
+            next->next = new xmppd::jabberid_pool(
+                static_cast<const xmppd::jabberid &>(*b), a->get_pool());
+            pool_cleanup(a->get_pool(), jid_pool_cleaner, next->next);
             return a;
         }
         next = next->next;
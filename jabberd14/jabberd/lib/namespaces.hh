@@ -36,6 +36,7 @@
 #define NS_CLIENT "jabber:client"
 #define NS_SERVER "jabber:server"
 #define NS_DIALBACK "jabber:server:dialback"
+#define NS_DIALBACK_FEATURES "urn:xmpp:features:dialback"
 #define NS_COMPONENT_ACCEPT "jabber:component:accept"
 #define NS_AUTH "jabber:iq:auth"
 #define NS_AUTH_CRYPT "jabber:iq:auth:crypt"
@@ -105,6 +106,9 @@
 #define NS_JABBERD_XDBSQL                                                      \
     "http://jabberd.org/ns/xdbsql" /**< namespace for substitution in xdb_sql  \
                                       configuration */
+#define NS_JABBERD_XDBBATCH                                                    \
+    "http://jabberd.org/ns/xdbbatch" /**< namespace wrapping the results of    \
+                                        batched xdb get requests */
 #define NS_JABBERD_ACL                                                         \
     "http://jabberd.org/ns/acl" /**< namespace for access control lists */
 #define NS_JABBERD_LOOPCHECK                                                   \
@@ -156,6 +160,12 @@
 #define NS_JABBERD_CONFIG_XDBSQL                                               \
     "jabber:config:xdb_sql" /**< namepace of the xdb_sql component             \
                                configuration */
+#define NS_JABBERD_CONFIG_XDBSQLITE                                            \
+    "jabber:config:xdb_sqlite" /**< namespace of the xdb_sqlite component      \
+                                  configuration */
+#define NS_JABBERD_CONFIG_PROXY65                                              \
+    "http://xmppd.org/ns/proxy65" /**< namespace of the proxy65 component      \
+                                     configuration */
 #define NS_JABBERD_CONFIG_DYNAMICHOST                                          \
     "http://xmppd.org/ns/dynamichost" /**< namespace of the dynamic            \
                                          configuration of additional hosts for \
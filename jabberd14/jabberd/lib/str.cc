@@ -45,6 +45,15 @@
 #include <str.hh>
 
 #include <cstring>
+#include <ostream>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STR_HAVE_AVX2 /**< compile the AVX2 kernel, selected at runtime */
+#endif
+#endif
 
 /**
  * NULL pointer save version of strdup()
@@ -99,6 +108,10 @@ int j_strcmp(char const *a, char const *b) {
     if (a == NULL || b == NULL)
         return -1;
 
+    /* interned strings */
+    if (a == b)
+        return 0;
+
     while (*a == *b && *a != '\0' && *b != '\0') {
         a++;
         b++;
@@ -231,73 +244,214 @@ char *strunescape(pool p, char *buf) {
 }
 
 /**
- * escape a string to be print as XML
+ * check if a character has to be escaped in XML
  *
- * @param s the original string
- * @result the string with &, ', ", &lt; and > replaced with their entity
- * representation
+ * @param c the character to check
+ * @return true if c is one of &, ', ", &lt;, or >
  */
-std::string strescape(std::string s) {
-    // replace & with &amp;
-    for (std::string::size_type pos = s.find('&'); pos != std::string::npos;
-         pos = s.find('&', pos + 1)) {
-        s.insert(pos + 1, "amp;");
+static inline bool _strescape_needed(char c) {
+    return c == '&' || c == '\'' || c == '"' || c == '<' || c == '>';
+}
+
+/**
+ * find the first character in a string, that has to be escaped (scalar
+ * version)
+ *
+ * @param s the string to search in
+ * @param len length of the string
+ * @return offset of the first character to escape, len if there is none
+ */
+static size_t _strescape_span_scalar(char const *s, size_t len) {
+    size_t i = 0;
+    while (i < len && !_strescape_needed(s[i]))
+        i++;
+    return i;
+}
+
+#ifdef __SSE2__
+/**
+ * find the first character in a string, that has to be escaped (SSE2 version,
+ * checking 16 characters at once)
+ *
+ * @param s the string to search in
+ * @param len length of the string
+ * @return offset of the first character to escape, len if there is none
+ */
+static size_t _strescape_span_sse2(char const *s, size_t len) {
+    __m128i const amp = _mm_set1_epi8('&');
+    __m128i const apos = _mm_set1_epi8('\'');
+    __m128i const quot = _mm_set1_epi8('"');
+    __m128i const lt = _mm_set1_epi8('<');
+    __m128i const gt = _mm_set1_epi8('>');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i const chunk =
+            _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, amp),
+                                     _mm_cmpeq_epi8(chunk, apos));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, quot));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, lt));
+        found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, gt));
+        int const mask = _mm_movemask_epi8(found);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
     }
 
-    // replace ' with &apos;
-    for (std::string::size_type pos = s.find('\''); pos != std::string::npos;
-         pos = s.find('\'', pos + 1)) {
-        s.replace(pos, 1, "&apos;");
+    return i + _strescape_span_scalar(s + i, len - i);
+}
+#endif
+
+#ifdef STR_HAVE_AVX2
+/**
+ * find the first character in a string, that has to be escaped (AVX2 version,
+ * checking 32 characters at once)
+ *
+ * @param s the string to search in
+ * @param len length of the string
+ * @return offset of the first character to escape, len if there is none
+ */
+__attribute__((target("avx2"))) static size_t
+_strescape_span_avx2(char const *s, size_t len) {
+    __m256i const amp = _mm256_set1_epi8('&');
+    __m256i const apos = _mm256_set1_epi8('\'');
+    __m256i const quot = _mm256_set1_epi8('"');
+    __m256i const lt = _mm256_set1_epi8('<');
+    __m256i const gt = _mm256_set1_epi8('>');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i const chunk =
+            _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp),
+                                        _mm256_cmpeq_epi8(chunk, apos));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, quot));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, lt));
+        found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, gt));
+        unsigned const mask =
+            static_cast<unsigned>(_mm256_movemask_epi8(found));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
     }
 
-    // replace " with &quot;
-    for (std::string::size_type pos = s.find('"'); pos != std::string::npos;
-         pos = s.find('"', pos + 1)) {
-        s.replace(pos, 1, "&quot;");
+    return i + _strescape_span_sse2(s + i, len - i);
+}
+#endif
+
+/**
+ * select the fastest version of _strescape_span() the CPU supports
+ */
+static size_t _strescape_span_select(char const *s, size_t len);
+
+/**
+ * find the first character in a string, that has to be escaped
+ *
+ * Points to the version of the function, that is best for the CPU we are
+ * running on. (Selected on the first call.)
+ */
+static size_t (*_strescape_span)(char const *s,
+                                 size_t len) = _strescape_span_select;
+
+static size_t _strescape_span_select(char const *s, size_t len) {
+#if defined(STR_HAVE_AVX2)
+    __builtin_cpu_init();
+    _strescape_span = __builtin_cpu_supports("avx2") ? _strescape_span_avx2
+                                                     : _strescape_span_sse2;
+#elif defined(__SSE2__)
+    _strescape_span = _strescape_span_sse2;
+#else
+    _strescape_span = _strescape_span_scalar;
+#endif
+    return _strescape_span(s, len);
+}
+
+/**
+ * get the entity representation of a character, that has to be escaped
+ *
+ * @param c the character (one of &, ', ", &lt;, or >)
+ * @return the entity for the character
+ */
+static inline char const *_strescape_entity(char c) {
+    switch (c) {
+        case '&':
+            return "&amp;";
+        case '\'':
+            return "&apos;";
+        case '"':
+            return "&quot;";
+        case '<':
+            return "&lt;";
+        default:
+            return "&gt;";
     }
+}
 
-    // replace < with &lt;
-    for (std::string::size_type pos = s.find('<'); pos != std::string::npos;
-         pos = s.find('<', pos + 1)) {
-        s.replace(pos, 1, "&lt;");
+/**
+ * escape a string to be print as XML
+ *
+ * @param s the original string
+ * @result the string with &, ', ", &lt; and > replaced with their entity
+ * representation
+ */
+std::string strescape(std::string s) {
+    std::string::size_type pos = _strescape_span(s.data(), s.length());
+
+    // nothing to escape?
+    if (pos == s.length())
+        return s;
+
+    std::string result;
+    result.reserve(s.length() + s.length() / 8 + 8);
+    result.append(s, 0, pos);
+    while (pos < s.length()) {
+        result += _strescape_entity(s[pos++]);
+        std::string::size_type const span =
+            _strescape_span(s.data() + pos, s.length() - pos);
+        result.append(s, pos, span);
+        pos += span;
     }
 
-    // replace > with &gt;
-    for (std::string::size_type pos = s.find('>'); pos != std::string::npos;
-         pos = s.find('>', pos + 1)) {
-        s.replace(pos, 1, "&gt;");
+    return result;
+}
+
+/**
+ * write a string escaped for XML to a stream
+ *
+ * This does the same as strescape(std::string) without creating copies of
+ * the string.
+ *
+ * @param out the stream to write to
+ * @param s the string to escape (NULL is handled as the empty string)
+ * @return out
+ */
+std::ostream &strescape(std::ostream &out, char const *s) {
+    if (s == NULL)
+        return out;
+
+    size_t const len = std::strlen(s);
+    size_t pos = 0;
+    while (pos < len) {
+        size_t const span = _strescape_span(s + pos, len - pos);
+        out.write(s + pos, span);
+        pos += span;
+        if (pos < len)
+            out << _strescape_entity(s[pos++]);
     }
 
-    return s;
+    return out;
 }
 
 char *strescape(pool p, char *buf) {
-    int i, j, oldlen, newlen;
+    size_t i, j, oldlen, newlen;
     char *temp;
 
     if (p == NULL || buf == NULL)
         return (NULL);
 
     oldlen = newlen = strlen(buf);
-    for (i = 0; i < oldlen; i++) {
-        switch (buf[i]) {
-            case '&':
-                newlen += 5;
-                break;
-            case '\'':
-                newlen += 6;
-                break;
-            case '\"':
-                newlen += 6;
-                break;
-            case '<':
-                newlen += 4;
-                break;
-            case '>':
-                newlen += 4;
-                break;
-        }
-    }
+    for (i = _strescape_span(buf, oldlen); i < oldlen;
+         i += 1 + _strescape_span(buf + i + 1, oldlen - i - 1))
+        newlen += std::strlen(_strescape_entity(buf[i])) - 1;
 
     if (oldlen == newlen)
         return buf;
@@ -307,36 +461,163 @@ char *strescape(pool p, char *buf) {
     if (temp == NULL)
         return (NULL);
 
-    for (i = j = 0; i < oldlen; i++) {
-        switch (buf[i]) {
-            case '&':
-                memcpy(&temp[j], "&amp;", 5);
-                j += 5;
-                break;
-            case '\'':
-                memcpy(&temp[j], "&apos;", 6);
-                j += 6;
-                break;
-            case '\"':
-                memcpy(&temp[j], "&quot;", 6);
-                j += 6;
-                break;
-            case '<':
-                memcpy(&temp[j], "&lt;", 4);
-                j += 4;
-                break;
-            case '>':
-                memcpy(&temp[j], "&gt;", 4);
-                j += 4;
-                break;
-            default:
-                temp[j++] = buf[i];
+    for (i = j = 0; i < oldlen;) {
+        size_t const span = _strescape_span(buf + i, oldlen - i);
+        memcpy(&temp[j], &buf[i], span);
+        i += span;
+        j += span;
+        if (i < oldlen) {
+            char const *const entity = _strescape_entity(buf[i++]);
+            size_t const entity_len = std::strlen(entity);
+            memcpy(&temp[j], entity, entity_len);
+            j += entity_len;
         }
     }
     temp[j] = '\0';
     return temp;
 }
 
+/**
+ * find the first character in a string, that is not ASCII (scalar version)
+ *
+ * @param s the string to search in
+ * @param len length of the string
+ * @return offset of the first non-ASCII character, len if there is none
+ */
+static size_t _str_ascii_span_scalar(char const *s, size_t len) {
+    size_t i = 0;
+    while (i < len && (static_cast<unsigned char>(s[i]) & 0x80) == 0)
+        i++;
+    return i;
+}
+
+#ifdef __SSE2__
+/**
+ * find the first character in a string, that is not ASCII (SSE2 version,
+ * checking 16 characters at once)
+ *
+ * @param s the string to search in
+ * @param len length of the string
+ * @return offset of the first non-ASCII character, len if there is none
+ */
+static size_t _str_ascii_span_sse2(char const *s, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        int const mask = _mm_movemask_epi8(
+            _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + _str_ascii_span_scalar(s + i, len - i);
+}
+#endif
+
+#ifdef STR_HAVE_AVX2
+/**
+ * find the first character in a string, that is not ASCII (AVX2 version,
+ * checking 32 characters at once)
+ *
+ * @param s the string to search in
+ * @param len length of the string
+ * @return offset of the first non-ASCII character, len if there is none
+ */
+__attribute__((target("avx2"))) static size_t
+_str_ascii_span_avx2(char const *s, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        unsigned const mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i))));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + _str_ascii_span_sse2(s + i, len - i);
+}
+#endif
+
+/**
+ * select the fastest version of _str_ascii_span() the CPU supports
+ */
+static size_t _str_ascii_span_select(char const *s, size_t len);
+
+/**
+ * find the first character in a string, that is not ASCII
+ *
+ * Points to the version of the function, that is best for the CPU we are
+ * running on. (Selected on the first call.)
+ */
+static size_t (*_str_ascii_span)(char const *s,
+                                 size_t len) = _str_ascii_span_select;
+
+static size_t _str_ascii_span_select(char const *s, size_t len) {
+#if defined(STR_HAVE_AVX2)
+    __builtin_cpu_init();
+    _str_ascii_span = __builtin_cpu_supports("avx2") ? _str_ascii_span_avx2
+                                                     : _str_ascii_span_sse2;
+#elif defined(__SSE2__)
+    _str_ascii_span = _str_ascii_span_sse2;
+#else
+    _str_ascii_span = _str_ascii_span_scalar;
+#endif
+    return _str_ascii_span(s, len);
+}
+
+/**
+ * check if a string is valid UTF-8 (RFC 3629)
+ *
+ * Runs of ASCII characters are skipped in bulk, only the multi-byte sequences
+ * are checked one by one. Overlong encodings, surrogates and code points above
+ * U+10FFFF are rejected.
+ *
+ * @param s the string to check
+ * @param len length of the string
+ * @return true if the string is valid UTF-8
+ */
+bool j_utf8_valid(char const *s, size_t len) {
+    unsigned char const *p = reinterpret_cast<unsigned char const *>(s);
+    size_t i = 0;
+
+    if (s == NULL)
+        return false;
+
+    while ((i += _str_ascii_span(s + i, len - i)) < len) {
+        unsigned char const c = p[i];
+        unsigned char lower = 0x80;
+        unsigned char upper = 0xBF;
+        size_t follow;
+
+        if (c >= 0xC2 && c <= 0xDF) {
+            follow = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            follow = 2;
+            if (c == 0xE0)
+                lower = 0xA0; /* overlong */
+            else if (c == 0xED)
+                upper = 0x9F; /* surrogates */
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            follow = 3;
+            if (c == 0xF0)
+                lower = 0x90; /* overlong */
+            else if (c == 0xF4)
+                upper = 0x8F; /* above U+10FFFF */
+        } else {
+            return false;
+        }
+
+        if (len - i <= follow || p[i + 1] < lower || p[i + 1] > upper)
+            return false;
+        for (size_t f = 2; f <= follow; f++)
+            if ((p[i + f] & 0xC0) != 0x80)
+                return false;
+        i += follow + 1;
+    }
+
+    return true;
+}
+
 char *zonestr(char const *const file, int const line) {
     static char buff[64];
     snprintf(buff, sizeof(buff), "%s:%d", file, line);
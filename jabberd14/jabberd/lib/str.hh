@@ -32,6 +32,8 @@
 
 #include "pool.hh"
 
+#include <cstddef>
+#include <iosfwd>
 #include <locale>
 
 #define ZONE zonestr(__FILE__, __LINE__)
@@ -45,6 +47,7 @@ int j_strncmp(char const *a, char const *b, int i);
 int j_strncasecmp(char const *a, char const *b, int i);
 int j_strlen(char const *a);
 int j_atoi(char const *a, int def);
+bool j_utf8_valid(char const *s, size_t len);
 
 namespace xmppd {
 class to_lower {
@@ -60,5 +63,6 @@ private:
 char *strescape(pool p, char *buf); /* Escape <>&'" chars */
 char *strunescape(pool p, char *buf);
 std::string strescape(std::string s);
+std::ostream &strescape(std::ostream &out, char const *s);
 
 #endif // __STR_HH
@@ -0,0 +1,153 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file strbench.cc
+ * @brief microbenchmark of XML escaping and UTF-8 validation
+ *
+ * Compares strescape() and j_utf8_valid() with the byte by byte
+ * implementations they replaced. Not installed, run it from the build
+ * directory: ./strbench [rounds]
+ */
+
+#include "str.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <glibmm.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+/**
+ * the former implementation of strescape(), one pass for each character
+ *
+ * @param s the original string
+ * @return the escaped string
+ */
+static std::string strbench_strescape_legacy(std::string s) {
+    for (std::string::size_type pos = s.find('&'); pos != std::string::npos;
+         pos = s.find('&', pos + 1)) {
+        s.insert(pos + 1, "amp;");
+    }
+    for (std::string::size_type pos = s.find('\''); pos != std::string::npos;
+         pos = s.find('\'', pos + 1)) {
+        s.replace(pos, 1, "&apos;");
+    }
+    for (std::string::size_type pos = s.find('"'); pos != std::string::npos;
+         pos = s.find('"', pos + 1)) {
+        s.replace(pos, 1, "&quot;");
+    }
+    for (std::string::size_type pos = s.find('<'); pos != std::string::npos;
+         pos = s.find('<', pos + 1)) {
+        s.replace(pos, 1, "&lt;");
+    }
+    for (std::string::size_type pos = s.find('>'); pos != std::string::npos;
+         pos = s.find('>', pos + 1)) {
+        s.replace(pos, 1, "&gt;");
+    }
+    return s;
+}
+
+/**
+ * build a sample text by repeating a pattern
+ *
+ * @param pattern the pattern to repeat
+ * @param size minimum size of the sample
+ * @return the sample text
+ */
+static std::string strbench_sample(char const *pattern, size_t size) {
+    std::string sample;
+    sample.reserve(size + 64);
+    while (sample.length() < size)
+        sample += pattern;
+    return sample;
+}
+
+/**
+ * run a function repeatedly on a sample and print the throughput
+ *
+ * @param name name of the benchmarked function
+ * @param sample the sample to pass to the function
+ * @param rounds how often to call the function
+ * @param f the function, returning a value that is summed up (to keep the
+ * compiler from removing the calls)
+ */
+template <typename F>
+static void strbench_run(char const *name, std::string const &sample,
+                         int rounds, F f) {
+    size_t check = 0;
+    std::chrono::steady_clock::time_point const start =
+        std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+        check += f(sample);
+    std::chrono::duration<double> const elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    double const mb = static_cast<double>(sample.length()) * rounds / 1e6;
+    std::cout << "  " << std::left << std::setw(24) << name << std::right
+              << std::fixed << std::setprecision(1) << std::setw(10)
+              << mb / elapsed.count() << " MB/s  (" << check << ")"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    size_t const size = 1000000;
+    int const rounds = argc > 1 ? j_atoi(argv[1], 100) : 100;
+
+    struct {
+        char const *name;
+        char const *pattern;
+    } const samples[] = {
+        {"plain text", "The quick brown fox jumps over the lazy dog. "},
+        {"markup", "<a href=\"x\">Tom & 'Jerry'</a> "},
+        {"non-ASCII", "Gr\xc3\xbc\xc3\x9f" "e aus K\xc3\xb6ln \xe2\x82\xac "
+                      "\xf0\x9f\x98\x80 "},
+    };
+
+    std::cout << "strbench: " << rounds << " rounds of " << size / 1000
+              << " kB" << std::endl;
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        std::string const sample = strbench_sample(samples[i].pattern, size);
+        std::cout << samples[i].name << ":" << std::endl;
+
+        strbench_run("strescape (legacy)", sample, rounds,
+                     [](std::string const &s) {
+                         return strbench_strescape_legacy(s).length();
+                     });
+        strbench_run("strescape", sample, rounds, [](std::string const &s) {
+            return strescape(s).length();
+        });
+        strbench_run("ustring::validate", sample, rounds,
+                     [](std::string const &s) {
+                         Glib::ustring const u(s);
+                         return static_cast<size_t>(u.validate());
+                     });
+        strbench_run("j_utf8_valid", sample, rounds, [](std::string const &s) {
+            return static_cast<size_t>(j_utf8_valid(s.data(), s.length()));
+        });
+    }
+
+    return 0;
+}
@@ -30,7 +30,7 @@
 
 /**
  * @file xhash.cc
- * @brief implements a hashmap using STL containers
+ * @brief implements the C style API of the xhash hashmap
  */
 
 #include <xhash.hh>
@@ -38,25 +38,6 @@
 #include <namespaces.hh>
 #include <xmlnode.hh>
 
-namespace xmppd {
-template <class value_type>
-typename xmppd::xhash<value_type>::iterator
-xhash<value_type>::get_by_domain(std::string domainkey) {
-    while (true) {
-        typename xmppd::xhash<value_type>::iterator result =
-            xhash<value_type>::find(domainkey);
-        if (result != xhash<value_type>::end())
-            return result;
-
-        std::string::size_type dot_pos = domainkey.find(".");
-        if (dot_pos == std::string::npos)
-            return xhash<value_type>::find("*");
-
-        domainkey.erase(0, dot_pos + 1);
-    }
-}
-} // namespace xmppd
-
 /**
  * create a new xhash hash collection
  *
@@ -31,24 +31,236 @@
 #ifndef __XHASH_HH
 #define __XHASH_HH
 
-#include <unordered_map>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace xmppd {
 
 /**
- * a class implementing a hash with std::string as key and void* as value
+ * a class implementing a hash with std::string as key and value_type as value
  *
  * This is a replacement for the xht structure in older versions of jabberd14
  * and the xhash_...() functions are mapped to method calls on this object.
  *
- * @todo This dynamically maps to either a map or an unordered_map if available.
- * This depends on a test made in the configure script. But we should not depend
- * on definitions in config.h (i.e. definitions made by the configure script) in
- * files we do install. This should be fixed before this code gets released.
+ * The hash uses open addressing with linear probing on a flat array of slots.
+ * Each slot stores the hash of its key and a pointer to the entry, so that
+ * probing only compares keys if the hashes match, and entries do not move
+ * when the table grows. Keys are looked up as std::string_view, so no
+ * temporary strings are created for lookups.
+ *
+ * Removed entries leave a marker in their slot, entries are never moved by a
+ * removal. Therefore removing the current entry while iterating is safe.
  */
-template <class value_type>
-class xhash : public std::unordered_map<std::string, value_type> {
+template <class value_type> class xhash {
+  public:
+    /**
+     * type of the entries in the hash (key and value)
+     */
+    typedef std::pair<const std::string, value_type> entry_type;
+
+  private:
+    /**
+     * a slot in the table
+     *
+     * Empty slots have a NULL entry and a hash of 0, slots of removed entries
+     * have a NULL entry and a hash of 1.
+     */
+    struct slot {
+        size_t hash;       /**< hash of the key of the entry */
+        entry_type *entry; /**< the entry, NULL for unused slots */
+    };
+
   public:
+    /**
+     * iterator over the entries of the hash
+     */
+    template <class entry_ref_type> class basic_iterator {
+      public:
+        basic_iterator() : slots(NULL), index(0) {}
+        basic_iterator(std::vector<slot> const *slots, size_t index)
+            : slots(slots), index(index) {
+            skip_unused();
+        }
+        template <class other_type>
+        basic_iterator(basic_iterator<other_type> const &other)
+            : slots(other.slots), index(other.index) {}
+
+        entry_ref_type &operator*() const { return *(*slots)[index].entry; }
+        entry_ref_type *operator->() const { return (*slots)[index].entry; }
+        basic_iterator &operator++() {
+            index++;
+            skip_unused();
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator previous(*this);
+            ++*this;
+            return previous;
+        }
+        template <class other_type>
+        bool operator==(basic_iterator<other_type> const &other) const {
+            return index == other.index;
+        }
+        template <class other_type>
+        bool operator!=(basic_iterator<other_type> const &other) const {
+            return index != other.index;
+        }
+
+      private:
+        template <class other_type> friend class basic_iterator;
+
+        /**
+         * advance to the next used slot (or the end of the table)
+         */
+        void skip_unused() {
+            while (slots != NULL && index < slots->size() &&
+                   (*slots)[index].entry == NULL)
+                index++;
+        }
+
+        std::vector<slot> const *slots; /**< the slots of the hash */
+        size_t index; /**< index of the current slot */
+    };
+
+    typedef basic_iterator<entry_type> iterator;
+    typedef basic_iterator<entry_type const> const_iterator;
+
+    xhash() : used(0), removed(0) {}
+    xhash(xhash const &other) : used(0), removed(0) {
+        for (const_iterator p = other.begin(); p != other.end(); ++p)
+            (*this)[p->first] = p->second;
+    }
+    xhash &operator=(xhash const &other) {
+        if (this != &other) {
+            xhash copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+    ~xhash() { clear(); }
+
+    /**
+     * exchange the content of two hashes
+     *
+     * @param other the hash to exchange the content with
+     */
+    void swap(xhash &other) {
+        slots.swap(other.slots);
+        std::swap(used, other.used);
+        std::swap(removed, other.removed);
+    }
+
+    iterator begin() { return iterator(&slots, 0); }
+    iterator end() { return iterator(&slots, slots.size()); }
+    const_iterator begin() const { return const_iterator(&slots, 0); }
+    const_iterator end() const { return const_iterator(&slots, slots.size()); }
+
+    /**
+     * get the number of entries in the hash
+     *
+     * @return number of entries
+     */
+    size_t size() const { return used; }
+
+    /**
+     * check if the hash has no entries
+     *
+     * @return true if there are no entries in the hash
+     */
+    bool empty() const { return used == 0; }
+
+    /**
+     * find an entry in the hash
+     *
+     * @param key the key of the entry
+     * @return iterator to the entry, end() if there is no such entry
+     */
+    iterator find(std::string_view key) {
+        return iterator(&slots, lookup(key, hash_key(key)));
+    }
+
+    /**
+     * find an entry in the hash
+     *
+     * @param key the key of the entry
+     * @return iterator to the entry, end() if there is no such entry
+     */
+    const_iterator find(std::string_view key) const {
+        return const_iterator(&slots, lookup(key, hash_key(key)));
+    }
+
+    /**
+     * get the number of entries with a key (0 or 1)
+     *
+     * @param key the key to check
+     * @return 1 if there is an entry with this key, 0 else
+     */
+    size_t count(std::string_view key) const {
+        return lookup(key, hash_key(key)) < slots.size() ? 1 : 0;
+    }
+
+    /**
+     * access the value of an entry, the entry is created if it does not exist
+     *
+     * @param key the key of the entry
+     * @return reference to the value of the entry
+     */
+    value_type &operator[](std::string_view key) {
+        size_t hash = hash_key(key);
+        size_t index = lookup(key, hash);
+        if (index < slots.size())
+            return slots[index].entry->second;
+
+        // grow (or clean up removed slots) before adding
+        if ((used + removed + 1) * 4 > slots.size() * 3)
+            rehash(used + 1 > slots.size() / 2 ? slots.size() * 2
+                                               : slots.size());
+
+        index = probe_free(hash);
+        if (slots[index].hash == 1)
+            removed--;
+        slots[index].hash = hash;
+        slots[index].entry =
+            new entry_type(std::string(key.data(), key.length()), value_type());
+        used++;
+        return slots[index].entry->second;
+    }
+
+    /**
+     * remove an entry from the hash
+     *
+     * @param key the key of the entry
+     * @return number of removed entries (0 or 1)
+     */
+    size_t erase(std::string_view key) {
+        size_t index = lookup(key, hash_key(key));
+        if (index >= slots.size())
+            return 0;
+
+        delete slots[index].entry;
+        slots[index].entry = NULL;
+        slots[index].hash = 1;
+        used--;
+        removed++;
+        return 1;
+    }
+
+    /**
+     * remove all entries from the hash
+     */
+    void clear() {
+        for (typename std::vector<slot>::iterator p = slots.begin();
+             p != slots.end(); ++p)
+            delete p->entry;
+        slots.clear();
+        used = 0;
+        removed = 0;
+    }
+
     /**
      * get an entry from the hash but consider the key to be a domain
      *
@@ -60,7 +272,93 @@ class xhash : public std::unordered_map<std::string, value_type> {
      * @param domainkey the key that should be considered as a domain
      * @return iterator to the found value
      */
-    typename xhash<value_type>::iterator get_by_domain(std::string domainkey);
+    iterator get_by_domain(std::string_view domainkey) {
+        while (true) {
+            iterator result = find(domainkey);
+            if (result != end())
+                return result;
+
+            std::string_view::size_type dot_pos = domainkey.find('.');
+            if (dot_pos == std::string_view::npos)
+                return find("*");
+
+            domainkey.remove_prefix(dot_pos + 1);
+        }
+    }
+
+  private:
+    /**
+     * calculate the hash of a key
+     *
+     * The values 0 and 1 are reserved to mark unused slots.
+     *
+     * @param key the key
+     * @return the hash of the key
+     */
+    static size_t hash_key(std::string_view key) {
+        size_t hash = std::hash<std::string_view>()(key);
+        return hash > 1 ? hash : hash + 2;
+    }
+
+    /**
+     * find the slot of a key
+     *
+     * @param key the key to look up
+     * @param hash the hash of the key
+     * @return index of the slot, slots.size() if there is no such key
+     */
+    size_t lookup(std::string_view key, size_t hash) const {
+        if (used == 0)
+            return slots.size();
+
+        size_t mask = slots.size() - 1;
+        for (size_t index = hash & mask;; index = (index + 1) & mask) {
+            slot const &s = slots[index];
+            if (s.hash == 0)
+                return slots.size();
+            if (s.hash == hash && s.entry != NULL && s.entry->first == key)
+                return index;
+        }
+    }
+
+    /**
+     * find the slot where a new entry for a key is stored
+     *
+     * @param hash the hash of the key
+     * @return index of the first empty or removed slot for the hash
+     */
+    size_t probe_free(size_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t index = hash & mask;
+        while (slots[index].entry != NULL)
+            index = (index + 1) & mask;
+        return index;
+    }
+
+    /**
+     * rebuild the table with a new number of slots, dropping removed slots
+     *
+     * @param capacity the new number of slots (rounded up to a power of two)
+     */
+    void rehash(size_t capacity) {
+        size_t new_size = 8;
+        while (new_size < capacity)
+            new_size *= 2;
+
+        std::vector<slot> old_slots(new_size, slot());
+        old_slots.swap(slots);
+        removed = 0;
+
+        for (typename std::vector<slot>::iterator p = old_slots.begin();
+             p != old_slots.end(); ++p) {
+            if (p->entry != NULL)
+                slots[probe_free(p->hash)] = *p;
+        }
+    }
+
+    std::vector<slot> slots; /**< the table (size is a power of two) */
+    size_t used;             /**< number of entries in the table */
+    size_t removed;          /**< number of slots of removed entries */
 };
 } // namespace xmppd
 
@@ -43,33 +43,360 @@
 #include <map>
 #include <sstream>
 #include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 
 //----[ internal types ]-------------------------------------------------------
 
+/**
+ * a node in an XML tree
+ *
+ * The fields are ordered by the node types, that need them: text nodes only
+ * allocate the fields up to ::name, attributes the fields up to ::firstchild,
+ * only elements allocate the whole structure. Fields behind the allocated
+ * size of a node must not be accessed, check the type first.
+ */
 struct xmlnode_t {
-    char *name;          /**< local name of the xmlnode */
-    char *prefix;        /**< namespace prefix for this xmlnode */
-    char *ns_iri;        /**< namespace IRI for this xmlnode */
     unsigned short type; /**< type of the xmlnode, one of ::NTYPE_TAG,
                             ::NTYPE_ATTRIB, ::NTYPE_CDATA, or ::NTYPE_UNDEF */
+    int data_sz; /**< length of the data in the xmlnode */
     char *data;  /**< data of the xmlnode, for attributes this is the value, for
                     text nodes this is the text */
-    int data_sz; /**< length of the data in the xmlnode */
-                 /*     int                 complete; */
     pool p; /**< memory pool used by this xmlnode (the same as for all other
                xmlnode in a tree) */
     struct xmlnode_t
         *parent; /**< parent node for this node, or NULL for the root element */
+    struct xmlnode_t *prev; /**< previous sibling */
+    struct xmlnode_t *next; /**< next sibling */
+
+    /* not allocated for text nodes */
+    char const *name;   /**< local name of the xmlnode (interned if
+                           possible) */
+    char const *prefix; /**< namespace prefix for this xmlnode (interned if
+                           possible) */
+    char const *ns_iri; /**< namespace IRI for this xmlnode (interned if
+                           possible) */
+
+    /* only allocated for elements */
     struct xmlnode_t *firstchild; /**< first child element of this node, or NULL
                                      for no child elements */
     struct xmlnode_t *lastchild;  /**< last child element of this node, or NULL
                                      for no child elements */
-    struct xmlnode_t *prev;       /**< previous sibling */
-    struct xmlnode_t *next;       /**< next sibling */
     struct xmlnode_t *firstattrib; /**< first attribute node of this node */
     struct xmlnode_t *lastattrib;  /**< last attribute node of this node */
+    char const *raw; /**< the element as it has been received, only set on
+                        root elements, cleared when the tree is modified */
+};
+
+/** bytes allocated for a text node */
+#define XMLNODE_SIZE_CDATA offsetof(struct xmlnode_t, name)
+
+/** bytes allocated for an attribute node */
+#define XMLNODE_SIZE_ATTRIB offsetof(struct xmlnode_t, firstchild)
+
+/** bytes allocated for an element node */
+#define XMLNODE_SIZE_TAG sizeof(struct xmlnode_t)
+
+/**
+ * check if a node is an element (and has the fields of elements allocated)
+ *
+ * @param node the node to check
+ * @return true if node is an element
+ */
+static inline bool _xmlnode_is_tag(xmlnode_t const *node) {
+    return node != NULL && node->type == NTYPE_TAG;
+}
+
+/**
+ * note that a tree has been modified, the received form of the tree cannot be
+ * used anymore
+ *
+ * @param node the node, that has been modified
+ */
+static inline void _xmlnode_modified(xmlnode node) {
+    if (node == NULL)
+        return;
+
+    while (node->parent != NULL)
+        node = node->parent;
+
+    if (_xmlnode_is_tag(node))
+        node->raw = NULL;
+}
+
+//----[ interned strings ]-----------------------------------------------------
+
+/** longest string that gets interned */
+#define XMLNODE_INTERN_MAXLEN 128
+
+/** maximum number of strings in the intern table (including the defaults) */
+#define XMLNODE_INTERN_MAXENTRIES 4096
+
+/**
+ * key in the intern table: a string, that does not need to be zero terminated
+ */
+typedef struct xmlnode_intern_key_struct {
+    char const *str; /**< the string */
+    size_t len;      /**< length of the string */
+} _xmlnode_intern_key;
+
+/**
+ * hash function for strings (FNV-1a), used by the intern table and the path
+ * cache
+ *
+ * The 64 bit parameters are used where size_t has 64 bits, so that the upper
+ * half of the hash is mixed as well.
+ */
+struct xmlnode_string_hash {
+    size_t operator()(_xmlnode_intern_key const &key) const {
+        return hash(key.str, key.len);
+    }
+
+    size_t operator()(char const *str) const {
+        return hash(str, std::strlen(str));
+    }
+
+  private:
+    static size_t hash(char const *str, size_t len) {
+        size_t const prime = sizeof(size_t) >= 8
+                                 ? static_cast<size_t>(1099511628211ULL)
+                                 : static_cast<size_t>(16777619UL);
+        size_t hash = sizeof(size_t) >= 8
+                          ? static_cast<size_t>(14695981039346656037ULL)
+                          : static_cast<size_t>(2166136261UL);
+        for (size_t i = 0; i < len; i++) {
+            hash ^= static_cast<unsigned char>(str[i]);
+            hash *= prime;
+        }
+        return hash;
+    }
+};
+
+/**
+ * equality of keys in the intern table
+ */
+struct xmlnode_intern_equal {
+    bool operator()(_xmlnode_intern_key const &a,
+                    _xmlnode_intern_key const &b) const {
+        return a.len == b.len && std::memcmp(a.str, b.str, a.len) == 0;
+    }
 };
 
+/**
+ * strings, that are in the intern table from the start
+ *
+ * Names and namespaces used by nearly every stanza. As the namespace constants
+ * themselves are the canonical strings, code comparing with them can often
+ * compare pointers.
+ */
+static char const *const xmlnode_intern_defaults[] = {
+    // namespaces
+    NS_SERVER, NS_CLIENT, NS_COMPONENT_ACCEPT, NS_STREAM, NS_DIALBACK, NS_XMLNS,
+    NS_XML, NS_XMPP_STANZAS, NS_XMPP_STREAMS, NS_XMPP_TLS, NS_XMPP_SASL,
+    NS_SESSION, NS_ROSTER, NS_AUTH, NS_REGISTER, NS_OFFLINE, NS_DELAY,
+    NS_VERSION, NS_TIME, NS_VCARD, NS_PRIVATE, NS_LAST, NS_PRIVACY, NS_EVENT,
+    NS_XHTML, NS_DISCO_INFO, NS_DISCO_ITEMS, NS_DATA, NS_XMPP_PING,
+    NS_JABBERD_XDB, NS_JABBERD_WRAPPER, NS_JABBERD_STOREDPRESENCE,
+    // element names
+    "stream", "features", "message", "body", "subject", "thread", "presence",
+    "show", "status", "priority", "iq", "query", "error", "text", "x", "item",
+    "group", "result", "verify", "route", "xdb", "log", "session", "vCard",
+    "delay", "c", "html", "active", "composing", "paused", "inactive",
+    "starttls", "proceed", "mechanisms", "mechanism", "auth", "success",
+    "failure", "bind", "resource", "jid", "ping", "identity", "feature",
+    // attribute names and prefixes
+    "to", "from", "id", "type", "xmlns", "xml", "lang", "version", "name",
+    "subscription", "ask", "node", "code", "stamp", "hash", "ver", "ext",
+    "category", "var", "sc", "db", NULL};
+
+/**
+ * the table of interned strings
+ *
+ * Strings are never removed from this table. As jabberd14 uses cooperative
+ * threads only, no locking is needed.
+ */
+typedef std::unordered_set<_xmlnode_intern_key, xmlnode_string_hash,
+                           xmlnode_intern_equal>
+    xmlnode_intern_table;
+
+/**
+ * get the table of interned strings, initialize it on first use
+ *
+ * @return the intern table
+ */
+static xmlnode_intern_table &xmlnode_get_intern_table() {
+    static xmlnode_intern_table *table = NULL;
+
+    if (table == NULL) {
+        table = new xmlnode_intern_table(XMLNODE_INTERN_MAXENTRIES);
+        for (int i = 0; xmlnode_intern_defaults[i] != NULL; i++) {
+            _xmlnode_intern_key key = {xmlnode_intern_defaults[i],
+                                       strlen(xmlnode_intern_defaults[i])};
+            table->insert(key);
+        }
+    }
+    return *table;
+}
+
+/**
+ * get the canonical copy of a string, if the string is already interned
+ *
+ * Unlike xmlnode_intern() this does not add the string to the table. It is
+ * used for strings, that are not taken from received XML, so that they
+ * cannot fill the table.
+ *
+ * @param str the zero terminated string
+ * @return the canonical copy of the string, NULL if it is not interned
+ */
+static char const *_xmlnode_intern_lookup(char const *str) {
+    xmlnode_intern_table &table = xmlnode_get_intern_table();
+    _xmlnode_intern_key key = {str, std::strlen(str)};
+
+    xmlnode_intern_table::const_iterator entry = table.find(key);
+    return entry == table.end() ? NULL : entry->str;
+}
+
+/**
+ * get the canonical copy of a string
+ *
+ * Element names, namespace prefixes, and namespace IRIs are taken from a
+ * global table, so that nodes share them instead of keeping their own copies.
+ * New strings are added as long as the table is not full.
+ *
+ * @param str the string (does not need to be zero terminated)
+ * @param len the length of the string
+ * @return the canonical copy of the string, NULL if the string cannot be
+ * interned (too long or table full)
+ */
+char const *xmlnode_intern(char const *str, size_t len) {
+    xmlnode_intern_table &table = xmlnode_get_intern_table();
+    _xmlnode_intern_key key = {str, len};
+    xmlnode_intern_table::const_iterator entry;
+    char *copy = NULL;
+
+    if (str == NULL || len > XMLNODE_INTERN_MAXLEN)
+        return NULL;
+
+    entry = table.find(key);
+    if (entry != table.end())
+        return entry->str;
+
+    if (table.size() >= XMLNODE_INTERN_MAXENTRIES)
+        return NULL;
+
+    copy = new char[len + 1];
+    std::memcpy(copy, str, len);
+    copy[len] = '\0';
+    key.str = copy;
+    table.insert(key);
+    return copy;
+}
+
+/**
+ * get the canonical copy of a zero terminated string
+ *
+ * @param str the string
+ * @return the canonical copy of the string, NULL if the string cannot be
+ * interned (too long or table full)
+ */
+char const *xmlnode_intern(char const *str) {
+    return str == NULL ? NULL : xmlnode_intern(str, std::strlen(str));
+}
+
+/**
+ * get a string to be used as a name, prefix, or namespace IRI of a node
+ *
+ * @param p the memory pool to copy the string to, if it cannot be interned
+ * @param str the string (does not need to be zero terminated)
+ * @param len the length of the string
+ * @return the canonical copy of the string, or a copy in the memory pool
+ */
+static char const *_xmlnode_name_dup(pool p, char const *str, size_t len) {
+    char const *result = NULL;
+    char *copy = NULL;
+
+    if (str == NULL)
+        return NULL;
+
+    result = xmlnode_intern(str, len);
+    if (result != NULL)
+        return result;
+
+    copy = static_cast<char *>(pmalloco(p, len + 1));
+    std::memcpy(copy, str, len);
+    return copy;
+}
+
+/**
+ * get a string to be used as a name, prefix, or namespace IRI of a node
+ *
+ * @param p the memory pool to copy the string to, if it cannot be interned
+ * @param str the zero terminated string
+ * @return the canonical copy of the string, or a copy in the memory pool
+ */
+static char const *_xmlnode_name_dup(pool p, char const *str) {
+    return str == NULL ? NULL : _xmlnode_name_dup(p, str, std::strlen(str));
+}
+
+//----[ compiled paths ]-------------------------------------------------------
+
+/** maximum number of compiled paths kept by xmlnode_get_tags() */
+#define XMLNODE_PATH_CACHE_MAXENTRIES 1024
+
+#define XMLNODE_PATH_AXIS_CHILD 0     /**< step in the child axis */
+#define XMLNODE_PATH_AXIS_PARENT 1    /**< step in the parent axis */
+#define XMLNODE_PATH_AXIS_ATTRIBUTE 2 /**< step in the attribute axis */
+
+#define XMLNODE_PATH_TEST_NAME 0 /**< step matches nodes by name */
+#define XMLNODE_PATH_TEST_ANY 1  /**< step matches any node ('*') */
+#define XMLNODE_PATH_TEST_TEXT 2 /**< step matches text nodes ('text()') */
+
+/**
+ * a single step of a compiled path
+ */
+typedef struct xmlnode_path_step_struct {
+    int axis;        /**< axis of the step, one of XMLNODE_PATH_AXIS_* */
+    int test;        /**< what the step matches, one of XMLNODE_PATH_TEST_* */
+    bool has_prefix; /**< if the node test has a namespace prefix */
+    std::string prefix;      /**< namespace prefix of the node test */
+    char const *name;        /**< local name of the node test */
+    std::string name_buffer; /**< storage of the local name */
+    bool has_predicate;       /**< if the step has a predicate */
+    bool predicate_supported; /**< if we support the predicate */
+    bool attrib_has_prefix;   /**< if the attribute in the predicate has a
+                                 namespace prefix */
+    std::string attrib_prefix;      /**< namespace prefix of the attribute */
+    char const *attrib_name;        /**< local name of the attribute */
+    std::string attrib_name_buffer; /**< storage of the attribute name */
+    bool attrib_value_present; /**< if the value of the attribute is checked */
+    std::string attrib_value;  /**< value the attribute has to have */
+} _xmlnode_path_step;
+
+/**
+ * a compiled path, as used by xmlnode_get_tags()
+ */
+struct xmlnode_path_struct {
+    std::string path; /**< the path as string */
+    bool invalid;     /**< if the path has syntax errors (never matches) */
+    std::vector<_xmlnode_path_step> steps; /**< the steps of the path */
+};
+
+/**
+ * equality of zero terminated strings
+ */
+struct xmlnode_cstring_equal {
+    bool operator()(char const *a, char const *b) const {
+        return std::strcmp(a, b) == 0;
+    }
+};
+
+/**
+ * cache of compiled paths (key points to the path inside the compiled path)
+ */
+typedef std::unordered_map<char const *, xmlnode_path, xmlnode_string_hash,
+                           xmlnode_cstring_equal>
+    xmlnode_path_cache;
+
 //-----------------------------------------------------------------------------
 
 #ifdef POOL_DEBUG
@@ -109,14 +436,16 @@ static xmlnode _xmlnode_new(pool p, const char *name, const char *prefix,
         p = pool_heap(1 * 1024);
     }
 
-    /* Allocate & zero memory */
-    result = (xmlnode)pmalloco(p, sizeof(_xmlnode));
+    /* Allocate & zero memory, only what is used for this type of node */
+    result = (xmlnode)pmalloco(p, type == NTYPE_TAG      ? XMLNODE_SIZE_TAG
+                                  : type == NTYPE_ATTRIB ? XMLNODE_SIZE_ATTRIB
+                                                         : XMLNODE_SIZE_CDATA);
 
     /* Initialize fields */
     if (type != NTYPE_CDATA) {
-        result->name = pstrdup(p, name);
-        result->prefix = pstrdup(p, prefix);
-        result->ns_iri = pstrdup(p, ns_iri);
+        result->name = _xmlnode_name_dup(p, name);
+        result->prefix = _xmlnode_name_dup(p, prefix);
+        result->ns_iri = _xmlnode_name_dup(p, ns_iri);
     }
     result->type = type;
     result->p = p;
@@ -170,9 +499,11 @@ static xmlnode _xmlnode_insert(xmlnode parent, const char *name,
                                unsigned int type) {
     xmlnode result;
 
-    if (parent == NULL || (type != NTYPE_CDATA && name == NULL))
+    if (!_xmlnode_is_tag(parent) || (type != NTYPE_CDATA && name == NULL))
         return NULL;
 
+    _xmlnode_modified(parent);
+
     /* If parent->firstchild is NULL, simply create a new node for the first
      * child */
     if (parent->firstchild == NULL) {
@@ -286,7 +617,7 @@ static void _xmlnode_serialize(std::ostream &s, xmlnode_t const *x,
                                int ns_number = 0) {
     // print out NTYPE_CDATA?
     if (x->type == NTYPE_CDATA) {
-        s << strescape(xmlnode_get_data(const_cast<xmlnode>(x)));
+        strescape(s, xmlnode_get_data(const_cast<xmlnode>(x)));
         return;
     }
 
@@ -299,8 +630,8 @@ static void _xmlnode_serialize(std::ostream &s, xmlnode_t const *x,
         }
 
         // print local name and value
-        s << x->name << "='"
-          << strescape(xmlnode_get_data(const_cast<xmlnode>(x))) << "'";
+        s << x->name << "='";
+        strescape(s, xmlnode_get_data(const_cast<xmlnode>(x))) << "'";
 
         // we are done with the attribute
         return;
@@ -356,7 +687,8 @@ static void _xmlnode_serialize(std::ostream &s, xmlnode_t const *x,
                                          : ns_replace == 2 ? NS_COMPONENT_ACCEPT
                                                            : NS_SERVER;
             }
-            s << " xmlns='" << strescape(ns_iri) << "'";
+            s << " xmlns='";
+            strescape(s, ns_iri) << "'";
             nslist.update("", x->ns_iri ? x->ns_iri : "");
         }
     }
@@ -387,8 +719,8 @@ static void _xmlnode_serialize(std::ostream &s, xmlnode_t const *x,
                 } else {
                     ns << "ns" << ns_number++;
                 }
-                s << " xmlns:" << ns.str() << "='" << strescape(cur->ns_iri)
-                  << "'";
+                s << " xmlns:" << ns.str() << "='";
+                strescape(s, cur->ns_iri) << "'";
                 nslist.update(ns.str(), cur->ns_iri);
             }
         }
@@ -435,7 +767,7 @@ static void _xmlnode_serialize(std::ostream &s, xmlnode_t const *x,
  * @return 1 if the node has attributes, 0 else
  */
 static int _xmlnode_has_attribs(xmlnode node) {
-    if ((node != NULL) && (node->firstattrib != NULL))
+    if (_xmlnode_is_tag(node) && (node->firstattrib != NULL))
         return 1;
     return 0;
 }
@@ -457,122 +789,171 @@ static int _xmlnode_get_datasz(xmlnode node) {
 }
 
 /**
- * helper function for xmlnode_get_tags()
- *
- * Appends xmlnode node, if the predicate matches. If there is a next_step, not
- * the xmlnode is added itself, but the result of an xmlnode_get_tags()
- * recursion is added
+ * get the compiled form of a path from the cache, compile and cache it if it
+ * is not cached yet
  *
- * @param result_first pointer to the pointer to the first list element of the
- * result (gets modified)
- * @param result_last pointer to the pointer to the first list element of the
- * result (gets modified)
- * @param node the node, that should be appended if there is no next_step, or
- * which should be the parent node for the next_step
- * @param _predicate the predicate for this step
- * @param next_step the next step for recursion
+ * @param path the path
+ * @return the compiled path, NULL if it is not cached and the cache is full
  */
-static void _xmlnode_append_if_predicate(xmlnode_vector &result_vector,
-                                         xmlnode node, char const *_predicate,
-                                         const char *next_step,
-                                         xht namespaces) {
-    /* sanity checks */
-    if (node == NULL || namespaces == NULL)
-        return;
+static xmlnode_path _xmlnode_path_cached(char const *path) {
+    static xmlnode_path_cache *cache = NULL;
+    xmlnode_path_cache::iterator entry;
+    xmlnode_path compiled = NULL;
 
-    /* check the predicate */
-    if (_predicate != NULL) {
-        char *attrib_ns_iri = NULL;
-        xmlnode iter = NULL;
-        int predicate_matched = 0;
+    if (cache == NULL)
+        cache = new xmlnode_path_cache();
 
-        /* we only support checking for attribute existence or attribute values
-         * for now */
-        if (_predicate[0] != '@') {
-            /* do not add, we do not support the predicate :-( */
-            return;
-        }
+    entry = cache->find(path);
+    if (entry != cache->end())
+        return entry->second;
 
-        /* skip the '@' */
-        _predicate++;
+    /* paths containing values might be constructed at runtime, do not let
+     * them grow the cache forever */
+    if (cache->size() >= XMLNODE_PATH_CACHE_MAXENTRIES)
+        return NULL;
 
-        /* make predicate a string, so we can better work with it */
-        std::string predicate(_predicate);
+    compiled = xmlnode_path_compile(path);
+    (*cache)[compiled->path.c_str()] = compiled;
+    return compiled;
+}
 
-        /* is there a value we have to match? */
-        std::string attrib_value;
-        std::string attrib_name;
-        bool attrib_value_present = false;
-        std::string::size_type pos = predicate.find("=");
-        if (pos != std::string::npos) {
-            attrib_value_present = true;
-            attrib_value = predicate.substr(pos + 1);
+/**
+ * check if the predicate of a step matches a node
+ *
+ * @param step the step
+ * @param node the node to check
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @return true if the predicate matches
+ */
+static bool _xmlnode_path_predicate(const _xmlnode_path_step &step,
+                                    xmlnode node, xht namespaces) {
+    char const *attrib_ns_iri = NULL;
+    xmlnode iter = NULL;
 
-            // remove quotes
-            attrib_value.erase(0, 1);
-            if (attrib_value.length() > 1)
-                attrib_value.erase(attrib_value.length() - 1);
+    /* we only support checking for attribute existence or attribute values
+     * for now */
+    if (!step.predicate_supported)
+        return false;
 
-            // get the name of the attribute (including the prefix for now)
-            attrib_name = predicate.substr(0, pos);
-        } else {
-            attrib_name = predicate;
+    // does the attribute have a namespace prefix?
+    if (step.attrib_has_prefix)
+        attrib_ns_iri = static_cast<char const *>(
+            xhash_get(namespaces, step.attrib_prefix.c_str()));
+
+    /* iterate over the attributes */
+    for (iter = xmlnode_get_firstattrib(node); iter != NULL;
+         iter = xmlnode_get_nextsibling(iter)) {
+        /* attribute differs in name? */
+        if (j_strcmp(step.attrib_name, iter->name) != 0) {
+            continue;
         }
 
-        // does the attribute have a namespace prefix?
-        pos = attrib_name.find(":");
-        if (pos != std::string::npos) {
-            attrib_ns_iri = static_cast<char *>(
-                xhash_get(namespaces, attrib_name.substr(0, pos).c_str()));
-            attrib_name.erase(0, pos + 1);
+        /* attribute differs in namespace IRI? */
+        if (j_strcmp(attrib_ns_iri, iter->ns_iri) != 0 &&
+            !(attrib_ns_iri == NULL && iter->ns_iri == NULL)) {
+            continue;
         }
 
-        /* iterate over the namespace attributes */
-        for (iter = xmlnode_get_firstattrib(node); iter != NULL;
-             iter = xmlnode_get_nextsibling(iter)) {
-            /* attribute differs in name? */
-            if (j_strcmp(attrib_name.c_str(), iter->name) != 0) {
-                continue;
-            }
+        /* we have to check the value and it differs */
+        if (step.attrib_value_present &&
+            j_strcmp(step.attrib_value.c_str(), xmlnode_get_data(iter)) != 0) {
+            continue;
+        }
 
-            /* attribute differs in namespace IRI? */
-            if (j_strcmp(attrib_ns_iri, iter->ns_iri) != 0 &&
-                !(attrib_ns_iri == NULL && iter->ns_iri == NULL)) {
-                continue;
-            }
+        /* predicate matches! */
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * evaluate a compiled path, starting at one of its steps
+ *
+ * @param path the compiled path
+ * @param step_index the step to start with
+ * @param context_node the node where to start the step
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @param result_vector where to add all matching nodes, NULL to stop at the
+ * first matching node
+ * @return the first matching node, NULL if no node matched
+ */
+static xmlnode _xmlnode_path_eval(xmlnode_path path, unsigned int step_index,
+                                  xmlnode context_node, xht namespaces,
+                                  xmlnode_vector *result_vector) {
+    const _xmlnode_path_step &step = path->steps[step_index];
+    bool last_step = step_index + 1 >= path->steps.size();
+    char const *ns_iri = NULL;
+    xmlnode first_match = NULL;
+    xmlnode iter = NULL;
+
+    /* check for the namespace IRI we have to match the node */
+    if (step.has_prefix) {
+        ns_iri = static_cast<char const *>(
+            xhash_get(namespaces, step.prefix.c_str()));
+    } else if (step.axis != XMLNODE_PATH_AXIS_ATTRIBUTE) {
+        ns_iri = static_cast<char const *>(xhash_get(namespaces, ""));
+    }
 
-            /* we have to check the value and it differs */
-            if (attrib_value_present &&
-                j_strcmp(attrib_value.c_str(), xmlnode_get_data(iter)) != 0) {
+    /* iterate over all nodes on the axis, checking if this step matches them */
+    for (iter = step.axis == XMLNODE_PATH_AXIS_CHILD
+                    ? xmlnode_get_firstchild(context_node)
+                    : step.axis == XMLNODE_PATH_AXIS_PARENT
+                          ? xmlnode_get_parent(context_node)
+                          : xmlnode_get_firstattrib(context_node);
+         iter != NULL;
+         iter = step.axis == XMLNODE_PATH_AXIS_PARENT
+                    ? NULL
+                    : xmlnode_get_nextsibling(iter)) {
+        xmlnode match = NULL;
+
+        if (step.test == XMLNODE_PATH_TEST_ANY) {
+            /* matching all nodes, match ns_iri if prefix has been specified */
+            if (step.has_prefix && (iter->type == NTYPE_CDATA ||
+                                    j_strcmp(ns_iri, iter->ns_iri) != 0)) {
                 continue;
             }
-
-            /* predicate matches! */
-            predicate_matched = 1;
-            break;
+        } else if (step.test == XMLNODE_PATH_TEST_TEXT) {
+            /* matching text node */
+            if (iter->type != NTYPE_CDATA)
+                continue;
+        } else if (iter->type == NTYPE_CDATA ||
+                   !((ns_iri == NULL && iter->ns_iri == NULL) ||
+                     j_strcmp(ns_iri, iter->ns_iri) == 0) ||
+                   j_strcmp(step.name, iter->name) != 0) {
+            /* not the element or attribute we are looking for */
+            continue;
         }
 
-        /* return without adding anything if the predicate did not match */
-        if (!predicate_matched)
-            return;
-    }
+        /* merge all text nodes, that are direct siblings with this one */
+        if (iter->type == NTYPE_CDATA)
+            _xmlnode_merge(iter);
 
-    /* when we are here: no predicate, or predicate matched */
+        /* check the predicate */
+        if (step.has_predicate &&
+            !_xmlnode_path_predicate(step, iter, namespaces))
+            continue;
 
-    /* if no next_step, than add the node to the list and return */
-    if (next_step == NULL) {
-        result_vector.push_back(node);
-        return;
-    }
+        if (last_step) {
+            /* add the node itself */
+            match = iter;
+            if (result_vector != NULL)
+                result_vector->push_back(iter);
+        } else {
+            /* there is a next step, we have to recurse */
+            match = _xmlnode_path_eval(path, step_index + 1, iter, namespaces,
+                                       result_vector);
+        }
 
-    /* there is a next_step, we have to recurse */
-    xmlnode_vector sub_result = xmlnode_get_tags(node, next_step, namespaces);
+        if (first_match == NULL)
+            first_match = match;
 
-    /* did we get a result we have to add? */
-    xmlnode_vector::iterator iter;
-    for (iter = sub_result.begin(); iter != sub_result.end(); ++iter) {
-        result_vector.push_back(*iter);
+        /* we are only interested in the first match? */
+        if (first_match != NULL && result_vector == NULL)
+            break;
     }
+
+    return first_match;
 }
 
 /* External routines */
@@ -722,7 +1103,7 @@ xmlnode xmlnode_insert_tag(xmlnode parent, const char *name) {
     const char *local_name = NULL;
     xmlnode result = NULL;
 
-    if (name == NULL)
+    if (!_xmlnode_is_tag(parent) || name == NULL)
         return NULL;
 
     local_name = strchr(name, ':');
@@ -735,9 +1116,8 @@ xmlnode xmlnode_insert_tag(xmlnode parent, const char *name) {
     result =
         _xmlnode_insert(parent, local_name, NULL, parent->ns_iri, NTYPE_TAG);
     if (result != NULL && local_name > name) {
-        result->prefix = static_cast<char *>(
-            pmalloco(xmlnode_pool(result), local_name - name));
-        snprintf(result->prefix, local_name - name, "%s", name);
+        result->prefix = _xmlnode_name_dup(xmlnode_pool(result), name,
+                                           local_name - name - 1);
     }
 
     return result;
@@ -767,7 +1147,7 @@ xmlnode xmlnode_insert_tag_ns(xmlnode parent, const char *name,
 
     /* for compatibility with xmlnode users not aware of our namespace handling
      */
-    if (parent != NULL && j_strcmp(parent->prefix, prefix) != 0) {
+    if (new_node != NULL && j_strcmp(parent->prefix, prefix) != 0) {
         if (prefix == NULL) {
             xmlnode_put_attrib_ns(new_node, "xmlns", NULL, NS_XMLNS, ns_iri);
         } else {
@@ -826,8 +1206,8 @@ xmlnode xmlnode_get_tag(xmlnode parent, const char *name) {
     char *str, *slash, *qmark, *equals;
     xmlnode step, ret;
 
-    if (parent == NULL || parent->firstchild == NULL || name == NULL ||
-        *name == '\0')
+    if (!_xmlnode_is_tag(parent) || parent->firstchild == NULL ||
+        name == NULL || *name == '\0')
         return NULL;
 
     if (strstr(name, "/") == NULL && strstr(name, "?") == NULL &&
@@ -921,7 +1301,197 @@ xmlnode xmlnode_get_tag(xmlnode parent, const char *name) {
 }
 
 /**
- * at all xmlnodes that match a path
+ * compile a path, so that it can be evaluated faster multiple times
+ *
+ * See xmlnode_get_tags() for the supported paths. Namespace prefixes are kept
+ * in the compiled path, they are resolved when the path is evaluated.
+ *
+ * @note xmlnode_get_tags() and xmlnode_get_first_tag() keep compiled versions
+ * of the paths they are called with, you only need this function for paths
+ * that are constructed at runtime
+ *
+ * @param path the path (xpath like syntax, but only a small subset)
+ * @return the compiled path, has to be freed using xmlnode_path_free()
+ */
+xmlnode_path xmlnode_path_compile(char const *path) {
+    xmlnode_path result = new _xmlnode_path();
+    std::string remaining = path ? path : "";
+
+    result->path = remaining;
+    result->invalid = false;
+
+    do {
+        _xmlnode_path_step step;
+
+        /* check if there is an axis */
+        step.axis = XMLNODE_PATH_AXIS_CHILD;
+        if (remaining.compare(0, 7, "child::") == 0) {
+            remaining.erase(0, 7);
+        } else if (remaining.compare(0, 8, "parent::") == 0) {
+            step.axis = XMLNODE_PATH_AXIS_PARENT;
+            remaining.erase(0, 8);
+        } else if (remaining.compare(0, 11, "attribute::") == 0) {
+            step.axis = XMLNODE_PATH_AXIS_ATTRIBUTE;
+            remaining.erase(0, 11);
+        }
+
+        /* separate this step from the next one, and check for a predicate in
+         * this step */
+        std::string::size_type start_predicate = remaining.find("[");
+        std::string::size_type start_next_step = remaining.find("/");
+        std::string this_step;
+        std::string next_step;
+        std::string predicate;
+        if (start_predicate == std::string::npos &&
+            start_next_step == std::string::npos) {
+            // there is neither a predicate nor a next step in the path
+            this_step = remaining;
+        } else if (start_predicate == std::string::npos ||
+                   (start_next_step != std::string::npos &&
+                    start_predicate > start_next_step)) {
+            this_step = remaining.substr(0, start_next_step);
+            next_step = remaining.substr(start_next_step + 1);
+        } else {
+            std::string::size_type end_predicate =
+                remaining.find("]", start_predicate);
+            if (end_predicate == std::string::npos) {
+                // error in predicate syntax, the path never matches
+                result->invalid = true;
+                break;
+            }
+
+            if (start_next_step != std::string::npos) {
+                if (start_next_step < end_predicate)
+                    start_next_step = remaining.find("/", end_predicate);
+                if (start_next_step != std::string::npos)
+                    next_step = remaining.substr(start_next_step + 1);
+            }
+
+            predicate = remaining.substr(start_predicate + 1,
+                                         end_predicate - start_predicate - 1);
+            this_step = remaining.substr(0, start_predicate);
+        }
+
+        /* namespace prefix the node has to match */
+        std::string::size_type end_prefix = this_step.find(":");
+        step.has_prefix = end_prefix != std::string::npos;
+        if (step.has_prefix) {
+            step.prefix = this_step.substr(0, end_prefix);
+            this_step.erase(0, end_prefix + 1);
+        }
+
+        /* what has to match? */
+        step.test = this_step == "*"        ? XMLNODE_PATH_TEST_ANY
+                    : this_step == "text()" ? XMLNODE_PATH_TEST_TEXT
+                                            : XMLNODE_PATH_TEST_NAME;
+        step.name_buffer = this_step;
+
+        /* the predicate */
+        step.has_predicate = predicate.length() > 0;
+        step.predicate_supported = step.has_predicate && predicate[0] == '@';
+        step.attrib_has_prefix = false;
+        step.attrib_value_present = false;
+        if (step.predicate_supported) {
+            /* skip the '@' */
+            predicate.erase(0, 1);
+
+            /* is there a value we have to match? */
+            std::string::size_type pos = predicate.find("=");
+            if (pos != std::string::npos) {
+                step.attrib_value_present = true;
+                step.attrib_value = predicate.substr(pos + 1);
+
+                // remove quotes
+                step.attrib_value.erase(0, 1);
+                if (step.attrib_value.length() > 1)
+                    step.attrib_value.erase(step.attrib_value.length() - 1);
+
+                // get the name of the attribute (including the prefix for now)
+                predicate.erase(pos);
+            }
+
+            // does the attribute have a namespace prefix?
+            pos = predicate.find(":");
+            if (pos != std::string::npos) {
+                step.attrib_has_prefix = true;
+                step.attrib_prefix = predicate.substr(0, pos);
+                predicate.erase(0, pos + 1);
+            }
+            step.attrib_name_buffer = predicate;
+        }
+
+        result->steps.push_back(step);
+        remaining = next_step;
+    } while (remaining.length() > 0);
+
+    /* names are compared using the interned strings if they are already
+     * interned, else using the buffers (which do not move anymore): paths are
+     * built at runtime (e.g. with attribute values), adding their names would
+     * fill the intern table */
+    std::vector<_xmlnode_path_step>::iterator iter;
+    for (iter = result->steps.begin(); iter != result->steps.end(); ++iter) {
+        iter->name = _xmlnode_intern_lookup(iter->name_buffer.c_str());
+        if (iter->name == NULL)
+            iter->name = iter->name_buffer.c_str();
+        iter->attrib_name =
+            _xmlnode_intern_lookup(iter->attrib_name_buffer.c_str());
+        if (iter->attrib_name == NULL)
+            iter->attrib_name = iter->attrib_name_buffer.c_str();
+    }
+
+    return result;
+}
+
+/**
+ * free a compiled path
+ *
+ * @param path the compiled path (as returned by xmlnode_path_compile())
+ */
+void xmlnode_path_free(xmlnode_path path) { delete path; }
+
+/**
+ * get all xmlnodes that match a compiled path
+ *
+ * @param path the compiled path
+ * @param context_node the xmlnode where to start the path
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @return the matching xmlnodes
+ */
+xmlnode_vector xmlnode_path_eval(xmlnode_path path, xmlnode context_node,
+                                 xht namespaces) {
+    xmlnode_vector result_vector;
+
+    /* sanity check */
+    if (path == NULL || path->invalid || context_node == NULL ||
+        namespaces == NULL)
+        return result_vector;
+
+    _xmlnode_path_eval(path, 0, context_node, namespaces, &result_vector);
+    return result_vector;
+}
+
+/**
+ * get the first xmlnode that matches a compiled path
+ *
+ * This does not construct a vector of results, and stops at the first match.
+ *
+ * @param path the compiled path
+ * @param context_node the xmlnode where to start the path
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @return the first matching xmlnode, NULL if no xmlnode matches
+ */
+xmlnode xmlnode_path_eval_first(xmlnode_path path, xmlnode context_node,
+                                xht namespaces) {
+    /* sanity check */
+    if (path == NULL || path->invalid || context_node == NULL ||
+        namespaces == NULL)
+        return NULL;
+
+    return _xmlnode_path_eval(path, 0, context_node, namespaces, NULL);
+}
+
+/**
+ * get all xmlnodes that match a path
  *
  * The valid paths are a very small subset of xpath.
  *
@@ -936,155 +1506,63 @@ xmlnode xmlnode_get_tag(xmlnode parent, const char *name) {
  * - foobar[\@attribute]
  * - *[\@attribute='value']
  *
+ * The path is compiled only the first time it is used (see
+ * xmlnode_path_compile()).
+ *
  * @param context_node the xmlnode where to start the path
  * @param path the path (xpath like syntax, but only a small subset)
  * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
- * @param p memory pool to use
- * @return first item in the list of xmlnodes, or NULL if no xmlnode matched the
- * path
+ * @return the matching xmlnodes
  */
-xmlnode_vector xmlnode_get_tags(xmlnode context_node, const char *_path,
+xmlnode_vector xmlnode_get_tags(xmlnode context_node, const char *path,
                                 xht namespaces) {
-    int axis = 0; /* 0 = child, 1 = parent, 2 = attribute */
-    char const *ns_iri = NULL;
     xmlnode_vector result_vector;
-    xmlnode iter = NULL;
+    xmlnode_path compiled = NULL;
 
     /* sanity check */
-    if (context_node == NULL || _path == NULL || namespaces == NULL)
-        return xmlnode_vector();
-
-    // make path a string we can better work with
-    std::string path = _path;
-
-    /* check if there is an axis */
-    if (path.substr(0, 7) == "child::") {
-        path.erase(0, 7);
-    } else if (path.substr(0, 8) == "parent::") {
-        axis = 1;
-        path.erase(0, 8);
-    } else if (path.substr(0, 11) == "attribute::") {
-        axis = 2;
-        path.erase(0, 11);
-    }
-
-    /* separate this step from the next one, and check for a predicate in this
-     * step */
-    std::string::size_type start_predicate = path.find("[");
-    std::string::size_type start_next_step = path.find("/");
-    std::string this_step;
-    std::string next_step;
-    std::string predicate;
-    if (start_predicate == std::string::npos &&
-        start_next_step == std::string::npos) {
-        // there is neither a predicate nor a next step in the path
-        this_step = path;
-    } else if (start_predicate == std::string::npos ||
-               (start_next_step != std::string::npos &&
-                start_predicate > start_next_step)) {
-        this_step = path.substr(0, start_next_step);
-        next_step = path.substr(start_next_step + 1);
-    } else {
-        std::string::size_type end_predicate = path.find("]", start_predicate);
-        if (end_predicate == std::string::npos) {
-            // error in predicate syntax, return empty vector
-            return xmlnode_vector();
-        }
-
-        if (start_next_step != std::string::npos) {
-            if (start_next_step < end_predicate)
-                start_next_step = path.find("/", end_predicate);
-            if (start_next_step != std::string::npos)
-                next_step = path.substr(start_next_step + 1);
-        }
-
-        predicate = path.substr(start_predicate + 1,
-                                end_predicate - start_predicate - 1);
-        this_step = path.substr(0, start_predicate);
-    }
-
-    /* check for the namespace IRI we have to match the node */
-    std::string::size_type end_prefix = this_step.find(":");
-    if (end_prefix == std::string::npos) {
-        // default prefix or NULL if axis is an attribute
-        ns_iri = axis == 2
-                     ? NULL
-                     : static_cast<const char *>(xhash_get(namespaces, ""));
-    } else {
-        ns_iri = static_cast<const char *>(
-            xhash_get(namespaces, this_step.substr(0, end_prefix).c_str()));
-        this_step.erase(0, end_prefix + 1);
-    }
+    if (context_node == NULL || path == NULL || namespaces == NULL)
+        return result_vector;
 
-    /* iterate over all child nodes, checking if this step matches them */
-    for (iter = axis == 0
-                    ? xmlnode_get_firstchild(context_node)
-                    : axis == 1
-                          ? xmlnode_get_parent(context_node)
-                          : axis == 2 ? xmlnode_get_firstattrib(context_node)
-                                      : NULL;
-         iter != NULL;
-         iter = axis == 0
-                    ? xmlnode_get_nextsibling(iter)
-                    : axis == 1
-                          ? NULL
-                          : axis == 2 ? xmlnode_get_nextsibling(iter) : NULL) {
-        if (this_step == "*") {
-            /* matching all nodes */
-
-            /* match ns_iri if prefix has been specified */
-            if (end_prefix != std::string::npos) {
-                if (iter->type == NTYPE_CDATA ||
-                    j_strcmp(ns_iri, iter->ns_iri) != 0) {
-                    continue;
-                }
-            }
-
-            /* merging if it is a text node */
-            if (iter->type == NTYPE_CDATA)
-                _xmlnode_merge(iter);
-
-            /* append to the result */
-            _xmlnode_append_if_predicate(
-                result_vector, iter,
-                predicate.length() > 0 ? predicate.c_str() : NULL,
-                next_step.length() > 0 ? next_step.c_str() : NULL, namespaces);
-
-            continue;
-        }
+    compiled = _xmlnode_path_cached(path);
+    if (compiled != NULL)
+        return xmlnode_path_eval(compiled, context_node, namespaces);
 
-        if (iter->type == NTYPE_CDATA && this_step == "text()") {
-            /* matching text node */
-
-            /* merge all text nodes, that are direct siblings with this one */
-            _xmlnode_merge(iter);
-
-            /* append to the result */
-            _xmlnode_append_if_predicate(
-                result_vector, iter,
-                predicate.length() > 0 ? predicate.c_str() : NULL,
-                next_step.length() > 0 ? next_step.c_str() : NULL, namespaces);
-
-            continue;
-        }
+    /* cache is full */
+    compiled = xmlnode_path_compile(path);
+    result_vector = xmlnode_path_eval(compiled, context_node, namespaces);
+    xmlnode_path_free(compiled);
+    return result_vector;
+}
 
-        if (iter->type != NTYPE_CDATA &&
-            ((ns_iri == NULL && iter->ns_iri == NULL) ||
-             j_strcmp(ns_iri, iter->ns_iri) == 0) &&
-            j_strcmp(this_step.c_str(), iter->name) == 0) {
-            /* matching element or attribute */
+/**
+ * get the first xmlnode that matches a path
+ *
+ * This is the same as xmlnode_get_list_item(xmlnode_get_tags(...), 0), but
+ * does not construct a vector of results, and stops at the first match.
+ *
+ * @param context_node the xmlnode where to start the path
+ * @param path the path (see xmlnode_get_tags())
+ * @param namespaces hashtable mapping namespace prefixes to namespace IRIs
+ * @return the first matching xmlnode, NULL if no xmlnode matches
+ */
+xmlnode xmlnode_get_first_tag(xmlnode context_node, char const *path,
+                              xht namespaces) {
+    xmlnode result = NULL;
+    xmlnode_path compiled = NULL;
 
-            /* append to the result */
-            _xmlnode_append_if_predicate(
-                result_vector, iter,
-                predicate.length() > 0 ? predicate.c_str() : NULL,
-                next_step.length() > 0 ? next_step.c_str() : NULL, namespaces);
+    /* sanity check */
+    if (context_node == NULL || path == NULL || namespaces == NULL)
+        return NULL;
 
-            continue;
-        }
-    }
+    compiled = _xmlnode_path_cached(path);
+    if (compiled != NULL)
+        return xmlnode_path_eval_first(compiled, context_node, namespaces);
 
-    return result_vector;
+    /* cache is full */
+    compiled = xmlnode_path_compile(path);
+    result = xmlnode_path_eval_first(compiled, context_node, namespaces);
+    xmlnode_path_free(compiled);
+    return result;
 }
 
 /**
@@ -1135,11 +1613,13 @@ char *xmlnode_get_list_item_data(const xmlnode_vector &first, unsigned int i) {
  */
 void xmlnode_change_namespace(xmlnode node, const char *ns_iri) {
     /* santiy check */
-    if (node == NULL)
+    if (!_xmlnode_is_tag(node))
         return;
 
+    _xmlnode_modified(node);
+
     /* update the namespace */
-    node->ns_iri = ns_iri ? pstrdup(xmlnode_pool(node), ns_iri) : NULL;
+    node->ns_iri = _xmlnode_name_dup(xmlnode_pool(node), ns_iri);
 
     /* is there an attribute declaring this namespace? */
     if (node->prefix == NULL) {
@@ -1164,7 +1644,7 @@ void xmlnode_change_namespace(xmlnode node, const char *ns_iri) {
 void xmlnode_put_attrib(xmlnode owner, const char *name, const char *value) {
     const char *local_name = NULL;
 
-    if (name == NULL)
+    if (!_xmlnode_is_tag(owner) || name == NULL)
         return;
 
     /* namespace declaration? */
@@ -1178,7 +1658,7 @@ void xmlnode_put_attrib(xmlnode owner, const char *name, const char *value) {
 
         /* namespace prefix of the tag? */
         if (j_strcmp(name + 6, owner->prefix) == 0) {
-            owner->ns_iri = pstrdup(owner->p, value);
+            owner->ns_iri = _xmlnode_name_dup(owner->p, value);
         }
         return xmlnode_put_attrib_ns(owner, name + 6, "xmlns", NS_XMLNS, value);
     }
@@ -1193,7 +1673,7 @@ void xmlnode_put_attrib(xmlnode owner, const char *name, const char *value) {
             value = NS_SERVER;
 
         if (owner->prefix == NULL) {
-            owner->ns_iri = pstrdup(owner->p, value);
+            owner->ns_iri = _xmlnode_name_dup(owner->p, value);
         }
         return xmlnode_put_attrib_ns(owner, name, NULL, NS_XMLNS, value);
     }
@@ -1225,7 +1705,7 @@ void xmlnode_put_attrib_ns(xmlnode owner, const char *name, const char *prefix,
                            const char *ns_iri, const char *value) {
     xmlnode attrib;
 
-    if (owner == NULL || name == NULL || value == NULL)
+    if (!_xmlnode_is_tag(owner) || name == NULL || value == NULL)
         return;
 
     /* 'jabber:client' and 'jabber:component:accept' are represented as
@@ -1235,6 +1715,8 @@ void xmlnode_put_attrib_ns(xmlnode owner, const char *name, const char *prefix,
     else if (j_strcmp(ns_iri, NS_COMPONENT_ACCEPT) == 0)
         ns_iri = NS_SERVER;
 
+    _xmlnode_modified(owner);
+
     /* If there are no existing attributs, allocate a new one to start
     the list */
     if (owner->firstattrib == NULL) {
@@ -1288,7 +1770,7 @@ char *xmlnode_get_attrib_ns(xmlnode owner, const char *name,
                             const char *ns_iri) {
     xmlnode attrib;
 
-    if (owner != NULL && owner->firstattrib != NULL) {
+    if (_xmlnode_is_tag(owner) && owner->firstattrib != NULL) {
         attrib =
             _xmlnode_search(owner->firstattrib, name, ns_iri, NTYPE_ATTRIB);
         if (attrib != NULL)
@@ -1307,13 +1789,13 @@ char *xmlnode_get_attrib_ns(xmlnode owner, const char *name,
  * @return attribute node
  */
 xmlnode xmlnode_get_firstattrib(xmlnode parent) {
-    if (parent != NULL)
+    if (_xmlnode_is_tag(parent))
         return parent->firstattrib;
     return NULL;
 }
 
 static xmlnode_t const *xmlnode_get_firstattrib_const(xmlnode_t const *parent) {
-    return parent ? parent->firstattrib : NULL;
+    return _xmlnode_is_tag(parent) ? parent->firstattrib : NULL;
 }
 
 /**
@@ -1326,13 +1808,13 @@ static xmlnode_t const *xmlnode_get_firstattrib_const(xmlnode_t const *parent) {
  * @return child node
  */
 xmlnode xmlnode_get_firstchild(xmlnode parent) {
-    if (parent != NULL)
+    if (_xmlnode_is_tag(parent))
         return parent->firstchild;
     return NULL;
 }
 
 static xmlnode_t const *xmlnode_get_firstchild_const(xmlnode_t const *parent) {
-    return parent ? parent->firstchild : NULL;
+    return _xmlnode_is_tag(parent) ? parent->firstchild : NULL;
 }
 
 /**
@@ -1345,7 +1827,7 @@ static xmlnode_t const *xmlnode_get_firstchild_const(xmlnode_t const *parent) {
  * @return last child node
  */
 xmlnode xmlnode_get_lastchild(xmlnode parent) {
-    if (parent != NULL)
+    if (_xmlnode_is_tag(parent))
         return parent->lastchild;
     return NULL;
 }
@@ -1409,11 +1891,12 @@ xmlnode xmlnode_get_parent(xmlnode node) {
  * @return name of the node
  */
 char *xmlnode_get_name(xmlnode node) {
-    if (node == NULL)
+    /* text nodes do not have a name */
+    if (node == NULL || node->type == NTYPE_CDATA)
         return NULL;
 
     if (node->prefix == NULL)
-        return node->name;
+        return const_cast<char *>(node->name);
 
     std::ostringstream result;
     result << node->prefix << ":" << node->name;
@@ -1427,7 +1910,8 @@ char *xmlnode_get_name(xmlnode node) {
  * @return the local name of the node
  */
 const char *xmlnode_get_localname(xmlnode node) {
-    if (node == NULL)
+    /* text nodes do not have a name */
+    if (node == NULL || node->type == NTYPE_CDATA)
         return NULL;
 
     return node->name;
@@ -1440,7 +1924,8 @@ const char *xmlnode_get_localname(xmlnode node) {
  * @return namespace IRI of the node
  */
 const char *xmlnode_get_namespace(xmlnode node) {
-    if (node == NULL)
+    /* text nodes do not have a name */
+    if (node == NULL || node->type == NTYPE_CDATA)
         return NULL;
     return node->ns_iri;
 }
@@ -1456,7 +1941,8 @@ const char *xmlnode_get_namespace(xmlnode node) {
  * @return namespace prefix of the node, NULL for the default prefix
  */
 const char *xmlnode_get_nsprefix(xmlnode node) {
-    if (node == NULL)
+    /* text nodes do not have a name */
+    if (node == NULL || node->type == NTYPE_CDATA)
         return NULL;
     return node->prefix;
 }
@@ -1505,7 +1991,7 @@ int xmlnode_get_type(xmlnode node) {
  * @return 1 if the node has childrens, 0 else
  */
 int xmlnode_has_children(xmlnode node) {
-    if ((node != NULL) && (node->firstchild != NULL))
+    if (_xmlnode_is_tag(node) && (node->firstchild != NULL))
         return 1;
     return 0;
 }
@@ -1536,6 +2022,7 @@ void xmlnode_hide(xmlnode child) {
         return;
 
     parent = child->parent;
+    _xmlnode_modified(parent);
 
     /* first fix up at the child level */
     _xmlnode_hide_sibling(child);
@@ -1582,12 +2069,14 @@ void xmlnode_hide_attrib_ns(xmlnode parent, const char *name,
                             const char *ns_iri) {
     xmlnode attrib;
 
-    if (parent == NULL || parent->firstattrib == NULL || name == NULL)
+    if (!_xmlnode_is_tag(parent) || parent->firstattrib == NULL ||
+        name == NULL)
         return;
 
     attrib = _xmlnode_search(parent->firstattrib, name, ns_iri, NTYPE_ATTRIB);
     if (attrib == NULL)
         return;
+    _xmlnode_modified(parent);
 
     /* first fix up at the child level */
     _xmlnode_hide_sibling(attrib);
@@ -1649,6 +2138,42 @@ char *xmlnode_serialize_string(xmlnode_t const *node,
     return pstrdup(xmlnode_pool(const_cast<xmlnode>(node)), s.str().c_str());
 }
 
+/**
+ * remember the serialization of a root element as it has been received
+ *
+ * The serialization is kept until the tree is modified using any of the
+ * xmlnode_* functions. It has to be in the namespace context of a stream with
+ * 'jabber:server' (or 'jabber:client', or 'jabber:component:accept') as the
+ * default namespace and must not use any other namespace prefix declared
+ * outside of the element.
+ *
+ * @param node the root element the serialization is for
+ * @param raw the serialization of the element
+ * @param len length of the serialization
+ */
+void xmlnode_set_raw(xmlnode node, char const *raw, size_t len) {
+    if (!_xmlnode_is_tag(node) || node->parent != NULL || raw == NULL)
+        return;
+
+    char *copy = static_cast<char *>(pmalloco(node->p, len + 1));
+    memcpy(copy, raw, len);
+    copy[len] = '\0';
+    node->raw = copy;
+}
+
+/**
+ * get the serialization of a root element as it has been received
+ *
+ * @param node the root element
+ * @return the serialization as it has been received, NULL if it is not known
+ * or the tree has been modified since
+ */
+char const *xmlnode_get_raw(xmlnode_t const *node) {
+    if (!_xmlnode_is_tag(node) || node->parent != NULL)
+        return NULL;
+    return node->raw;
+}
+
 /**
  * copy an element node as a child to an other node
  *
@@ -1659,7 +2184,7 @@ char *xmlnode_serialize_string(xmlnode_t const *node,
 xmlnode xmlnode_insert_tag_node(xmlnode parent, xmlnode node) {
     xmlnode child;
 
-    if (parent == NULL || node == NULL)
+    if (parent == NULL || !_xmlnode_is_tag(node))
         return NULL;
 
     child =
@@ -1710,7 +2235,7 @@ void xmlnode_insert_node(xmlnode parent, xmlnode node) {
 xmlnode xmlnode_dup(xmlnode x) {
     xmlnode x2;
 
-    if (x == NULL)
+    if (!_xmlnode_is_tag(x))
         return NULL;
 
     x2 = xmlnode_new_tag_ns(x->name, x->prefix, x->ns_iri);
@@ -1736,7 +2261,7 @@ xmlnode xmlnode_dup(xmlnode x) {
 xmlnode xmlnode_dup_pool(pool p, xmlnode x) {
     xmlnode x2;
 
-    if (x == NULL)
+    if (!_xmlnode_is_tag(x))
         return NULL;
 
     x2 = xmlnode_new_tag_pool_ns(p, x->name, x->prefix, x->ns_iri);
@@ -1779,8 +2304,7 @@ xmlnode xmlnode_wrap(xmlnode x, const char *wrapper) {
 
     if (local_name > wrapper) {
         result->prefix =
-            static_cast<char *>(pmalloco(result->p, local_name - wrapper));
-        snprintf(result->prefix, local_name - wrapper, "%s", wrapper);
+            _xmlnode_name_dup(result->p, wrapper, local_name - wrapper - 1);
     }
 
     return result;
@@ -1809,6 +2333,7 @@ xmlnode xmlnode_wrap_ns(xmlnode x, const char *name, const char *prefix,
     wrap = xmlnode_new_tag_pool_ns(x->p, name, prefix, ns_iri);
     if (wrap == NULL)
         return NULL;
+    _xmlnode_modified(x);
     wrap->firstchild = x;
     wrap->lastchild = x;
     x->parent = wrap;
@@ -1991,6 +2516,55 @@ ns_decl_list::ns_decl_list(const xmlnode node) {
     }
 }
 
+/**
+ * create a new scope of namespace declarations, that starts with the
+ * declarations of an other list
+ *
+ * The declarations of the other list are shared, not copied.
+ *
+ * @param other the list to start with
+ */
+ns_decl_list::ns_decl_list(const ns_decl_list &other) {
+    other.share();
+    shared = other.shared;
+}
+
+/**
+ * replace the declarations by the declarations of an other list
+ *
+ * The declarations of the other list are shared, not copied.
+ *
+ * @param other the list to take the declarations from
+ * @return this list
+ */
+ns_decl_list &ns_decl_list::operator=(const ns_decl_list &other) {
+    if (this != &other) {
+        other.share();
+        shared = other.shared;
+        own.clear();
+    }
+    return *this;
+}
+
+/**
+ * move the own declarations to the shared declarations, so that they can be
+ * shared with a copy of this list
+ */
+void ns_decl_list::share() const {
+    if (own.empty())
+        return;
+
+    std::shared_ptr<declarations> merged = std::make_shared<declarations>();
+    if (shared) {
+        merged->reserve(shared->size() + own.size());
+        merged->insert(merged->end(), shared->begin(), shared->end());
+    }
+    merged->insert(merged->end(), own.begin(), own.end());
+
+    shared = merged;
+    own.clear();
+}
+
 /**
  * add a declared prefix to the list of namespace prefix declarations
  *
@@ -1999,8 +2573,7 @@ ns_decl_list::ns_decl_list(const xmlnode node) {
  */
 void ns_decl_list::update(const std::string &prefix,
                           const std::string &ns_iri) {
-    std::pair<std::string, std::string> new_declaration(prefix, ns_iri);
-    push_back(new_declaration);
+    own.push_back(declaration(prefix, ns_iri));
 }
 
 /**
@@ -2009,10 +2582,28 @@ void ns_decl_list::update(const std::string &prefix,
  * @param prefix the prefix, that should get undeclared
  */
 void ns_decl_list::delete_last(const std::string &prefix) {
-    ns_decl_list::reverse_iterator p;
-    for (p = rbegin(); p != rend(); ++p) {
+    declarations::reverse_iterator p;
+    for (p = own.rbegin(); p != own.rend(); ++p) {
         if (p->first == prefix) {
-            erase((++p).base());
+            own.erase((++p).base());
+            return;
+        }
+    }
+
+    if (!shared)
+        return;
+
+    // the declaration is shared, take our own copy of the shared
+    // declarations before removing it
+    declarations::const_reverse_iterator s;
+    for (s = shared->rbegin(); s != shared->rend(); ++s) {
+        if (s->first == prefix) {
+            declarations::const_iterator found = (++s).base();
+            declarations copy(shared->begin(), found);
+            copy.insert(copy.end(), found + 1, shared->end());
+            copy.insert(copy.end(), own.begin(), own.end());
+            own.swap(copy);
+            shared.reset();
             return;
         }
     }
@@ -2040,9 +2631,9 @@ char const *ns_decl_list::get_nsprefix(const std::string &iri) const {
  */
 char const *ns_decl_list::get_nsprefix(const std::string &iri,
                                        bool accept_default_prefix) const {
-    ns_decl_list::const_reverse_iterator p;
-    // iterate on all list items backwards
-    for (p = rbegin(); p != rend(); ++p) {
+    declarations::const_reverse_iterator p;
+    // iterate on all list items backwards, own declarations are newer
+    for (p = own.rbegin(); p != own.rend(); ++p) {
         // is it the IRI we are looking for? if it's the default prefix, do we
         // accept it? isn't the prefix redeclared differently?
         if (p->second == iri && (accept_default_prefix || p->first != "") &&
@@ -2050,6 +2641,15 @@ char const *ns_decl_list::get_nsprefix(const std::string &iri,
             return p->first.c_str();
         }
     }
+    if (shared) {
+        for (p = shared->rbegin(); p != shared->rend(); ++p) {
+            if (p->second == iri &&
+                (accept_default_prefix || p->first != "") &&
+                check_prefix(p->first, iri)) {
+                return p->first.c_str();
+            }
+        }
+    }
 
     // namespace is not declared
     throw std::invalid_argument("Namespace currently not declared");
@@ -2064,12 +2664,19 @@ char const *ns_decl_list::get_nsprefix(const std::string &iri,
  * @throws std::invalid_argument if prefix is not bound to a namespace
  */
 char const *ns_decl_list::get_nsiri(const std::string &prefix) const {
-    ns_decl_list::const_reverse_iterator p;
-    for (p = rbegin(); p != rend(); ++p) {
+    declarations::const_reverse_iterator p;
+    for (p = own.rbegin(); p != own.rend(); ++p) {
         if (p->first == prefix) {
             return p->second.c_str();
         }
     }
+    if (shared) {
+        for (p = shared->rbegin(); p != shared->rend(); ++p) {
+            if (p->first == prefix) {
+                return p->second.c_str();
+            }
+        }
+    }
 
     // prefix is not bound
     throw std::invalid_argument("Namespace prefix not bound to a namespace");
@@ -2094,6 +2701,72 @@ bool ns_decl_list::check_prefix(const std::string &prefix,
         return false;
     }
 }
+
+/**
+ * split a name as reported by expat
+ *
+ * @param name the name as reported by expat (namespace IRI and local name
+ * separated by ::XMLNS_SEPARATOR, or the qualified name if expat could not
+ * expand the prefix)
+ * @param nslist list of currently declared namespace prefixes
+ * @param guessed_ns_iri namespace IRI to use for undeclared prefixes
+ * @param default_ns_iri namespace IRI to use for names without a prefix, that
+ * have not been expanded by expat
+ */
+expat_qname::expat_qname(char const *name, const ns_decl_list &nslist,
+                         char const *guessed_ns_iri,
+                         char const *default_ns_iri)
+    : ns_iri(NULL), prefix(NULL), local_name("") {
+    char const *separator = NULL;
+
+    if (name == NULL)
+        return;
+
+    separator = std::strchr(name, XMLNS_SEPARATOR);
+    if (separator != NULL) {
+        // expat found the namespace IRI for us (this should be the case for a
+        // correct stream)
+        ns_iri = xmlnode_intern(name, separator - name);
+        if (ns_iri == NULL) {
+            buffer.assign(name, separator - name);
+            ns_iri = buffer.c_str();
+        }
+        local_name = separator + 1;
+        try {
+            prefix = nslist.get_nsprefix(ns_iri);
+            if (*prefix == '\0')
+                prefix = NULL;
+        } catch (std::invalid_argument&) {
+        }
+        return;
+    }
+
+    // expat could not expand the prefix, it's not declared
+    //
+    // ... be liberal in what you accept ...
+    separator = std::strchr(name, ':');
+    if (separator == NULL) {
+        ns_iri = default_ns_iri;
+        local_name = name;
+        return;
+    }
+
+    // start with a guess
+    prefix = xmlnode_intern(name, separator - name);
+    if (prefix == NULL) {
+        buffer.assign(name, separator - name);
+        prefix = buffer.c_str();
+    }
+    local_name = separator + 1;
+    ns_iri = guessed_ns_iri;
+
+    // some well known prefixes (but they would have to be declared!)
+    if (std::strcmp(prefix, "stream") == 0) {
+        ns_iri = NS_STREAM;
+    } else if (std::strcmp(prefix, "db") == 0) {
+        ns_iri = NS_DIALBACK;
+    }
+}
 } // namespace xmppd
 
 #ifdef POOL_DEBUG
@@ -35,6 +35,7 @@
 #include "xhash.hh"
 
 #include <list>
+#include <memory>
 #include <vector>
 
 #define NTYPE_TAG 0    /**< xmlnode is an element (tag) */
@@ -49,17 +50,24 @@
            callbacks */
 
 typedef struct xmlnode_t _xmlnode, *xmlnode;
+typedef struct xmlnode_path_struct _xmlnode_path, *xmlnode_path;
 
 namespace xmppd {
 
 /**
  * This class represents and manages a list of bindings from namespace prefixes
  * to namespace IRIs
+ *
+ * Copies of a list share the declarations made before the copy (copy on
+ * write). Copying a list to open a new scope therefore does not copy the
+ * declarations, only declarations added to the copy are owned by it.
  */
-class ns_decl_list : private std::list<std::pair<std::string, std::string>> {
+class ns_decl_list {
   public:
     ns_decl_list();
     ns_decl_list(const xmlnode node);
+    ns_decl_list(const ns_decl_list &other);
+    ns_decl_list &operator=(const ns_decl_list &other);
     void update(const std::string &prefix, const std::string &ns_iri);
     void delete_last(const std::string &prefix);
     char const *get_nsprefix(const std::string &iri) const;
@@ -70,6 +78,36 @@ class ns_decl_list : private std::list<std::pair<std::string, std::string>> {
                       const std::string &ns_iri) const;
 
   private:
+    typedef std::pair<std::string, std::string> declaration;
+    typedef std::vector<declaration> declarations;
+
+    void share() const;
+
+    mutable std::shared_ptr<declarations const>
+        shared; /**< older declarations, shared with copies of the list */
+    mutable declarations own; /**< newer declarations, owned by this list */
+};
+
+/**
+ * This class splits a name as reported by expat into namespace IRI, prefix,
+ * and local name
+ *
+ * The namespace IRI and the prefix are interned (see xmlnode_intern()) if
+ * possible, the local name points into the name reported by expat. All three
+ * stay valid as long as the name, the namespace declarations, and this object
+ * are not changed.
+ */
+class expat_qname {
+  public:
+    expat_qname(char const *name, const ns_decl_list &nslist,
+                char const *guessed_ns_iri, char const *default_ns_iri);
+    char const *ns_iri;     /**< namespace IRI, NULL for none */
+    char const *prefix;     /**< namespace prefix, NULL for the default */
+    char const *local_name; /**< local name */
+
+  private:
+    std::string buffer; /**< copy of the namespace IRI or prefix, if it could
+                           not be interned */
 };
 
 } // namespace xmppd
@@ -84,6 +122,10 @@ class ns_decl_list : private std::list<std::pair<std::string, std::string>> {
  */
 typedef std::vector<xmlnode> xmlnode_vector;
 
+/* Interned names and namespace IRIs */
+char const *xmlnode_intern(char const *str);
+char const *xmlnode_intern(char const *str, size_t len);
+
 /* Node creation routines */
 xmlnode xmlnode_wrap(xmlnode x, const char *wrapper);
 xmlnode xmlnode_wrap_ns(xmlnode x, const char *name, const char *prefix,
@@ -120,10 +162,20 @@ xmlnode xmlnode_get_tag(xmlnode parent, char const *name);
 char *xmlnode_get_tag_data(xmlnode parent, char const *name);
 xmlnode_vector xmlnode_get_tags(xmlnode context_node, char const *path,
                                 xht namespaces);
+xmlnode xmlnode_get_first_tag(xmlnode context_node, char const *path,
+                              xht namespaces);
 xmlnode xmlnode_get_list_item(const xmlnode_vector &first, unsigned int i);
 char *xmlnode_get_list_item_data(const xmlnode_vector &first, unsigned int i);
 xmlnode xmlnode_select_by_lang(const xmlnode_vector &nodes, const char *lang);
 
+/* Compiled paths */
+xmlnode_path xmlnode_path_compile(char const *path);
+void xmlnode_path_free(xmlnode_path path);
+xmlnode_vector xmlnode_path_eval(xmlnode_path path, xmlnode context_node,
+                                 xht namespaces);
+xmlnode xmlnode_path_eval_first(xmlnode_path path, xmlnode context_node,
+                                xht namespaces);
+
 /* Attribute accessors */
 void xmlnode_put_attrib(xmlnode owner, const char *name, const char *value);
 void xmlnode_put_attrib_ns(xmlnode owner, const char *name, const char *prefix,
@@ -156,7 +208,11 @@ int xmlnode_has_children(xmlnode node);
 char *xmlnode_serialize_string(xmlnode_t const *node,
                                const xmppd::ns_decl_list &nslist,
                                int stream_type);
+void xmlnode_set_raw(xmlnode node, char const *raw, size_t len);
+char const *xmlnode_get_raw(xmlnode_t const *node);
 
+/* namespace IRIs of nodes are interned, this is a pointer comparison for the
+ * common namespaces (j_strcmp() compares pointers first) */
 #define NSCHECK(x, n) (j_strcmp(xmlnode_get_namespace(x), n) == 0)
 
 // TODO: the following actually is inside xhash.cc, but I cannot
@@ -91,53 +91,17 @@ struct streamerr_struct {
 static void _xstream_startElement(void *_xs, const char *name,
                                   const char **atts) {
     xstream xs = static_cast<xstream>(_xs);
-    std::string prefix;
-    std::string ns_iri;
-    std::string local_name;
-    std::string qname(name ? name : "");
 
-    // if we do not have a ns declaration list for the stanza yet create one by
-    // copying the root's ns_decl_list
+    // if we do not have a ns declaration list for the stanza yet create one,
+    // that shares the declarations of the root
     if (!xs->ns_stanza) {
         xs->ns_stanza = xs->ns_root ? new xmppd::ns_decl_list(*xs->ns_root)
                                     : new xmppd::ns_decl_list();
     }
 
-    // get prefix and local name of the element
-    std::string::size_type separator_pos = qname.find(XMLNS_SEPARATOR);
-    if (separator_pos != std::string::npos) {
-        ns_iri = qname.substr(0, separator_pos);
-        local_name = qname.substr(separator_pos + 1);
-        try {
-            // XXX do we need to care about the prefix at all?
-            prefix = xs->ns_stanza->get_nsprefix(ns_iri);
-        } catch (std::invalid_argument&) {
-        }
-    } else {
-        // expat could not expand the prefix, it's not declared
-        //
-        // ... be liberal in what you accept ...
-        //
-        // XXX do we really want to be?
-
-        // start with a guess
-        std::string::size_type colon_pos = qname.find(':');
-        if (colon_pos != std::string::npos) {
-            prefix = qname.substr(0, colon_pos);
-            local_name = qname.substr(colon_pos + 1);
-            ns_iri = "http://jabberd.org/ns/clue";
-
-            // some well known prefixes (but tehy would have to be declared!)
-            if (prefix == "stream") {
-                ns_iri = NS_STREAM;
-            } else if (prefix == "db") {
-                ns_iri = NS_DIALBACK;
-            }
-        } else {
-            local_name = qname;
-            ns_iri = NS_SERVER;
-        }
-    }
+    // get namespace, prefix, and local name of the element
+    xmppd::expat_qname qname(name, *xs->ns_stanza, "http://jabberd.org/ns/clue",
+                             NS_SERVER);
 
     /* if xstream is bad, get outa here */
     if (xs->status > XSTREAM_NODE)
@@ -147,9 +111,8 @@ static void _xstream_startElement(void *_xs, const char *name,
         pool p = pool_heap(
             5 *
             1024); /* 5k, typically 1-2k each plus copy of self and workspace */
-        xs->node = xmlnode_new_tag_pool_ns(p, local_name.c_str(),
-                                           prefix == "" ? NULL : prefix.c_str(),
-                                           ns_iri.c_str());
+        xs->node = xmlnode_new_tag_pool_ns(p, qname.local_name, qname.prefix,
+                                           qname.ns_iri);
         xmlnode_put_expat_attribs(xs->node, atts, *xs->ns_stanza);
 
         if (xs->status == XSTREAM_ROOT) {
@@ -201,8 +164,8 @@ static void _xstream_startElement(void *_xs, const char *name,
             xs->node = NULL;
         }
     } else {
-        xs->node = xmlnode_insert_tag_ns(xs->node, local_name.c_str(),
-                                         prefix.c_str(), ns_iri.c_str());
+        xs->node = xmlnode_insert_tag_ns(xs->node, qname.local_name,
+                                         qname.prefix, qname.ns_iri);
         xmlnode_put_expat_attribs(xs->node, atts, *xs->ns_stanza);
     }
 
@@ -234,10 +197,9 @@ static void _xstream_endElement(void *_xs, const char *name) {
         /* we are the top-most node, feed to the app who is responsible to
          * delete it */
         if (parent == NULL) {
-            /* we do not need the list of namespaces for the stanza anymore */
-            delete xs->ns_stanza;
-            xs->ns_stanza = NULL;
-
+            /* the list of namespaces for the stanza is kept for the next
+             * stanza, the declarations of this stanza go out of scope with the
+             * end of its elements */
             (xs->f)(XSTREAM_NODE, xs->node, xs->arg);
         }
 
@@ -278,7 +240,7 @@ static void _xstream_startNamespaceDecl(void *arg, const XML_Char *prefix,
                                         const XML_Char *iri) {
     xstream xs = static_cast<xstream>(arg);
 
-    // create a new ns_decl_list if necessary, and copy what namespaces we
+    // create a new ns_decl_list if necessary, that shares the namespaces we
     // already have on the root element
     if (!xs->ns_stanza) {
         xs->ns_stanza = xs->ns_root ? new xmppd::ns_decl_list(*xs->ns_root)
@@ -507,6 +507,7 @@ static mio _mio_accept(mio m) {
     newm->peer_ip = pstrdup(newm->p, addr_str);
     newm->peer_port = ntohs(serv_addr.sin6_port);
     newm->our_ip = pstrdup(newm->p, m->our_ip);
+    newm->our_port = m->our_port;
 
     /* copy karma settings */
     mio_karma2(newm, &m->k);
@@ -948,6 +949,28 @@ static void _mio_loop_process_a_socket(mio m, int *maxfd, fd_set *rfds,
 
     /* no outstanding recalls */
 
+    /* the owner of a watched socket does the I/O itself */
+    if (m->flags.watched) {
+        if (m->flags.watch_read && FD_ISSET(m->fd, rfds) && m->cb != NULL)
+            (*m->cb)(m, MIO_READABLE, m->cb_arg, NULL, NULL, 0);
+
+        if (m->state == state_CLOSE || !FD_ISSET(m->fd, wfds))
+            return;
+
+        /* data written with mio_write() goes first */
+        if (m->queue != NULL) {
+            int write_return = _mio_write_dump(m);
+            if (write_return < 0)
+                mio_close(m);
+            if (write_return != 0)
+                return;
+        }
+
+        if (m->flags.watch_write && m->cb != NULL)
+            (*m->cb)(m, MIO_WRITEABLE, m->cb_arg, NULL, NULL, 0);
+        return;
+    }
+
     /* anything to read? */
     if (FD_ISSET(m->fd, rfds)) {
         log_debug2(ZONE, LOGT_IO, "Trying to read on socket %i", m->fd);
@@ -1008,6 +1031,19 @@ static void *_mio_main(void *arg) {
         FD_ZERO(&wfds);
         FD_ZERO(&rfds);
         for (cur = mio__data->master__list; cur != NULL; cur = cur->next) {
+            /* a TLS worker thread owns the socket during the handshake */
+            if (cur->flags.handshake_parked)
+                continue;
+
+            /* the owner of a watched socket selects the events itself */
+            if (cur->flags.watched) {
+                if (cur->queue != NULL || cur->flags.watch_write)
+                    FD_SET(cur->fd, &wfds);
+                if (cur->flags.watch_read)
+                    FD_SET(cur->fd, &rfds);
+                continue;
+            }
+
             /* check if we want to get write events for this socket */
             if (cur->queue != NULL || cur->flags.recall_write_when_writeable ||
                 cur->flags.recall_read_when_writeable ||
@@ -1038,6 +1074,9 @@ static void *_mio_main(void *arg) {
             log_debug2(ZONE, LOGT_EXECFLOW, "got a notify on zzz");
             pth_read(mio__data->zzz[0], buf, sizeof(buf));
             mio__data->zzz_active = 0;
+
+            /* TLS worker threads might have finished handshakes */
+            mio_tls_collect_handshakes();
         }
 
         /* loop through the sockets, check for stuff to do */
@@ -1045,6 +1084,11 @@ static void *_mio_main(void *arg) {
             next = cur->next; /* a mio might get deleted inside
                                  _mio_loop_process_a_socket() so that we cannot
                                  access cur afterwards! */
+            /* parked sockets (even closed ones) are still used by a TLS
+             * worker thread */
+            if (cur->flags.handshake_parked)
+                continue;
+
             /* if the mio socket is not closed, process it */
             if (cur->state != state_CLOSE) {
                 _mio_loop_process_a_socket(cur, &maxfd, &rfds, &wfds, retval);
@@ -1137,6 +1181,29 @@ void mio_init(void) {
                 xmlnode_get_data(xmlnode_get_list_item(
                     xmlnode_get_tags(io, "flash-policy", namespaces), 0)));
 
+    // keep received stanzas to pass them through unchanged?
+    mio__data->passthrough =
+        xmlnode_get_list_item(xmlnode_get_tags(io, "passthrough", namespaces),
+                              0) != NULL;
+
+    // limits for received stanzas
+    mio__data->limits[mio_limit_size] =
+        j_atoi(xmlnode_get_data(xmlnode_get_list_item(
+                   xmlnode_get_tags(io, "limits/size", namespaces), 0)),
+               0);
+    mio__data->limits[mio_limit_depth] =
+        j_atoi(xmlnode_get_data(xmlnode_get_list_item(
+                   xmlnode_get_tags(io, "limits/depth", namespaces), 0)),
+               0);
+    mio__data->limits[mio_limit_attribs] =
+        j_atoi(xmlnode_get_data(xmlnode_get_list_item(
+                   xmlnode_get_tags(io, "limits/attribs", namespaces), 0)),
+               0);
+    mio__data->limits[mio_limit_children] =
+        j_atoi(xmlnode_get_data(xmlnode_get_list_item(
+                   xmlnode_get_tags(io, "limits/children", namespaces), 0)),
+               0);
+
     if (karma != NULL) {
         mio__data->k->val =
             j_atoi(xmlnode_get_data(xmlnode_get_list_item(
@@ -1201,13 +1268,16 @@ void mio_stop(void) {
     /* loop each socket, and close it */
     for (cur = mio__data->master__list; cur != NULL;) {
         mnext = cur->next;
-        _mio_close(cur);
+        /* a TLS worker thread might still use it, it's dropped on exit */
+        if (!cur->flags.handshake_parked)
+            _mio_close(cur);
         cur = mnext;
     }
 
     /* signal the loop to end */
     pth_abort(mio__data->t);
 
+    _mio_xml_free_idle_parsers();
     pool_free(mio__data->p);
     mio__data = NULL;
 }
@@ -1287,6 +1357,36 @@ void mio_close(mio m) {
     _wakeup_mio_loop();
 }
 
+/**
+ * let the owner of a socket do the I/O itself, MIO only signals when the
+ * socket becomes readable or writeable
+ *
+ * Instead of reading from the socket and passing MIO_BUFFER events, MIO passes
+ * MIO_READABLE events to the callback function while @a readable is set, and
+ * MIO_WRITEABLE events while @a writeable is set (after the data written with
+ * mio_write() has been sent). Sockets that are neither readable nor writeable
+ * are not polled at all, the owner has to call this function again to get
+ * further events. Karma does not apply to watched sockets.
+ *
+ * @param m the socket to watch
+ * @param readable if MIO_READABLE events should be passed
+ * @param writeable if MIO_WRITEABLE events should be passed
+ */
+void mio_watch(mio m, int readable, int writeable) {
+    if (m == NULL)
+        return;
+
+    /* the select loop has to include newly watched events */
+    bool wakeup = (readable && !m->flags.watch_read) ||
+                  (writeable && !m->flags.watch_write);
+
+    m->flags.watched = 1;
+    m->flags.watch_read = readable ? 1 : 0;
+    m->flags.watch_write = writeable ? 1 : 0;
+    if (wakeup)
+        _wakeup_mio_loop();
+}
+
 /**
  * writes a str, or XML stanza to the client socket
  *
@@ -1346,8 +1446,15 @@ void mio_write(mio m, xmlnode stanza, char const *buffer, int len) {
     } else {
         newwbq->type = queue_XMLNODE;
 
-        newwbq->data = xmlnode_serialize_string(
-            stanza, m->out_ns ? *m->out_ns : xmppd::ns_decl_list(), 0);
+        /* can we write the stanza as we received it? (only if it has not been
+         * modified and this stream has the same default namespace) */
+        char const *raw = xmlnode_get_raw(stanza);
+        if (raw != NULL && m->out_ns != NULL &&
+            m->out_ns->check_prefix("", NS_SERVER))
+            newwbq->data = const_cast<char *>(raw);
+        else
+            newwbq->data = xmlnode_serialize_string(
+                stanza, m->out_ns ? *m->out_ns : xmppd::ns_decl_list(), 0);
         if (!newwbq->data) {
             pool_free(p);
             return;
@@ -1609,6 +1716,7 @@ mio mio_listen(int port, char const *listen_host, mio_std_cb cb, void *arg,
     newm = static_cast<mio>(mio_new(fd, cb, arg, mh));
     newm->type = type_LISTEN;
     newm->our_ip = pstrdup(newm->p, listen_host);
+    newm->our_port = port;
 
     log_debug2(ZONE, LOGT_IO, "mio starting to listen on %d [%s]", port,
                listen_host);
@@ -37,23 +37,31 @@
 #include "jabberd.h"
 #include <namespaces.hh>
 
+#include <condition_variable>
+#include <cstring>
 #include <fcntl.h>
 #include <gcrypt.h>
+#include <gnutls/socket.h>
 #include <iostream>
 #include <libtasn1.h>
 #include <list>
 #include <map>
+#include <mutex>
+#include <poll.h>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
-// Tell gcrypt that we are using libpth - had to move this to a plain C file
+// Tell gcrypt to use POSIX threads - had to move this to a plain C file
 extern "C" void mio_tls_gcrypt_init();
 
 extern const ASN1_ARRAY_TYPE subjectAltName_asn1_tab[];
 
+extern ios mio__data;
+
 /**
  * the credentials used by the server
  *
@@ -72,6 +80,253 @@ pool mio_tls_pool = NULL;
  */
 ASN1_TYPE mio_tls_asn1_tree = ASN1_TYPE_EMPTY;
 
+/** default number of TLS sessions kept for resumption */
+#define MIO_TLS_SESSION_CACHE_SIZE 1024
+
+/** default number of seconds a TLS session can be resumed */
+#define MIO_TLS_SESSION_TIMEOUT 3600
+
+/** default number of seconds a session ticket key is used */
+#define MIO_TLS_TICKET_KEY_LIFETIME 3600
+
+/** interval of the TLS heartbeat (key rotation and statistics) */
+#define MIO_TLS_BEAT 60
+
+/** default number of handshake worker threads (0 = handshake in mio thread) */
+#define MIO_TLS_HANDSHAKE_WORKERS 0
+
+/** seconds after which a handshake done by a worker thread is aborted */
+#define MIO_TLS_HANDSHAKE_TIMEOUT 60
+
+/**
+ * a bounded cache of TLS session data
+ *
+ * If the cache is full, the least recently used session is dropped. The cache
+ * is also accessed by the handshake worker threads and therefore locked.
+ */
+class mio_tls_session_cache {
+  public:
+    mio_tls_session_cache() : max_entries(0), timeout(0) {}
+
+    /**
+     * set the size of the cache and the lifetime of its entries
+     *
+     * @param max_entries maximum number of cached sessions (0 disables)
+     * @param timeout seconds after which a session is not resumed anymore
+     */
+    void configure(size_t max_entries, time_t timeout) {
+        std::lock_guard<std::mutex> guard(lock);
+        this->max_entries = max_entries;
+        this->timeout = timeout;
+        while (index.size() > max_entries) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    /**
+     * check if the cache is enabled
+     *
+     * @return true if sessions are cached
+     */
+    bool enabled() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return max_entries > 0;
+    }
+
+    /**
+     * get the configured lifetime of cached sessions
+     *
+     * @return lifetime in seconds
+     */
+    time_t get_timeout() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return timeout;
+    }
+
+    /**
+     * store session data in the cache
+     *
+     * @param key the key of the session
+     * @param data the session data
+     */
+    void put(std::string const &key, std::string const &data) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (max_entries == 0)
+            return;
+
+        erase(key);
+        if (index.size() >= max_entries) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.push_front(
+            entry_type(key, std::make_pair(data, time(NULL) + timeout)));
+        index[key] = entries.begin();
+    }
+
+    /**
+     * get session data from the cache
+     *
+     * @param key the key of the session
+     * @param data where to store the session data
+     * @return true if the session has been found, false else
+     */
+    bool get(std::string const &key, std::string &data) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, entry_list::iterator>::iterator p =
+            index.find(key);
+        if (p == index.end())
+            return false;
+
+        if (p->second->second.second < time(NULL)) {
+            entries.erase(p->second);
+            index.erase(p);
+            return false;
+        }
+
+        entries.splice(entries.begin(), entries, p->second);
+        data = p->second->second.first;
+        return true;
+    }
+
+    /**
+     * remove session data from the cache
+     *
+     * @param key the key of the session
+     */
+    void remove(std::string const &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        erase(key);
+    }
+
+  private:
+    /** key, session data, and expiration time of a cached session */
+    typedef std::pair<std::string, std::pair<std::string, time_t>> entry_type;
+
+    /** list of cached sessions, most recently used first */
+    typedef std::list<entry_type> entry_list;
+
+    size_t max_entries; /**< maximum number of cached sessions */
+    time_t timeout;     /**< lifetime of cached sessions */
+    entry_list entries; /**< the cached sessions */
+    std::map<std::string, entry_list::iterator>
+        index;               /**< the cached sessions by key */
+    mutable std::mutex lock; /**< protects all members */
+
+    /**
+     * remove session data from the cache, the lock has to be held
+     *
+     * @param key the key of the session
+     */
+    void erase(std::string const &key) {
+        std::map<std::string, entry_list::iterator>::iterator p =
+            index.find(key);
+        if (p == index.end())
+            return;
+
+        entries.erase(p->second);
+        index.erase(p);
+    }
+};
+
+/**
+ * sessions of incoming connections (key is the session id)
+ */
+static mio_tls_session_cache mio_tls_server_sessions;
+
+/**
+ * sessions of outgoing connections (key is our identity and the peer address)
+ */
+static mio_tls_session_cache mio_tls_client_sessions;
+
+/**
+ * key used to encrypt session tickets
+ *
+ * GnuTLS takes a single key per session, so tickets issued before the key has
+ * been replaced are rejected, and the peer does a full handshake (or resumes
+ * from the session cache).
+ */
+static gnutls_datum_t mio_tls_ticket_key = {NULL, 0};
+
+/**
+ * how long a session ticket key is used before it is replaced (0 if session
+ * tickets are disabled)
+ */
+static time_t mio_tls_ticket_key_lifetime = 0;
+
+/**
+ * when the current session ticket key has been created
+ */
+static time_t mio_tls_ticket_key_created = 0;
+
+/**
+ * number of TLS handshakes
+ */
+struct mio_tls_handshake_count {
+    unsigned long full;    /**< handshakes with a full key exchange */
+    unsigned long resumed; /**< handshakes resuming a previous session */
+    unsigned long ktls;    /**< connections using kernel TLS afterwards */
+};
+
+/**
+ * numbers of handshakes (key is the listener, "outgoing" for connections we
+ * initiated)
+ */
+static std::map<std::string, mio_tls_handshake_count> mio_tls_handshakes;
+
+/**
+ * if the kernel TLS data path should be used for connections on which GnuTLS
+ * enabled it
+ */
+static bool mio_tls_use_ktls = false;
+
+/**
+ * a TLS handshake passed to a worker thread
+ */
+struct mio_tls_handshake_job {
+    mio m; /**< the parked connection (only accessed by the mio thread) */
+    gnutls_session_t session; /**< the session to do the handshake on */
+    int fd;                   /**< the socket of the connection */
+    int wakeup_fd; /**< where to signal the mio thread the finished job */
+    int result;    /**< the result of the handshake */
+};
+
+/**
+ * number of handshake worker threads
+ */
+static int mio_tls_handshake_workers = 0;
+
+/**
+ * protects the queues of handshake jobs and the queue depth
+ */
+static std::mutex mio_tls_handshake_lock;
+
+/**
+ * signals the worker threads that a job has been queued
+ */
+static std::condition_variable mio_tls_handshake_queued;
+
+/**
+ * handshakes waiting for a worker thread
+ */
+static std::list<mio_tls_handshake_job> mio_tls_handshake_queue;
+
+/**
+ * handshakes done by the worker threads, waiting to be passed back to mio
+ */
+static std::list<mio_tls_handshake_job> mio_tls_handshake_done;
+
+/**
+ * number of handshakes queued or in progress in a worker thread
+ */
+static size_t mio_tls_handshake_depth = 0;
+
+/**
+ * maximum of mio_tls_handshake_depth since the last statistics
+ */
+static size_t mio_tls_handshake_depth_max = 0;
+
 /**
  * close the TLS connection
  *
@@ -540,6 +795,340 @@ mio_tls_process_key(xmlnode x,
     mio_tls_credentials[id] = current_credentials;
 }
 
+/**
+ * gnutls callback to store the data of a session for resumption
+ *
+ * @param ptr the session cache
+ * @param key the session id
+ * @param data the session data
+ * @return 0 on success
+ */
+static int mio_tls_db_store(void *ptr, gnutls_datum_t key,
+                            gnutls_datum_t data) {
+    static_cast<mio_tls_session_cache *>(ptr)->put(
+        std::string(reinterpret_cast<char *>(key.data), key.size),
+        std::string(reinterpret_cast<char *>(data.data), data.size));
+    return 0;
+}
+
+/**
+ * gnutls callback to retrieve the data of a session for resumption
+ *
+ * @param ptr the session cache
+ * @param key the session id
+ * @return the session data (allocated using gnutls_malloc()), NULL data if
+ * unknown
+ */
+static gnutls_datum_t mio_tls_db_retrieve(void *ptr, gnutls_datum_t key) {
+    gnutls_datum_t result = {NULL, 0};
+    std::string data;
+
+    if (!static_cast<mio_tls_session_cache *>(ptr)->get(
+            std::string(reinterpret_cast<char *>(key.data), key.size), data))
+        return result;
+
+    result.data = static_cast<unsigned char *>(gnutls_malloc(data.length()));
+    if (result.data == NULL)
+        return result;
+    std::memcpy(result.data, data.data(), data.length());
+    result.size = data.length();
+    return result;
+}
+
+/**
+ * gnutls callback to remove the data of a session
+ *
+ * @param ptr the session cache
+ * @param key the session id
+ * @return 0 on success
+ */
+static int mio_tls_db_remove(void *ptr, gnutls_datum_t key) {
+    static_cast<mio_tls_session_cache *>(ptr)->remove(
+        std::string(reinterpret_cast<char *>(key.data), key.size));
+    return 0;
+}
+
+/**
+ * keep the data of a session we initiated, to resume it on the next
+ * connection to the same peer
+ *
+ * @param session the session
+ */
+static void mio_tls_store_client_session(gnutls_session_t session) {
+    char const *key =
+        static_cast<char const *>(gnutls_session_get_ptr(session));
+    gnutls_datum_t data = {NULL, 0};
+
+    if (key == NULL || !mio_tls_client_sessions.enabled())
+        return;
+
+    if (gnutls_session_get_data2(session, &data) != 0)
+        return;
+    mio_tls_client_sessions.put(
+        key, std::string(reinterpret_cast<char *>(data.data), data.size));
+    gnutls_free(data.data);
+}
+
+/**
+ * drop the kept data of a session we initiated, e.g. because the handshake
+ * failed
+ *
+ * @param session the session
+ */
+static void mio_tls_forget_client_session(gnutls_session_t session) {
+    char const *key =
+        static_cast<char const *>(gnutls_session_get_ptr(session));
+
+    if (key != NULL)
+        mio_tls_client_sessions.remove(key);
+}
+
+/**
+ * gnutls hook called when a session ticket has been received on a session we
+ * initiated (with TLS 1.3 tickets are received after the handshake)
+ *
+ * @param session the session
+ * @return always 0
+ */
+static int mio_tls_ticket_received(gnutls_session_t session, unsigned int htype,
+                                   unsigned when, unsigned int incoming,
+                                   const gnutls_datum_t *msg) {
+    mio_tls_store_client_session(session);
+    return 0;
+}
+
+/**
+ * account a finished handshake and keep the session for resumption
+ *
+ * @param m the mio the handshake finished on
+ * @param originator true if we initiated the connection
+ */
+static void mio_tls_handshake_finished(mio m, bool originator) {
+    gnutls_session_t session = static_cast<gnutls_session_t>(m->ssl);
+
+    std::ostringstream listener;
+    if (originator)
+        listener << "outgoing";
+    else
+        listener << (m->our_ip != NULL ? m->our_ip : "*") << ":"
+                 << m->our_port;
+
+    bool resumed = gnutls_session_is_resumed(session) != 0;
+    mio_tls_handshake_count &count = mio_tls_handshakes[listener.str()];
+    if (resumed)
+        count.resumed++;
+    else
+        count.full++;
+
+    // GnuTLS passes the keys to the kernel, if enabled in its configuration
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+    if (mio_tls_use_ktls) {
+        gnutls_transport_ktls_enable_flags_t ktls =
+            gnutls_transport_is_ktls_enabled(session);
+        m->flags.ktls_send = (ktls & GNUTLS_KTLS_SEND) != 0;
+        m->flags.ktls_recv = (ktls & GNUTLS_KTLS_RECV) != 0;
+        if (m->flags.ktls_send || m->flags.ktls_recv)
+            count.ktls++;
+    }
+#endif
+
+    log_debug2(ZONE, LOGT_IO,
+               "%s TLS handshake on fd #%i (%s, kTLS tx=%i rx=%i)",
+               resumed ? "resumed" : "full", m->fd, listener.str().c_str(),
+               m->flags.ktls_send ? 1 : 0, m->flags.ktls_recv ? 1 : 0);
+
+    // keep the session, with TLS 1.3 this happens when the ticket is received
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_3)
+        return;
+#endif
+    if (originator)
+        mio_tls_store_client_session(session);
+}
+
+/**
+ * do a TLS handshake blocking the calling thread
+ *
+ * This is executed by the handshake worker threads and must not use any
+ * function of jabberd (memory pools, logging, pth).
+ *
+ * @param session the session to do the handshake on
+ * @param fd the (non-blocking) socket of the session
+ * @return result of gnutls_handshake()
+ */
+static int mio_tls_blocking_handshake(gnutls_session_t session, int fd) {
+    time_t timeout = time(NULL) + MIO_TLS_HANDSHAKE_TIMEOUT;
+
+    for (;;) {
+        int ret = gnutls_handshake(session);
+        if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED)
+            return ret;
+
+        if (time(NULL) >= timeout)
+            return GNUTLS_E_TIMEDOUT;
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events =
+            gnutls_record_get_direction(session) == 0 ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        ::poll(&pfd, 1, 1000);
+    }
+}
+
+/**
+ * main function of a handshake worker thread
+ */
+static void mio_tls_handshake_worker() {
+    std::unique_lock<std::mutex> guard(mio_tls_handshake_lock);
+
+    for (;;) {
+        mio_tls_handshake_queued.wait(
+            guard, [] { return !mio_tls_handshake_queue.empty(); });
+        mio_tls_handshake_job job = mio_tls_handshake_queue.front();
+        mio_tls_handshake_queue.pop_front();
+        guard.unlock();
+
+        job.result = mio_tls_blocking_handshake(job.session, job.fd);
+
+        guard.lock();
+        mio_tls_handshake_done.push_back(job);
+        mio_tls_handshake_depth--;
+
+        // wake up the mio thread
+        if (::write(job.wakeup_fd, " ", 1) < 0) {
+            // the mio thread will find the job on its next wakeup
+        }
+    }
+}
+
+/**
+ * start the handshake worker threads
+ *
+ * The threads are never stopped, they are just dropped on exit.
+ *
+ * @param count number of threads to start
+ */
+static void mio_tls_start_handshake_workers(int count) {
+    for (; mio_tls_handshake_workers < count; mio_tls_handshake_workers++)
+        std::thread(mio_tls_handshake_worker).detach();
+}
+
+/**
+ * park a connection and pass its handshake to a worker thread
+ *
+ * The connection is ignored by the mio loop until the handshake has finished
+ * and mio_tls_collect_handshakes() has passed it back.
+ *
+ * @param m the connection
+ * @param session the session to do the handshake on
+ */
+static void mio_tls_park_handshake(mio m, gnutls_session_t session) {
+    mio_tls_handshake_job job;
+    job.m = m;
+    job.session = session;
+    job.fd = m->fd;
+    job.wakeup_fd = mio__data->zzz[1];
+    job.result = 0;
+
+    m->flags.handshake_parked = 1;
+    log_debug2(ZONE, LOGT_IO, "passing TLS handshake for fd #%i to a worker",
+               m->fd);
+
+    std::lock_guard<std::mutex> guard(mio_tls_handshake_lock);
+    mio_tls_handshake_queue.push_back(job);
+    mio_tls_handshake_depth++;
+    if (mio_tls_handshake_depth > mio_tls_handshake_depth_max)
+        mio_tls_handshake_depth_max = mio_tls_handshake_depth;
+    mio_tls_handshake_queued.notify_one();
+}
+
+/**
+ * pass connections, on which a worker thread finished the handshake, back to
+ * the mio loop
+ *
+ * Called by the mio thread after it has been woken up.
+ */
+void mio_tls_collect_handshakes() {
+    std::list<mio_tls_handshake_job> done;
+
+    {
+        std::lock_guard<std::mutex> guard(mio_tls_handshake_lock);
+        done.swap(mio_tls_handshake_done);
+    }
+
+    for (std::list<mio_tls_handshake_job>::iterator p = done.begin();
+         p != done.end(); ++p) {
+        mio m = p->m;
+
+        m->flags.handshake_parked = 0;
+
+        // closed while parked? mio will close it now
+        if (m->state == state_CLOSE)
+            continue;
+
+        if (p->result < 0) {
+            log_debug2(ZONE, LOGT_IO, "TLS handshake failed for fd #%i: %s",
+                       m->fd, gnutls_strerror(p->result));
+            mio_close(m);
+            continue;
+        }
+
+        m->mh->handshake = NULL;
+        log_debug2(ZONE, LOGT_IO, "TLS handshake finished for fd #%i", m->fd);
+        mio_tls_handshake_finished(m, false);
+    }
+}
+
+/**
+ * heartbeat of the TLS layer: replaces the session ticket key and logs the
+ * handshake statistics
+ *
+ * @param arg unused/ignored
+ * @return always r_DONE
+ */
+static result mio_tls_beat(void *arg) {
+    // replace the session ticket key
+    if (mio_tls_ticket_key_lifetime > 0 &&
+        time(NULL) - mio_tls_ticket_key_created >=
+            mio_tls_ticket_key_lifetime) {
+        gnutls_datum_t new_key = {NULL, 0};
+        int ret = gnutls_session_ticket_key_generate(&new_key);
+        if (ret < 0) {
+            log_warn(NULL, "Cannot generate new TLS session ticket key: %s",
+                     gnutls_strerror(ret));
+        } else {
+            // sessions keep a copy of the key they have been enabled with
+            gnutls_free(mio_tls_ticket_key.data);
+            mio_tls_ticket_key = new_key;
+            mio_tls_ticket_key_created = time(NULL);
+            log_debug2(ZONE, LOGT_IO, "replaced TLS session ticket key");
+        }
+    }
+
+    // log statistics
+    for (std::map<std::string, mio_tls_handshake_count>::const_iterator p =
+             mio_tls_handshakes.begin();
+         p != mio_tls_handshakes.end(); ++p) {
+        log_debug2(ZONE, LOGT_STATUS,
+                   "TLS handshakes for %s: %lu full, %lu resumed, %lu kTLS",
+                   p->first.c_str(), p->second.full, p->second.resumed,
+                   p->second.ktls);
+    }
+    if (mio_tls_handshake_workers > 0) {
+        std::lock_guard<std::mutex> guard(mio_tls_handshake_lock);
+        log_debug2(ZONE, LOGT_STATUS,
+                   "TLS handshake queue: %lu queued or in progress (max %lu), "
+                   "%i workers",
+                   static_cast<unsigned long>(mio_tls_handshake_depth),
+                   static_cast<unsigned long>(mio_tls_handshake_depth_max),
+                   mio_tls_handshake_workers);
+        mio_tls_handshake_depth_max = mio_tls_handshake_depth;
+    }
+
+    return r_DONE;
+}
+
 /**
  * early initiatizations for GnuTLS
  *
@@ -548,7 +1137,7 @@ mio_tls_process_key(xmlnode x,
  * @return true on success, false on failure
  */
 bool mio_tls_early_init() {
-    // prepare gcrypt with libpth
+    // prepare gcrypt for the handshake worker threads
     mio_tls_gcrypt_init();
 
     /* initialize the GNU TLS library */
@@ -599,6 +1188,10 @@ void mio_ssl_init(xmlnode x) {
     std::list<std::string> crl_files_pem;
     std::list<std::string> crl_files_der;
     bool dhparams_der = false;
+    long session_cache_size = MIO_TLS_SESSION_CACHE_SIZE;
+    long session_timeout = MIO_TLS_SESSION_TIMEOUT;
+    long ticket_key_lifetime = MIO_TLS_TICKET_KEY_LIFETIME;
+    long handshake_workers = MIO_TLS_HANDSHAKE_WORKERS;
     for (cur = xmlnode_get_firstchild(x); cur != NULL;
          cur = xmlnode_get_nextsibling(cur)) {
         if (xmlnode_get_type(cur) != NTYPE_TAG) {
@@ -640,6 +1233,35 @@ void mio_ssl_init(xmlnode x) {
             continue;
         }
 
+        if (j_strcmp(xmlnode_get_localname(cur), "sessioncache") == 0) {
+            session_cache_size =
+                j_atoi(xmlnode_get_data(cur), MIO_TLS_SESSION_CACHE_SIZE);
+            continue;
+        }
+
+        if (j_strcmp(xmlnode_get_localname(cur), "sessiontimeout") == 0) {
+            session_timeout =
+                j_atoi(xmlnode_get_data(cur), MIO_TLS_SESSION_TIMEOUT);
+            continue;
+        }
+
+        if (j_strcmp(xmlnode_get_localname(cur), "sessiontickets") == 0) {
+            ticket_key_lifetime =
+                j_atoi(xmlnode_get_data(cur), MIO_TLS_TICKET_KEY_LIFETIME);
+            continue;
+        }
+
+        if (j_strcmp(xmlnode_get_localname(cur), "ktls") == 0) {
+            mio_tls_use_ktls = true;
+            continue;
+        }
+
+        if (j_strcmp(xmlnode_get_localname(cur), "workers") == 0) {
+            handshake_workers =
+                j_atoi(xmlnode_get_data(cur), MIO_TLS_HANDSHAKE_WORKERS);
+            continue;
+        }
+
         if (j_strcmp(xmlnode_get_localname(cur), "crlfile") == 0) {
             char const *const crlfile_data = xmlnode_get_data(cur);
             char const *const crlfile_type =
@@ -657,6 +1279,31 @@ void mio_ssl_init(xmlnode x) {
         }
     }
 
+    /* session resumption */
+    if (session_cache_size < 0)
+        session_cache_size = 0;
+    if (ticket_key_lifetime < 0)
+        ticket_key_lifetime = 0;
+    mio_tls_server_sessions.configure(session_cache_size, session_timeout);
+    mio_tls_client_sessions.configure(session_cache_size, session_timeout);
+    mio_tls_ticket_key_lifetime = ticket_key_lifetime;
+    if (mio_tls_ticket_key_lifetime > 0 &&
+        mio_tls_ticket_key.data == NULL) {
+        ret = gnutls_session_ticket_key_generate(&mio_tls_ticket_key);
+        if (ret < 0) {
+            log_warn(NULL, "Cannot generate TLS session ticket key: %s",
+                     gnutls_strerror(ret));
+            mio_tls_ticket_key.data = NULL;
+        }
+        mio_tls_ticket_key_created = time(NULL);
+    }
+    mio_tls_start_handshake_workers(handshake_workers);
+    static bool beat_registered = false;
+    if (!beat_registered) {
+        register_beat(MIO_TLS_BEAT, mio_tls_beat, NULL);
+        beat_registered = true;
+    }
+
     /* create DH parameters */
     ret = gnutls_dh_params_init(&mio_tls_dh_params);
     if (ret < 0) {
@@ -767,6 +1414,26 @@ ssize_t _mio_ssl_read(mio m, void *buf, size_t count) {
     m->flags.recall_read_when_readable = 0;
     m->flags.recall_read_when_writeable = 0;
 
+    /* with kernel TLS the kernel already decrypted the application data */
+    if (m->flags.ktls_recv &&
+        gnutls_record_check_pending(static_cast<gnutls_session_t>(m->ssl)) ==
+            0) {
+        read_return = pth_read(m->fd, buf, count);
+
+        if (read_return > 0) {
+            return read_return;
+        }
+        if (read_return == -1 && (errno == EINTR || errno == EAGAIN)) {
+            return 0;
+        }
+
+        /* EIO: the next record is no application data (e.g. an alert), it
+         * has to be processed by GnuTLS */
+        if (read_return == 0 || errno != EIO) {
+            return -1;
+        }
+    }
+
     /* trying to read */
     read_return = gnutls_record_recv(static_cast<gnutls_session_t>(m->ssl),
                                      (char *)buf, count);
@@ -829,6 +1496,19 @@ ssize_t _mio_ssl_write(mio m, const void *buf, size_t count) {
     m->flags.recall_write_when_readable = 0;
     m->flags.recall_write_when_writeable = 0;
 
+    /* with kernel TLS the kernel encrypts the data written to the socket */
+    if (m->flags.ktls_send) {
+        write_return = pth_write(m->fd, buf, count);
+
+        if (write_return > 0) {
+            return write_return;
+        }
+        if (write_return == -1 && (errno == EINTR || errno == EAGAIN)) {
+            return 0;
+        }
+        return -1;
+    }
+
     /* trying to write data */
     write_return =
         gnutls_record_send(static_cast<gnutls_session_t>(m->ssl), buf, count);
@@ -885,6 +1565,10 @@ int _mio_tls_cont_handshake_server(mio m) {
         /* reset the handler for handshake */
         m->mh->handshake = NULL;
         log_debug2(ZONE, LOGT_IO, "TLS handshake finished for fd #%i", m->fd);
+        /* only sessions we initiated have a resumption key as pointer */
+        mio_tls_handshake_finished(
+            m, gnutls_session_get_ptr(static_cast<gnutls_session_t>(m->ssl)) !=
+                   NULL);
         return 1;
     } else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
         if (gnutls_record_get_direction(
@@ -905,6 +1589,7 @@ int _mio_tls_cont_handshake_server(mio m) {
     } else {
         log_debug2(ZONE, LOGT_IO, "TLS handshake failed for fd #%i: %s", m->fd,
                    gnutls_strerror(ret));
+        mio_tls_forget_client_session(static_cast<gnutls_session_t>(m->ssl));
         return -1;
     }
 }
@@ -1040,6 +1725,45 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
     }
     gnutls_dh_set_prime_bits(session, 1024);
 
+    /* session resumption */
+    if (originator) {
+        /* resume a previous session with the same peer */
+        std::ostringstream key;
+        key << (identity != NULL ? identity : "") << "/"
+            << (m->peer_ip != NULL ? m->peer_ip : "") << ":" << m->peer_port;
+        std::string data;
+        if (mio_tls_client_sessions.get(key.str(), data)) {
+            ret = gnutls_session_set_data(session, data.data(), data.length());
+            if (ret != 0) {
+                log_debug2(ZONE, LOGT_IO,
+                           "Cannot resume TLS session for fd #%i: %s", m->fd,
+                           gnutls_strerror(ret));
+            }
+        }
+        gnutls_session_set_ptr(session, pstrdup(m->p, key.str().c_str()));
+        gnutls_handshake_set_hook_function(
+            session, GNUTLS_HANDSHAKE_NEW_SESSION_TICKET, GNUTLS_HOOK_POST,
+            mio_tls_ticket_received);
+    } else {
+        if (mio_tls_server_sessions.enabled()) {
+            gnutls_db_set_retrieve_function(session, mio_tls_db_retrieve);
+            gnutls_db_set_store_function(session, mio_tls_db_store);
+            gnutls_db_set_remove_function(session, mio_tls_db_remove);
+            gnutls_db_set_ptr(session, &mio_tls_server_sessions);
+            gnutls_db_set_cache_expiration(
+                session, mio_tls_server_sessions.get_timeout());
+        }
+        if (mio_tls_ticket_key.data != NULL) {
+            ret = gnutls_session_ticket_enable_server(session,
+                                                      &mio_tls_ticket_key);
+            if (ret != 0) {
+                log_debug2(ZONE, LOGT_IO,
+                           "Error enabling session tickets for fd #%i: %s",
+                           m->fd, gnutls_strerror(ret));
+            }
+        }
+    }
+
     /* associate with the socket */
     gnutls_transport_set_int(session, m->fd);
 
@@ -1053,6 +1777,13 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
     /* TLS handshake */
     m->flags.recall_handshake_when_readable = 0;
     m->flags.recall_handshake_when_writeable = 0;
+    if (!originator && mio_tls_handshake_workers > 0) {
+        /* let a worker thread do the key exchange */
+        m->ssl = session;
+        pool_cleanup(m->p, _mio_ssl_cleanup, (void *)session);
+        mio_tls_park_handshake(m, session);
+        return 0;
+    }
     ret = gnutls_handshake(session);
     if (ret < 0) {
         if (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN) {
@@ -1077,6 +1808,7 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
 
         /* real error happened */
         mio_close(m);
+        mio_tls_forget_client_session(session);
         gnutls_deinit(session);
         log_debug2(ZONE, LOGT_IO, "TLS handshake failed on socket #%i: %s",
                    m->fd, gnutls_strerror(ret));
@@ -1087,6 +1819,7 @@ int mio_ssl_starttls(mio m, int originator, const char *identity) {
     m->ssl = session;
     log_debug2(ZONE, LOGT_EXECFLOW, "m->ssl is now %X, session=%X", m->ssl,
                session);
+    mio_tls_handshake_finished(m, originator);
 
     pool_cleanup(m->p, _mio_ssl_cleanup, (void *)session);
 
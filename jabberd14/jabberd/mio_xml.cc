@@ -44,6 +44,8 @@
 #include <namespaces.hh>
 #include <xmlnode.hh>
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <libgen.h>
 #include <sys/stat.h>
@@ -53,6 +55,241 @@
 /* defined in mio.c */
 extern ios mio__data;
 
+/**
+ * check if a namespace is the namespace of stanzas on a stream
+ *
+ * @param ns_iri the namespace IRI to check
+ * @return true if it is 'jabber:server', 'jabber:client', or
+ * 'jabber:component:accept'
+ */
+static bool _mio_xml_is_stanza_ns(char const *ns_iri) {
+    return j_strcmp(ns_iri, NS_SERVER) == 0 ||
+           j_strcmp(ns_iri, NS_CLIENT) == 0 ||
+           j_strcmp(ns_iri, NS_COMPONENT_ACCEPT) == 0;
+}
+
+/**
+ * drop the kept received bytes up to a position in the stream
+ *
+ * @param m the mio
+ * @param upto stream position of the first byte, that has to be kept
+ */
+static void _mio_xml_raw_consume(mio m, XML_Index upto) {
+    if (m->in_raw == NULL || upto <= m->in_raw_offset)
+        return;
+
+    m->in_raw->erase(0, std::min<std::string::size_type>(
+                            upto - m->in_raw_offset, m->in_raw->length()));
+    m->in_raw_offset = upto;
+}
+
+/**
+ * check if an element of a received stanza allows to pass the stanza through
+ * unchanged, taint the stanza if it does not
+ *
+ * Received stanzas are only passed through unchanged, if they do not depend
+ * on namespace prefixes declared on the stream root element.
+ *
+ * @param m the mio
+ * @param qname the name of the element
+ * @param attribs attributes of the element
+ */
+static void _mio_xml_raw_check(mio m, xmppd::expat_qname const &qname,
+                               const char **attribs) {
+    // stanza root element has to be in the default namespace of the stream
+    if (m->stacknode == NULL && !_mio_xml_is_stanza_ns(qname.ns_iri))
+        m->flags.in_raw_tainted = 1;
+
+    // no prefixed element names
+    if (qname.prefix != NULL)
+        m->flags.in_raw_tainted = 1;
+
+    // no prefixed attributes, but xml:lang and the like
+    for (int i = 0; attribs[i] != NULL; i += 2) {
+        if (std::strchr(attribs[i], XMLNS_SEPARATOR) != NULL &&
+            std::strncmp(attribs[i], NS_XML, std::strlen(NS_XML)) != 0)
+            m->flags.in_raw_tainted = 1;
+    }
+}
+
+/**
+ * internal expat callback for comments: a stanza containing a comment is not
+ * passed through unchanged
+ *
+ * @param _m the mio
+ * @param data the comment
+ */
+static void _mio_xstream_comment(void *_m, const XML_Char *data) {
+    mio m = static_cast<mio>(_m);
+
+    if (m->stacknode != NULL)
+        m->flags.in_raw_tainted = 1;
+}
+
+/**
+ * internal expat callback for processing instructions: a stanza containing a
+ * processing instruction is not passed through unchanged
+ *
+ * @param _m the mio
+ * @param target the target of the processing instruction
+ * @param data the data of the processing instruction
+ */
+static void _mio_xstream_processing_instruction(void *_m,
+                                                const XML_Char *target,
+                                                const XML_Char *data) {
+    mio m = static_cast<mio>(_m);
+
+    if (m->stacknode != NULL)
+        m->flags.in_raw_tainted = 1;
+}
+
+/**
+ * internal expat callback for document type declarations: entities declared
+ * by them could be referenced in any stanza, so no stanza of the stream is
+ * passed through unchanged
+ *
+ * @param _m the mio
+ * @param name the name of the document type
+ * @param sysid the system identifier
+ * @param pubid the public identifier
+ * @param has_internal_subset if an internal subset is declared
+ */
+static void _mio_xstream_doctype(void *_m, const XML_Char *name,
+                                 const XML_Char *sysid, const XML_Char *pubid,
+                                 int has_internal_subset) {
+    mio m = static_cast<mio>(_m);
+
+    if (m->in_raw != NULL) {
+        delete m->in_raw;
+        m->in_raw = NULL;
+    }
+}
+
+/**
+ * internal expat callback for everything without a handler of its own (e.g.
+ * CDATA section markers): taint the stanza, as it might contain constructs
+ * that must not be passed through unchanged
+ *
+ * @param _m the mio
+ * @param data the unhandled data
+ * @param len length of the data
+ */
+static void _mio_xstream_default(void *_m, const XML_Char *data, int len) {
+    mio m = static_cast<mio>(_m);
+
+    if (m->stacknode != NULL)
+        m->flags.in_raw_tainted = 1;
+}
+
+/**
+ * close a stream, that exceeded a limit for received stanzas
+ *
+ * The stanza received so far is dropped and all further data received on the
+ * stream is discarded. The stream is closed with a policy-violation stream
+ * error.
+ *
+ * @param m the mio
+ * @param limit the limit, that has been exceeded
+ */
+static void _mio_xml_limit_exceeded(mio m, mio_limit limit) {
+    static char const *const limit_names[mio_limit_count] = {
+        "size", "depth", "attribute", "child element"};
+
+    if (m->flags.in_limit_exceeded)
+        return;
+    m->flags.in_limit_exceeded = 1;
+
+    mio__data->limits_exceeded[limit]++;
+    log_notice(NULL,
+               "closing stream from %s: received stanza exceeds the %s limit "
+               "of %ld (%lu streams closed for this limit)",
+               m->peer_ip, limit_names[limit], mio__data->limits[limit],
+               mio__data->limits_exceeded[limit]);
+
+    // stop parsing, if we are called by expat
+    XML_ParsingStatus status;
+    XML_GetParsingStatus(m->parser, &status);
+    if (status.parsing == XML_PARSING)
+        XML_StopParser(m->parser, XML_FALSE);
+
+    // stop building the stanza (freeing the pool of the complete stanza)
+    xmlnode_free(m->stacknode);
+    m->stacknode = NULL;
+    if (m->in_raw) {
+        delete m->in_raw;
+        m->in_raw = NULL;
+    }
+
+    if (m->cb != NULL)
+        (*m->cb)(m, MIO_ERROR, m->cb_arg, NULL, NULL, 0);
+    mio_write(m, NULL, SERROR_POLICYVIOLATION, -1);
+    mio_close(m);
+}
+
+/**
+ * check if the currently received stanza exceeds the size limit
+ *
+ * @param m the mio
+ * @param position stream position up to which data has been received
+ * @return true if the limit has been exceeded (and the stream is closed)
+ */
+static bool _mio_xml_check_size(mio m, XML_Index position) {
+    if (mio__data->limits[mio_limit_size] <= 0 ||
+        position - m->in_stanza_start <= mio__data->limits[mio_limit_size])
+        return false;
+
+    _mio_xml_limit_exceeded(m, mio_limit_size);
+    return true;
+}
+
+/**
+ * check the limits for a start tag of a received element
+ *
+ * @param m the mio
+ * @param attribs attributes of the element
+ * @return true if a limit has been exceeded (and the stream is closed)
+ */
+static bool _mio_xml_check_element(mio m, const char **attribs) {
+    if (_mio_xml_check_size(m, XML_GetCurrentByteIndex(m->parser) +
+                                   XML_GetCurrentByteCount(m->parser)))
+        return true;
+
+    // attributes
+    if (mio__data->limits[mio_limit_attribs] > 0) {
+        long count = 0;
+        while (attribs[count * 2] != NULL)
+            count++;
+        if (count > mio__data->limits[mio_limit_attribs]) {
+            _mio_xml_limit_exceeded(m, mio_limit_attribs);
+            return true;
+        }
+    }
+
+    // the stream root element is not part of a stanza
+    if (!m->flags.root)
+        return false;
+
+    // depth
+    m->in_depth++;
+    if (mio__data->limits[mio_limit_depth] > 0 &&
+        m->in_depth > mio__data->limits[mio_limit_depth]) {
+        _mio_xml_limit_exceeded(m, mio_limit_depth);
+        return true;
+    }
+
+    // child elements of the parent
+    if (m->in_children != NULL) {
+        if (!m->in_children->empty() &&
+            ++m->in_children->back() > mio__data->limits[mio_limit_children]) {
+            _mio_xml_limit_exceeded(m, mio_limit_children);
+            return true;
+        }
+        m->in_children->push_back(0);
+    }
+
+    return false;
+}
+
 /**
  * internal expat callback for start tags
  *
@@ -63,51 +300,33 @@ extern ios mio__data;
 static void _mio_xstream_startElement(void *_m, const char *name,
                                       const char **attribs) {
     mio m = static_cast<mio>(_m);
-    std::string prefix;
-    std::string ns_iri;
-    std::string local_name;
-    std::string qname(name ? name : "");
 
-    // create a new list of declated namespaces if necessary
+    // stanza start?
+    if (m->flags.root && m->stacknode == NULL)
+        m->in_stanza_start = XML_GetCurrentByteIndex(m->parser);
+
+    // enforce the limits for received stanzas
+    if (m->flags.in_limit_exceeded || _mio_xml_check_element(m, attribs))
+        return;
+
+    // create a new list of declated namespaces if necessary (sharing the
+    // declarations of the root element)
     if (!m->in_stanza) {
         m->in_stanza = m->in_root ? new xmppd::ns_decl_list(*m->in_root)
                                   : new xmppd::ns_decl_list();
     }
 
-    // get prefix and local name of the element
-    std::string::size_type separator_pos = qname.find(XMLNS_SEPARATOR);
-    if (separator_pos != std::string::npos) {
-        ns_iri = qname.substr(0, separator_pos);
-        local_name = qname.substr(separator_pos + 1);
-        try {
-            // XXX do we need to care about the prefix at all?
-            prefix = m->in_stanza->get_nsprefix(ns_iri);
-        } catch (std::invalid_argument&) {
-        }
-    } else {
-        // expat could not expand the prefix, it's not declared
-        //
-        // ... be liberal in what you accept ...
-        //
-        // XXX do we really want to be?
-
-        // start with a guess
-        std::string::size_type colon_pos = qname.find(':');
-        if (colon_pos != std::string::npos) {
-            prefix = qname.substr(0, colon_pos);
-            local_name = qname.substr(colon_pos + 1);
-            ns_iri = "http://jabberd.org/ns/clue";
-
-            // some well known prefixes (but tehy would have to be declared!)
-            if (prefix == "stream") {
-                ns_iri = NS_STREAM;
-            } else if (prefix == "db") {
-                ns_iri = NS_DIALBACK;
-            }
-        } else {
-            local_name = qname;
-            ns_iri = NS_SERVER;
+    // get namespace, prefix, and local name of the element
+    xmppd::expat_qname qname(name, *m->in_stanza, "http://jabberd.org/ns/clue",
+                             NS_SERVER);
+
+    // keeping received stanzas? start of a new one?
+    if (m->in_raw != NULL && m->flags.root) {
+        if (m->stacknode == NULL) {
+            m->in_raw_stanza = XML_GetCurrentByteIndex(m->parser);
+            _mio_xml_raw_consume(m, m->in_raw_stanza);
         }
+        _mio_xml_raw_check(m, qname, attribs);
     }
 
     /* If stacknode is NULL, we are starting a new packet and must
@@ -115,9 +334,8 @@ static void _mio_xstream_startElement(void *_m, const char *name,
     if (m->stacknode == NULL) {
         pool p = pool_heap(5 * 1024); /* 5k, typically 1-2k each, plus copy of
                                          self and workspace */
-        m->stacknode = xmlnode_new_tag_pool_ns(
-            p, local_name.c_str(), prefix == "" ? NULL : prefix.c_str(),
-            ns_iri.c_str());
+        m->stacknode = xmlnode_new_tag_pool_ns(p, qname.local_name,
+                                               qname.prefix, qname.ns_iri);
         xmlnode_put_expat_attribs(m->stacknode, attribs, *m->in_stanza);
 
         /* If the root is 0, this must be the root node.. */
@@ -169,11 +387,19 @@ static void _mio_xstream_startElement(void *_m, const char *name,
                 xmlnode_free(m->stacknode);
             m->stacknode = NULL;
             m->flags.root = 1;
+
+            // the root element is not part of any stanza
+            m->in_stanza_start = XML_GetCurrentByteIndex(m->parser) +
+                                 XML_GetCurrentByteCount(m->parser);
+            if (m->in_raw != NULL) {
+                _mio_xml_raw_consume(m, XML_GetCurrentByteIndex(m->parser) +
+                                            XML_GetCurrentByteCount(m->parser));
+                m->flags.in_raw_tainted = 0;
+            }
         }
     } else {
-        m->stacknode = xmlnode_insert_tag_ns(
-            m->stacknode, local_name.c_str(),
-            prefix == "" ? NULL : prefix.c_str(), ns_iri.c_str());
+        m->stacknode = xmlnode_insert_tag_ns(m->stacknode, qname.local_name,
+                                             qname.prefix, qname.ns_iri);
         xmlnode_put_expat_attribs(m->stacknode, attribs, *m->in_stanza);
     }
 }
@@ -187,6 +413,10 @@ static void _mio_xstream_startElement(void *_m, const char *name,
 static void _mio_xstream_endElement(void *_m, const char *name) {
     mio m = static_cast<mio>(_m);
 
+    // discarding data after a limit has been exceeded?
+    if (m->flags.in_limit_exceeded)
+        return;
+
     /* If the stacknode is already NULL, then this closing element
        must be the closing ROOT tag, so notify and exit */
     if (m->stacknode == NULL) {
@@ -209,13 +439,35 @@ static void _mio_xstream_endElement(void *_m, const char *name) {
         mio_close(m);
     } else {
         xmlnode parent = xmlnode_get_parent(m->stacknode);
+
+        m->in_depth--;
+        if (m->in_children != NULL && !m->in_children->empty())
+            m->in_children->pop_back();
+
         /* Fire the NODE event if this closing element has no parent */
         if (parent == NULL) {
-            // we do not need the list of namespaces for the current stanza
-            // anymore
-            if (m->in_stanza) {
-                delete m->in_stanza;
-                m->in_stanza = NULL;
+            m->in_stanza_start = XML_GetCurrentByteIndex(m->parser) +
+                                 XML_GetCurrentByteCount(m->parser);
+
+            // the list of namespaces for the stanza is kept for the next
+            // stanza, the declarations of this stanza go out of scope with the
+            // end of its elements
+
+            // keep the stanza as received, if it can be passed through
+            if (m->in_raw != NULL) {
+                XML_Index end = XML_GetCurrentByteIndex(m->parser) +
+                                XML_GetCurrentByteCount(m->parser);
+                if (!m->flags.in_raw_tainted &&
+                    m->in_raw_stanza >= m->in_raw_offset &&
+                    end <= m->in_raw_offset +
+                               static_cast<XML_Index>(m->in_raw->length()))
+                    xmlnode_set_raw(
+                        m->stacknode,
+                        m->in_raw->data() +
+                            (m->in_raw_stanza - m->in_raw_offset),
+                        end - m->in_raw_stanza);
+                _mio_xml_raw_consume(m, end);
+                m->flags.in_raw_tainted = 0;
             }
 
             /* do we have to copy the language of the root element to the stanza
@@ -242,9 +494,23 @@ static void _mio_xstream_endElement(void *_m, const char *name) {
  */
 void _mio_xstream_CDATA(void *_m, const char *cdata, int len) {
     mio m = static_cast<mio>(_m);
+    XML_Index end = XML_GetCurrentByteIndex(m->parser) +
+                    XML_GetCurrentByteCount(m->parser);
 
-    if (m->stacknode != NULL)
-        xmlnode_insert_cdata(m->stacknode, cdata, len);
+    // discarding data after a limit has been exceeded?
+    if (m->flags.in_limit_exceeded)
+        return;
+
+    if (m->stacknode != NULL) {
+        if (!_mio_xml_check_size(m, end))
+            xmlnode_insert_cdata(m->stacknode, cdata, len);
+        return;
+    }
+
+    // whitespace between stanzas does not count for the next stanza
+    m->in_stanza_start = end;
+    if (m->in_raw != NULL && m->flags.root)
+        _mio_xml_raw_consume(m, end);
 }
 
 /**
@@ -261,8 +527,8 @@ static void _mio_xstream_startNamespaceDecl(void *arg, const XML_Char *prefix,
                                             const XML_Char *iri) {
     mio m = (mio)arg;
 
-    /* create a new memory pool if necessary, and copy what namespaces we
-     * already have on the root element */
+    /* create a new list if necessary, that shares the namespaces we already
+     * have on the root element */
     if (!m->in_stanza) {
         m->in_stanza = m->in_root ? new xmppd::ns_decl_list(*m->in_root)
                                   : new xmppd::ns_decl_list();
@@ -270,6 +536,10 @@ static void _mio_xstream_startNamespaceDecl(void *arg, const XML_Char *prefix,
 
     /* store the new prefix in the list */
     m->in_stanza->update(prefix ? prefix : "", iri ? iri : "");
+
+    /* redeclaring the namespace of stanzas prevents passing them through */
+    if (m->in_raw != NULL && m->flags.root && _mio_xml_is_stanza_ns(iri))
+        m->flags.in_raw_tainted = 1;
 }
 
 /**
@@ -290,6 +560,52 @@ static void _mio_xstream_endNamespaceDecl(void *arg, const XML_Char *prefix) {
     }
 }
 
+/**
+ * get an expat parser for a new XML stream
+ *
+ * Parsers of closed streams are reused if available, else a new parser is
+ * created.
+ *
+ * @return the parser, ready to parse a new document
+ */
+static XML_Parser _mio_xml_get_parser() {
+    if (mio__data != NULL && mio__data->idle_parsers_count > 0)
+        return mio__data->idle_parsers[--mio__data->idle_parsers_count];
+
+    return XML_ParserCreateNS(NULL, XMLNS_SEPARATOR);
+}
+
+/**
+ * release the expat parser of a closed XML stream
+ *
+ * The parser is reset and kept for reuse by a later stream, or freed if
+ * enough parsers are kept already.
+ *
+ * @param parser the parser to release
+ */
+static void _mio_xml_release_parser(XML_Parser parser) {
+    if (mio__data != NULL && !mio__data->shutdown &&
+        mio__data->idle_parsers_count < MIO_XML_IDLE_PARSERS &&
+        XML_ParserReset(parser, NULL)) {
+        mio__data->idle_parsers[mio__data->idle_parsers_count++] = parser;
+        return;
+    }
+
+    XML_ParserFree(parser);
+}
+
+/**
+ * free the expat parsers kept for reuse
+ */
+void _mio_xml_free_idle_parsers(void) {
+    if (mio__data == NULL)
+        return;
+
+    while (mio__data->idle_parsers_count > 0)
+        XML_ParserFree(
+            mio__data->idle_parsers[--mio__data->idle_parsers_count]);
+}
+
 /**
  * destructor for a mio xstream, frees allocated memory
  *
@@ -303,13 +619,17 @@ void _mio_xstream_cleanup(void *arg) {
         XML_SetElementHandler(m->parser, NULL, NULL);
         XML_SetCharacterDataHandler(m->parser, NULL);
         XML_SetNamespaceDeclHandler(m->parser, NULL, NULL);
+        XML_SetCommentHandler(m->parser, NULL);
+        XML_SetProcessingInstructionHandler(m->parser, NULL);
+        XML_SetStartDoctypeDeclHandler(m->parser, NULL);
+        XML_SetDefaultHandlerExpand(m->parser, NULL);
     }
 
     xmlnode_free(m->stacknode);
     m->stacknode = NULL;
 
     if (m->parser)
-        XML_ParserFree(m->parser);
+        _mio_xml_release_parser(m->parser);
     m->parser = NULL;
 
     if (m->in_root) {
@@ -324,6 +644,14 @@ void _mio_xstream_cleanup(void *arg) {
         delete m->out_ns;
         m->out_ns = NULL;
     }
+    if (m->in_raw) {
+        delete m->in_raw;
+        m->in_raw = NULL;
+    }
+    if (m->in_children) {
+        delete m->in_children;
+        m->in_children = NULL;
+    }
 }
 
 /**
@@ -335,14 +663,38 @@ void _mio_xstream_cleanup(void *arg) {
  */
 void _mio_xstream_init(mio m) {
     if (m != NULL) {
-        /* Initialize the parser */
-        m->parser = XML_ParserCreateNS(NULL, XMLNS_SEPARATOR);
+        /* Initialize the parser (XML_ParserReset() removed the handlers of
+         * reused parsers) */
+        m->parser = _mio_xml_get_parser();
         XML_SetUserData(m->parser, m);
         XML_SetElementHandler(m->parser, _mio_xstream_startElement,
                               _mio_xstream_endElement);
         XML_SetCharacterDataHandler(m->parser, _mio_xstream_CDATA);
         XML_SetNamespaceDeclHandler(m->parser, _mio_xstream_startNamespaceDecl,
                                     _mio_xstream_endNamespaceDecl);
+        /* keep received stanzas to pass them through unchanged? */
+        if (mio__data != NULL && mio__data->passthrough && m->in_raw == NULL) {
+            m->in_raw = new std::string();
+            m->in_raw_offset = 0;
+            m->flags.in_raw_tainted = 0;
+        }
+        /* only stanzas consisting of elements, attributes and text are passed
+         * through, everything else taints them */
+        if (m->in_raw != NULL) {
+            XML_SetCommentHandler(m->parser, _mio_xstream_comment);
+            XML_SetProcessingInstructionHandler(
+                m->parser, _mio_xstream_processing_instruction);
+            XML_SetStartDoctypeDeclHandler(m->parser, _mio_xstream_doctype);
+            XML_SetDefaultHandlerExpand(m->parser, _mio_xstream_default);
+        }
+        /* position in the stream for enforcing the limits */
+        m->in_parsed = 0;
+        m->in_stanza_start = 0;
+        m->in_depth = 0;
+        if (mio__data != NULL && mio__data->limits[mio_limit_children] > 0 &&
+            m->in_children == NULL)
+            m->in_children = new std::vector<long>();
+
         /* Setup a cleanup routine to release the parser when everything is done
          */
         pool_cleanup(m->p, _mio_xstream_cleanup, (void *)m);
@@ -363,6 +715,10 @@ void _mio_xstream_init(mio m) {
 void _mio_xml_parser(mio m, const void *vbuf, size_t bufsz) {
     char *nul, *buf = (char *)vbuf;
 
+    /* discard data after a received stanza exceeded a limit */
+    if (m->flags.in_limit_exceeded)
+        return;
+
     /* check if the stream has to be resetted (after STARTTLS) */
     if (m->flags.reset_stream) {
         _mio_xstream_cleanup(m);
@@ -618,7 +974,15 @@ void _mio_xml_parser(mio m, const void *vbuf, size_t bufsz) {
             bufsz--;
         }
 
+    /* keep what we pass to expat, if we pass through received stanzas */
+    if (m->in_raw != NULL)
+        m->in_raw->append(buf, bufsz);
+
     if (XML_Parse(m->parser, buf, bufsz, 0) == 0) {
+        /* stopped because a limit has been exceeded? */
+        if (m->flags.in_limit_exceeded)
+            return;
+
         log_debug2(ZONE, LOGT_XML, "[%s] XML Parsing Error: %s", ZONE,
                    XML_ErrorString(XML_GetErrorCode(m->parser)));
         if (m->cb != NULL) {
@@ -631,7 +995,14 @@ void _mio_xml_parser(mio m, const void *vbuf, size_t bufsz) {
                       -1);
             mio_close(m);
         }
+        return;
     }
+
+    /* data buffered by expat (e.g. an incomplete start tag) counts for the
+     * size limit as well */
+    m->in_parsed += bufsz;
+    if (!m->flags.in_limit_exceeded)
+        _mio_xml_check_size(m, m->in_parsed);
 }
 
 /**
@@ -0,0 +1,260 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file tlsbench.cc
+ * @brief loopback throughput benchmark of the TLS data path
+ *
+ * Sends data over a TLS connection on the loopback interface, using the same
+ * data path as mio_tls: plain write()/read() on the socket for the directions
+ * the kernel handles (kTLS), gnutls_record_send()/gnutls_record_recv()
+ * otherwise. Not installed, run it from the build directory:
+ *
+ * ./tlsbench [megabytes]
+ *
+ * kTLS is only used if it is enabled in the GnuTLS system configuration. To
+ * compare both paths, run it once as it is and once with
+ * GNUTLS_SYSTEM_PRIORITY_FILE pointing to a file containing "[global]" and
+ * "ktls = true" (the 'tls' kernel module has to be loaded).
+ */
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <gnutls/gnutls.h>
+#include <gnutls/socket.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** GnuTLS priorities: anonymous key exchange, which needs TLS 1.2 */
+#define TLSBENCH_PRIORITY "NORMAL:-VERS-TLS1.3:-KX-ALL:+ANON-ECDH"
+
+/** size of the chunks written by the sender */
+#define TLSBENCH_CHUNK 16384
+
+/**
+ * check which directions of a session are handled by the kernel
+ *
+ * @param session the session after the handshake
+ * @param send set to true if the kernel encrypts the data we send
+ * @param recv set to true if the kernel decrypts the data we receive
+ */
+static void tlsbench_ktls(gnutls_session_t session, bool &send, bool &recv) {
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+    gnutls_transport_ktls_enable_flags_t const ktls =
+        gnutls_transport_is_ktls_enabled(session);
+    send = (ktls & GNUTLS_KTLS_SEND) != 0;
+    recv = (ktls & GNUTLS_KTLS_RECV) != 0;
+#else
+    send = recv = false;
+#endif
+}
+
+/**
+ * set up a TLS session on a connected socket and do the handshake
+ *
+ * @param fd the socket
+ * @param server true for the server side of the connection
+ * @return the session, NULL on error
+ */
+static gnutls_session_t tlsbench_handshake(int fd, bool server) {
+    gnutls_session_t session = NULL;
+    int ret;
+
+    gnutls_init(&session, server ? GNUTLS_SERVER : GNUTLS_CLIENT);
+    gnutls_priority_set_direct(session, TLSBENCH_PRIORITY, NULL);
+    if (server) {
+        gnutls_anon_server_credentials_t cred;
+        gnutls_anon_allocate_server_credentials(&cred);
+        gnutls_credentials_set(session, GNUTLS_CRD_ANON, cred);
+    } else {
+        gnutls_anon_client_credentials_t cred;
+        gnutls_anon_allocate_client_credentials(&cred);
+        gnutls_credentials_set(session, GNUTLS_CRD_ANON, cred);
+    }
+    gnutls_transport_set_int(session, fd);
+
+    do {
+        ret = gnutls_handshake(session);
+    } while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
+    if (ret < 0) {
+        std::cerr << "handshake failed: " << gnutls_strerror(ret) << std::endl;
+        gnutls_deinit(session);
+        return NULL;
+    }
+    return session;
+}
+
+/**
+ * receive all data and acknowledge it with a single byte (server side)
+ *
+ * @param fd the socket
+ * @param total number of bytes to receive
+ * @return exit code for the process
+ */
+static int tlsbench_receive(int fd, size_t total) {
+    gnutls_session_t session = tlsbench_handshake(fd, true);
+    if (session == NULL)
+        return 1;
+
+    bool ktls_send, ktls_recv;
+    tlsbench_ktls(session, ktls_send, ktls_recv);
+    static char buf[TLSBENCH_CHUNK];
+    size_t received = 0;
+
+    while (received < total) {
+        ssize_t len = -1;
+
+        if (ktls_recv && gnutls_record_check_pending(session) == 0) {
+            len = read(fd, buf, sizeof(buf));
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0 && errno != EIO)
+                return 1;
+        }
+
+        /* userspace path, or a record that is no application data */
+        if (len < 0) {
+            len = gnutls_record_recv(session, buf, sizeof(buf));
+            if (len == GNUTLS_E_AGAIN || len == GNUTLS_E_INTERRUPTED)
+                continue;
+        }
+        if (len <= 0)
+            return 1;
+        received += len;
+    }
+
+    gnutls_record_send(session, "", 1);
+    gnutls_bye(session, GNUTLS_SHUT_WR);
+    gnutls_deinit(session);
+    return 0;
+}
+
+/**
+ * send the data and wait for the acknowledgement (client side)
+ *
+ * @param fd the socket
+ * @param total number of bytes to send
+ * @return exit code for the process
+ */
+static int tlsbench_send(int fd, size_t total) {
+    gnutls_session_t session = tlsbench_handshake(fd, false);
+    if (session == NULL)
+        return 1;
+
+    bool ktls_send, ktls_recv;
+    tlsbench_ktls(session, ktls_send, ktls_recv);
+    static char buf[TLSBENCH_CHUNK];
+    std::memset(buf, 'x', sizeof(buf));
+
+    std::chrono::steady_clock::time_point const start =
+        std::chrono::steady_clock::now();
+    for (size_t sent = 0; sent < total;) {
+        size_t const chunk =
+            total - sent < sizeof(buf) ? total - sent : sizeof(buf);
+        ssize_t const len = ktls_send
+                                ? write(fd, buf, chunk)
+                                : gnutls_record_send(session, buf, chunk);
+        if (len < 0 && (errno == EINTR || len == GNUTLS_E_AGAIN ||
+                        len == GNUTLS_E_INTERRUPTED))
+            continue;
+        if (len <= 0)
+            return 1;
+        sent += len;
+    }
+
+    /* the acknowledgement is a userspace record, the kernel passes it up */
+    char ack;
+    if (gnutls_record_recv(session, &ack, 1) != 1)
+        return 1;
+    std::chrono::duration<double> const elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << "kTLS send: " << (ktls_send ? "yes" : "no") << ", kTLS recv: "
+              << (ktls_recv ? "yes" : "no") << std::endl
+              << total / 1000000 << " MB in " << elapsed.count() << " s: "
+              << total / 1e6 / elapsed.count() << " MB/s" << std::endl;
+
+    gnutls_deinit(session);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t const total =
+        static_cast<size_t>(argc > 1 ? std::atoi(argv[1]) : 1000) * 1000000;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    gnutls_global_init();
+
+    /* listen on a free port of the loopback interface */
+    int const listener = socket(AF_INET, SOCK_STREAM, 0);
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) != 0 ||
+        listen(listener, 1) != 0 ||
+        getsockname(listener, reinterpret_cast<struct sockaddr *>(&addr),
+                    &addrlen) != 0) {
+        std::cerr << "cannot listen: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    pid_t const pid = fork();
+    if (pid < 0) {
+        std::cerr << "cannot fork: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    if (pid == 0) {
+        int const fd = accept(listener, NULL, NULL);
+        close(listener);
+        return fd < 0 ? 1 : tlsbench_receive(fd, total);
+    }
+
+    close(listener);
+    int const fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                          sizeof(addr)) != 0) {
+        std::cerr << "cannot connect: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    int result = tlsbench_send(fd, total);
+    close(fd);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result = 1;
+
+    gnutls_global_deinit();
+    return result;
+}
@@ -37,6 +37,254 @@
 
 #include <namespaces.hh>
 
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+extern xmlnode greymatter__;
+
+/** seconds prefetched results are kept, if they are not cached anyway */
+#define XDB_PREFETCH_TTL 10
+
+/** maximum number of prefetched results, if the cache is not configured */
+#define XDB_PREFETCH_MAXENTRIES 1000
+
+/** key of an entry in the read-through cache: namespace and owner */
+typedef std::pair<std::string, std::string> xdb_readcache_key;
+
+/**
+ * an entry in the read-through cache
+ */
+typedef struct xdb_readcache_entry_struct {
+    xmlnode data;  /**< copy of the result, NULL if there has been no data */
+    time_t stored; /**< when the result has been stored */
+    int ttl;       /**< seconds the result stays valid */
+    std::list<xdb_readcache_key>::iterator lru; /**< position in ::lru */
+} _xdb_readcache_entry;
+
+/**
+ * read-through cache for xdb_get() results of an xdbcache
+ *
+ * The cache is configured in the &lt;xdbcache/&gt; element inside the
+ * &lt;global/&gt; section of the configuration file. Entries expire after
+ * a TTL and the least recently used entries get removed if the cache is full.
+ * Sets sent through the same xdbcache remove the entry they modify.
+ *
+ * Results fetched by xdb_prefetch() are kept for a short time even if the
+ * cache is not configured.
+ */
+typedef struct xdb_readcache_struct {
+    int ttl;                  /**< seconds an entry stays valid */
+    unsigned int maxentries;  /**< maximum number of cached results */
+    std::set<std::string> namespaces; /**< namespaces to cache, all if empty */
+    std::map<xdb_readcache_key, _xdb_readcache_entry>
+        entries;                         /**< the cached results */
+    std::list<xdb_readcache_key> lru;    /**< keys, most recently used first */
+    unsigned int generation;  /**< incremented on each invalidation */
+    unsigned long hits;       /**< number of results served from the cache */
+    unsigned long misses;     /**< number of results not in the cache */
+} * xdb_readcache, _xdb_readcache;
+
+/**
+ * remove an entry from the read-through cache
+ *
+ * @param rc the read-through cache
+ * @param entry iterator pointing to the entry
+ */
+static void
+xdb_readcache_erase(xdb_readcache rc,
+                    std::map<xdb_readcache_key, _xdb_readcache_entry>::iterator
+                        entry) {
+    if (entry->second.data != NULL)
+        xmlnode_free(entry->second.data);
+    rc->lru.erase(entry->second.lru);
+    rc->entries.erase(entry);
+}
+
+/**
+ * invalidate cached results
+ *
+ * @param rc the read-through cache (may be NULL)
+ * @param owner owner of the results to invalidate, NULL for all owners
+ * @param ns namespace of the results to invalidate, NULL for all namespaces
+ */
+static void xdb_readcache_invalidate(xdb_readcache rc, char const *owner,
+                                     char const *ns) {
+    std::map<xdb_readcache_key, _xdb_readcache_entry>::iterator entry;
+
+    if (rc == NULL)
+        return;
+
+    /* results of gets that are still in flight are not stored anymore */
+    rc->generation++;
+
+    if (ns != NULL && owner != NULL) {
+        entry = rc->entries.find(xdb_readcache_key(ns, owner));
+        if (entry != rc->entries.end())
+            xdb_readcache_erase(rc, entry);
+        return;
+    }
+
+    entry = ns == NULL ? rc->entries.begin()
+                       : rc->entries.lower_bound(xdb_readcache_key(ns, ""));
+    while (entry != rc->entries.end() &&
+           (ns == NULL || entry->first.first == ns)) {
+        std::map<xdb_readcache_key, _xdb_readcache_entry>::iterator next =
+            entry;
+        ++next;
+        if (owner == NULL || entry->first.second == owner)
+            xdb_readcache_erase(rc, entry);
+        entry = next;
+    }
+}
+
+/**
+ * get a result from the read-through cache
+ *
+ * @param rc the read-through cache (may be NULL)
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @param found set to 1 if the result has been in the cache, 0 else
+ * @return copy of the cached result (to be freed by the caller), NULL if not
+ * cached or the cached result has been empty
+ */
+static xmlnode xdb_readcache_get(xdb_readcache rc, jid owner, char const *ns,
+                                 int *found) {
+    std::map<xdb_readcache_key, _xdb_readcache_entry>::iterator entry;
+
+    *found = 0;
+    if (rc == NULL)
+        return NULL;
+
+    entry = rc->entries.find(xdb_readcache_key(ns, jid_full(owner)));
+    if (entry == rc->entries.end()) {
+        rc->misses++;
+        return NULL;
+    }
+
+    /* expired? */
+    if (time(NULL) - entry->second.stored > entry->second.ttl) {
+        xdb_readcache_erase(rc, entry);
+        rc->misses++;
+        return NULL;
+    }
+
+    /* move to the front of the LRU list */
+    rc->lru.splice(rc->lru.begin(), rc->lru, entry->second.lru);
+
+    *found = 1;
+    rc->hits++;
+    return entry->second.data ? xmlnode_dup(entry->second.data) : NULL;
+}
+
+/**
+ * store a result in the read-through cache
+ *
+ * @param rc the read-through cache (may be NULL)
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @param data the result (gets copied), NULL if there has been no data
+ * @param prefetched if the result has been requested by xdb_prefetch()
+ */
+static void xdb_readcache_put(xdb_readcache rc, jid owner, char const *ns,
+                              xmlnode data, int prefetched) {
+    std::map<xdb_readcache_key, _xdb_readcache_entry>::iterator entry;
+    xdb_readcache_key key;
+    _xdb_readcache_entry new_entry;
+    unsigned int capacity = 0;
+    int cacheable = 0;
+
+    if (rc == NULL)
+        return;
+
+    /* is this a result we cache? */
+    cacheable = rc->maxentries > 0 &&
+                (rc->namespaces.empty() || rc->namespaces.count(ns) > 0);
+    if (!cacheable && !prefetched)
+        return;
+    capacity = rc->maxentries > 0 ? rc->maxentries : XDB_PREFETCH_MAXENTRIES;
+
+    /* replace an existing entry */
+    key = xdb_readcache_key(ns, jid_full(owner));
+    entry = rc->entries.find(key);
+    if (entry != rc->entries.end())
+        xdb_readcache_erase(rc, entry);
+
+    /* make room for the new entry */
+    while (rc->entries.size() >= capacity)
+        xdb_readcache_erase(rc, rc->entries.find(rc->lru.back()));
+
+    rc->lru.push_front(key);
+    new_entry.data = data ? xmlnode_dup(data) : NULL;
+    new_entry.stored = time(NULL);
+    new_entry.ttl = cacheable ? rc->ttl : XDB_PREFETCH_TTL;
+    new_entry.lru = rc->lru.begin();
+    rc->entries[key] = new_entry;
+}
+
+/**
+ * free the read-through cache, when the instance gets freed
+ *
+ * @param arg the read-through cache
+ */
+static void xdb_readcache_free(void *arg) {
+    xdb_readcache rc = static_cast<xdb_readcache>(arg);
+
+    xdb_readcache_invalidate(rc, NULL, NULL);
+    delete rc;
+}
+
+/**
+ * create the read-through cache for an xdbcache
+ *
+ * If the cache is not configured, it only keeps prefetched results.
+ *
+ * @param id the instance the xdbcache is created for
+ * @return the read-through cache
+ */
+static xdb_readcache xdb_readcache_new(instance id) {
+    xht namespaces = NULL;
+    xmlnode config = NULL;
+    xdb_readcache rc = NULL;
+
+    rc = new _xdb_readcache();
+    pool_cleanup(id->p, xdb_readcache_free, rc);
+
+    namespaces = xhash_new(3);
+    xhash_put(namespaces, "", const_cast<char *>(NS_JABBERD_CONFIGFILE));
+    config = xmlnode_get_list_item(
+        xmlnode_get_tags(greymatter__, "global/xdbcache", namespaces), 0);
+    if (config == NULL) {
+        xhash_free(namespaces);
+        return rc;
+    }
+
+    rc->ttl = j_atoi(
+        xmlnode_get_list_item_data(xmlnode_get_tags(config, "ttl", namespaces),
+                                   0),
+        60);
+    rc->maxentries = j_atoi(xmlnode_get_list_item_data(
+                                xmlnode_get_tags(config, "maxentries",
+                                                 namespaces),
+                                0),
+                            1000);
+    xmlnode_vector cached_namespaces =
+        xmlnode_get_tags(config, "namespace", namespaces);
+    for (xmlnode_vector::iterator ns = cached_namespaces.begin();
+         ns != cached_namespaces.end(); ++ns) {
+        char const *ns_iri = xmlnode_get_data(*ns);
+        if (ns_iri != NULL)
+            rc->namespaces.insert(ns_iri);
+    }
+    xhash_free(namespaces);
+
+    log_debug2(ZONE, LOGT_STORAGE | LOGT_INIT,
+               "xdb read-through cache for %s: ttl %i, %u entries", id->id,
+               rc->ttl, rc->maxentries);
+    return rc;
+}
+
 /**
  * ::o_PRECOND packet handler that filters the packets incoming for the instance
  * to look for xdb packets
@@ -60,6 +308,20 @@ static result xdb_results(instance id, dpacket p, void *arg) {
     log_debug2(ZONE, LOGT_STORAGE, "xdb_results checking xdb packet %s",
                xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
 
+    // explicit invalidation of the read-through cache (as xdb results are
+    // shipped as normal packets, it is a result with action='invalidate')
+    if (j_strcmp(xmlnode_get_attrib_ns(p->x, "action", NULL), "invalidate") ==
+        0) {
+        jid owner = jid_new(p->p, xmlnode_get_attrib_ns(p->x, "owner", NULL));
+
+        pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
+        xdb_readcache_invalidate(xc->readcache, owner ? jid_full(owner) : NULL,
+                                 xmlnode_get_attrib_ns(p->x, "ns", NULL));
+        pth_mutex_release(&(xc->mutex));
+        pool_free(p->p);
+        return r_DONE;
+    }
+
     // we need an id on the xdb as this is what we use to find the query this
     // result is for
     if ((idstr = xmlnode_get_attrib_ns(p->x, "id", NULL)) == NULL)
@@ -135,6 +397,8 @@ static void xdb_deliver(instance i, xdbcache xc) {
     xmlnode_put_attrib_ns(x, "to", NULL, NULL, jid_full(xc->owner));
     xmlnode_put_attrib_ns(x, "from", NULL, NULL, i->id);
     xmlnode_put_attrib_ns(x, "ns", NULL, NULL, xc->ns);
+    if (!xc->set && xc->batch != NULL)
+        xmlnode_put_attrib_ns(x, "batch", NULL, NULL, xc->batch);
     ids << xc->id;
     xmlnode_put_attrib_ns(x, "id", NULL, NULL,
                           ids.str().c_str()); /* to track response */
@@ -190,6 +454,15 @@ static result xdb_thump(void *arg) {
         cur = next;
     }
 
+    if (xc->readcache != NULL) {
+        log_debug2(ZONE, LOGT_STORAGE,
+                   "xdb read-through cache of %s: %u entries, %lu hits, %lu "
+                   "misses",
+                   xc->i->id,
+                   static_cast<unsigned int>(xc->readcache->entries.size()),
+                   xc->readcache->hits, xc->readcache->misses);
+    }
+
     pth_mutex_release(&(xc->mutex));
     return r_DONE;
 }
@@ -220,6 +493,7 @@ xdbcache xdb_cache(instance id) {
     newx->next = newx->prev = newx; /* init ring */
     pth_mutex_init(
         &(newx->mutex)); // init mutex that protects the access to the xdbcache
+    newx->readcache = xdb_readcache_new(id);
 
     /* register the handler in the instance to filter out xdb results */
     register_phandler(id, o_PRECOND, xdb_results, (void *)newx);
@@ -243,6 +517,8 @@ xdbcache xdb_cache(instance id) {
 xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     _xdbcache newx;
     xmlnode x;
+    int cached = 0;
+    unsigned int generation = 0;
     /* pth_cond_t cond = PTH_COND_INIT; */
 
     if (xc == NULL || owner == NULL || ns == NULL) {
@@ -250,11 +526,25 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
         return NULL;
     }
 
+    /* do we have the result in the read-through cache? */
+    if (xc->readcache != NULL) {
+        pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
+        x = xdb_readcache_get(xc->readcache, owner, ns, &cached);
+        generation = xc->readcache->generation;
+        pth_mutex_release(&(xc->mutex));
+        if (cached) {
+            log_debug2(ZONE, LOGT_STORAGE, "xdb_get() cache hit for %s %s",
+                       jid_full(owner), ns);
+            return x;
+        }
+    }
+
     /* init this newx */
     newx.i = NULL;
     newx.set = 0;
     newx.data = NULL;
     newx.ns = ns;
+    newx.batch = NULL;
     newx.owner = owner;
     newx.sent = time(NULL);
     newx.preblock = 1; /* flag */
@@ -289,6 +579,14 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
          x = xmlnode_get_nextsibling(x))
         ;
 
+    /* keep a copy of the result, if nothing has been invalidated meanwhile */
+    if (xc->readcache != NULL && newx.data != NULL) {
+        pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
+        if (xc->readcache->generation == generation)
+            xdb_readcache_put(xc->readcache, owner, ns, x, 0);
+        pth_mutex_release(&(xc->mutex));
+    }
+
     /* there were no children (results) to the xdb request, free the packet */
     if (x == NULL)
         xmlnode_free(newx.data);
@@ -296,6 +594,125 @@ xmlnode xdb_get(xdbcache xc, jid owner, const char *ns) {
     return x;
 }
 
+/**
+ * fetch the data of several namespaces for a user in a single xdb request
+ *
+ * The results are kept in the read-through cache, so that following calls of
+ * xdb_get() for these namespaces do not have to wait for the xdb again.
+ * Namespaces that are already cached or not handled by the same xdb
+ * component as the first namespace are skipped.
+ *
+ * Blocks until the results are retrieved, host must map back to this service!
+ *
+ * @param xc the xdbcache used for this query
+ * @param owner for which JID the query should be made
+ * @param namespaces NULL terminated list of namespaces to query
+ */
+void xdb_prefetch(xdbcache xc, jid owner, char const *const *namespaces) {
+    _xdbcache newx;
+    xmlnode x = NULL;
+    xmlnode cur = NULL;
+    int cached = 0;
+    int count = 0;
+    unsigned int generation = 0;
+    char const *first_ns = NULL;
+    std::string batch;
+
+    if (xc == NULL || owner == NULL || namespaces == NULL ||
+        xc->readcache == NULL)
+        return;
+
+    /* which namespaces do we have to request? */
+    pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
+    for (; *namespaces != NULL; namespaces++) {
+        if (first_ns != NULL &&
+            !deliver_xdb_same_instance(owner->get_domain().c_str(), first_ns,
+                                       *namespaces))
+            continue;
+
+        x = xdb_readcache_get(xc->readcache, owner, *namespaces, &cached);
+        if (cached) {
+            xmlnode_free(x);
+            continue;
+        }
+
+        if (first_ns == NULL)
+            first_ns = *namespaces;
+        else
+            batch += " ";
+        batch += *namespaces;
+        count++;
+    }
+    generation = xc->readcache->generation;
+    pth_mutex_release(&(xc->mutex));
+
+    /* not worth a batched request */
+    if (count < 2)
+        return;
+
+    /* init this newx */
+    newx.i = NULL;
+    newx.set = 0;
+    newx.data = NULL;
+    newx.ns = first_ns;
+    newx.batch = batch.c_str();
+    newx.owner = owner;
+    newx.sent = time(NULL);
+    newx.preblock = 1; /* flag */
+    pth_cond_init(&(newx.cond));
+
+    pth_mutex_acquire(&(xc->mutex), FALSE, NULL);
+    newx.id = xc->id++;
+    newx.next = xc->next;
+    newx.prev = xc;
+    newx.next->prev = &newx;
+    xc->next = &newx;
+
+    /* send it on it's way, holding the lock */
+    xdb_deliver(xc->i, &newx);
+
+    log_debug2(ZONE, LOGT_STORAGE | LOGT_THREAD,
+               "xdb_prefetch() waiting for %s %s", jid_full(owner),
+               batch.c_str());
+    if (newx.preblock)
+        pth_cond_await(&(newx.cond), &(xc->mutex), NULL); /* blocks thread */
+
+    /* nothing returned, or something has been invalidated meanwhile */
+    if (newx.data == NULL || xc->readcache->generation != generation) {
+        pth_mutex_release(&(xc->mutex));
+        if (newx.data != NULL)
+            xmlnode_free(newx.data);
+        return;
+    }
+
+    /* keep the results */
+    for (x = xmlnode_get_firstchild(newx.data); x != NULL;
+         x = xmlnode_get_nextsibling(x)) {
+        if (xmlnode_get_type(x) != NTYPE_TAG)
+            continue;
+
+        /* xdb handler does not support batches, we only got the first ns */
+        if (j_strcmp(xmlnode_get_namespace(x), NS_JABBERD_XDBBATCH) != 0) {
+            xdb_readcache_put(xc->readcache, owner, first_ns, x, 1);
+            break;
+        }
+
+        for (cur = xmlnode_get_firstchild(x);
+             cur != NULL && xmlnode_get_type(cur) != NTYPE_TAG;
+             cur = xmlnode_get_nextsibling(cur))
+            ;
+        xdb_readcache_put(xc->readcache, owner,
+                          xmlnode_get_attrib_ns(x, "ns", NULL), cur, 1);
+    }
+    pth_mutex_release(&(xc->mutex));
+
+    log_debug2(ZONE, LOGT_STORAGE | LOGT_THREAD,
+               "xdb_prefetch() done waiting for %s %s", jid_full(owner),
+               batch.c_str());
+
+    xmlnode_free(newx.data);
+}
+
 /* sends new xml xdb action, data is NOT freed, app responsible for freeing it
  */
 /* act must be NULL, "check", or "insert" for now, insert will either blindly
@@ -319,6 +736,7 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const *act,
     newx.set = 1;
     newx.data = data;
     newx.ns = ns;
+    newx.batch = NULL;
     newx.act = act;
     newx.match = match;
     newx.matchpath = matchpath;
@@ -337,6 +755,9 @@ static int _xdb_act(xdbcache xc, jid owner, const char *ns, char const *act,
     newx.next->prev = &newx;
     xc->next = &newx;
 
+    /* the cached result will be outdated */
+    xdb_readcache_invalidate(xc->readcache, jid_full(owner), ns);
+
     /* send it on it's way */
     xdb_deliver(xc->i, &newx);
 
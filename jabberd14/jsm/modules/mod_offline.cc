@@ -115,16 +115,12 @@ static mreturn mod_offline_message(mapi m, modoffline_conf conf) {
     for (cur = xmlnode_get_firstchild(m->packet->x); cur != NULL;
          cur = xmlnode_get_nextsibling(cur)) {
         if (NSCHECK(cur, NS_EVENT)) {
-            if (xmlnode_get_list_item(
-                    xmlnode_get_tags(cur, "event:id",
-                                     m->si->std_namespace_prefixes),
-                    0) != NULL)
+            if (xmlnode_get_first_tag(cur, "event:id",
+                                      m->si->std_namespace_prefixes) != NULL)
                 return M_PASS; /* bah, we don't want to store events offline
                                   (XXX: do we?) */
-            if (xmlnode_get_list_item(
-                    xmlnode_get_tags(cur, "event:offline",
-                                     m->si->std_namespace_prefixes),
-                    0) != NULL)
+            if (xmlnode_get_first_tag(cur, "event:offline",
+                                      m->si->std_namespace_prefixes) != NULL)
                 break; /* cur remaining set is the flag */
         }
     }
@@ -132,10 +128,8 @@ static mreturn mod_offline_message(mapi m, modoffline_conf conf) {
     log_debug2(ZONE, LOGT_DELIVER, "handling message for %s",
                m->user->id->get_node().c_str());
 
-    if ((cur2 = xmlnode_get_list_item(
-             xmlnode_get_tags(m->packet->x, "expire:x",
-                              m->si->std_namespace_prefixes),
-             0)) != NULL) {
+    if ((cur2 = xmlnode_get_first_tag(m->packet->x, "expire:x",
+                                      m->si->std_namespace_prefixes)) != NULL) {
         if (j_atoi(xmlnode_get_attrib_ns(cur2, "seconds", NULL), 0) == 0)
             return M_PASS;
 
@@ -284,9 +278,8 @@ static int mod_offline_check_expired(mapi m, xmlnode message) {
     int diff = 0;
     char str[11];
     int now = time(NULL);
-    xmlnode x = xmlnode_get_list_item(
-        xmlnode_get_tags(message, "expire:x", m->si->std_namespace_prefixes),
-        0);
+    xmlnode x = xmlnode_get_first_tag(message, "expire:x",
+                                      m->si->std_namespace_prefixes);
 
     /* messages without expire information will never expire */
     if (x == NULL)
@@ -76,7 +76,7 @@ static mreturn mod_useridpolicy_new(mapi m, void *arg) {
         jid_new(m->packet->p, "invalid"); /* for 'invalid' as domain see RFC
                                              2606, we just need any domain */
     jid_set(user_jid, username, JID_USER);
-    username = user_jid->get_node().c_str();
+    username = pstrdup(m->packet->p, user_jid->get_node().c_str());
 
     /* get configuration, disable the module if not configured */
     if ((config = js_config(m->si, "jsm:mod_useridpolicy", NULL)) == NULL)
@@ -425,10 +425,18 @@ void js_session_end(session s, char const *reason) {
  * Calles all registered modules for the event e_SESSION and notifies them about
  * the newly created session
  *
+ * The data the modules read when a session starts is prefetched using a single
+ * xdb request before.
+ *
  * @param arg the newly created session
  */
 void _js_session_start(void *arg) {
     session s = (session)arg;
+    char const *const prefetch[] = {NS_ROSTER, NS_PRIVACY, NS_OFFLINE, NS_LAST,
+                                    NULL};
+
+    /* get the user's data the modules will ask for */
+    xdb_prefetch(s->si->xc, s->u->id, prefetch);
 
     /* let the modules go to it */
     js_mapi_call(s->si, e_SESSION, NULL, s->u, s);
@@ -35,18 +35,60 @@
 #include <hash.hh>
 #include <namespaces.hh>
 
+#include <cerrno>
+#include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <stdexcept>
+#include <unistd.h>
 #include <vector>
 
 namespace xmppd {
 namespace proxy65 {
-proxy65::proxy65(instance i, xmlnode x) : instance_base(i, x) {
+
+/**
+ * maximum number of bytes relayed by a single read
+ */
+static size_t const relay_chunk = 65536;
+
+/**
+ * maximum number of reads from one socket per event, before other sockets get
+ * processed
+ */
+static int const relay_rounds = 16;
+
+/**
+ * minimum number of bytes a connection has to be allowed to read, before it
+ * gets throttled
+ */
+static size_t const shaping_min_read = 1024;
+
+/**
+ * minimum size of the burst of a token_bucket
+ */
+static size_t const shaping_min_burst = 4096;
+
+/**
+ * seconds between measurements of the throughput
+ */
+static int const shaping_measure_interval = 5;
+
+proxy65::proxy65(instance i, xmlnode x)
+    : instance_base(i, x), shaper_running(false), jid_rate(0), stream_rate(0) {
     // allocate our standard namespace prefixes
     std_namespace_prefixes = xhash_new(3);
     xhash_put(std_namespace_prefixes, "", const_cast<char *>(NS_SERVER));
     xhash_put(std_namespace_prefixes, "bytestreams",
               const_cast<char *>(NS_BYTESTREAMS));
+    xhash_put(std_namespace_prefixes, "proxy65",
+              const_cast<char *>(NS_JABBERD_CONFIG_PROXY65));
+
+    // read the bandwidth limits
+    configurate();
+
+    // measure the throughput regularily
+    gettimeofday(&last_measured, NULL);
+    set_heartbeat_interval(shaping_measure_interval);
 
     // open the socket to listen on
     // XXX IP and port needs to be configurable, fixed for now
@@ -54,6 +96,49 @@ proxy65::proxy65(instance i, xmlnode x) : instance_base(i, x) {
                MIO_LISTEN_RAW);
 }
 
+void proxy65::configurate() {
+    xmlnode config = get_instance_config();
+
+    global_bucket.set_rate(j_atoi(
+        xmlnode_get_data(xmlnode_get_list_item(
+            xmlnode_get_tags(config, "proxy65:bandwidth/proxy65:global",
+                             std_namespace_prefixes),
+            0)),
+        0));
+    stream_rate = j_atoi(
+        xmlnode_get_data(xmlnode_get_list_item(
+            xmlnode_get_tags(config, "proxy65:bandwidth/proxy65:stream",
+                             std_namespace_prefixes),
+            0)),
+        0);
+
+    // rates for entities, either the default or for a specific entity
+    xmlnode_vector jid_elements = xmlnode_get_tags(
+        config, "proxy65:bandwidth/proxy65:jid", std_namespace_prefixes);
+    for (xmlnode_vector::iterator p = jid_elements.begin();
+         p != jid_elements.end(); ++p) {
+        size_t rate = j_atoi(xmlnode_get_data(*p), 0);
+        char const *jid_attrib = xmlnode_get_attrib_ns(*p, "jid", NULL);
+        if (jid_attrib == NULL) {
+            jid_rate = rate;
+            continue;
+        }
+
+        jid entity = jid_new(xmlnode_pool(config), jid_attrib);
+        if (entity == NULL) {
+            log(warn) << "ignoring bandwidth for invalid JID " << jid_attrib;
+            continue;
+        }
+        jid_rates[jid_full(jid_user(entity))] = rate;
+    }
+
+    log_debug2(ZONE, LOGT_INIT,
+               "bandwidth limits: global %zu, per JID %zu (%zu special), per "
+               "stream %zu B/s",
+               global_bucket.get_rate(), jid_rate, jid_rates.size(),
+               stream_rate);
+}
+
 void proxy65::conn_accepted_wrapper(mio m, int state, void *arg,
                                     xmlnode unused1, char *unused2,
                                     int unused3) {
@@ -135,6 +220,36 @@ result proxy65::iq_disco_info(jpacket p) {
 
     switch (jpacket_subtype(p)) {
         case JPACKET__GET:
+            // request for the bandwidth statistics?
+            if (j_strcmp(xmlnode_get_attrib_ns(p->iq, "node", NULL),
+                         "bandwidth") == 0) {
+                jutil_iqresult(p->x);
+                p->iq =
+                    xmlnode_insert_tag_ns(p->x, "query", NULL, NS_DISCO_INFO);
+                xmlnode_put_attrib_ns(p->iq, "node", NULL, NULL, "bandwidth");
+
+                size_t throttled_count = 0;
+                for (std::set<connected_sockets *>::iterator iter =
+                         active_connections.begin();
+                     iter != active_connections.end(); ++iter)
+                    if ((*iter)->is_throttled())
+                        throttled_count++;
+
+                std::ostringstream name;
+                name << "Forwarding " << global_bucket.get_throughput()
+                     << " B/s (limit: " << global_bucket.get_rate()
+                     << " B/s) on " << active_connections.size()
+                     << " bytestreams, " << throttled_count << " throttled";
+                x = xmlnode_insert_tag_ns(p->iq, "identity", NULL,
+                                          NS_DISCO_INFO);
+                xmlnode_put_attrib_ns(x, "category", NULL, NULL, "hierarchy");
+                xmlnode_put_attrib_ns(x, "type", NULL, NULL, "leaf");
+                xmlnode_put_attrib_ns(x, "name", NULL, NULL,
+                                      name.str().c_str());
+                deliver(p->x);
+                return r_DONE;
+            }
+
             jutil_iqresult(p->x);
             p->iq = xmlnode_insert_tag_ns(p->x, "query", NULL, NS_DISCO_INFO);
             x = xmlnode_insert_tag_ns(p->iq, "identity", NULL, NS_DISCO_INFO);
@@ -157,10 +272,68 @@ result proxy65::iq_disco_info(jpacket p) {
 }
 
 result proxy65::iq_disco_items(jpacket p) {
+    xmlnode x = NULL;
+    char const *node = NULL;
+
     switch (jpacket_subtype(p)) {
         case JPACKET__GET:
+            node = xmlnode_get_attrib_ns(p->iq, "node", NULL);
+            if (node != NULL && j_strcmp(node, "bandwidth") != 0) {
+                bounce_stanza(p->x, XTERROR_NOTFOUND);
+                return r_DONE;
+            }
+
             jutil_iqresult(p->x);
-            p->iq = xmlnode_insert_tag_ns(p->x, "query", NULL, NS_DISCO_ITEMS);
+            if (node == NULL) {
+                p->iq =
+                    xmlnode_insert_tag_ns(p->x, "query", NULL, NS_DISCO_ITEMS);
+                x = xmlnode_insert_tag_ns(p->iq, "item", NULL, NS_DISCO_ITEMS);
+                xmlnode_put_attrib_ns(x, "jid", NULL, NULL,
+                                      get_instance_id().c_str());
+                xmlnode_put_attrib_ns(x, "node", NULL, NULL, "bandwidth");
+                xmlnode_put_attrib_ns(x, "name", NULL, NULL, "Bandwidth");
+            } else {
+                p->iq =
+                    xmlnode_insert_tag_ns(p->x, "query", NULL, NS_DISCO_ITEMS);
+                xmlnode_put_attrib_ns(p->iq, "node", NULL, NULL, "bandwidth");
+
+                // the requesting entity gets the rates of its own bytestreams
+                std::string requestor = jid_full(jid_user(p->from));
+                std::map<std::string, token_bucket>::iterator owner_bucket =
+                    jid_buckets.find(requestor);
+                if (owner_bucket != jid_buckets.end()) {
+                    std::ostringstream name;
+                    name << requestor << ": "
+                         << owner_bucket->second.get_throughput()
+                         << " B/s (limit: " << owner_bucket->second.get_rate()
+                         << " B/s)";
+                    x = xmlnode_insert_tag_ns(p->iq, "item", NULL,
+                                              NS_DISCO_ITEMS);
+                    xmlnode_put_attrib_ns(x, "jid", NULL, NULL,
+                                          get_instance_id().c_str());
+                    xmlnode_put_attrib_ns(x, "name", NULL, NULL,
+                                          name.str().c_str());
+                }
+                for (std::set<connected_sockets *>::iterator iter =
+                         active_connections.begin();
+                     iter != active_connections.end(); ++iter) {
+                    if ((*iter)->get_owner() != requestor)
+                        continue;
+
+                    std::ostringstream name;
+                    name << (*iter)->get_identifier() << ": "
+                         << (*iter)->get_bucket().get_throughput()
+                         << " B/s (limit: " << (*iter)->get_bucket().get_rate()
+                         << " B/s), " << (*iter)->get_forwarded_traffic()
+                         << " B forwarded";
+                    x = xmlnode_insert_tag_ns(p->iq, "item", NULL,
+                                              NS_DISCO_ITEMS);
+                    xmlnode_put_attrib_ns(x, "jid", NULL, NULL,
+                                          get_instance_id().c_str());
+                    xmlnode_put_attrib_ns(x, "name", NULL, NULL,
+                                          name.str().c_str());
+                }
+            }
             deliver(p->x);
             return r_DONE;
         case JPACKET__SET: {
@@ -264,11 +437,33 @@ result proxy65::iq_bytestreams_activate(jpacket p) {
     std::ostringstream identifier;
     identifier << initiator << " -> " << target << " (" << sid << ")";
 
+    // the buckets shared with other connections: of the initiator and global
+    std::string owner = jid_full(jid_user(p->from));
+    std::map<std::string, token_bucket>::iterator owner_bucket =
+        jid_buckets.find(owner);
+    if (owner_bucket == jid_buckets.end()) {
+        std::map<std::string, size_t>::iterator configured =
+            jid_rates.find(owner);
+        owner_bucket =
+            jid_buckets
+                .insert(std::pair<std::string, token_bucket>(
+                    owner, token_bucket(configured == jid_rates.end()
+                                            ? jid_rate
+                                            : configured->second)))
+                .first;
+    }
+    std::vector<token_bucket *> shared_buckets;
+    shared_buckets.push_back(&owner_bucket->second);
+    shared_buckets.push_back(&global_bucket);
+
     // interconnect the two connections
     connected_sockets *new_conn = new connected_sockets(
-        matched_connections[0], matched_connections[1], identifier.str());
+        matched_connections[0], matched_connections[1], identifier.str(),
+        owner, stream_rate, shared_buckets);
     new_conn->event_closed().connect(
         sigc::mem_fun(*this, &proxy65::active_connection_disconnected));
+    new_conn->event_throttled().connect(
+        sigc::mem_fun(*this, &proxy65::active_connection_throttled));
     active_connections.insert(
         new_conn); // XXX protect this for the case that it
                    // diconnectes before it gets inserted
@@ -283,6 +478,20 @@ result proxy65::iq_bytestreams_activate(jpacket p) {
 
 void proxy65::active_connection_disconnected(connected_sockets *conn) {
     active_connections.erase(conn);
+    throttled_connections.erase(conn);
+
+    // forget the bucket of the owner, if this has been the last connection
+    bool owner_active = false;
+    for (std::set<connected_sockets *>::iterator p =
+             active_connections.begin();
+         p != active_connections.end(); ++p) {
+        if ((*p)->get_owner() == conn->get_owner()) {
+            owner_active = true;
+            break;
+        }
+    }
+    if (!owner_active)
+        jid_buckets.erase(conn->get_owner());
 
     log(notice) << "Reflected bytestream has been closed after transfering "
                 << conn->get_forwarded_traffic()
@@ -290,6 +499,79 @@ void proxy65::active_connection_disconnected(connected_sockets *conn) {
     delete conn;
 }
 
+void proxy65::active_connection_throttled(connected_sockets *conn,
+                                          long wait) {
+    struct timeval resume;
+    gettimeofday(&resume, NULL);
+    resume.tv_sec += wait / 1000;
+    resume.tv_usec += (wait % 1000) * 1000;
+    if (resume.tv_usec >= 1000000) {
+        resume.tv_sec++;
+        resume.tv_usec -= 1000000;
+    }
+    throttled_connections[conn] = resume;
+
+    // start the thread resuming the connections if not yet running
+    if (!shaper_running) {
+        shaper_running = true;
+        pth_attr_t attr = pth_attr_new();
+        pth_attr_set(attr, PTH_ATTR_JOINABLE, FALSE);
+        pth_spawn(attr, proxy65::shaper_thread, this);
+        pth_attr_destroy(attr);
+    }
+}
+
+void *proxy65::shaper_thread(void *arg) {
+    proxy65 *self = static_cast<proxy65 *>(arg);
+
+    while (!self->throttled_connections.empty()) {
+        // find the connection that resumes first
+        std::map<connected_sockets *, struct timeval>::iterator first =
+            self->throttled_connections.begin();
+        for (std::map<connected_sockets *, struct timeval>::iterator p =
+                 self->throttled_connections.begin();
+             p != self->throttled_connections.end(); ++p) {
+            if (timercmp(&p->second, &first->second, <))
+                first = p;
+        }
+
+        // wait until it has to resume
+        struct timeval now, wait;
+        gettimeofday(&now, NULL);
+        if (timercmp(&first->second, &now, >)) {
+            timersub(&first->second, &now, &wait);
+            pth_nap(pth_time(wait.tv_sec, wait.tv_usec));
+            continue; // connections might have changed in the meantime
+        }
+
+        // resuming might switch to other threads, that close connections
+        connected_sockets *conn = first->first;
+        self->throttled_connections.erase(first);
+        conn->resume();
+    }
+
+    self->shaper_running = false;
+    return NULL;
+}
+
+void proxy65::on_heartbeat() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double seconds = (now.tv_sec - last_measured.tv_sec) +
+                     (now.tv_usec - last_measured.tv_usec) / 1000000.0;
+    last_measured = now;
+
+    global_bucket.update_throughput(seconds);
+    for (std::map<std::string, token_bucket>::iterator p =
+             jid_buckets.begin();
+         p != jid_buckets.end(); ++p)
+        p->second.update_throughput(seconds);
+    for (std::set<connected_sockets *>::iterator p =
+             active_connections.begin();
+         p != active_connections.end(); ++p)
+        (*p)->get_bucket().update_throughput(seconds);
+}
+
 socks5stub::socks5stub(mio m) : current_state(state_connected), m(m) {
     mio_reset(m, socks5stub::mio_event_wrapper, this);
 
@@ -478,9 +760,70 @@ void socks5stub::on_closed() {
     disconnected(this);
 }
 
-connected_sockets::connected_sockets(socks5stub *socket1, socks5stub *socket2,
-                                     const std::string &identifier)
-    : identifier(identifier), forwarded_traffic(0) {
+token_bucket::token_bucket(size_t rate)
+    : rate(0), burst(0), tokens(0), counted(0), throughput(0) {
+    gettimeofday(&filled, NULL);
+    set_rate(rate);
+    tokens = burst;
+}
+
+void token_bucket::set_rate(size_t rate) {
+    this->rate = rate;
+    burst = rate / 4 > shaping_min_burst ? rate / 4 : shaping_min_burst;
+    if (tokens > burst)
+        tokens = burst;
+}
+
+size_t token_bucket::available(struct timeval const &now) {
+    if (rate == 0)
+        return SIZE_MAX;
+
+    double elapsed = (now.tv_sec - filled.tv_sec) +
+                     (now.tv_usec - filled.tv_usec) / 1000000.0;
+    if (elapsed > 0) {
+        tokens += elapsed * rate;
+        if (tokens > burst)
+            tokens = burst;
+        filled = now;
+    }
+
+    return tokens > 0 ? static_cast<size_t>(tokens) : 0;
+}
+
+void token_bucket::consume(size_t bytes) {
+    counted += bytes;
+    if (rate > 0)
+        tokens -= bytes;
+}
+
+long token_bucket::get_wait(size_t bytes) const {
+    if (rate == 0)
+        return 0;
+    if (bytes > burst)
+        bytes = burst;
+    if (tokens >= bytes)
+        return 0;
+    return static_cast<long>((bytes - tokens) * 1000 / rate) + 1;
+}
+
+void token_bucket::update_throughput(double seconds) {
+    throughput = seconds > 0 ? static_cast<size_t>(counted / seconds) : 0;
+    counted = 0;
+}
+
+connected_sockets::connected_sockets(
+    socks5stub *socket1, socks5stub *socket2, const std::string &identifier,
+    const std::string &owner, size_t rate,
+    const std::vector<token_bucket *> &shared_buckets)
+    : identifier(identifier), owner(owner), forwarded_traffic(0), bucket(rate),
+      throttling(false) {
+    for (int c = 0; c < 2; c++) {
+        pipes[c][0] = -1;
+        pipes[c][1] = -1;
+        buffer_start[c] = 0;
+        piped[c] = 0;
+    }
+
     // sanity checks
     if (!socket1 || !socket2)
         throw std::invalid_argument(
@@ -489,6 +832,11 @@ connected_sockets::connected_sockets(socks5stub *socket1, socks5stub *socket2,
         throw std::invalid_argument("socks5stub passed to connected_sockets "
                                     "constructor, that has no connection");
 
+    // the buckets this connection has to respect
+    buckets.push_back(&bucket);
+    buckets.insert(buckets.end(), shared_buckets.begin(),
+                   shared_buckets.end());
+
     // take over the connections
     this->sockets[0] = socket1->m;
     socket1->m = NULL;
@@ -517,11 +865,181 @@ connected_sockets::connected_sockets(socks5stub *socket1, socks5stub *socket2,
     // delete the passed sockets
     delete socket1;
     delete socket2;
+
+    // relay the data in the kernel if possible
+    if (!create_pipes()) {
+        log_debug2(ZONE, LOGT_IO, "relaying #%i and #%i through buffers",
+                   this->sockets[0]->fd, this->sockets[1]->fd);
+        buffers[0].resize(relay_chunk);
+        buffers[1].resize(relay_chunk);
+    }
+
+    // mio only has to tell us, when we can read or write
+    watch_sockets();
+}
+
+bool connected_sockets::create_pipes() {
+#ifdef HAVE_SPLICE
+    for (int c = 0; c < 2; c++) {
+        if (pipe2(pipes[c], O_NONBLOCK | O_CLOEXEC) != 0) {
+            log_warn(NULL, "cannot create pipe for splicing: %s",
+                     strerror(errno));
+            close_pipes();
+            return false;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t connected_sockets::get_allowance() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    size_t allowance = relay_chunk;
+    for (std::vector<token_bucket *>::iterator p = buckets.begin();
+         p != buckets.end(); ++p) {
+        size_t available = (*p)->available(now);
+        if (available < allowance)
+            allowance = available;
+    }
+
+    // enough bandwidth for a reasonable read?
+    if (allowance >= shaping_min_read)
+        return allowance;
+
+    // stop reading, until the exhausted buckets have been refilled
+    long wait = 0;
+    for (std::vector<token_bucket *>::iterator p = buckets.begin();
+         p != buckets.end(); ++p) {
+        long bucket_wait = (*p)->get_wait(shaping_min_read);
+        if (bucket_wait > wait)
+            wait = bucket_wait;
+    }
+    log_debug2(ZONE, LOGT_IO, "throttling %s for %li ms", identifier.c_str(),
+               wait);
+    throttling = true;
+    throttled(this, wait);
+    return 0;
+}
+
+ssize_t connected_sockets::fill_pipe(int socketindex, size_t max_bytes) {
+    ssize_t result = -1;
+
+#ifdef HAVE_SPLICE
+    if (pipes[socketindex][1] != -1) {
+        result =
+            splice(sockets[socketindex]->fd, NULL, pipes[socketindex][1], NULL,
+                   max_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } else
+#endif
+    {
+        if (max_bytes > buffers[socketindex].size())
+            max_bytes = buffers[socketindex].size();
+        result = read(sockets[socketindex]->fd, &buffers[socketindex][0],
+                      max_bytes);
+        buffer_start[socketindex] = 0;
+    }
+
+    if (result > 0)
+        piped[socketindex] = result;
+    return result;
+}
+
+ssize_t connected_sockets::drain_pipe(int socketindex) {
+    int othersocket = 1 - socketindex;
+    ssize_t result = -1;
+
+#ifdef HAVE_SPLICE
+    if (pipes[socketindex][0] != -1) {
+        result = splice(pipes[socketindex][0], NULL, sockets[othersocket]->fd,
+                        NULL, piped[socketindex],
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } else
+#endif
+    {
+        result = write(sockets[othersocket]->fd,
+                       &buffers[socketindex][buffer_start[socketindex]],
+                       piped[socketindex]);
+        if (result > 0)
+            buffer_start[socketindex] += result;
+    }
+
+    if (result > 0) {
+        piped[socketindex] -= result;
+        forwarded_traffic += result;
+    }
+    return result;
+}
+
+void connected_sockets::relay_data(int socketindex) {
+    int othersocket = 1 - socketindex;
+
+    for (int round = 0; round < relay_rounds; round++) {
+        // the sockets might have been closed in the meantime
+        if (!sockets[socketindex] || !sockets[othersocket])
+            return;
+
+        // write what has been read, after what mio_write() has queued
+        if (piped[socketindex] > 0) {
+            if (sockets[othersocket]->queue != NULL)
+                return;
+
+            if (drain_pipe(socketindex) < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    return;
+                log_debug2(ZONE, LOGT_IO, "writing to #%i failed: %s",
+                           sockets[othersocket]->fd, strerror(errno));
+                mio_close(sockets[othersocket]);
+                return;
+            }
+            if (piped[socketindex] > 0)
+                return;
+        }
+
+        // pipe is empty, read more data if the bandwidth allows it
+        if (throttling)
+            return;
+        size_t allowance = get_allowance();
+        if (allowance == 0)
+            return;
+
+        ssize_t read_bytes = fill_pipe(socketindex, allowance);
+        if (read_bytes == 0 ||
+            (read_bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+            // connection closed by peer or error
+            mio_close(sockets[socketindex]);
+            return;
+        }
+        if (read_bytes < 0)
+            return;
+
+        for (std::vector<token_bucket *>::iterator p = buckets.begin();
+             p != buckets.end(); ++p)
+            (*p)->consume(read_bytes);
+    }
+}
+
+void connected_sockets::watch_sockets() {
+    // read only into empty pipes while the bandwidth is not exceeded, wait
+    // for writeability if a pipe has data
+    for (int c = 0; c < 2; c++) {
+        if (sockets[c])
+            mio_watch(sockets[c], piped[c] == 0 && !throttling,
+                      piped[1 - c] > 0);
+    }
+}
+
+void connected_sockets::resume() {
+    throttling = false;
+    watch_sockets();
 }
 
 void connected_sockets::mio_event_wrapper(mio m, int state, void *arg,
-                                          xmlnode unused1, char *buffer,
-                                          int bufferlen) {
+                                          xmlnode unused1, char *unused2,
+                                          int unused3) {
     // sanity check
     if (arg == NULL || m == NULL)
         return;
@@ -536,10 +1054,13 @@ void connected_sockets::mio_event_wrapper(mio m, int state, void *arg,
         case MIO_CLOSED:
             static_cast<connected_sockets *>(arg)->on_closed(socketindex);
             break;
-        case MIO_BUFFER:
-            if (bufferlen > 0 && buffer != NULL)
-                static_cast<connected_sockets *>(arg)->on_data(
-                    socketindex, std::string(buffer, bufferlen));
+        case MIO_READABLE:
+            static_cast<connected_sockets *>(arg)->relay_data(socketindex);
+            static_cast<connected_sockets *>(arg)->watch_sockets();
+            break;
+        case MIO_WRITEABLE:
+            static_cast<connected_sockets *>(arg)->relay_data(1 - socketindex);
+            static_cast<connected_sockets *>(arg)->watch_sockets();
             break;
     }
 }
@@ -555,18 +1076,6 @@ void connected_sockets::on_closed(int socketindex) {
     closed(this);
 }
 
-void connected_sockets::on_data(int socketindex,
-                                const std::string &received_data) {
-    int othersocket = 1 - socketindex;
-
-    // send data received on the one socket to the other socket
-    if (sockets[othersocket]) {
-        forwarded_traffic += received_data.length();
-        mio_write(sockets[othersocket], NULL, received_data.c_str(),
-                  received_data.length());
-    }
-}
-
 void connected_sockets::close_sockets() {
     for (int c = 0; c < 2; c++) {
         if (sockets[c]) {
@@ -575,6 +1084,19 @@ void connected_sockets::close_sockets() {
             sockets[c] = NULL;
         }
     }
+    close_pipes();
+}
+
+void connected_sockets::close_pipes() {
+    for (int c = 0; c < 2; c++) {
+        for (int end = 0; end < 2; end++) {
+            if (pipes[c][end] != -1) {
+                close(pipes[c][end]);
+                pipes[c][end] = -1;
+            }
+        }
+        piped[c] = 0;
+    }
 }
 
 connected_sockets::~connected_sockets() {
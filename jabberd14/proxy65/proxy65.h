@@ -26,6 +26,8 @@
 #include <map>
 #include <set>
 #include <sigc++/sigc++.h>
+#include <sys/time.h>
+#include <vector>
 
 namespace xmppd {
 namespace proxy65 {
@@ -33,8 +35,88 @@ namespace proxy65 {
 // forward declaration
 class socks5stub;
 
+/**
+ * @brief limits the rate of forwarded data (token bucket)
+ *
+ * The bucket is refilled with rate bytes per second, up to a burst of a
+ * quarter second (at least 4 kB). A bucket with a rate of 0 does not limit
+ * anything, but still measures the throughput.
+ */
+class token_bucket {
+  public:
+    /**
+     * create a new bucket
+     *
+     * @param rate bytes per second, 0 for no limit
+     */
+    token_bucket(size_t rate = 0);
+
+    /**
+     * change the rate of the bucket
+     *
+     * @param rate bytes per second, 0 for no limit
+     */
+    void set_rate(size_t rate);
+
+    /**
+     * get the configured rate of the bucket
+     *
+     * @return bytes per second, 0 for no limit
+     */
+    size_t get_rate() const { return rate; }
+
+    /**
+     * refill the bucket and get the number of bytes that may be forwarded
+     *
+     * @param now the current time
+     * @return the number of bytes, SIZE_MAX if the bucket does not limit
+     */
+    size_t available(struct timeval const &now);
+
+    /**
+     * take bytes that have been forwarded out of the bucket
+     *
+     * @param bytes the number of forwarded bytes
+     */
+    void consume(size_t bytes);
+
+    /**
+     * get how long it takes until a number of bytes may be forwarded
+     *
+     * @param bytes the number of bytes (limited to the burst size)
+     * @return milliseconds to wait
+     */
+    long get_wait(size_t bytes) const;
+
+    /**
+     * calculate the throughput of the last interval, and start a new interval
+     *
+     * @param seconds length of the interval
+     */
+    void update_throughput(double seconds);
+
+    /**
+     * get the throughput measured in the last interval
+     *
+     * @return bytes per second
+     */
+    size_t get_throughput() const { return throughput; }
+
+  private:
+    size_t rate;           /**< bytes per second, 0 for no limit */
+    size_t burst;          /**< maximum number of tokens */
+    double tokens;         /**< bytes that may be forwarded right now */
+    struct timeval filled; /**< when the bucket has been refilled */
+    size_t counted;        /**< bytes forwarded in the current interval */
+    size_t throughput; /**< bytes per second in the last interval */
+};
+
 /**
  * @brief connects two sockets to each other
+ *
+ * The data is relayed with splice() through a pipe for each direction if
+ * possible, else through a buffer for each direction. mio only signals when
+ * the sockets can be read or written.
  */
 class connected_sockets {
   public:
@@ -49,9 +131,15 @@ class connected_sockets {
      * @param socket2 the other socket that gets connected
      * @param identifier an identifier for this connection (this identifier can
      * later be requested with get_identifier())
+     * @param owner the bare JID of the entity that activated the bytestream
+     * @param rate bytes per second for this connection (0 for no limit)
+     * @param shared_buckets further buckets limiting this connection (shared
+     * with other connections)
      */
     connected_sockets(socks5stub *socket1, socks5stub *socket2,
-                      const std::string &identifier);
+                      const std::string &identifier, const std::string &owner,
+                      size_t rate,
+                      const std::vector<token_bucket *> &shared_buckets);
 
     /**
      * destruct an instance of connected sockets, this will
@@ -66,6 +154,22 @@ class connected_sockets {
      */
     sigc::signal<void, connected_sockets *> &event_closed() { return closed; }
 
+    /**
+     * event that signals that the connection stopped reading, as it exceeded
+     * its bandwidth
+     *
+     * a pointer to the instance and the milliseconds after which resume()
+     * should be called get passed with the event
+     */
+    sigc::signal<void, connected_sockets *, long> &event_throttled() {
+        return throttled;
+    }
+
+    /**
+     * continue reading after the connection has been throttled
+     */
+    void resume();
+
     /**
      * get the amount of traffic that has been forwarded already
      *
@@ -80,12 +184,38 @@ class connected_sockets {
      */
     const std::string &get_identifier() { return identifier; }
 
+    /**
+     * get the entity that activated the bytestream
+     *
+     * @return the bare JID of the entity
+     */
+    const std::string &get_owner() { return owner; }
+
+    /**
+     * get the bucket limiting only this connection
+     *
+     * @return the bucket
+     */
+    token_bucket &get_bucket() { return bucket; }
+
+    /**
+     * check if the connection currently does not read because of its bandwidth
+     *
+     * @return true if throttled
+     */
+    bool is_throttled() { return throttling; }
+
   private:
     /**
      * the identifier for this connection
      */
     std::string identifier;
 
+    /**
+     * the bare JID of the entity that activated the bytestream
+     */
+    std::string owner;
+
     /**
      * Counter to remember the amount of bytes that have been forwarded
      */
@@ -96,6 +226,48 @@ class connected_sockets {
      */
     mio sockets[2];
 
+    /**
+     * pipes used to relay the data in the kernel with splice()
+     *
+     * pipes[i] holds the data read from sockets[i], that has not yet been
+     * written to the other socket. The file descriptors are -1 if the data is
+     * relayed through buffers instead.
+     */
+    int pipes[2][2];
+
+    /**
+     * buffers used to relay the data if it cannot be spliced
+     *
+     * buffers[i] holds the data read from sockets[i], starting at
+     * buffer_start[i]
+     */
+    std::vector<char> buffers[2];
+
+    /**
+     * offset of the data not yet written in each of the buffers
+     */
+    size_t buffer_start[2];
+
+    /**
+     * number of bytes in each of the pipes (or buffers)
+     */
+    size_t piped[2];
+
+    /**
+     * the bucket limiting only this connection
+     */
+    token_bucket bucket;
+
+    /**
+     * all buckets limiting this connection (including bucket)
+     */
+    std::vector<token_bucket *> buckets;
+
+    /**
+     * if the connection does not read as it exceeded its bandwidth
+     */
+    bool throttling;
+
     /**
      * static function, that can be registered as mio event handler,
      * will redirect the events to instance methods
@@ -104,12 +276,11 @@ class connected_sockets {
      * @param state the type of event
      * @param arg the connected_socket instance this call is for
      * @param unused1 not used
-     * @param buffer for MIO_BUFFER events this is the pointer to the read data
-     * @param bufferlen for MIO_BUFFER events this is the length of the read
-     * data
+     * @param unused2 not used
+     * @param unused3 not used
      */
     static void mio_event_wrapper(mio m, int state, void *arg, xmlnode unused1,
-                                  char *buffer, int bufferlen);
+                                  char *unused2, int unused3);
 
     /**
      * the event that handles if one of the connected sockets get closed
@@ -120,14 +291,50 @@ class connected_sockets {
     void on_closed(int socketindex);
 
     /**
-     * the event that handles data that has been received on one of the sockets,
-     * that are connected
+     * create the pipes used to relay the data with splice()
+     *
+     * @return true if the data can be relayed with splice(), false if it has
+     * to be relayed through buffers
+     */
+    bool create_pipes();
+
+    /**
+     * get the number of bytes that may be read without exceeding the
+     * bandwidth of the connection, and stop reading if it is exhausted
+     *
+     * @return the number of bytes, 0 if the connection got throttled
+     */
+    size_t get_allowance();
+
+    /**
+     * relay data from one socket to the other, as long as the sockets do not
+     * block and the bandwidth is not exceeded
+     *
+     * @param socketindex the index of the socket the data is read from
+     */
+    void relay_data(int socketindex);
+
+    /**
+     * read data from a socket into its pipe (or buffer)
+     *
+     * @param socketindex the index of the socket to read from
+     * @param max_bytes the maximum number of bytes to read
+     * @return the number of bytes read, 0 on end of stream, -1 on errors
+     */
+    ssize_t fill_pipe(int socketindex, size_t max_bytes);
+
+    /**
+     * write data from the pipe (or buffer) of a socket to the other socket
      *
-     * @param socketindex the index of the socket on which the data has been
-     * received
-     * @param received_data the data that has been received
+     * @param socketindex the index of the socket the data has been read from
+     * @return the number of bytes written, -1 on errors
+     */
+    ssize_t drain_pipe(int socketindex);
+
+    /**
+     * update which events mio should signal, after data has been relayed
      */
-    void on_data(int socketindex, const std::string &received_data);
+    void watch_sockets();
 
     /**
      * this signal gets fired if the connection of the two sockets ended
@@ -136,10 +343,21 @@ class connected_sockets {
      */
     sigc::signal<void, connected_sockets *> closed;
 
+    /**
+     * this signal gets fired if the connection stopped reading because of its
+     * bandwidth
+     */
+    sigc::signal<void, connected_sockets *, long> throttled;
+
     /**
      * closed the sockets that are connected, if they are not already closed
      */
     void close_sockets();
+
+    /**
+     * close the pipes used for splicing, if they are open
+     */
+    void close_pipes();
 };
 
 /**
@@ -297,7 +515,18 @@ class proxy65 : public instance_base {
      */
     proxy65(instance i, xmlnode x);
 
+  protected:
+    /**
+     * measure the throughput of the active connections
+     */
+    void on_heartbeat();
+
   private:
+    /**
+     * read the configuration of the instance
+     */
+    void configurate();
+
     /**
      * Signal handler that handles disconnected connections that where currently
      * doing the socks5 protocol
@@ -313,6 +542,24 @@ class proxy65 : public instance_base {
      */
     void active_connection_disconnected(connected_sockets *conn);
 
+    /**
+     * Signal handler that handles established connections that stopped reading
+     * because they exceeded their bandwidth
+     *
+     * @param conn the connected_sockets instance that got throttled
+     * @param wait milliseconds after which the connection should resume
+     */
+    void active_connection_throttled(connected_sockets *conn, long wait);
+
+    /**
+     * main function of the thread that resumes throttled connections, runs as
+     * long as there are throttled connections
+     *
+     * @param arg the ::proxy65 instance
+     * @return always NULL
+     */
+    static void *shaper_thread(void *arg);
+
     /**
      * Signal handler that handles connections that finished the socks5 protocol
      *
@@ -343,6 +590,53 @@ class proxy65 : public instance_base {
      */
     std::set<connected_sockets *> active_connections;
 
+    /**
+     * the connections, that do not read because they exceeded their bandwidth
+     *
+     * Key is the connection, value is the time when it should resume reading
+     */
+    std::map<connected_sockets *, struct timeval> throttled_connections;
+
+    /**
+     * if the thread resuming throttled connections is running
+     */
+    bool shaper_running;
+
+    /**
+     * bucket limiting the bandwidth of all connections together
+     */
+    token_bucket global_bucket;
+
+    /**
+     * buckets limiting the bandwidth of the connections of an entity
+     *
+     * Key is the bare JID of the entity that activated the bytestreams
+     */
+    std::map<std::string, token_bucket> jid_buckets;
+
+    /**
+     * bytes per second for the connections of an entity, if not configured
+     * for the entity in jid_rates (0 for no limit)
+     */
+    size_t jid_rate;
+
+    /**
+     * bytes per second for the connections of configured entities
+     *
+     * Key is the bare JID of the entity
+     */
+    std::map<std::string, size_t> jid_rates;
+
+    /**
+     * bytes per second for each connection (0 for no limit)
+     */
+    size_t stream_rate;
+
+    /**
+     * when the throughput has been measured the last time
+     */
+    struct timeval last_measured;
+
     /**
      * method that handles newly accepted connections
      *
@@ -0,0 +1,255 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2007-2019 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/**
+ * @file relaybench.cc
+ * @brief loopback throughput benchmark of the bytestream relay
+ *
+ * Relays data between two TCP connections on the loopback interface, once
+ * through a user space buffer (read() and write(), like proxy65 does without
+ * splice()) and once through a pipe with splice() (like
+ * connected_sockets::fill_pipe() and connected_sockets::drain_pipe()). Not
+ * installed, run it from the build directory:
+ *
+ * ./relaybench [megabytes]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * create a TCP connection on the loopback interface
+ *
+ * @param a set to one end of the connection
+ * @param b set to the other end of the connection
+ * @return true on success
+ */
+static bool relaybench_connection(int &a, int &b) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    int const listener = socket(AF_INET, SOCK_STREAM, 0);
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) != 0 ||
+        listen(listener, 1) != 0 ||
+        getsockname(listener, reinterpret_cast<struct sockaddr *>(&addr),
+                    &addrlen) != 0)
+        return false;
+
+    a = socket(AF_INET, SOCK_STREAM, 0);
+    if (a < 0 || connect(a, reinterpret_cast<struct sockaddr *>(&addr),
+                         sizeof(addr)) != 0)
+        return false;
+    b = accept(listener, NULL, NULL);
+    close(listener);
+    return b >= 0;
+}
+
+/**
+ * write data to a socket until the total is reached (the sender)
+ *
+ * @param fd the socket
+ * @param total number of bytes to write
+ */
+static void relaybench_source(int fd, size_t total) {
+    std::vector<char> buf(65536, 'x');
+
+    for (size_t sent = 0; sent < total;) {
+        size_t const chunk =
+            total - sent < buf.size() ? total - sent : buf.size();
+        ssize_t const len = write(fd, &buf[0], chunk);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return;
+        sent += len;
+    }
+}
+
+/**
+ * read from a socket until the connection is closed (the receiver)
+ *
+ * @param fd the socket
+ */
+static void relaybench_sink(int fd) {
+    std::vector<char> buf(65536);
+
+    for (;;) {
+        ssize_t const len = read(fd, &buf[0], buf.size());
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return;
+    }
+}
+
+/**
+ * relay data from one socket to an other through a user space buffer
+ *
+ * @param in the socket to read from
+ * @param out the socket to write to
+ * @return number of bytes relayed
+ */
+static size_t relaybench_buffered(int in, int out) {
+    std::vector<char> buf(8192);
+    size_t relayed = 0;
+
+    for (;;) {
+        ssize_t len = read(in, &buf[0], buf.size());
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return relayed;
+        for (ssize_t written = 0; written < len;) {
+            ssize_t const w = write(out, &buf[written], len - written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return relayed;
+            written += w;
+        }
+        relayed += len;
+    }
+}
+
+#ifdef HAVE_SPLICE
+/**
+ * relay data from one socket to an other through a pipe with splice()
+ *
+ * @param in the socket to read from
+ * @param out the socket to write to
+ * @return number of bytes relayed
+ */
+static size_t relaybench_splice(int in, int out) {
+    size_t relayed = 0;
+    int pipefd[2];
+
+    if (pipe(pipefd) != 0)
+        return 0;
+    for (;;) {
+        ssize_t piped = splice(in, NULL, pipefd[1], NULL, 65536, SPLICE_F_MOVE);
+        if (piped < 0 && errno == EINTR)
+            continue;
+        if (piped <= 0)
+            break;
+        while (piped > 0) {
+            ssize_t const w =
+                splice(pipefd[0], NULL, out, NULL, piped, SPLICE_F_MOVE);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                break;
+            piped -= w;
+            relayed += w;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return relayed;
+}
+#endif
+
+/**
+ * measure one relay function
+ *
+ * @param name name of the relay function
+ * @param relay the relay function
+ * @param total number of bytes to relay
+ */
+static void relaybench_run(char const *name, size_t (*relay)(int, int),
+                           size_t total) {
+    int src_out, relay_in, relay_out, sink_in;
+
+    if (!relaybench_connection(src_out, relay_in) ||
+        !relaybench_connection(relay_out, sink_in)) {
+        std::cerr << "cannot connect: " << std::strerror(errno) << std::endl;
+        return;
+    }
+
+    std::chrono::steady_clock::time_point const start =
+        std::chrono::steady_clock::now();
+
+    pid_t const source = fork();
+    if (source == 0) {
+        close(relay_in);
+        close(relay_out);
+        close(sink_in);
+        relaybench_source(src_out, total);
+        _exit(0);
+    }
+    close(src_out);
+
+    pid_t const sink = fork();
+    if (sink == 0) {
+        close(relay_in);
+        close(relay_out);
+        relaybench_sink(sink_in);
+        _exit(0);
+    }
+    close(sink_in);
+
+    size_t const relayed = relay(relay_in, relay_out);
+    close(relay_in);
+    close(relay_out);
+    waitpid(source, NULL, 0);
+    waitpid(sink, NULL, 0);
+
+    std::chrono::duration<double> const elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << relayed / 1000000 << " MB in "
+              << elapsed.count() << " s: " << relayed / 1e6 / elapsed.count()
+              << " MB/s" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    size_t const total =
+        static_cast<size_t>(argc > 1 ? std::atoi(argv[1]) : 1000) * 1000000;
+
+    relaybench_run("buffered", relaybench_buffered, total);
+#ifdef HAVE_SPLICE
+    relaybench_run("splice", relaybench_splice, total);
+#else
+    std::cout << "splice: not available" << std::endl;
+#endif
+
+    return 0;
+}
@@ -202,20 +202,22 @@ result resolver::on_stanza_packet(dpacket dp) {
     }
 
     // store the packet, so that we can forward it when it has been resolved,
-    // and start resolving
-    pending_jobs[dp->host] =
-        std::shared_ptr<resolver_job>(new resolver_job(*this, dp));
-    log(xmppd::notice) << "Created new resolver job: "
-                       << *(pending_jobs[dp->host]);
-    pending_jobs[dp->host]->register_result_callback(
+    // and start resolving (the job may complete immediately if everything is
+    // cached, keep it until start() returned)
+    std::shared_ptr<resolver_job> job(new resolver_job(*this, dp));
+    pending_jobs[dp->host] = job;
+    log(xmppd::notice) << "Created new resolver job: " << *job;
+    job->register_result_callback(
         sigc::mem_fun(*this, &xmppd::resolver::resolver::handle_completed_job));
+    job->start();
     return r_DONE;
 }
 
 result resolver::on_route_packet(dpacket dp) {
-    // only packets addressed to us directly (no default route) are accepted as
-    // routed packets
-    if (!dp->host || get_instance_id() != dp->host) {
+    // only packets addressed to us directly (no default route) or resolve
+    // requests of our dialback are accepted as routed packets
+    if ((!dp->host || get_instance_id() != dp->host) &&
+        !deliver_is_resolve_request(dp)) {
         return instance_base::on_route_packet(dp);
     }
 
@@ -24,6 +24,7 @@
 
 #include <jabberd.h>
 
+#include <dnscache.hh>
 #include <lwresc.hh>
 
 namespace xmppd {
@@ -114,6 +115,14 @@ class resolver_job {
      */
     ~resolver_job();
 
+    /**
+     * start resolving
+     *
+     * The job may complete before this method returns, if all records are
+     * cached. Therefore result callbacks have to be registered before.
+     */
+    void start();
+
     /**
      * add a packet that waits for the job to be completed
      *
@@ -225,6 +234,31 @@ class resolver_job {
      */
     void resolve_current_providing_host_a();
 
+    /**
+     * add the targets of SRV records to providing_hosts
+     *
+     * @param records the SRV records
+     */
+    void add_providing_hosts(std::vector<xmppd::dns_record> const &records);
+
+    /**
+     * add resolved addresses of the current_providing_host to the result
+     *
+     * @param records the AAAA or A records
+     * @param ipv6 true if these are AAAA records
+     */
+    void add_addresses(std::vector<xmppd::dns_record> const &records,
+                       bool ipv6);
+
+    /**
+     * check if a query failed because the name does not exist (and the
+     * failure can be cached)
+     *
+     * @param result the result of the query
+     * @return true if the name or the record type does not exist
+     */
+    static bool is_negative_result(xmppd::lwresc::lwresult const &result);
+
     /**
      * list of signals to disconnect on destruction
      */
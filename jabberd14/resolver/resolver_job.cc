@@ -58,8 +58,10 @@ resolver_job::resolver_job(resolver &owner, dpacket dp)
 
     // set current service
     current_service = resend_services.begin();
+}
 
-    // start resolving this service
+void resolver_job::start() {
+    // start resolving the first service
     start_resolving_service();
 }
 
@@ -86,6 +88,22 @@ void resolver_job::start_resolving_service() {
         name_to_resolve << std::string(current_service->get_service_prefix())
                         << "." << std::string(destination);
 
+        // already cached?
+        std::vector<xmppd::dns_record> records;
+        switch (xmppd::dns_cache::shared().get(
+            name_to_resolve.str(), xmppd::dns_cache::rr_srv, records)) {
+            case xmppd::dns_cache::lookup_hit:
+                add_providing_hosts(records);
+                resolve_providing_hosts();
+                return;
+            case xmppd::dns_cache::lookup_negative:
+                ++current_service;
+                start_resolving_service();
+                return;
+            default:
+                break;
+        }
+
         xmppd::lwresc::rrsetbyname query(name_to_resolve.str(), ns_c_in,
                                          ns_t_srv);
 
@@ -112,6 +130,8 @@ void resolver_job::start_resolving_service() {
 }
 
 void resolver_job::on_a_query_result(xmppd::lwresc::lwresult const &result) {
+    std::vector<xmppd::dns_record> records;
+
     // did we successfully get a result?
     if (result.getResult() == xmppd::lwresc::lwresult::res_success) {
         // we got a result, process it
@@ -126,26 +146,34 @@ void resolver_job::on_a_query_result(xmppd::lwresc::lwresult const &result) {
             // get the returned records
             std::vector<xmppd::lwresc::rrecord *> rrs = rrSet->getRR();
 
-            // iterate them to find SRV records
+            // iterate them to find A records
             for (std::vector<xmppd::lwresc::rrecord *>::const_iterator p =
                      rrs.begin();
                  p != rrs.end(); ++p) {
-                try {
-                    xmppd::lwresc::a_record const *rr =
-                        dynamic_cast<xmppd::lwresc::a_record const *>(*p);
-
-                    result_buffer << "," << rr->getAddress() << ":"
-                                  << current_providing_host->second;
-                } catch (std::bad_cast&) {
+                xmppd::lwresc::a_record const *rr =
+                    dynamic_cast<xmppd::lwresc::a_record const *>(*p);
+                if (rr == NULL) {
+                    continue;
                 }
+
+                xmppd::dns_record record = {rr->getAddress(), 0, 0, 0};
+                records.push_back(record);
             }
 
+            xmppd::dns_cache::shared().put(current_providing_host->first,
+                                           xmppd::dns_cache::rr_a, records,
+                                           rrSet->getTTL());
         } catch (std::bad_cast&) {
             // we expected to get a lwresult_rrset on successfull resolving of
             // our query
         }
+    } else if (is_negative_result(result)) {
+        xmppd::dns_cache::shared().put_negative(current_providing_host->first,
+                                                xmppd::dns_cache::rr_a);
     }
 
+    add_addresses(records, false);
+
     // resolve the next providing host
     ++current_providing_host;
 
@@ -154,6 +182,17 @@ void resolver_job::on_a_query_result(xmppd::lwresc::lwresult const &result) {
 }
 
 void resolver_job::resolve_current_providing_host_a() {
+    // already cached?
+    std::vector<xmppd::dns_record> records;
+    if (xmppd::dns_cache::shared().get(current_providing_host->first,
+                                       xmppd::dns_cache::rr_a, records) !=
+        xmppd::dns_cache::lookup_miss) {
+        add_addresses(records, false);
+        ++current_providing_host;
+        resolve_current_providing_host();
+        return;
+    }
+
     // create the query
     xmppd::lwresc::rrsetbyname query(current_providing_host->first, ns_c_in,
                                      ns_t_a);
@@ -169,6 +208,8 @@ void resolver_job::resolve_current_providing_host_a() {
 }
 
 void resolver_job::on_aaaa_query_result(xmppd::lwresc::lwresult const &result) {
+    std::vector<xmppd::dns_record> records;
+
     // did we successfully get a result?
     if (result.getResult() == xmppd::lwresc::lwresult::res_success) {
         // we got a result, process it
@@ -183,26 +224,34 @@ void resolver_job::on_aaaa_query_result(xmppd::lwresc::lwresult const &result) {
             // get the returned records
             std::vector<xmppd::lwresc::rrecord *> rrs = rrSet->getRR();
 
-            // iterate them to find SRV records
+            // iterate them to find AAAA records
             for (std::vector<xmppd::lwresc::rrecord *>::const_iterator p =
                      rrs.begin();
                  p != rrs.end(); ++p) {
-                try {
-                    xmppd::lwresc::aaaa_record const *rr =
-                        dynamic_cast<xmppd::lwresc::aaaa_record const *>(*p);
-
-                    result_buffer << ",[" << rr->getAddress()
-                                  << "]:" << current_providing_host->second;
-                } catch (std::bad_cast&) {
+                xmppd::lwresc::aaaa_record const *rr =
+                    dynamic_cast<xmppd::lwresc::aaaa_record const *>(*p);
+                if (rr == NULL) {
+                    continue;
                 }
+
+                xmppd::dns_record record = {rr->getAddress(), 0, 0, 0};
+                records.push_back(record);
             }
 
+            xmppd::dns_cache::shared().put(current_providing_host->first,
+                                           xmppd::dns_cache::rr_aaaa, records,
+                                           rrSet->getTTL());
         } catch (std::bad_cast&) {
             // we expected to get a lwresult_rrset on successfull resolving of
             // our query
         }
+    } else if (is_negative_result(result)) {
+        xmppd::dns_cache::shared().put_negative(current_providing_host->first,
+                                                xmppd::dns_cache::rr_aaaa);
     }
 
+    add_addresses(records, true);
+
     // try A lookup
     resolve_current_providing_host_a();
     return;
@@ -219,6 +268,16 @@ void resolver_job::resolve_current_providing_host() {
         return;
     }
 
+    // already cached?
+    std::vector<xmppd::dns_record> records;
+    if (xmppd::dns_cache::shared().get(current_providing_host->first,
+                                       xmppd::dns_cache::rr_aaaa, records) !=
+        xmppd::dns_cache::lookup_miss) {
+        add_addresses(records, true);
+        resolve_current_providing_host_a();
+        return;
+    }
+
     // create the query
     xmppd::lwresc::rrsetbyname query(current_providing_host->first, ns_c_in,
                                      ns_t_aaaa);
@@ -242,8 +301,17 @@ void resolver_job::resolve_providing_hosts() {
 }
 
 void resolver_job::on_srv_query_result(xmppd::lwresc::lwresult const &result) {
+    std::ostringstream name_resolved;
+    name_resolved << std::string(current_service->get_service_prefix()) << "."
+                  << std::string(destination);
+
     // did we successfully get a result?
     if (result.getResult() != xmppd::lwresc::lwresult::res_success) {
+        if (is_negative_result(result)) {
+            xmppd::dns_cache::shared().put_negative(name_resolved.str(),
+                                                    xmppd::dns_cache::rr_srv);
+        }
+
         // try next service
         ++current_service;
         start_resolving_service();
@@ -263,39 +331,38 @@ void resolver_job::on_srv_query_result(xmppd::lwresc::lwresult const &result) {
         std::vector<xmppd::lwresc::rrecord *> rrs = rrSet->getRR();
 
         // iterate them to find SRV records
-        bool found_srv_record = false;
+        std::vector<xmppd::dns_record> records;
         for (std::vector<xmppd::lwresc::rrecord *>::const_iterator p =
                  rrs.begin();
              p != rrs.end(); ++p) {
-            try {
-                xmppd::lwresc::srv_record const *rr =
-                    dynamic_cast<xmppd::lwresc::srv_record const *>(*p);
-                found_srv_record = true;
-
-                // XXX the following line is only for debugging
-                std::cout << "One SRV result for " << destination << "/"
-                          << current_service->get_service_prefix()
-                          << " is: " << rr->getPrio() << " " << rr->getWeight()
-                          << " " << rr->getDName() << ":" << rr->getPort()
-                          << std::endl;
-
-                // XXX we have to sort by priority and weight
-
-                // for now, add unsorted to the list
-                std::ostringstream port;
-                port << rr->getPort();
-                providing_hosts.push_back(
-                    std::pair<Glib::ustring, Glib::ustring>(rr->getDName(),
-                                                            port.str()));
-
-            } catch (std::bad_cast&) {
+            xmppd::lwresc::srv_record const *rr =
+                dynamic_cast<xmppd::lwresc::srv_record const *>(*p);
+            if (rr == NULL) {
                 // it hasn't been a SRV record - we can ignore it
+                continue;
             }
+
+            // XXX the following line is only for debugging
+            std::cout << "One SRV result for " << destination << "/"
+                      << current_service->get_service_prefix()
+                      << " is: " << rr->getPrio() << " " << rr->getWeight()
+                      << " " << rr->getDName() << ":" << rr->getPort()
+                      << std::endl;
+
+            xmppd::dns_record record = {rr->getDName(), rr->getPort(),
+                                        rr->getPrio(), rr->getWeight()};
+            records.push_back(record);
         }
 
+        // keep the result (a negative entry if there have been no SRV records)
+        xmppd::dns_cache::shared().put(name_resolved.str(),
+                                       xmppd::dns_cache::rr_srv, records,
+                                       rrSet->getTTL());
+
         // if we found something we have to resolve the providing hosts, else
         // try next service
-        if (found_srv_record) {
+        if (!records.empty()) {
+            add_providing_hosts(records);
             // resolve the returned locations to IP addresses
             resolve_providing_hosts();
         } else {
@@ -310,6 +377,39 @@ void resolver_job::on_srv_query_result(xmppd::lwresc::lwresult const &result) {
     }
 }
 
+void resolver_job::add_providing_hosts(
+    std::vector<xmppd::dns_record> const &records) {
+    // XXX we have to sort by priority and weight
+
+    // for now, add unsorted to the list
+    for (std::vector<xmppd::dns_record>::const_iterator p = records.begin();
+         p != records.end(); ++p) {
+        std::ostringstream port;
+        port << p->port;
+        providing_hosts.push_back(
+            std::pair<Glib::ustring, Glib::ustring>(p->target, port.str()));
+    }
+}
+
+void resolver_job::add_addresses(std::vector<xmppd::dns_record> const &records,
+                                 bool ipv6) {
+    for (std::vector<xmppd::dns_record>::const_iterator p = records.begin();
+         p != records.end(); ++p) {
+        if (ipv6) {
+            result_buffer << ",[" << p->target
+                          << "]:" << current_providing_host->second;
+        } else {
+            result_buffer << "," << p->target << ":"
+                          << current_providing_host->second;
+        }
+    }
+}
+
+bool resolver_job::is_negative_result(xmppd::lwresc::lwresult const &result) {
+    return result.getResult() == xmppd::lwresc::lwresult::res_notfound ||
+           result.getResult() == xmppd::lwresc::lwresult::res_typenotfound;
+}
+
 sigc::connection resolver_job::register_result_callback(
     sigc::signal<void, resolver_job &>::slot_type const &callback) {
     sigc::signal<void, resolver_job &> new_signal =
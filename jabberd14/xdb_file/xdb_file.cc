@@ -507,10 +507,33 @@ result xdb_file_phandler(instance i, dpacket p, void *arg) {
                 ret = 1;
         }
     } else {
+        char const *batch = xmlnode_get_attrib_ns(p->x, "batch", NULL);
+
         /* a get always returns, data or not */
         ret = 1;
 
-        if (data != NULL) {
+        if (batch != NULL) {
+            /* several namespaces requested, wrap each of them */
+            std::istringstream batch_ns(batch);
+            std::string cur_ns;
+
+            while (batch_ns >> cur_ns) {
+                std::ostringstream cur_xpath;
+                xmlnode wrapper = xmlnode_insert_tag_ns(p->x, "result", NULL,
+                                                        NS_JABBERD_XDBBATCH);
+                xmlnode_put_attrib_ns(wrapper, "ns", NULL, NULL,
+                                      cur_ns.c_str());
+
+                cur_xpath << "*[@xdbns='" << cur_ns << "']";
+                data = xmlnode_get_list_item(
+                    xmlnode_get_tags(top, cur_xpath.str().c_str(),
+                                     xf->std_ns_prefixes),
+                    0);
+                if (data != NULL)
+                    xmlnode_hide_attrib_ns(
+                        xmlnode_insert_tag_node(wrapper, data), "xdbns", NULL);
+            }
+        } else if (data != NULL) {
             /* cool, send em back a copy of the data */
             xmlnode_hide_attrib_ns(xmlnode_insert_tag_node(p->x, data), "xdbns",
                                    NULL);
@@ -560,6 +583,8 @@ void _xdb_convert_hostspool(pool p, const char *spoolroot, char *host) {
     DIR *sdir;
     struct dirent *dent;
     char digit01[3], digit23[3];
+    unsigned long converted = 0;
+    time_t start = time(NULL);
 
     /* get the dir location */
     std::ostringstream hostspool;
@@ -604,11 +629,16 @@ void _xdb_convert_hostspool(pool p, const char *spoolroot, char *host) {
                           "failed to move %s to %s while converting spool: %s",
                           oldname.str().c_str(), newname.str().c_str(),
                           strerror(errno));
+            else
+                converted++;
         }
     }
 
     /* close the directory */
     closedir(sdir);
+
+    log_notice(host, "converted %lu files of spool %s in %ld s", converted,
+               hostspool.str().c_str(), static_cast<long>(time(NULL) - start));
 }
 
 /**
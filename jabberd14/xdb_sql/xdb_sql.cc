@@ -72,6 +72,25 @@ typedef struct xdbsql_ns_def_struct {
         delete_query; /**< SQL query to delete old values */
 } * xdbsql_ns_def, _xdbsql_ns_def;
 
+/**
+ * a set request that waits to be committed in a shared transaction together
+ * with other set requests
+ */
+typedef struct xdbsql_pending_set_struct {
+    dpacket p; /**< the xdb request, that gets answered after the commit */
+    std::list<std::string>
+        statements; /**< SQL statements that have to be executed */
+} _xdbsql_pending_set;
+
+/**
+ * a SQL query of a get request and where its results have to be placed
+ */
+typedef struct xdbsql_get_query_struct {
+    char const *query;   /**< the SQL query */
+    xmlnode xmltemplate; /**< template to construct the result */
+    xmlnode result;      /**< where to add the results */
+} _xdbsql_get_query;
+
 /**
  * structure that holds the data used by xdb_sql internally
  */
@@ -87,7 +106,8 @@ typedef struct xdbsql_struct {
           use_postgresql(0), postgresql(NULL), postgresql_conninfo(NULL),
 #endif
           onconnect(NULL), namespace_prefixes(NULL),
-          std_namespace_prefixes(NULL){};
+          std_namespace_prefixes(NULL), i(NULL), batch_window(0),
+          batch_maxsets(0), batch_flush_scheduled(0){};
 
     std::map<std::string, _xdbsql_ns_def>
         namespace_defs; /**< definitions of queries for the different namespaces
@@ -115,6 +135,17 @@ typedef struct xdbsql_struct {
                                    value = ns_iri) */
     xht std_namespace_prefixes; /**< prefixes used by the component itself for
                                    the namespaces */
+    instance i; /**< the instance we are running as (needed when flushing
+                   batched set requests) */
+    int batch_window; /**< milliseconds set requests are collected to be
+                         committed in a shared transaction, 0 to commit each
+                         set request on its own */
+    unsigned int batch_maxsets; /**< maximum number of set requests in a shared
+                                   transaction */
+    int batch_flush_scheduled;  /**< if a thread is waiting to flush the
+                                   collected set requests */
+    std::list<_xdbsql_pending_set>
+        pending_sets; /**< set requests waiting for the shared transaction */
 } * xdbsql, _xdbsql;
 
 /* forward declaration */
@@ -345,7 +376,7 @@ static int xdb_sql_execute_mysql(instance i, xdbsql xq, char *query,
                        num_fields);
 
             /* instantiate a copy of the template */
-            new_instance = xmlnode_dup_pool(result->p, xmltemplate);
+            new_instance = xmlnode_dup_pool(xmlnode_pool(result), xmltemplate);
 
             /* find variables in the template and replace them with values */
             while (variable = xdb_sql_find_node_recursive(new_instance, "value",
@@ -372,7 +403,7 @@ static int xdb_sql_execute_mysql(instance i, xdbsql xq, char *query,
                             continue;
                         }
                         xmlnode fieldcopy =
-                            xmlnode_dup_pool(result->p, fieldvalue);
+                            xmlnode_dup_pool(xmlnode_pool(result), fieldvalue);
                         xmlnode_free(fieldvalue);
                         xmlnode_insert_tag_node(parent, fieldcopy);
                     } else {
@@ -404,48 +435,49 @@ static int xdb_sql_execute_mysql(instance i, xdbsql xq, char *query,
 }
 #endif
 
+#ifdef HAVE_POSTGRESQL
 /**
- * execute a sql query using postgresql
+ * make sure we are connected to the PostgreSQL server
  *
  * @param i the instance we are running in
  * @param xq instance internal data
- * @param query the SQL query to execute
- * @param xmltemplate template to construct the result
- * @param result where to add the results
- * @return 0 on success, non zero on failure
+ * @return 0 if connected, non zero on failure
  */
-#ifdef HAVE_POSTGRESQL
-static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char const *query,
-                                      xmlnode xmltemplate, xmlnode result) {
-    PGresult *res = NULL;
-    ExecStatusType status = static_cast<ExecStatusType>(0);
-    int row = 0;
-    int fields = 0;
-
+static int xdb_sql_postgresql_check_connection(instance i, xdbsql xq) {
     /* are we still connected? */
-    if (PQstatus(xq->postgresql) != CONNECTION_OK) {
-        log_warn(i->id, "resetting connection to the PostgreSQL server");
+    if (PQstatus(xq->postgresql) == CONNECTION_OK)
+        return 0;
 
-        /* reset the connection */
-        PQreset(xq->postgresql);
+    log_warn(i->id, "resetting connection to the PostgreSQL server");
 
-        /* are we now connected? */
-        if (PQstatus(xq->postgresql) != CONNECTION_OK) {
-            log_error(i->id, "cannot reset connection: %s",
-                      PQerrorMessage(xq->postgresql));
-            return 1;
-        } else if (xq->onconnect) {
-            xdb_sql_execute(i, xq, xq->onconnect, NULL, NULL);
-        }
-    }
+    /* reset the connection */
+    PQreset(xq->postgresql);
 
-    /* try to execute the query */
-    res = PQexec(xq->postgresql, query);
-    if (res == NULL) {
-        log_error(i->id, "cannot execute PostgreSQL query: %s",
+    /* are we now connected? */
+    if (PQstatus(xq->postgresql) != CONNECTION_OK) {
+        log_error(i->id, "cannot reset connection: %s",
                   PQerrorMessage(xq->postgresql));
         return 1;
+    } else if (xq->onconnect) {
+        xdb_sql_execute(i, xq, xq->onconnect, NULL, NULL);
     }
+    return 0;
+}
+
+/**
+ * check the result of a PostgreSQL statement and add the returned rows
+ *
+ * @param i the instance we are running in
+ * @param res the result of the statement (gets cleared)
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results (NULL to ignore returned rows)
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sql_postgresql_result(instance i, PGresult *res,
+                                     xmlnode xmltemplate, xmlnode result) {
+    ExecStatusType status = static_cast<ExecStatusType>(0);
+    int row = 0;
+    int fields = 0;
 
     /* get the status of the execution */
     status = PQresultStatus(res);
@@ -458,24 +490,30 @@ static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char const *query,
                      PQresultErrorMessage(res));
             PQclear(res);
             return 1;
-        case PGRES_COMMAND_OK:
-        case PGRES_COPY_OUT:
-        case PGRES_COPY_IN:
-        case PGRES_COPY_BOTH:
         case PGRES_SINGLE_TUPLE:
         case PGRES_TUPLES_OK:
+            /* we got rows, fetch them below */
+            break;
+        default:
             PQclear(res);
             return 0;
     }
 
+    /* nobody is interested in the rows */
+    if (xmltemplate == NULL || result == NULL) {
+        PQclear(res);
+        return 0;
+    }
+
     /* the postgresql query succeded: fetch results */
     fields = PQnfields(res);
     for (row = 0; row < PQntuples(res); row++) {
+        int row_okay = 1;
         xmlnode variable = NULL;
         xmlnode new_instance = NULL;
 
         /* instantiate a copy of the template */
-        new_instance = xmlnode_dup_pool(result->p, xmltemplate);
+        new_instance = xmlnode_dup_pool(xmlnode_pool(result), xmltemplate);
 
         /* find variables in the template and replace them with values */
         while ((variable = xdb_sql_find_node_recursive(new_instance, "value",
@@ -496,7 +534,14 @@ static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char const *query,
                     xmlnode fieldvalue =
                         xmlnode_str(PQgetvalue(res, row, value - 1),
                                     PQgetlength(res, row, value - 1));
-                    xmlnode fieldcopy = xmlnode_dup_pool(result->p, fieldvalue);
+                    if (fieldvalue == NULL) {
+                        log_warn(i->id, "could not parse: %s",
+                                 PQgetvalue(res, row, value - 1));
+                        row_okay = 0;
+                        continue;
+                    }
+                    xmlnode fieldcopy =
+                        xmlnode_dup_pool(xmlnode_pool(result), fieldvalue);
                     xmlnode_free(fieldvalue);
                     xmlnode_insert_tag_node(parent, fieldcopy);
                 } else {
@@ -508,15 +553,111 @@ static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char const *query,
         }
 
         /* insert the result */
-        log_debug2(
-            ZONE, LOGT_STORAGE, "the row results in: %s",
-            xmlnode_serialize_string(new_instance, xmppd::ns_decl_list(), 0));
-        xmlnode_insert_node(result, xmlnode_get_firstchild(new_instance));
+        if (row_okay) {
+            log_debug2(ZONE, LOGT_STORAGE, "the row results in: %s",
+                       xmlnode_serialize_string(new_instance,
+                                                xmppd::ns_decl_list(), 0));
+            xmlnode_insert_node(result, xmlnode_get_firstchild(new_instance));
+        } else {
+            log_warn(i->id,
+                     "ignoring a row in a SQL result, due to problems with it");
+        }
     }
 
     PQclear(res);
     return 0;
 }
+
+/**
+ * execute a sql query using postgresql
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param query the SQL query to execute
+ * @param xmltemplate template to construct the result
+ * @param result where to add the results
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sql_execute_postgresql(instance i, xdbsql xq, char const *query,
+                                      xmlnode xmltemplate, xmlnode result) {
+    PGresult *res = NULL;
+
+    if (xdb_sql_postgresql_check_connection(i, xq))
+        return 1;
+
+    /* try to execute the query */
+    res = PQexec(xq->postgresql, query);
+    if (res == NULL) {
+        log_error(i->id, "cannot execute PostgreSQL query: %s",
+                  PQerrorMessage(xq->postgresql));
+        return 1;
+    }
+
+    return xdb_sql_postgresql_result(i, res, xmltemplate, result);
+}
+
+/**
+ * execute the queries of a get request inside a single transaction using
+ * postgresql
+ *
+ * All queries (including BEGIN and COMMIT) are sent as a single
+ * multi-statement query, the results are read back in order. This costs only
+ * one round trip to the database server.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param queries the queries to execute
+ * @return 0 on success, non zero on failure
+ */
+static int
+xdb_sql_execute_gets_postgresql(instance i, xdbsql xq,
+                                const std::list<_xdbsql_get_query> &queries) {
+    std::list<_xdbsql_get_query>::const_iterator iter;
+    std::ostringstream batch;
+    PGresult *res = NULL;
+    int ret = 0;
+
+    if (xdb_sql_postgresql_check_connection(i, xq))
+        return 1;
+
+    batch << "BEGIN";
+    for (iter = queries.begin(); iter != queries.end(); ++iter) {
+        batch << ";" << iter->query;
+    }
+    batch << ";COMMIT";
+
+    if (!PQsendQuery(xq->postgresql, batch.str().c_str())) {
+        log_error(i->id, "cannot execute PostgreSQL query: %s",
+                  PQerrorMessage(xq->postgresql));
+        return 1;
+    }
+
+    /* the result of BEGIN */
+    if ((res = PQgetResult(xq->postgresql)) != NULL)
+        ret = xdb_sql_postgresql_result(i, res, NULL, NULL);
+
+    /* the results of the queries, then COMMIT */
+    for (iter = queries.begin(); iter != queries.end() && ret == 0; ++iter) {
+        if ((res = PQgetResult(xq->postgresql)) == NULL) {
+            ret = 1;
+            break;
+        }
+        ret = xdb_sql_postgresql_result(i, res, iter->xmltemplate,
+                                        iter->result);
+    }
+
+    /* read the remaining results, the connection is busy until we got all */
+    while ((res = PQgetResult(xq->postgresql)) != NULL) {
+        if (xdb_sql_postgresql_result(i, res, NULL, NULL))
+            ret = 1;
+    }
+
+    /* a failed statement aborts the transaction, clean it up */
+    if (ret)
+        xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+
+    return ret;
+}
 #endif
 
 /**
@@ -558,6 +699,280 @@ static void xdb_sql_makeresult(dpacket p) {
     xmlnode_put_attrib_ns(p->x, "from", NULL, NULL, jid_full(p->id));
 }
 
+/**
+ * execute a list of SQL statements inside a single transaction
+ *
+ * With PostgreSQL the statements (including BEGIN and COMMIT) are sent as a
+ * single multi-statement query, so the whole transaction costs only one round
+ * trip to the database server. For other drivers each statement is executed
+ * on its own.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param statements the SQL statements to execute
+ * @return 0 on success, non zero on failure (the transaction is rolled back)
+ */
+static int
+xdb_sql_execute_transaction(instance i, xdbsql xq,
+                            const std::list<std::string> &statements) {
+    std::list<std::string>::const_iterator iter;
+
+#ifdef HAVE_POSTGRESQL
+    if (xq->use_postgresql) {
+        std::ostringstream batch;
+
+        batch << "BEGIN";
+        for (iter = statements.begin(); iter != statements.end(); ++iter) {
+            batch << ";" << *iter;
+        }
+        batch << ";COMMIT";
+
+        if (xdb_sql_execute(i, xq, batch.str().c_str(), NULL, NULL)) {
+            /* SQL query failed */
+            xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    /* start the transaction */
+    xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
+
+    for (iter = statements.begin(); iter != statements.end(); ++iter) {
+        if (xdb_sql_execute(i, xq, iter->c_str(), NULL, NULL)) {
+            /* SQL query failed */
+            xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+            return 1;
+        }
+    }
+
+    /* commit the transaction */
+    xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+    return 0;
+}
+
+/**
+ * execute the queries of a get request inside a single transaction
+ *
+ * With PostgreSQL the queries are sent as a single multi-statement query. For
+ * other drivers each query is executed on its own.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ * @param queries the queries to execute
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sql_execute_gets(instance i, xdbsql xq,
+                                const std::list<_xdbsql_get_query> &queries) {
+    std::list<_xdbsql_get_query>::const_iterator iter;
+
+#ifdef HAVE_POSTGRESQL
+    if (xq->use_postgresql) {
+        return xdb_sql_execute_gets_postgresql(i, xq, queries);
+    }
+#endif
+
+    /* start the transaction */
+    xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
+
+    for (iter = queries.begin(); iter != queries.end(); ++iter) {
+        if (xdb_sql_execute(i, xq, iter->query, iter->xmltemplate,
+                            iter->result)) {
+            /* SQL query failed */
+            xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
+            return 1;
+        }
+    }
+
+    /* commit the transaction */
+    xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+    return 0;
+}
+
+/**
+ * construct the SQL queries needed to handle a xdb get request for a
+ * namespace
+ *
+ * @param xq instance internal data
+ * @param ns_def the definitions for the namespace
+ * @param ns the namespace
+ * @param p the packet containing the xdb get request
+ * @param result_element where the results for the namespace have to be added
+ * @param queries where to add the constructed queries
+ */
+static void xdb_sql_get_queries(xdbsql xq, _xdbsql_ns_def &ns_def,
+                                char const *ns, dpacket p,
+                                xmlnode result_element,
+                                std::list<_xdbsql_get_query> &queries) {
+    std::list<std::vector<std::string>>::iterator iter;
+    char *group_element = NULL;
+    char *group_ns_iri = NULL;
+    char *group_prefix = NULL;
+    _xdbsql_get_query get_query;
+
+    /* the records might be grouped in a single element */
+    group_element = xmlnode_get_attrib_ns(ns_def.get_result, "group", NULL);
+    group_ns_iri = xmlnode_get_attrib_ns(ns_def.get_result, "groupiri", NULL);
+    group_prefix =
+        xmlnode_get_attrib_ns(ns_def.get_result, "groupprefix", NULL);
+    if (group_element != NULL) {
+        result_element = xmlnode_insert_tag_ns(result_element, group_element,
+                                               group_prefix, group_ns_iri);
+        xmlnode_put_attrib(result_element, "ns", ns);
+    }
+
+    for (iter = ns_def.get_query.begin(); iter != ns_def.get_query.end();
+         ++iter) {
+        get_query.query =
+            xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
+        get_query.xmltemplate = ns_def.get_result;
+        get_query.result = result_element;
+        log_debug2(ZONE, LOGT_STORAGE,
+                   "using the following SQL statement for selection: %s",
+                   get_query.query);
+        queries.push_back(get_query);
+    }
+}
+
+/**
+ * find the definitions how to handle a namespace
+ *
+ * @param xq instance internal data
+ * @param ns the namespace
+ * @return the definitions, NULL if the namespace is not handled
+ */
+static xdbsql_ns_def xdb_sql_find_ns_def(xdbsql xq, char const *ns) {
+    std::map<std::string, _xdbsql_ns_def>::iterator def;
+
+    def = xq->namespace_defs.find(ns);
+    if (def == xq->namespace_defs.end())
+        def = xq->namespace_defs.find("*");
+    if (def == xq->namespace_defs.end())
+        return NULL;
+    return &def->second;
+}
+
+/**
+ * construct the SQL statements needed to handle a xdb set request
+ *
+ * @param xq instance internal data
+ * @param ns_def the definitions for the namespace of the request
+ * @param p the packet containing the xdb set request
+ * @param delete_old if the delete queries have to be executed as well
+ * @param statements where to add the constructed statements
+ */
+static void xdb_sql_set_statements(xdbsql xq, _xdbsql_ns_def &ns_def,
+                                   dpacket p, int delete_old,
+                                   std::list<std::string> &statements) {
+    std::list<std::vector<std::string>>::iterator iter;
+    char *query = NULL;
+
+    /* delete old values */
+    if (delete_old) {
+        for (iter = ns_def.delete_query.begin();
+             iter != ns_def.delete_query.end(); ++iter) {
+            query =
+                xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
+            log_debug2(ZONE, LOGT_STORAGE,
+                       "using the following SQL statement for deletion: %s",
+                       query);
+            statements.push_back(query);
+        }
+    }
+
+    /* insert new values (if there are any) */
+    if (xmlnode_get_firstchild(p->x) != NULL) {
+        for (iter = ns_def.set_query.begin(); iter != ns_def.set_query.end();
+             ++iter) {
+            query =
+                xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
+            log_debug2(ZONE, LOGT_STORAGE,
+                       "using the following SQL statement for insertion: %s",
+                       query);
+            statements.push_back(query);
+        }
+    }
+}
+
+/**
+ * commit all collected set requests in a shared transaction and send the
+ * results
+ *
+ * If the shared transaction fails, each request is retried in its own
+ * transaction, so that a single bad request does not fail the others.
+ *
+ * @param i the instance we are running in
+ * @param xq instance internal data
+ */
+static void xdb_sql_flush_sets(instance i, xdbsql xq) {
+    std::list<_xdbsql_pending_set> sets;
+    std::list<_xdbsql_pending_set>::iterator iter;
+    std::list<std::string> statements;
+
+    /* take the collected requests, new ones will start the next batch */
+    sets.swap(xq->pending_sets);
+    if (sets.empty())
+        return;
+
+    log_debug2(ZONE, LOGT_STORAGE, "committing %u batched xdb set requests",
+               static_cast<unsigned int>(sets.size()));
+
+    for (iter = sets.begin(); iter != sets.end(); ++iter) {
+        statements.insert(statements.end(), iter->statements.begin(),
+                          iter->statements.end());
+    }
+
+    if (sets.size() > 1 &&
+        xdb_sql_execute_transaction(i, xq, statements) == 0) {
+        /* send results back */
+        for (iter = sets.begin(); iter != sets.end(); ++iter) {
+            xdb_sql_makeresult(iter->p);
+            deliver(dpacket_new(iter->p->x), NULL);
+        }
+        return;
+    }
+
+    /* single request or the shared transaction failed: commit one by one */
+    for (iter = sets.begin(); iter != sets.end(); ++iter) {
+        if (xdb_sql_execute_transaction(i, xq, iter->statements)) {
+            deliver_fail(iter->p, "SQL transaction failed");
+            continue;
+        }
+        xdb_sql_makeresult(iter->p);
+        deliver(dpacket_new(iter->p->x), NULL);
+    }
+}
+
+/**
+ * thread that waits for the batch window to close and flushes the collected
+ * set requests afterwards
+ *
+ * @param arg pointer to the instance internal data
+ * @return always NULL
+ */
+static void *xdb_sql_batch_flusher(void *arg) {
+    xdbsql xq = static_cast<xdbsql>(arg);
+
+    pth_usleep(xq->batch_window * 1000);
+
+    xq->batch_flush_scheduled = 0;
+    xdb_sql_flush_sets(xq->i, xq);
+
+    return NULL;
+}
+
+/**
+ * commit still collected set requests when the server shuts down
+ *
+ * @param arg pointer to the instance internal data
+ */
+static void xdb_sql_shutdown(void *arg) {
+    xdbsql xq = static_cast<xdbsql>(arg);
+
+    xdb_sql_flush_sets(xq->i, xq);
+}
+
 /**
  * callback function that is called by jabberd to handle xdb requests
  *
@@ -569,12 +984,11 @@ static void xdb_sql_makeresult(dpacket p) {
 static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
     xdbsql xq = (xdbsql)arg; /* xdb_sql internal data */
     char *ns = NULL;         /* namespace of the query */
-    _xdbsql_ns_def ns_def;   /* pointer to the namespace definitions */
+    xdbsql_ns_def ns_def;    /* pointer to the namespace definitions */
     int is_set_request = 0;  /* if this is a set request */
     char *action = NULL;     /* xdb-set action */
     char *match = NULL;      /* xdb-set match */
     char *matchpath = NULL;  /* xdb-set matchpath */
-    std::list<std::vector<std::string>>::iterator iter;
 
     log_debug2(ZONE, LOGT_STORAGE | LOGT_DELIVER, "handling xdb request %s",
                xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
@@ -588,11 +1002,8 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
     }
 
     /* check if we know how to handle this namespace */
-    if (xq->namespace_defs.find(ns) != xq->namespace_defs.end()) {
-        ns_def = xq->namespace_defs[ns];
-    } else if (xq->namespace_defs.find("*") != xq->namespace_defs.end()) {
-        ns_def = xq->namespace_defs["*"];
-    } else {
+    ns_def = xdb_sql_find_ns_def(xq, ns);
+    if (ns_def == NULL) {
         log_error(i->id,
                   "xdb_sql got a xdb request for an unconfigured namespace %s, "
                   "use this handler only for selected namespaces.",
@@ -604,155 +1015,90 @@ static result xdb_sql_phandler(instance i, dpacket p, void *arg) {
     is_set_request =
         (j_strcmp(xmlnode_get_attrib_ns(p->x, "type", NULL), "set") == 0);
     if (is_set_request) {
+        _xdbsql_pending_set pending;
+
         /* set request */
         action = xmlnode_get_attrib_ns(p->x, "action", NULL);
         match = xmlnode_get_attrib_ns(p->x, "match", NULL);
         matchpath = xmlnode_get_attrib_ns(p->x, "matchpath", NULL);
 
         if (action == NULL) {
-            char *query = NULL;
-
-            /* just a boring set */
-
-            /* start the transaction */
-            xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
-
-            /* delete old values */
-            for (iter = ns_def.delete_query.begin();
-                 iter != ns_def.delete_query.end(); ++iter) {
-                query = xdb_sql_construct_query(*iter, p->x,
-                                                xq->namespace_prefixes);
-                log_debug2(ZONE, LOGT_STORAGE,
-                           "using the following SQL statement for deletion: %s",
-                           query);
-                if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
-                    /* SQL query failed */
-                    xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
-                    return r_ERR;
-                }
-            }
+            /* just a boring set: replace old values */
+            xdb_sql_set_statements(xq, *ns_def, p, 1, pending.statements);
+        } else if (j_strcmp(action, "insert") == 0) {
+            /* delete matches (if any) and insert */
+            xdb_sql_set_statements(xq, *ns_def, p,
+                                   match != NULL || matchpath != NULL,
+                                   pending.statements);
+        } else {
+            /* not supported action, probably check */
+            log_warn(i->id, "unable to handle unsupported xdb-set action '%s'",
+                     action);
+            return r_ERR;
+        }
 
-            /* insert new values (if there are any) */
-            if (xmlnode_get_firstchild(p->x) != NULL) {
-                for (iter = ns_def.set_query.begin();
-                     iter != ns_def.set_query.end(); ++iter) {
-                    query = xdb_sql_construct_query(*iter, p->x,
-                                                    xq->namespace_prefixes);
-                    log_debug2(
-                        ZONE, LOGT_STORAGE,
-                        "using the following SQL statement for insertion: %s",
-                        query);
-                    if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
-                        /* SQL query failed */
-                        xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
-                        return r_ERR;
-                    }
-                }
+        /* not batching set requests? commit now */
+        if (xq->batch_window <= 0) {
+            if (xdb_sql_execute_transaction(i, xq, pending.statements)) {
+                return r_ERR;
             }
 
-            /* commit the transaction */
-            xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
-
             /* send result back */
             xdb_sql_makeresult(p);
             deliver(dpacket_new(p->x), NULL);
             return r_DONE;
-        } else if (j_strcmp(action, "insert") == 0) {
-            char *query = NULL;
-
-            /* start the transaction */
-            xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
-
-            /* delete matches */
-            if (match != NULL || matchpath != NULL) {
-                for (iter = ns_def.delete_query.begin();
-                     iter != ns_def.delete_query.end(); ++iter) {
-                    query = xdb_sql_construct_query(*iter, p->x,
-                                                    xq->namespace_prefixes);
-                    log_debug2(ZONE, LOGT_STORAGE,
-                               "using the following SQL statement for "
-                               "insert/match[path] deletion: %s",
-                               query);
-                    if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
-                        /* SQL query failed */
-                        xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
-                        return r_ERR;
-                    }
-                }
-            }
-
-            /* insert new values if there are any */
-            if (xmlnode_get_firstchild(p->x) != NULL) {
-                for (iter = ns_def.set_query.begin();
-                     iter != ns_def.set_query.end(); ++iter) {
-                    query = xdb_sql_construct_query(*iter, p->x,
-                                                    xq->namespace_prefixes);
-                    log_debug2(
-                        ZONE, LOGT_STORAGE,
-                        "using the following SQL statement for insertion: %s",
-                        query);
-                    if (xdb_sql_execute(i, xq, query, NULL, NULL)) {
-                        /* SQL query failed */
-                        xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
-                        return r_ERR;
-                    }
-                }
-            }
+        }
 
-            /* commit the transaction */
-            xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+        /* collect the request for a shared transaction */
+        pending.p = p;
+        xq->pending_sets.push_back(pending);
 
-            /* send result back */
-            xdb_sql_makeresult(p);
-            deliver(dpacket_new(p->x), NULL);
-            return r_DONE;
-        } else {
-            /* not supported action, probably check */
-            log_warn(i->id, "unable to handle unsupported xdb-set action '%s'",
-                     action);
-            return r_ERR;
+        if (xq->pending_sets.size() >= xq->batch_maxsets) {
+            xdb_sql_flush_sets(i, xq);
+        } else if (!xq->batch_flush_scheduled) {
+            xq->batch_flush_scheduled = 1;
+            pth_spawn(PTH_ATTR_DEFAULT, xdb_sql_batch_flusher, (void *)xq);
         }
+        return r_DONE;
     } else {
-        char *query = NULL;
-        char *group_element = NULL;
-        char *group_ns_iri = NULL;
-        char *group_prefix = NULL;
-        xmlnode result_element = p->x;
+        std::list<_xdbsql_get_query> queries;
+        char const *batch = xmlnode_get_attrib_ns(p->x, "batch", NULL);
 
         /* get request */
 
-        /* start the transaction */
-        xdb_sql_execute(i, xq, "BEGIN", NULL, NULL);
-
-        /* get the record(s) */
-        group_element = xmlnode_get_attrib_ns(ns_def.get_result, "group", NULL);
-        group_ns_iri =
-            xmlnode_get_attrib_ns(ns_def.get_result, "groupiri", NULL);
-        group_prefix =
-            xmlnode_get_attrib_ns(ns_def.get_result, "groupprefix", NULL);
-        if (group_element != NULL) {
-            result_element = xmlnode_insert_tag_ns(
-                result_element, group_element, group_prefix, group_ns_iri);
-            xmlnode_put_attrib(result_element, "ns", ns);
-        }
-
-        for (iter = ns_def.get_query.begin(); iter != ns_def.get_query.end();
-             ++iter) {
-            query =
-                xdb_sql_construct_query(*iter, p->x, xq->namespace_prefixes);
-            log_debug2(ZONE, LOGT_STORAGE,
-                       "using the following SQL statement for selection: %s",
-                       query);
-            if (xdb_sql_execute(i, xq, query, ns_def.get_result,
-                                result_element)) {
-                /* SQL query failed */
-                xdb_sql_execute(i, xq, "ROLLBACK", NULL, NULL);
-                return r_ERR;
+        /* make sure we read what has been written before */
+        xdb_sql_flush_sets(i, xq);
+
+        if (batch != NULL) {
+            /* several namespaces requested, wrap the results of each */
+            std::istringstream batch_ns(batch);
+            std::string cur_ns;
+
+            while (batch_ns >> cur_ns) {
+                xdbsql_ns_def cur_def = xdb_sql_find_ns_def(xq, cur_ns.c_str());
+                xmlnode wrapper = xmlnode_insert_tag_ns(p->x, "result", NULL,
+                                                        NS_JABBERD_XDBBATCH);
+                xmlnode_put_attrib_ns(wrapper, "ns", NULL, NULL,
+                                      cur_ns.c_str());
+
+                /* not handled by us: no data */
+                if (cur_def == NULL)
+                    continue;
+
+                xdb_sql_get_queries(
+                    xq, *cur_def,
+                    xmlnode_get_attrib_ns(wrapper, "ns", NULL), p, wrapper,
+                    queries);
             }
+        } else {
+            xdb_sql_get_queries(xq, *ns_def, ns, p, p->x, queries);
         }
 
-        /* commit the transaction */
-        xdb_sql_execute(i, xq, "COMMIT", NULL, NULL);
+        /* get the record(s) */
+        if (xdb_sql_execute_gets(i, xq, queries)) {
+            /* SQL query failed */
+            return r_ERR;
+        }
 
         /* construct the result */
         xdb_sql_makeresult(p);
@@ -1047,6 +1393,7 @@ extern "C" void xdb_sql(instance i, xmlnode x) {
 
     /* create our internal data */
     xq = new _xdbsql;
+    xq->i = i;
     pool_cleanup(i->p, xdb_sql_cleanup, xq);
     xq->std_namespace_prefixes = xhash_new(3);
     xhash_put(xq->std_namespace_prefixes, "xdbsql",
@@ -1105,6 +1452,26 @@ extern "C" void xdb_sql(instance i, xmlnode x) {
                   driver);
     }
 
+    /* shall we collect set requests to commit them in shared transactions? */
+    xq->batch_window = j_atoi(
+        xmlnode_get_data(xmlnode_get_list_item(
+            xmlnode_get_tags(config, "xdbsql:batch/xdbsql:window",
+                             xq->std_namespace_prefixes),
+            0)),
+        0);
+    xq->batch_maxsets = j_atoi(
+        xmlnode_get_data(xmlnode_get_list_item(
+            xmlnode_get_tags(config, "xdbsql:batch/xdbsql:maxsets",
+                             xq->std_namespace_prefixes),
+            0)),
+        64);
+    if (xq->batch_window > 0) {
+        log_debug2(ZONE, LOGT_INIT,
+                   "batching set requests for %i ms (up to %u requests)",
+                   xq->batch_window, xq->batch_maxsets);
+        register_shutdown(xdb_sql_shutdown, (void *)xq);
+    }
+
     /* read the handler defintions */
     xdb_sql_handler_read(i, xq, config);
 
@@ -0,0 +1,963 @@
+/*
+ * Copyrights
+ *
+ * Copyright (c) 2006-2007 Matthias Wimmer
+ *
+ * This file is part of jabberd14.
+ *
+ * This software is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#include <jabberd.h>
+
+#include <expat.hh>
+#include <namespaces.hh>
+
+#include <map>
+#include <sstream>
+#include <string>
+
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
+
+/**
+ * @file xdb_sqlite.cc
+ * @brief xdb module that stores data in an embedded SQLite database
+ *
+ * xdb_sqlite is an implementation of a xdb module for jabberd14, that stores
+ * the data in a SQLite database file. It does not need a database server like
+ * xdb_sql does, but still stores the data indexed by the owner of the data.
+ *
+ * Each configured namespace gets its own table, data in other namespaces is
+ * stored in a shared table. The element that is stored for a namespace is
+ * split into one row containing the element itself (without child elements)
+ * and one row for each child element. This way inserting a new child (e.g. an
+ * offline message) does not require rewriting all the data of the user.
+ *
+ * The database is used in WAL mode. Set requests are passed to a writer
+ * thread, that commits all requests, that are waiting, in a single
+ * transaction. Get requests are handled using a separate database connection,
+ * that is not blocked by the transactions of the writer.
+ */
+
+/** name of the table used for namespaces without an own table */
+#define XDBSQLITE_DEFAULT_TABLE "xdb_other"
+
+/** milliseconds SQLite itself waits for a lock, blocking all threads */
+#define XDBSQLITE_BUSY_TIMEOUT 50
+
+/** how often the writer retries to start a transaction on a locked database */
+#define XDBSQLITE_BEGIN_TRIES 100
+
+/** milliseconds the writer naps between tries to start a transaction */
+#define XDBSQLITE_BEGIN_BACKOFF 100
+
+#ifdef HAVE_SQLITE
+
+/**
+ * prepared statements to access the table of a namespace
+ */
+typedef struct xdbsqlite_table_struct {
+    xdbsqlite_table_struct()
+        : select(NULL), w_select(NULL), w_delete(NULL), w_insert(NULL),
+          w_update(NULL), w_del_row(NULL), w_max_seq(NULL){};
+
+    std::string name;        /**< name of the table */
+    sqlite3_stmt *select;    /**< read the rows of an owner (read connection) */
+    sqlite3_stmt *w_select;  /**< read the rows of an owner (writer) */
+    sqlite3_stmt *w_delete;  /**< delete all rows of an owner */
+    sqlite3_stmt *w_insert;  /**< insert a row */
+    sqlite3_stmt *w_update;  /**< replace the XML of a row */
+    sqlite3_stmt *w_del_row; /**< delete a single row */
+    sqlite3_stmt *w_max_seq; /**< get the highest sequence number of an owner */
+} * xdbsqlite_table, _xdbsqlite_table;
+
+/**
+ * a set request waiting to be handled by the writer thread
+ */
+typedef struct xdbsqlite_write_struct {
+    pth_message_t head; /**< the standard pth message header */
+    dpacket p;          /**< the xdb set request */
+} * xdbsqlite_write, _xdbsqlite_write;
+
+/**
+ * structure that holds the data used by xdb_sqlite internally
+ */
+typedef struct xdbsqlite_struct {
+    xdbsqlite_struct()
+        : i(NULL), file(NULL), db_read(NULL), db_write(NULL),
+          default_table(NULL), writes(NULL), batch_window(0),
+          batch_maxsets(0), std_namespace_prefixes(NULL){};
+
+    instance i;         /**< the instance we are running as */
+    char *file;         /**< filename of the database */
+    sqlite3 *db_read;   /**< database connection used for get requests */
+    sqlite3 *db_write;  /**< database connection used by the writer */
+    std::map<std::string, xdbsqlite_table>
+        tables; /**< tables of the configured namespaces (key is namespace) */
+    xdbsqlite_table
+        default_table; /**< table for namespaces not in ::tables */
+    pth_msgport_t writes; /**< set requests waiting for the writer */
+    pth_mutex_t write_lock; /**< held while a batch of set requests is
+                               written, as starting the transaction may nap */
+    int batch_window;     /**< milliseconds the writer waits to collect more
+                             set requests for a transaction */
+    int batch_maxsets;    /**< maximum number of set requests committed in a
+                             single transaction */
+    xht std_namespace_prefixes; /**< prefixes used by the component itself for
+                                   the namespaces */
+} * xdbsqlite, _xdbsqlite;
+
+/**
+ * execute a SQL statement that does not return results
+ *
+ * @param xs instance internal data
+ * @param db the connection to use
+ * @param sql the SQL statement(s)
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_exec(xdbsqlite xs, sqlite3 *db, char const *sql) {
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        log_error(xs->i->id, "SQLite statement (%s) failed: %s", sql,
+                  errmsg ? errmsg : sqlite3_errmsg(db));
+        sqlite3_free(errmsg);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * prepare a statement for a table
+ *
+ * @param xs instance internal data
+ * @param db the connection to prepare the statement for
+ * @param table the name of the table
+ * @param sql the statement, %s gets replaced by the table name
+ * @return the prepared statement, NULL on failure
+ */
+static sqlite3_stmt *xdb_sqlite_prepare(xdbsqlite xs, sqlite3 *db,
+                                        const std::string &table,
+                                        const char *sql) {
+    std::string statement(sql);
+    sqlite3_stmt *stmt = NULL;
+
+    statement.replace(statement.find("%s"), 2, "\"" + table + "\"");
+    if (sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL) !=
+        SQLITE_OK) {
+        log_error(xs->i->id, "cannot prepare SQLite statement (%s): %s",
+                  statement.c_str(), sqlite3_errmsg(db));
+        return NULL;
+    }
+    return stmt;
+}
+
+/**
+ * finalize the prepared statements of a table and free it
+ *
+ * @param table the table to free
+ */
+static void xdb_sqlite_table_free(xdbsqlite_table table) {
+    if (table == NULL)
+        return;
+
+    sqlite3_finalize(table->select);
+    sqlite3_finalize(table->w_select);
+    sqlite3_finalize(table->w_delete);
+    sqlite3_finalize(table->w_insert);
+    sqlite3_finalize(table->w_update);
+    sqlite3_finalize(table->w_del_row);
+    sqlite3_finalize(table->w_max_seq);
+    delete table;
+}
+
+/**
+ * create a table (if it does not exist yet) and prepare its statements
+ *
+ * @param xs instance internal data
+ * @param name name of the table
+ * @return the table, NULL on failure
+ */
+static xdbsqlite_table xdb_sqlite_table_open(xdbsqlite xs, char const *name) {
+    xdbsqlite_table table = NULL;
+    std::ostringstream create;
+
+    /* check that the name is a valid identifier */
+    for (char const *c = name; *c != '\0'; c++) {
+        if (!isalnum(*c) && *c != '_') {
+            log_error(xs->i->id, "invalid table name '%s' for xdb_sqlite",
+                      name);
+            return NULL;
+        }
+    }
+
+    /* create the table */
+    create << "CREATE TABLE IF NOT EXISTS \"" << name
+           << "\" (owner TEXT NOT NULL, ns TEXT NOT NULL, seq INTEGER NOT "
+              "NULL, xml TEXT NOT NULL, PRIMARY KEY (owner, ns, seq)) "
+              "WITHOUT ROWID";
+    if (xdb_sqlite_exec(xs, xs->db_write, create.str().c_str()))
+        return NULL;
+
+    table = new _xdbsqlite_table();
+    table->name = name;
+    table->select = xdb_sqlite_prepare(
+        xs, xs->db_read, table->name,
+        "SELECT seq, xml FROM %s WHERE owner=?1 AND ns=?2 ORDER BY seq");
+    table->w_select = xdb_sqlite_prepare(
+        xs, xs->db_write, table->name,
+        "SELECT seq, xml FROM %s WHERE owner=?1 AND ns=?2 ORDER BY seq");
+    table->w_delete =
+        xdb_sqlite_prepare(xs, xs->db_write, table->name,
+                           "DELETE FROM %s WHERE owner=?1 AND ns=?2");
+    table->w_insert = xdb_sqlite_prepare(
+        xs, xs->db_write, table->name,
+        "INSERT INTO %s (owner, ns, seq, xml) VALUES (?1, ?2, ?3, ?4)");
+    table->w_update = xdb_sqlite_prepare(
+        xs, xs->db_write, table->name,
+        "UPDATE %s SET xml=?4 WHERE owner=?1 AND ns=?2 AND seq=?3");
+    table->w_del_row = xdb_sqlite_prepare(
+        xs, xs->db_write, table->name,
+        "DELETE FROM %s WHERE owner=?1 AND ns=?2 AND seq=?3");
+    table->w_max_seq = xdb_sqlite_prepare(
+        xs, xs->db_write, table->name,
+        "SELECT MAX(seq) FROM %s WHERE owner=?1 AND ns=?2");
+
+    if (table->select == NULL || table->w_select == NULL ||
+        table->w_delete == NULL || table->w_insert == NULL ||
+        table->w_update == NULL || table->w_del_row == NULL ||
+        table->w_max_seq == NULL) {
+        xdb_sqlite_table_free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+/**
+ * get the table that stores a namespace
+ *
+ * @param xs instance internal data
+ * @param ns the namespace
+ * @return the table for this namespace
+ */
+static xdbsqlite_table xdb_sqlite_get_table(xdbsqlite xs, char const *ns) {
+    std::map<std::string, xdbsqlite_table>::iterator iter = xs->tables.find(ns);
+
+    return iter == xs->tables.end() ? xs->default_table : iter->second;
+}
+
+/**
+ * bind owner, namespace and optionally sequence number and XML to a statement
+ * and reset it for a new execution
+ *
+ * @param stmt the statement
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @param seq the sequence number of the row (ignored if negative)
+ * @param xml the XML of the row (ignored if NULL)
+ */
+static void xdb_sqlite_bind(sqlite3_stmt *stmt, char const *owner,
+                            char const *ns, sqlite3_int64 seq,
+                            char const *xml) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    sqlite3_bind_text(stmt, 1, owner, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, ns, -1, SQLITE_STATIC);
+    if (seq >= 0)
+        sqlite3_bind_int64(stmt, 3, seq);
+    if (xml != NULL)
+        sqlite3_bind_text(stmt, 4, xml, -1, SQLITE_TRANSIENT);
+}
+
+/**
+ * execute a bound statement, that does not return rows
+ *
+ * @param xs instance internal data
+ * @param stmt the statement
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_step_done(xdbsqlite xs, sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        log_error(xs->i->id, "SQLite statement failed: %s",
+                  sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * serialize an element without its child elements
+ *
+ * @param x the element
+ * @return the serialization (allocated from the pool of x)
+ */
+static char *xdb_sqlite_serialize_container(xmlnode x) {
+    xmlnode container = xmlnode_dup(x);
+    xmlnode child = xmlnode_get_firstchild(container);
+    char *result = NULL;
+
+    while (child != NULL) {
+        xmlnode next = xmlnode_get_nextsibling(child);
+
+        if (xmlnode_get_type(child) == NTYPE_TAG)
+            xmlnode_hide(child);
+        child = next;
+    }
+
+    result = pstrdup(xmlnode_pool(x), xmlnode_serialize_string(
+                                          container, xmppd::ns_decl_list(), 0));
+    xmlnode_free(container);
+    return result;
+}
+
+/**
+ * read the data of an owner in a namespace and rebuild the stored element
+ *
+ * @param xs instance internal data
+ * @param stmt the select statement to use
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @param seqs if not NULL, the sequence number of each child element is
+ * stored here
+ * @return the stored element (has to be freed by the caller), NULL if nothing
+ * is stored
+ */
+static xmlnode xdb_sqlite_load(xdbsqlite xs, sqlite3_stmt *stmt,
+                               char const *owner, char const *ns,
+                               std::map<xmlnode, sqlite3_int64> *seqs) {
+    xmlnode data = NULL;
+    int rc = 0;
+
+    xdb_sqlite_bind(stmt, owner, ns, -1, NULL);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlite3_int64 seq = sqlite3_column_int64(stmt, 0);
+        char const *xml =
+            reinterpret_cast<char const *>(sqlite3_column_text(stmt, 1));
+        xmlnode row = xmlnode_str(xml, sqlite3_column_bytes(stmt, 1));
+
+        if (row == NULL) {
+            log_warn(xs->i->id, "ignoring unparsable data of %s in %s: %s",
+                     owner, ns, xml);
+            continue;
+        }
+
+        if (seq == 0 && data == NULL) {
+            /* the element itself */
+            data = row;
+            continue;
+        }
+
+        if (data == NULL) {
+            /* child without element, should not happen */
+            data = xmlnode_new_tag_ns("foo", NULL, ns);
+        }
+
+        xmlnode child = xmlnode_insert_tag_node(data, row);
+        if (seqs != NULL)
+            (*seqs)[child] = seq;
+        xmlnode_free(row);
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        log_error(xs->i->id, "SQLite query for %s in %s failed: %s", owner, ns,
+                  sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    }
+
+    return data;
+}
+
+/**
+ * store a new child element for an owner in a namespace
+ *
+ * @param xs instance internal data
+ * @param table the table to use
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @param child the element to add
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_append(xdbsqlite xs, xdbsqlite_table table,
+                             char const *owner, char const *ns, xmlnode child) {
+    sqlite3_int64 seq = 0;
+
+    /* get the next sequence number */
+    xdb_sqlite_bind(table->w_max_seq, owner, ns, -1, NULL);
+    if (sqlite3_step(table->w_max_seq) == SQLITE_ROW)
+        seq = sqlite3_column_int64(table->w_max_seq, 0);
+    sqlite3_reset(table->w_max_seq);
+
+    xdb_sqlite_bind(
+        table->w_insert, owner, ns, seq + 1,
+        xmlnode_serialize_string(child, xmppd::ns_decl_list(), 0));
+    return xdb_sqlite_step_done(xs, table->w_insert);
+}
+
+/**
+ * handle a plain xdb set request (replacing the stored data)
+ *
+ * @param xs instance internal data
+ * @param table the table to use
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @param data the new data, NULL to delete the data
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_replace(xdbsqlite xs, xdbsqlite_table table,
+                              char const *owner, char const *ns,
+                              xmlnode data) {
+    sqlite3_int64 seq = 0;
+
+    /* delete the old data */
+    xdb_sqlite_bind(table->w_delete, owner, ns, -1, NULL);
+    if (xdb_sqlite_step_done(xs, table->w_delete))
+        return 1;
+
+    if (data == NULL)
+        return 0;
+
+    /* store the element itself */
+    xdb_sqlite_bind(table->w_insert, owner, ns, seq++,
+                    xdb_sqlite_serialize_container(data));
+    if (xdb_sqlite_step_done(xs, table->w_insert))
+        return 1;
+
+    /* and each child element */
+    for (xmlnode cur = xmlnode_get_firstchild(data); cur != NULL;
+         cur = xmlnode_get_nextsibling(cur)) {
+        if (xmlnode_get_type(cur) != NTYPE_TAG)
+            continue;
+
+        xdb_sqlite_bind(
+            table->w_insert, owner, ns, seq++,
+            xmlnode_serialize_string(cur, xmppd::ns_decl_list(), 0));
+        if (xdb_sqlite_step_done(xs, table->w_insert))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * handle a xdb insert request
+ *
+ * Elements matching the match or matchpath of the request are removed, before
+ * the new element is added.
+ *
+ * @param xs instance internal data
+ * @param table the table to use
+ * @param p the packet containing the request
+ * @param owner the owner of the data
+ * @param ns the namespace of the data
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_insert(xdbsqlite xs, xdbsqlite_table table, dpacket p,
+                             char const *owner, char const *ns) {
+    char const *match = xmlnode_get_attrib_ns(p->x, "match", NULL);
+    char const *matchpath = xmlnode_get_attrib_ns(p->x, "matchpath", NULL);
+    char const *matchns = xmlnode_get_attrib_ns(p->x, "matchns", NULL);
+    std::map<xmlnode, sqlite3_int64> seqs;
+    xmlnode data = NULL;
+    xmlnode new_child = NULL;
+    int ret = 0;
+
+    /* get the new element */
+    for (new_child = xmlnode_get_firstchild(p->x);
+         new_child != NULL && xmlnode_get_type(new_child) != NTYPE_TAG;
+         new_child = xmlnode_get_nextsibling(new_child))
+        ;
+
+    data = xdb_sqlite_load(xs, table->w_select, owner, ns,
+                           match || matchpath ? &seqs : NULL);
+
+    /* we're inserting into something that doesn't exist? create it */
+    if (data == NULL) {
+        xmlnode container = xmlnode_new_tag_ns("foo", NULL, ns);
+
+        xdb_sqlite_bind(table->w_insert, owner, ns, 0,
+                        xmlnode_serialize_string(container,
+                                                 xmppd::ns_decl_list(), 0));
+        xmlnode_free(container);
+        if (xdb_sqlite_step_done(xs, table->w_insert))
+            return 1;
+    } else if (match != NULL || matchpath != NULL) {
+        xmlnode_vector matches;
+        xht namespaces = NULL;
+        pool value_strings = NULL;
+
+        if (matchpath != NULL) {
+            if (matchns != NULL) {
+                xmlnode namespacesxml = xmlnode_str(matchns, j_strlen(matchns));
+                value_strings = pool_new();
+                namespaces = xhash_from_xml(namespacesxml, value_strings);
+                xmlnode_free(namespacesxml);
+            }
+            matches = xmlnode_get_tags(data, matchpath, namespaces);
+        } else {
+            xmlnode found = xmlnode_get_tag(data, match);
+            if (found != NULL)
+                matches.push_back(found);
+        }
+
+        /* remove the rows containing the matches */
+        for (xmlnode_vector::iterator item = matches.begin();
+             ret == 0 && item != matches.end(); ++item) {
+            xmlnode row = *item;
+
+            /* find the child of data that contains the match */
+            while (xmlnode_get_parent(row) != NULL &&
+                   xmlnode_get_parent(row) != data)
+                row = xmlnode_get_parent(row);
+            if (seqs.find(row) == seqs.end())
+                continue;
+
+            if (row == *item) {
+                /* the complete row matches */
+                xdb_sqlite_bind(table->w_del_row, owner, ns, seqs[row], NULL);
+                ret = xdb_sqlite_step_done(xs, table->w_del_row);
+            } else {
+                /* only a part of the row matches */
+                xmlnode_hide(*item);
+                xdb_sqlite_bind(
+                    table->w_update, owner, ns, seqs[row],
+                    xmlnode_serialize_string(row, xmppd::ns_decl_list(), 0));
+                ret = xdb_sqlite_step_done(xs, table->w_update);
+            }
+        }
+
+        if (namespaces != NULL)
+            xhash_free(namespaces);
+        if (value_strings != NULL)
+            pool_free(value_strings);
+    }
+
+    if (data != NULL)
+        xmlnode_free(data);
+
+    /* insert the new chunk into the existing data */
+    if (ret == 0 && new_child != NULL)
+        ret = xdb_sqlite_append(xs, table, owner, ns, new_child);
+
+    return ret;
+}
+
+/**
+ * execute a single set request inside of the current transaction
+ *
+ * @param xs instance internal data
+ * @param p the packet containing the request
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_write_one(xdbsqlite xs, dpacket p) {
+    char const *ns = xmlnode_get_attrib_ns(p->x, "ns", NULL);
+    char const *action = xmlnode_get_attrib_ns(p->x, "action", NULL);
+    char const *owner = jid_full(p->id);
+    xdbsqlite_table table = xdb_sqlite_get_table(xs, ns);
+    xmlnode data = NULL;
+
+    if (action == NULL) {
+        for (data = xmlnode_get_firstchild(p->x);
+             data != NULL && xmlnode_get_type(data) != NTYPE_TAG;
+             data = xmlnode_get_nextsibling(data))
+            ;
+        return xdb_sqlite_replace(xs, table, owner, ns, data);
+    }
+
+    if (j_strcmp(action, "insert") == 0)
+        return xdb_sqlite_insert(xs, table, p, owner, ns);
+
+    /* not supported action, probably check */
+    log_warn(xs->i->id, "unable to handle unsupported xdb-set action '%s'",
+             action);
+    return 1;
+}
+
+/**
+ * modify xdb query to be a result, that can be sent back
+ *
+ * @param p the packet that should be modified
+ */
+static void xdb_sqlite_makeresult(dpacket p) {
+    xmlnode_put_attrib_ns(p->x, "type", NULL, NULL, "result");
+    xmlnode_put_attrib_ns(p->x, "to", NULL, NULL,
+                          xmlnode_get_attrib_ns(p->x, "from", NULL));
+    xmlnode_put_attrib_ns(p->x, "from", NULL, NULL, jid_full(p->id));
+}
+
+/**
+ * start the transaction of the writer
+ *
+ * If the database is locked by another process, the writer naps and tries
+ * again, instead of letting SQLite block all threads while it waits.
+ *
+ * @param xs instance internal data
+ * @return 0 on success, non zero on failure
+ */
+static int xdb_sqlite_begin(xdbsqlite xs) {
+    int rc = SQLITE_OK;
+
+    for (int tries = 0;; tries++) {
+        rc = sqlite3_exec(xs->db_write, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+        if (rc != SQLITE_BUSY || tries >= XDBSQLITE_BEGIN_TRIES)
+            break;
+        pth_nap(pth_time(0, XDBSQLITE_BEGIN_BACKOFF * 1000));
+    }
+
+    if (rc != SQLITE_OK) {
+        log_error(xs->i->id, "cannot start SQLite transaction: %s",
+                  sqlite3_errmsg(xs->db_write));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * commit the set requests waiting for the writer in a single transaction
+ *
+ * Each request is executed inside its own savepoint, so that a failing request
+ * does not affect the other requests in the same transaction. If no
+ * transaction can be started, the waiting requests are bounced, so that the
+ * callers looping until no requests are pending do not loop forever.
+ *
+ * @param xs instance internal data
+ */
+static void xdb_sqlite_write_batch(xdbsqlite xs) {
+    std::list<std::pair<dpacket, int>> done;
+    std::list<std::pair<dpacket, int>>::iterator iter;
+    xdbsqlite_write w = NULL;
+    int committed = 0;
+
+    pth_mutex_acquire(&xs->write_lock, FALSE, NULL);
+
+    if (pth_msgport_pending(xs->writes) == 0) {
+        pth_mutex_release(&xs->write_lock);
+        return;
+    }
+
+    if (xdb_sqlite_begin(xs)) {
+        while ((w = reinterpret_cast<xdbsqlite_write>(
+                    pth_msgport_get(xs->writes))) != NULL)
+            deliver_fail(w->p, "storing data in SQLite failed");
+        pth_mutex_release(&xs->write_lock);
+        return;
+    }
+
+    while (done.size() < static_cast<size_t>(xs->batch_maxsets) &&
+           (w = reinterpret_cast<xdbsqlite_write>(
+                pth_msgport_get(xs->writes))) != NULL) {
+        int failed = 1;
+
+        if (xdb_sqlite_exec(xs, xs->db_write, "SAVEPOINT xdbset") == 0) {
+            failed = xdb_sqlite_write_one(xs, w->p);
+            if (!failed &&
+                xdb_sqlite_exec(xs, xs->db_write, "RELEASE xdbset") != 0)
+                failed = 1;
+            if (failed) {
+                xdb_sqlite_exec(xs, xs->db_write, "ROLLBACK TO xdbset");
+                xdb_sqlite_exec(xs, xs->db_write, "RELEASE xdbset");
+            }
+        }
+
+        done.push_back(std::pair<dpacket, int>(w->p, failed));
+    }
+
+    committed = xdb_sqlite_exec(xs, xs->db_write, "COMMIT") == 0;
+    if (!committed)
+        xdb_sqlite_exec(xs, xs->db_write, "ROLLBACK");
+
+    log_debug2(ZONE, LOGT_STORAGE, "committed %u xdb set requests",
+               static_cast<unsigned int>(done.size()));
+
+    /* send the results */
+    for (iter = done.begin(); iter != done.end(); ++iter) {
+        if (!committed || iter->second) {
+            deliver_fail(iter->first, "storing data in SQLite failed");
+            continue;
+        }
+        xdb_sqlite_makeresult(iter->first);
+        deliver(dpacket_new(iter->first->x), NULL);
+    }
+
+    pth_mutex_release(&xs->write_lock);
+}
+
+/**
+ * the writer thread, waits for set requests and commits them in batches
+ *
+ * @param arg instance internal data
+ * @return always NULL
+ */
+static void *xdb_sqlite_writer(void *arg) {
+    xdbsqlite xs = static_cast<xdbsqlite>(arg);
+    pth_event_t mpevt = pth_event(PTH_EVENT_MSG, xs->writes);
+
+    while (1) {
+        /* wait for requests */
+        pth_wait(mpevt);
+
+        /* wait for more requests to share the transaction */
+        if (xs->batch_window > 0 &&
+            pth_msgport_pending(xs->writes) < xs->batch_maxsets)
+            pth_usleep(xs->batch_window * 1000);
+
+        /* commit all of them */
+        while (pth_msgport_pending(xs->writes) > 0)
+            xdb_sqlite_write_batch(xs);
+    }
+
+    pth_event_free(mpevt, PTH_FREE_ALL);
+    return NULL;
+}
+
+/**
+ * callback function that is called by jabberd to handle xdb requests
+ *
+ * @param i the instance we are for jabberd
+ * @param p the packet containing the xdb query
+ * @param arg pointer to our own internal data
+ * @return r_DONE if we could handle the request, r_ERR otherwise
+ */
+static result xdb_sqlite_phandler(instance i, dpacket p, void *arg) {
+    xdbsqlite xs = static_cast<xdbsqlite>(arg);
+    char const *ns = NULL;
+    xmlnode data = NULL;
+
+    log_debug2(ZONE, LOGT_STORAGE | LOGT_DELIVER, "handling xdb request %s",
+               xmlnode_serialize_string(p->x, xmppd::ns_decl_list(), 0));
+
+    /* get the namespace of the request */
+    ns = xmlnode_get_attrib_ns(p->x, "ns", NULL);
+    if (ns == NULL) {
+        log_debug2(ZONE, LOGT_STORAGE | LOGT_STRANGE,
+                   "xdb_sqlite got a xdb request without namespace");
+        return r_ERR;
+    }
+
+    /* set requests are handled by the writer */
+    if (j_strcmp(xmlnode_get_attrib_ns(p->x, "type", NULL), "set") == 0) {
+        xdbsqlite_write w = static_cast<xdbsqlite_write>(
+            pmalloco(p->p, sizeof(_xdbsqlite_write)));
+        w->p = p;
+        pth_msgport_put(xs->writes, reinterpret_cast<pth_message_t *>(w));
+        return r_DONE;
+    }
+
+    /* make sure we read what has been written before */
+    while (pth_msgport_pending(xs->writes) > 0)
+        xdb_sqlite_write_batch(xs);
+
+    /* get request */
+    data = xdb_sqlite_load(xs, xdb_sqlite_get_table(xs, ns)->select,
+                           jid_full(p->id), ns, NULL);
+    if (data != NULL) {
+        xmlnode_insert_tag_node(p->x, data);
+        xmlnode_free(data);
+    }
+
+    xdb_sqlite_makeresult(p);
+    deliver(dpacket_new(p->x), NULL);
+    return r_DONE;
+}
+
+/**
+ * open a connection to the database
+ *
+ * @param xs instance internal data
+ * @return the connection, NULL on failure
+ */
+static sqlite3 *xdb_sqlite_open(xdbsqlite xs) {
+    sqlite3 *db = NULL;
+
+    if (sqlite3_open_v2(xs->file, &db,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                            SQLITE_OPEN_NOMUTEX,
+                        NULL) != SQLITE_OK) {
+        log_error(xs->i->id, "cannot open SQLite database %s: %s", xs->file,
+                  db ? sqlite3_errmsg(db) : "out of memory");
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    /* longer waits for locks are done by napping in xdb_sqlite_begin() */
+    sqlite3_busy_timeout(db, XDBSQLITE_BUSY_TIMEOUT);
+    if (xdb_sqlite_exec(xs, db, "PRAGMA journal_mode=WAL") ||
+        xdb_sqlite_exec(xs, db, "PRAGMA synchronous=NORMAL")) {
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+/**
+ * commit waiting set requests and close the database on shutdown
+ *
+ * @param arg instance internal data
+ */
+static void xdb_sqlite_shutdown(void *arg) {
+    xdbsqlite xs = static_cast<xdbsqlite>(arg);
+
+    while (pth_msgport_pending(xs->writes) > 0)
+        xdb_sqlite_write_batch(xs);
+}
+
+/**
+ * delete instance data, when the instance is freed
+ *
+ * @param arg pointer to the instance data (_xdbsqlite instance)
+ */
+static void xdb_sqlite_cleanup(void *arg) {
+    xdbsqlite xs = static_cast<xdbsqlite>(arg);
+    std::map<std::string, xdbsqlite_table>::iterator iter;
+
+    if (xs == NULL)
+        return;
+
+    for (iter = xs->tables.begin(); iter != xs->tables.end(); ++iter) {
+        xdb_sqlite_table_free(iter->second);
+    }
+    xdb_sqlite_table_free(xs->default_table);
+
+    sqlite3_close(xs->db_read);
+    sqlite3_close(xs->db_write);
+
+    delete xs;
+}
+
+#endif
+
+/**
+ * init the xdb_sqlite module, called by the jabberd module loader
+ *
+ * @param i jabberd's data about our instance
+ * @param x the &lt;load/&gt; xmlnode that instructed the moduleloader to load
+ * us
+ */
+extern "C" void xdb_sqlite(instance i, xmlnode x) {
+    log_debug2(ZONE, LOGT_INIT, "xdb_sqlite loading");
+
+#ifndef HAVE_SQLITE
+    log_error(i->id, "xdb_sqlite has been compiled without SQLite support");
+#else
+    xdbcache xc = NULL;    /* to fetch our configuration */
+    xmlnode config = NULL; /* our configuration */
+    xdbsqlite xs = NULL;
+
+    /* fetch our own configuration */
+    xc = xdb_cache(i);
+    if (xc != NULL) {
+        config = xdb_get(xc, jid_new(xmlnode_pool(x), "config@-internal"),
+                         NS_JABBERD_CONFIG_XDBSQLITE);
+    }
+    if (config == NULL) {
+        log_error(i->id, "xdb_sqlite failed to load its configuration");
+        return;
+    }
+
+    /* create our internal data */
+    xs = new _xdbsqlite;
+    xs->i = i;
+    pth_mutex_init(&xs->write_lock);
+    pool_cleanup(i->p, xdb_sqlite_cleanup, xs);
+    xs->std_namespace_prefixes = xhash_new(3);
+    xhash_put(xs->std_namespace_prefixes, "conf",
+              const_cast<char *>(NS_JABBERD_CONFIG_XDBSQLITE));
+
+    /* where the database is located */
+    xs->file = pstrdup(i->p, xmlnode_get_list_item_data(
+                                 xmlnode_get_tags(config, "conf:file",
+                                                  xs->std_namespace_prefixes),
+                                 0));
+    if (xs->file == NULL) {
+        log_error(i->id, "xdb_sqlite: no database file configured");
+        xmlnode_free(config);
+        return;
+    }
+
+    /* how set requests are batched */
+    xs->batch_window = j_atoi(
+        xmlnode_get_list_item_data(
+            xmlnode_get_tags(config, "conf:batch/conf:window",
+                             xs->std_namespace_prefixes),
+            0),
+        10);
+    xs->batch_maxsets = j_atoi(
+        xmlnode_get_list_item_data(
+            xmlnode_get_tags(config, "conf:batch/conf:maxsets",
+                             xs->std_namespace_prefixes),
+            0),
+        256);
+    if (xs->batch_maxsets < 1)
+        xs->batch_maxsets = 1;
+
+    /* open the database */
+    xs->db_write = xdb_sqlite_open(xs);
+    xs->db_read = xs->db_write ? xdb_sqlite_open(xs) : NULL;
+    if (xs->db_read == NULL) {
+        xmlnode_free(config);
+        return;
+    }
+
+    /* create the tables */
+    xs->default_table = xdb_sqlite_table_open(xs, XDBSQLITE_DEFAULT_TABLE);
+    if (xs->default_table == NULL) {
+        xmlnode_free(config);
+        return;
+    }
+    xmlnode_vector ns_defs = xmlnode_get_tags(config, "conf:namespace",
+                                              xs->std_namespace_prefixes);
+    for (xmlnode_vector::iterator ns_def = ns_defs.begin();
+         ns_def != ns_defs.end(); ++ns_def) {
+        char const *ns_iri = xmlnode_get_data(*ns_def);
+        char const *table_name = xmlnode_get_attrib_ns(*ns_def, "table", NULL);
+        xdbsqlite_table table = NULL;
+
+        if (ns_iri == NULL || table_name == NULL) {
+            log_warn(i->id, "ignoring incomplete namespace definition: %s",
+                     xmlnode_serialize_string(*ns_def, xmppd::ns_decl_list(),
+                                              0));
+            continue;
+        }
+
+        table = xdb_sqlite_table_open(xs, table_name);
+        if (table == NULL) {
+            xmlnode_free(config);
+            return;
+        }
+        xs->tables[ns_iri] = table;
+        log_debug2(ZONE, LOGT_INIT | LOGT_STORAGE,
+                   "storing namespace %s in table %s", ns_iri, table_name);
+    }
+
+    /* start the writer */
+    xs->writes = pth_msgport_create("xdb_sqlite");
+    pth_spawn(PTH_ATTR_DEFAULT, xdb_sqlite_writer, (void *)xs);
+    register_shutdown(xdb_sqlite_shutdown, (void *)xs);
+
+    /* register our packet handler */
+    register_phandler(i, o_DELIVER, xdb_sqlite_phandler, (void *)xs);
+
+    /* free the configuration we have processed */
+    xmlnode_free(config);
+#endif
+}